@@ -0,0 +1,533 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to rebuild pages of a loaded image from its file and
+/// to compare and hash pages.
+
+#include "code_integrity.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if DDIMON_CI_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Bytes hashed in each round, by eight 64-bit lanes
+static const ULONG kCipStripeSize = 64;
+
+static_assert(kCiPageSize % kCipStripeSize == 0, "Size check");
+
+static const USHORT kCipDosSignature = 0x5a4d;      // MZ
+static const ULONG kCipNtSignature = 0x00004550;    // PE\0\0
+static const USHORT kCipOptionalMagic32 = 0x10b;
+static const USHORT kCipOptionalMagic64 = 0x20b;
+static const ULONG kCipSectionHeaderSize = 40;
+static const ULONG kCipRelocationDirectory = 5;
+
+// Types of base relocations
+static const ULONG kCipRelocationAbsolute = 0;
+static const ULONG kCipRelocationHigh = 1;
+static const ULONG kCipRelocationLow = 2;
+static const ULONG kCipRelocationHighLow = 3;
+static const ULONG kCipRelocationHighAdj = 4;
+static const ULONG kCipRelocationDir64 = 10;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG64 CipLoad(_In_reads_bytes_(size) const UCHAR* bytes,
+                       _In_ ULONG size);
+
+static void CipStore(_Out_writes_bytes_(size) UCHAR* bytes, _In_ ULONG size,
+                     _In_ ULONG64 value);
+
+static ULONG CipGetRawSize(_In_ const CiSection& section);
+
+static const UCHAR* CipMapRange(_In_ const CiImage& image, _In_ ULONG rva,
+                                _In_ ULONG size);
+
+static void CipCopyRange(_In_ const CiImage& image, _In_ ULONG rva,
+                         _In_ ULONG64 size, _In_ ULONG64 file_offset,
+                         _In_ ULONG page_rva,
+                         _Inout_updates_bytes_(kCiWindowSize) UCHAR* window);
+
+static bool CipRelocate(_In_ const CiImage& image, _In_ ULONG page_rva,
+                        _In_ ULONG64 delta,
+                        _Inout_updates_bytes_(kCiWindowSize) UCHAR* window);
+
+static UCHAR* CipFindInWindow(_In_ ULONG page_rva, _In_ ULONG64 rva,
+                              _In_ ULONG size, _In_ UCHAR* window);
+
+static ULONG64 CipMix(_In_ ULONG64 value);
+
+static void CipRecordDifference(_In_ ULONG offset, _In_ ULONG mask,
+                                _Inout_ CiDifference* difference);
+
+static ULONG CipFindLowestBit(_In_ ULONG value);
+
+static ULONG CipFindHighestBit(_In_ ULONG value);
+
+static ULONG CipCountBits(_In_ ULONG value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Validates headers of a PE32 or PE32+ file. Returns false when the file is
+// truncated or malformed.
+_Use_decl_annotations_ bool CiParseImage(CiImage* image, const UCHAR* file,
+                                         ULONG64 file_size) {
+  *image = {};
+  if (file_size < 0x40 || CipLoad(file, 2) != kCipDosSignature) {
+    return false;
+  }
+  const auto nt_offset = CipLoad(file + 0x3c, 4);
+  if (nt_offset + 24 > file_size ||
+      CipLoad(file + nt_offset, 4) != kCipNtSignature) {
+    return false;
+  }
+
+  const auto file_header = file + nt_offset + 4;
+  const auto section_count = static_cast<ULONG>(CipLoad(file_header + 2, 2));
+  const auto optional_size = static_cast<ULONG>(CipLoad(file_header + 16, 2));
+  const auto optional_offset = nt_offset + 24;
+  if (optional_offset + optional_size > file_size || optional_size < 2) {
+    return false;
+  }
+
+  // Offsets of fields that differ between PE32 and PE32+
+  const auto optional = file + optional_offset;
+  const auto magic = CipLoad(optional, 2);
+  ULONG image_base_offset = 0;
+  ULONG image_base_size = 0;
+  ULONG directory_count_offset = 0;
+  if (magic == kCipOptionalMagic64) {
+    image_base_offset = 24;
+    image_base_size = 8;
+    directory_count_offset = 108;
+  } else if (magic == kCipOptionalMagic32) {
+    image_base_offset = 28;
+    image_base_size = 4;
+    directory_count_offset = 92;
+  } else {
+    return false;
+  }
+  const auto directories_offset = directory_count_offset + 4;
+  if (optional_size < directories_offset) {
+    return false;
+  }
+
+  image->file = file;
+  image->file_size = file_size;
+  image->image_base = CipLoad(optional + image_base_offset, image_base_size);
+  image->image_size = static_cast<ULONG>(CipLoad(optional + 56, 4));
+  image->header_size = static_cast<ULONG>(CipLoad(optional + 60, 4));
+  image->section_offset = static_cast<ULONG>(optional_offset + optional_size);
+  image->section_count = section_count;
+  if (image->section_offset +
+          static_cast<ULONG64>(section_count) * kCipSectionHeaderSize >
+      file_size) {
+    return false;
+  }
+
+  // A missing relocation directory is left empty; such an image can only be
+  // loaded at its preferred base
+  const auto directory_count = CipLoad(optional + directory_count_offset, 4);
+  const auto relocation = directories_offset + kCipRelocationDirectory * 8;
+  if (directory_count > kCipRelocationDirectory &&
+      relocation + 8 <= optional_size) {
+    image->relocation_rva = static_cast<ULONG>(CipLoad(optional + relocation,
+                                                       4));
+    image->relocation_size =
+        static_cast<ULONG>(CipLoad(optional + relocation + 4, 4));
+  }
+  return true;
+}
+
+// Returns a section header of the image
+_Use_decl_annotations_ bool CiGetSection(const CiImage& image, ULONG index,
+                                         CiSection* section) {
+  *section = {};
+  if (index >= image.section_count) {
+    return false;
+  }
+  const auto header =
+      image.file + image.section_offset + index * kCipSectionHeaderSize;
+  section->virtual_size = static_cast<ULONG>(CipLoad(header + 8, 4));
+  section->rva = static_cast<ULONG>(CipLoad(header + 12, 4));
+  section->raw_size = static_cast<ULONG>(CipLoad(header + 16, 4));
+  section->raw_offset = static_cast<ULONG>(CipLoad(header + 20, 4));
+  section->characteristics = static_cast<ULONG>(CipLoad(header + 36, 4));
+  return true;
+}
+
+// Rebuilds contents of the page at page_rva of the image loaded at load_base,
+// with kCiWindowMargin bytes on each side. Bytes not backed by the file are
+// zero. Returns false when relocations are malformed.
+_Use_decl_annotations_ bool CiBuildExpectedPage(const CiImage& image,
+                                                ULONG page_rva,
+                                                ULONG64 load_base,
+                                                UCHAR* window) {
+  for (auto i = 0ul; i < kCiWindowSize; ++i) {
+    window[i] = 0;
+  }
+
+  CipCopyRange(image, 0, image.header_size, 0, page_rva, window);
+  for (auto i = 0ul; i < image.section_count; ++i) {
+    CiSection section = {};
+    CiGetSection(image, i, &section);
+    CipCopyRange(image, section.rva, CipGetRawSize(section),
+                 section.raw_offset, page_rva, window);
+  }
+
+  const auto delta = load_base - image.image_base;
+  if (!delta) {
+    return true;
+  }
+  return CipRelocate(image, page_rva, delta, window);
+}
+
+// Hashes a page with a seed. Hashes of a page with different seeds are
+// unrelated, so that contents colliding with a page cannot be crafted
+// without knowing the seed.
+_Use_decl_annotations_ ULONG64 CiHashPage(const UCHAR* page, ULONG64 seed) {
+  // Each 64-bit lane accumulates the word and a product of its halves mixed
+  // with a key. Keys advance on each stripe so that words are bound to their
+  // positions.
+  const auto step = CipMix(seed ^ 0x9e3779b97f4a7c15ull) | 1;
+  ULONG64 keys[8] = {};
+  for (auto i = 0ul; i < 8; ++i) {
+    keys[i] = CipMix(seed + i);
+  }
+  ULONG64 accumulators[8] = {};
+
+#if DDIMON_CI_USE_SSE2
+  __m128i key_vectors[4] = {};
+  __m128i accumulator_vectors[4] = {};
+  for (auto i = 0ul; i < 4; ++i) {
+    key_vectors[i] = _mm_set_epi64x(static_cast<long long>(keys[i * 2 + 1]),
+                                    static_cast<long long>(keys[i * 2]));
+    accumulator_vectors[i] = _mm_setzero_si128();
+  }
+  const auto step_vector = _mm_set1_epi64x(static_cast<long long>(step));
+  for (auto offset = 0ul; offset < kCiPageSize; offset += kCipStripeSize) {
+    for (auto i = 0ul; i < 4; ++i) {
+      const auto data = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(page + offset + i * 16));
+      const auto keyed = _mm_xor_si128(data, key_vectors[i]);
+      const auto product = _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32));
+      accumulator_vectors[i] = _mm_add_epi64(
+          accumulator_vectors[i], _mm_add_epi64(data, product));
+      key_vectors[i] = _mm_add_epi64(key_vectors[i], step_vector);
+    }
+  }
+  for (auto i = 0ul; i < 4; ++i) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&accumulators[i * 2]),
+                     accumulator_vectors[i]);
+  }
+#else
+  for (auto offset = 0ul; offset < kCiPageSize; offset += kCipStripeSize) {
+    for (auto i = 0ul; i < 8; ++i) {
+      const auto data = CipLoad(page + offset + i * 8, 8);
+      const auto keyed = data ^ keys[i];
+      const auto product = (keyed & 0xffffffff) * (keyed >> 32);
+      accumulators[i] += data + product;
+      keys[i] += step;
+    }
+  }
+#endif
+
+  auto hash = seed;
+  for (const auto accumulator : accumulators) {
+    hash = CipMix(hash ^ accumulator);
+  }
+  return hash;
+}
+
+// Compares the first size bytes of pages and returns the number of bytes that
+// differ. difference is filled only when any does.
+_Use_decl_annotations_ ULONG CiComparePage(const UCHAR* live,
+                                           const UCHAR* expected, ULONG size,
+                                           CiDifference* difference) {
+  *difference = {};
+  auto offset = 0ul;
+
+#if DDIMON_CI_USE_SSE2
+  for (; offset + 16 <= size; offset += 16) {
+    const auto equal = _mm_cmpeq_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(live + offset)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(expected + offset)));
+    const auto mask = static_cast<ULONG>(~_mm_movemask_epi8(equal)) & 0xffff;
+    if (mask) {
+      CipRecordDifference(offset, mask, difference);
+    }
+  }
+#endif
+
+  // Remaining bytes, or all of them without SSE2, 32 bytes at a time
+  while (offset < size) {
+    const auto count = (size - offset < 32) ? size - offset : 32;
+    auto mask = 0ul;
+    for (auto i = 0ul; i < count; ++i) {
+      if (live[offset + i] != expected[offset + i]) {
+        mask |= 1ul << i;
+      }
+    }
+    if (mask) {
+      CipRecordDifference(offset, mask, difference);
+    }
+    offset += count;
+  }
+  return difference->changed_count;
+}
+
+// Loads a little-endian value of size bytes
+_Use_decl_annotations_ static ULONG64 CipLoad(const UCHAR* bytes,
+                                              ULONG size) {
+  ULONG64 value = 0;
+  for (auto i = size; i > 0; --i) {
+    value = (value << 8) | bytes[i - 1];
+  }
+  return value;
+}
+
+// Stores a little-endian value of size bytes
+_Use_decl_annotations_ static void CipStore(UCHAR* bytes, ULONG size,
+                                            ULONG64 value) {
+  for (auto i = 0ul; i < size; ++i) {
+    bytes[i] = static_cast<UCHAR>(value >> (i * 8));
+  }
+}
+
+// Returns bytes of raw data mapped by a section, which never exceed its
+// virtual size unless that is 0
+_Use_decl_annotations_ static ULONG CipGetRawSize(const CiSection& section) {
+  if (section.virtual_size && section.virtual_size < section.raw_size) {
+    return section.virtual_size;
+  }
+  return section.raw_size;
+}
+
+// Returns a pointer to size bytes of the file mapped at rva, or nullptr when
+// they are not contiguous in the file
+_Use_decl_annotations_ static const UCHAR* CipMapRange(const CiImage& image,
+                                                       ULONG rva,
+                                                       ULONG size) {
+  const auto end = static_cast<ULONG64>(rva) + size;
+  if (end <= image.header_size && end <= image.file_size) {
+    return image.file + rva;
+  }
+  for (auto i = 0ul; i < image.section_count; ++i) {
+    CiSection section = {};
+    CiGetSection(image, i, &section);
+    const auto section_end =
+        static_cast<ULONG64>(section.rva) + CipGetRawSize(section);
+    if (rva < section.rva || end > section_end) {
+      continue;
+    }
+    const auto file_offset =
+        static_cast<ULONG64>(section.raw_offset) + (rva - section.rva);
+    if (file_offset + size > image.file_size) {
+      return nullptr;
+    }
+    return image.file + file_offset;
+  }
+  return nullptr;
+}
+
+// Copies size bytes of the file at file_offset, mapped at rva, where they
+// overlap the window of the page at page_rva
+_Use_decl_annotations_ static void CipCopyRange(const CiImage& image,
+                                                ULONG rva, ULONG64 size,
+                                                ULONG64 file_offset,
+                                                ULONG page_rva,
+                                                UCHAR* window) {
+  if (file_offset >= image.file_size) {
+    return;
+  }
+  if (size > image.file_size - file_offset) {
+    size = image.file_size - file_offset;
+  }
+
+  // RVAs are biased by kCiWindowMargin so that the window of the first page
+  // does not start below 0
+  const auto window_begin = static_cast<ULONG64>(page_rva);
+  const auto window_end = window_begin + kCiWindowSize;
+  const auto range_begin = static_cast<ULONG64>(rva) + kCiWindowMargin;
+  const auto range_end = range_begin + size;
+  const auto begin = (range_begin > window_begin) ? range_begin : window_begin;
+  const auto end = (range_end < window_end) ? range_end : window_end;
+  for (auto position = begin; position < end; ++position) {
+    window[position - window_begin] =
+        image.file[file_offset + (position - range_begin)];
+  }
+}
+
+// Applies base relocations targeting the window of the page at page_rva for
+// the delta between the actual and the preferred base
+_Use_decl_annotations_ static bool CipRelocate(const CiImage& image,
+                                               ULONG page_rva, ULONG64 delta,
+                                               UCHAR* window) {
+  if (!image.relocation_size) {
+    return true;
+  }
+  const auto relocations =
+      CipMapRange(image, image.relocation_rva, image.relocation_size);
+  if (!relocations) {
+    return false;
+  }
+
+  // Walks blocks, each of which covers a page starting at block_rva
+  for (auto offset = 0ul; offset + 8 <= image.relocation_size;) {
+    const auto block_rva = CipLoad(relocations + offset, 4);
+    const auto block_size =
+        static_cast<ULONG>(CipLoad(relocations + offset + 4, 4));
+    if (block_size < 8 || block_size > image.relocation_size - offset) {
+      return false;
+    }
+    const auto entries = relocations + offset + 8;
+    const auto entry_count = (block_size - 8) / 2;
+    offset += block_size;
+
+    // Skips blocks whose relocations cannot reach the window, comparing RVAs
+    // biased as CipCopyRange() does
+    const auto block_begin = block_rva + kCiWindowMargin;
+    const auto block_end = block_begin + kCiPageSize + kCiWindowMargin;
+    if (block_end <= page_rva || block_begin >= page_rva + kCiWindowSize) {
+      continue;
+    }
+
+    for (auto i = 0ul; i < entry_count; ++i) {
+      const auto entry = static_cast<ULONG>(CipLoad(entries + i * 2, 2));
+      const auto target = block_rva + (entry & 0xfff);
+      ULONG size = 0;
+      auto value_shift = 0ul;
+      switch (entry >> 12) {
+        case kCipRelocationDir64:
+          size = 8;
+          break;
+        case kCipRelocationHighLow:
+          size = 4;
+          break;
+        case kCipRelocationLow:
+          size = 2;
+          break;
+        case kCipRelocationHigh:
+          size = 2;
+          value_shift = 16;
+          break;
+        case kCipRelocationHighAdj: {
+          // The next entry holds the signed low 16 bits of the value
+          if (i + 1 == entry_count) {
+            return false;
+          }
+          const auto low = static_cast<ULONG64>(static_cast<long long>(
+              static_cast<short>(CipLoad(entries + ++i * 2, 2))));
+          const auto bytes = CipFindInWindow(page_rva, target, 2, window);
+          if (bytes) {
+            const auto value =
+                (CipLoad(bytes, 2) << 16) + low + delta + 0x8000;
+            CipStore(bytes, 2, value >> 16);
+          }
+          continue;
+        }
+        case kCipRelocationAbsolute:
+        default:
+          continue;
+      }
+
+      const auto bytes = CipFindInWindow(page_rva, target, size, window);
+      if (bytes) {
+        CipStore(bytes, size, CipLoad(bytes, size) + (delta >> value_shift));
+      }
+    }
+  }
+  return true;
+}
+
+// Returns a pointer to size bytes at rva in the window of the page at
+// page_rva, or nullptr when they are not entirely in it. Those do not overlap
+// the page.
+_Use_decl_annotations_ static UCHAR* CipFindInWindow(ULONG page_rva,
+                                                     ULONG64 rva, ULONG size,
+                                                     UCHAR* window) {
+  const auto position = rva + kCiWindowMargin;
+  if (position < page_rva || position + size > page_rva + kCiWindowSize) {
+    return nullptr;
+  }
+  return window + (position - page_rva);
+}
+
+// Mixes bits of the value as the finalizer of SplitMix64
+_Use_decl_annotations_ static ULONG64 CipMix(ULONG64 value) {
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+  return value ^ (value >> 31);
+}
+
+// Adds differing bytes given as a bit mask of bytes from offset
+_Use_decl_annotations_ static void CipRecordDifference(
+    ULONG offset, ULONG mask, CiDifference* difference) {
+  if (!difference->changed_count) {
+    difference->first_offset = offset + CipFindLowestBit(mask);
+  }
+  difference->last_offset = offset + CipFindHighestBit(mask);
+  difference->changed_count += CipCountBits(mask);
+}
+
+// Returns an index of the lowest set bit of a non-zero value
+_Use_decl_annotations_ static ULONG CipFindLowestBit(ULONG value) {
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+  _BitScanForward(&index, value);
+  return index;
+#else
+  return static_cast<ULONG>(__builtin_ctz(value));
+#endif
+}
+
+// Returns an index of the highest set bit of a non-zero value
+_Use_decl_annotations_ static ULONG CipFindHighestBit(ULONG value) {
+#if defined(_MSC_VER)
+  unsigned long index = 0;
+  _BitScanReverse(&index, value);
+  return index;
+#else
+  return 31 - static_cast<ULONG>(__builtin_clz(value));
+#endif
+}
+
+// Returns the number of set bits. Differences are rare enough not to need
+// the POPCNT instruction, which not all processors with VT-x support.
+_Use_decl_annotations_ static ULONG CipCountBits(ULONG value) {
+  auto count = 0ul;
+  for (; value; value &= value - 1) {
+    ++count;
+  }
+  return count;
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares functions to rebuild pages of a loaded image from its file
+/// and to compare and hash pages.
+///
+/// Contents of a page an image is expected to have in memory are rebuilt from
+/// the file of the image by copying its headers and raw data of sections and
+/// applying base relocations for the address it is loaded at. Relocations
+/// crossing boundaries of a page are applied by rebuilding kCiWindowMargin
+/// bytes on each side of it. Hashes tell whether a page has changed since it
+/// was compared last time, and comparison tells which bytes differ. Both use
+/// SSE2 when DDIMON_CI_USE_SSE2 is 1 and give the same results either way.
+/// Functions here depend only on platform.h and never trust the file.
+
+#ifndef DDIMON_CODE_INTEGRITY_H_
+#define DDIMON_CODE_INTEGRITY_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Set 0 to hash and compare pages without SSE2. x86 kernel code may not use
+// SSE2 without saving the floating point state, so it is used only on x64.
+#if !defined(DDIMON_CI_USE_SSE2)
+#if defined(_AMD64_)
+#define DDIMON_CI_USE_SSE2 1
+#else
+#define DDIMON_CI_USE_SSE2 0
+#endif
+#endif
+
+static const ULONG kCiPageSize = 0x1000;
+
+// Bytes rebuilt on each side of a page, covering the widest relocation
+static const ULONG kCiWindowMargin = 8;
+static const ULONG kCiWindowSize = kCiPageSize + kCiWindowMargin * 2;
+
+// Characteristics of a section
+static const ULONG kCiSectionDiscardable = 0x02000000;
+static const ULONG kCiSectionExecute = 0x20000000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A file of an image validated by CiParseImage(). file must outlive it.
+struct CiImage {
+  const UCHAR* file;
+  ULONG64 file_size;
+  ULONG64 image_base;  // An address the image prefers to be loaded at
+  ULONG image_size;
+  ULONG header_size;
+  ULONG section_offset;  // A file offset of the first section header
+  ULONG section_count;
+  ULONG relocation_rva;
+  ULONG relocation_size;
+};
+
+struct CiSection {
+  ULONG rva;
+  ULONG virtual_size;
+  ULONG raw_offset;
+  ULONG raw_size;
+  ULONG characteristics;
+};
+
+// Bytes of a page that differ. Offsets are from the start of the page.
+struct CiDifference {
+  ULONG first_offset;
+  ULONG last_offset;
+  ULONG changed_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+bool CiParseImage(_Out_ CiImage* image,
+                  _In_reads_bytes_(file_size) const UCHAR* file,
+                  _In_ ULONG64 file_size);
+
+bool CiGetSection(_In_ const CiImage& image, _In_ ULONG index,
+                  _Out_ CiSection* section);
+
+bool CiBuildExpectedPage(_In_ const CiImage& image, _In_ ULONG page_rva,
+                         _In_ ULONG64 load_base,
+                         _Out_writes_bytes_(kCiWindowSize) UCHAR* window);
+
+ULONG64 CiHashPage(_In_reads_bytes_(kCiPageSize) const UCHAR* page,
+                   _In_ ULONG64 seed);
+
+ULONG CiComparePage(_In_reads_bytes_(size) const UCHAR* live,
+                    _In_reads_bytes_(size) const UCHAR* expected,
+                    _In_ ULONG size, _Out_ CiDifference* difference);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_CODE_INTEGRITY_H_
@@ -0,0 +1,426 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements code scanner functions.
+
+#include "code_scanner.h"
+#include <aux_klib.h>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#undef _HAS_EXCEPTIONS
+#define _HAS_EXCEPTIONS 0
+#include <vector>
+#include "code_integrity.h"
+#include "shadow_hook.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Files larger than this are not read
+static const ULONG kCspMaxFileSize = 64 * 1024 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+enum CspPageState : USHORT {
+  kCspPageUnknown = 0,  // Never compared
+  kCspPageClean,
+  kCspPageModified,
+};
+
+// A page as it was when compared last time
+struct CspPage {
+  ULONG64 hash;
+  USHORT first_offset;
+  USHORT last_offset;
+  USHORT changed_count;
+  CspPageState state;
+};
+static_assert(sizeof(CspPage) == 16, "Size check");
+
+// A loaded module and its pages, indexed by RVA
+struct CspModule {
+  ULONG64 base;
+  ULONG size;
+  USHORT file_name_offset;
+  char path[AUX_KLIB_MODULE_PATH_LEN];
+  std::vector<CspPage> pages;
+};
+
+// A file of a module read on the first page that needs it
+struct CspFile {
+  bool attempted;
+  UCHAR* contents;  // nullptr when the file could not be read
+  CiImage image;
+};
+
+// Output and work areas of a scan
+struct CspScanContext {
+  DdimonCodeScanStatistics* statistics;
+  DdimonModifiedCode* records;
+  ULONG capacity;
+  ULONG* record_count;
+  UCHAR* live_page;  // kCiPageSize bytes
+  UCHAR* window;     // kCiWindowSize bytes
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static std::vector<CspModule>*
+    CspQueryModules(_In_ std::vector<CspModule>* previous_modules);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void CspScanModule(
+    _In_ const SharedShadowHookPatchData* shared_sh_data,
+    _Inout_ CspModule* module, _Inout_ CspScanContext* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool CspReadFile(
+    _In_ const CspModule& module, _Inout_ CspFile* file);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void CspAddRecord(
+    _In_ const CspModule& module, _In_ ULONG64 rva, _In_ const CspPage& page,
+    _Inout_ CspScanContext* context);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, CsTermination)
+#pragma alloc_text(PAGE, CsScan)
+#pragma alloc_text(PAGE, CspQueryModules)
+#pragma alloc_text(PAGE, CspScanModule)
+#pragma alloc_text(PAGE, CspReadFile)
+#pragma alloc_text(PAGE, CspAddRecord)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Modules seen by the last scan, and a seed of hashes of their pages. Only
+// accessed by CsScan(), whose callers serialize calls.
+static std::vector<CspModule>* g_csp_modules;
+static ULONG64 g_csp_seed;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Frees hashes of pages kept between scans
+_Use_decl_annotations_ void CsTermination() {
+  PAGED_CODE();
+
+  delete g_csp_modules;
+  g_csp_modules = nullptr;
+}
+
+// Scans code of all loaded kernel modules and returns pages that differ from
+// files, as many as fit in records. Callers must serialize calls, and hooks
+// must not be installed or uninstalled meanwhile. Runs at PASSIVE_LEVEL
+// throughout so that a scan never keeps a processor from other threads.
+_Use_decl_annotations_ NTSTATUS
+CsScan(const SharedShadowHookPatchData* shared_sh_data,
+       DdimonCodeScanStatistics* statistics, DdimonModifiedCode* records,
+       ULONG capacity, ULONG* record_count) {
+  PAGED_CODE();
+
+  *statistics = {};
+  *record_count = 0;
+
+  LARGE_INTEGER frequency = {};
+  const auto begin = KeQueryPerformanceCounter(&frequency);
+  if (!g_csp_modules) {
+    g_csp_seed = __rdtsc() ^ KeQueryInterruptTime();
+  }
+
+  const auto modules = CspQueryModules(g_csp_modules);
+  if (!modules) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  delete g_csp_modules;
+  g_csp_modules = modules;
+
+  const auto buffer = static_cast<UCHAR*>(ExAllocatePoolWithTag(
+      PagedPool, kCiPageSize + kCiWindowSize, kHyperPlatformCommonPoolTag));
+  if (!buffer) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  CspScanContext context = {statistics, records, capacity, record_count,
+                            buffer, buffer + kCiPageSize};
+  for (auto& module : *modules) {
+    CspScanModule(shared_sh_data, &module, &context);
+  }
+  ExFreePoolWithTag(buffer, kHyperPlatformCommonPoolTag);
+
+  statistics->module_count = static_cast<ULONG>(modules->size());
+  const auto elapsed =
+      KeQueryPerformanceCounter(nullptr).QuadPart - begin.QuadPart;
+  statistics->elapsed_us = elapsed * 1000 * 1000 / frequency.QuadPart;
+  HYPERPLATFORM_LOG_INFO(
+      "Scanned %lu pages of %lu modules in %I64u us: %lu compared, %lu "
+      "cached, %lu modified.",
+      statistics->page_count, statistics->module_count,
+      statistics->elapsed_us, statistics->compared_count,
+      statistics->cached_count, statistics->modified_count);
+  return (*record_count < statistics->modified_count) ? STATUS_BUFFER_OVERFLOW
+                                                      : STATUS_SUCCESS;
+}
+
+// Returns currently loaded modules. Pages of modules found in
+// previous_modules at the same base with the same size and path are moved.
+_Use_decl_annotations_ static std::vector<CspModule>* CspQueryModules(
+    std::vector<CspModule>* previous_modules) {
+  PAGED_CODE();
+
+  ULONG size = 0;
+  auto status = AuxKlibQueryModuleInformation(
+      &size, sizeof(AUX_MODULE_EXTENDED_INFO), nullptr);
+  if (!NT_SUCCESS(status) || !size) {
+    return nullptr;
+  }
+  const auto infos = static_cast<AUX_MODULE_EXTENDED_INFO*>(
+      ExAllocatePoolWithTag(PagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!infos) {
+    return nullptr;
+  }
+  status = AuxKlibQueryModuleInformation(
+      &size, sizeof(AUX_MODULE_EXTENDED_INFO), infos);
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(infos, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+
+  const auto count = size / sizeof(AUX_MODULE_EXTENDED_INFO);
+  auto modules = new std::vector<CspModule>();
+  if (modules) {
+    modules->reserve(count);
+  }
+  if (!modules || modules->capacity() < count) {
+    delete modules;
+    ExFreePoolWithTag(infos, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+
+  for (auto i = 0ul; i < count; ++i) {
+    const auto& info = infos[i];
+    CspModule module = {};
+    module.base = reinterpret_cast<ULONG64>(info.BasicInfo.ImageBase);
+    module.size = info.ImageSize;
+    module.file_name_offset = info.FileNameOffset;
+    RtlCopyMemory(module.path, info.FullPathName, sizeof(module.path));
+    module.path[sizeof(module.path) - 1] = '\0';
+
+    if (previous_modules) {
+      for (auto& previous : *previous_modules) {
+        if (previous.base == module.base && previous.size == module.size &&
+            !strcmp(previous.path, module.path)) {
+          module.pages = std::move(previous.pages);
+          break;
+        }
+      }
+    }
+
+    // A module is left without pages and not scanned when they cannot be
+    // allocated
+    const auto page_count = BYTES_TO_PAGES(module.size);
+    if (module.pages.size() != page_count) {
+      module.pages.resize(page_count);
+    }
+    modules->push_back(std::move(module));
+  }
+  ExFreePoolWithTag(infos, kHyperPlatformCommonPoolTag);
+  return modules;
+}
+
+// Scans pages of executable and non-discardable sections of the module.
+// Sections are enumerated with headers in memory so that the file is read
+// only when a page has to be compared.
+_Use_decl_annotations_ static void CspScanModule(
+    const SharedShadowHookPatchData* shared_sh_data, CspModule* module,
+    CspScanContext* context) {
+  PAGED_CODE();
+
+  const auto base = reinterpret_cast<UCHAR*>(module->base);
+  CiImage image = {};
+  if (module->pages.size() != BYTES_TO_PAGES(module->size) ||
+      !MmIsAddressValid(base) ||
+      !CiParseImage(&image, base,
+                    (module->size < PAGE_SIZE) ? module->size : PAGE_SIZE)) {
+    return;
+  }
+
+  auto& statistics = *context->statistics;
+  CspFile file = {};
+  for (auto i = 0ul; i < image.section_count; ++i) {
+    CiSection section = {};
+    CiGetSection(image, i, &section);
+    if (!(section.characteristics & kCiSectionExecute) ||
+        (section.characteristics & kCiSectionDiscardable)) {
+      continue;
+    }
+
+    auto section_end = static_cast<ULONG64>(section.rva) + section.virtual_size;
+    if (section_end > module->size) {
+      section_end = module->size;
+    }
+    for (auto rva = static_cast<ULONG64>(section.rva) & ~(PAGE_SIZE - 1ull);
+         rva < section_end; rva += PAGE_SIZE) {
+      statistics.page_count++;
+      const auto address = base + rva;
+      if (ShIsShadowedPage(shared_sh_data, address)) {
+        statistics.shadowed_count++;
+        continue;
+      }
+      if (!MmIsAddressValid(address)) {
+        statistics.paged_out_count++;
+        continue;
+      }
+
+      // The copy is hashed and compared so that both see the same contents
+      RtlCopyMemory(context->live_page, address, PAGE_SIZE);
+      const auto hash = CiHashPage(context->live_page, g_csp_seed);
+      auto& page = module->pages[rva >> PAGE_SHIFT];
+      if (page.state != kCspPageUnknown && page.hash == hash) {
+        statistics.cached_count++;
+        if (page.state == kCspPageModified) {
+          CspAddRecord(*module, rva, page, context);
+        }
+        continue;
+      }
+
+      if (!CspReadFile(*module, &file) ||
+          !CiBuildExpectedPage(file.image, static_cast<ULONG>(rva),
+                               module->base, context->window)) {
+        statistics.unverified_count++;
+        continue;
+      }
+
+      // Bytes past the end of the section are not backed by it
+      const auto compared_size = static_cast<ULONG>(
+          (section_end - rva < PAGE_SIZE) ? section_end - rva : PAGE_SIZE);
+      CiDifference difference = {};
+      statistics.compared_count++;
+      page.hash = hash;
+      if (!CiComparePage(context->live_page,
+                         context->window + kCiWindowMargin, compared_size,
+                         &difference)) {
+        page.state = kCspPageClean;
+        continue;
+      }
+
+      page.state = kCspPageModified;
+      page.first_offset = static_cast<USHORT>(difference.first_offset);
+      page.last_offset = static_cast<USHORT>(difference.last_offset);
+      page.changed_count = static_cast<USHORT>(difference.changed_count);
+      HYPERPLATFORM_LOG_WARN(
+          "%s+%05I64x: %lu bytes differ from the file.",
+          module->path + module->file_name_offset,
+          rva + difference.first_offset, difference.changed_count);
+      CspAddRecord(*module, rva, page, context);
+    }
+  }
+
+  if (file.contents) {
+    ExFreePoolWithTag(file.contents, kHyperPlatformCommonPoolTag);
+  }
+}
+
+// Reads the file of the module unless it has been attempted. Returns false
+// when the file cannot be read or is not of the module.
+_Use_decl_annotations_ static bool CspReadFile(const CspModule& module,
+                                               CspFile* file) {
+  PAGED_CODE();
+
+  if (file->attempted) {
+    return file->contents != nullptr;
+  }
+  file->attempted = true;
+
+  ANSI_STRING ansi_path = {};
+  RtlInitAnsiString(&ansi_path, module.path);
+  UNICODE_STRING path = {};
+  auto status = RtlAnsiStringToUnicodeString(&path, &ansi_path, TRUE);
+  if (!NT_SUCCESS(status)) {
+    return false;
+  }
+  OBJECT_ATTRIBUTES object_attributes = {};
+  InitializeObjectAttributes(&object_attributes, &path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  HANDLE handle = nullptr;
+  IO_STATUS_BLOCK io_status = {};
+  status = ZwCreateFile(
+      &handle, GENERIC_READ | SYNCHRONIZE, &object_attributes, &io_status,
+      nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  RtlFreeUnicodeString(&path);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_WARN("%s cannot be opened (%08x).", module.path,
+                           status);
+    return false;
+  }
+
+  FILE_STANDARD_INFORMATION information = {};
+  status = ZwQueryInformationFile(handle, &io_status, &information,
+                                  sizeof(information),
+                                  FileStandardInformation);
+  const auto size = information.EndOfFile.QuadPart;
+  if (!NT_SUCCESS(status) || size <= 0 || size > kCspMaxFileSize) {
+    ZwClose(handle);
+    return false;
+  }
+  const auto contents = static_cast<UCHAR*>(ExAllocatePoolWithTag(
+      PagedPool, static_cast<SIZE_T>(size), kHyperPlatformCommonPoolTag));
+  if (!contents) {
+    ZwClose(handle);
+    return false;
+  }
+  LARGE_INTEGER offset = {};
+  status = ZwReadFile(handle, nullptr, nullptr, nullptr, &io_status, contents,
+                      static_cast<ULONG>(size), &offset, nullptr);
+  ZwClose(handle);
+
+  // A file replaced since the module was loaded hardly has the same size of
+  // image, and its pages would all look modified
+  if (!NT_SUCCESS(status) || io_status.Information != size ||
+      !CiParseImage(&file->image, contents, static_cast<ULONG64>(size)) ||
+      file->image.image_size != module.size) {
+    HYPERPLATFORM_LOG_WARN("%s cannot be read as the module (%08x).",
+                           module.path, status);
+    ExFreePoolWithTag(contents, kHyperPlatformCommonPoolTag);
+    return false;
+  }
+  file->contents = contents;
+  return true;
+}
+
+// Counts a modified page and returns it as far as capacity allows
+_Use_decl_annotations_ static void CspAddRecord(const CspModule& module,
+                                                ULONG64 rva,
+                                                const CspPage& page,
+                                                CspScanContext* context) {
+  PAGED_CODE();
+
+  context->statistics->modified_count++;
+  if (*context->record_count == context->capacity) {
+    return;
+  }
+  auto& record = context->records[(*context->record_count)++];
+  record.address = module.base + rva + page.first_offset;
+  record.module_base = module.base;
+  record.size = page.last_offset - page.first_offset + 1ul;
+  record.changed_count = page.changed_count;
+}
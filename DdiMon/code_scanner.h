@@ -0,0 +1,62 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to code scanner functions.
+///
+/// A code scanner finds code of loaded kernel modules modified by anyone
+/// other than DdiMon. Each resident page of executable sections is compared
+/// against the file of the module after relocations are applied, except
+/// pages shadowed by DdiMon. A hash of each page is kept between scans, and
+/// a page whose hash has not changed is not compared again, so that files
+/// are read only for modules with pages never seen or changed since.
+
+#ifndef DDIMON_CODE_SCANNER_H_
+#define DDIMON_CODE_SCANNER_H_
+
+#include <fltKernel.h>
+#include "ddi_mon_ioctl.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct SharedShadowHookPatchData;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void CsTermination();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    CsScan(_In_ const SharedShadowHookPatchData* shared_sh_data,
+           _Out_ DdimonCodeScanStatistics* statistics,
+           _Out_writes_to_(capacity, *record_count)
+               DdimonModifiedCode* records,
+           _In_ ULONG capacity, _Out_ ULONG* record_count);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_CODE_SCANNER_H_
@@ -0,0 +1,256 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to post and drain batches of operations through a
+/// command ring.
+
+#include "command_ring.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static_assert((kCrRingCapacity & (kCrRingCapacity - 1)) == 0,
+              "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG64 CrpLoadAcquire(_In_ const volatile ULONG64* value);
+
+static void CrpStoreRelease(_Inout_ volatile ULONG64* value,
+                            _In_ ULONG64 new_value);
+
+static ULONG64 CrpCompareExchange64(_Inout_ volatile ULONG64* value,
+                                    _In_ ULONG64 new_value,
+                                    _In_ ULONG64 comparand);
+
+static LONG CrpCompareExchange(_Inout_ volatile LONG* value,
+                               _In_ LONG new_value, _In_ LONG comparand);
+
+static LONG CrpDecrement(_Inout_ volatile LONG* value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes an empty ring
+_Use_decl_annotations_ void CrInitializeRing(CrRing* ring) {
+  ring->tail = 0;
+  ring->head = 0;
+  for (auto i = 0ul; i < kCrRingCapacity; ++i) {
+    ring->slots[i].sequence = i;
+    ring->slots[i].batch = nullptr;
+  }
+}
+
+// Initializes an empty batch to be posted to consumer_count rings
+_Use_decl_annotations_ void CrInitializeBatch(CrBatch* batch,
+                                              ULONG consumer_count) {
+  batch->operation_count = 0;
+  batch->pending_count = static_cast<LONG>(consumer_count);
+}
+
+// Appends an operation to the batch. Returns false when the batch is full.
+_Use_decl_annotations_ bool CrAddOperation(CrBatch* batch, ULONG kind,
+                                           ULONG64 argument0,
+                                           ULONG64 argument1) {
+  if (batch->operation_count == kCrMaxOperations) {
+    return false;
+  }
+
+  auto& operation = batch->operations[batch->operation_count++];
+  operation.kind = kind;
+  operation.status = 0;
+  operation.arguments[0] = argument0;
+  operation.arguments[1] = argument1;
+  return true;
+}
+
+// Posts the batch to the ring. Safe to call from any number of producers at
+// once. Returns false when the ring is full, in which case the caller either
+// retries after the consumer drained the ring or gives up with
+// CrCompleteBatch().
+_Use_decl_annotations_ bool CrPost(CrRing* ring, CrBatch* batch) {
+  auto position = CrpLoadAcquire(&ring->tail);
+  CrSlot* slot = nullptr;
+  for (;;) {
+    slot = &ring->slots[position & (kCrRingCapacity - 1)];
+    const auto sequence = CrpLoadAcquire(&slot->sequence);
+    const auto difference = static_cast<long long>(sequence - position);
+    if (difference == 0) {
+      // The slot is free for this position; claim the position
+      const auto observed =
+          CrpCompareExchange64(&ring->tail, position + 1, position);
+      if (observed == position) {
+        break;
+      }
+      position = observed;
+    } else if (difference < 0) {
+      // The slot still holds a batch posted kCrRingCapacity positions ago
+      return false;
+    } else {
+      // Another producer claimed the position
+      position = CrpLoadAcquire(&ring->tail);
+    }
+  }
+
+  slot->batch = batch;
+  CrpStoreRelease(&slot->sequence, position + 1);
+  return true;
+}
+
+// Applies all batches posted to the ring in order and returns the number of
+// them. Only one consumer may drain a ring at a time. A batch whose producer
+// has claimed a slot but not yet published it stops draining and is left for
+// the next call.
+_Use_decl_annotations_ ULONG CrDrain(CrRing* ring, CrHandler handler,
+                                     void* context) {
+  auto drained = 0ul;
+  for (;;) {
+    auto& slot = ring->slots[ring->head & (kCrRingCapacity - 1)];
+    if (CrpLoadAcquire(&slot.sequence) != ring->head + 1) {
+      break;
+    }
+
+    const auto batch = slot.batch;
+    CrpStoreRelease(&slot.sequence, ring->head + kCrRingCapacity);
+    ring->head++;
+
+    for (auto i = 0ul; i < batch->operation_count; ++i) {
+      auto& operation = batch->operations[i];
+      const auto status = handler(context, operation);
+      if (status < 0) {
+        CrpCompareExchange(&operation.status, status, 0);
+      }
+    }
+    CrpDecrement(&batch->pending_count);
+    drained++;
+  }
+  return drained;
+}
+
+// Completes the batch on behalf of a consumer it could not be posted to, and
+// records the failure status on all operations
+_Use_decl_annotations_ void CrCompleteBatch(CrBatch* batch, LONG status) {
+  for (auto i = 0ul; i < batch->operation_count; ++i) {
+    CrpCompareExchange(&batch->operations[i].status, status, 0);
+  }
+  CrpDecrement(&batch->pending_count);
+}
+
+// Returns true when the ring has no batch published to drain. Meant to be
+// called by or on behalf of the consumer.
+_Use_decl_annotations_ bool CrIsRingEmpty(const CrRing* ring) {
+  const auto& slot = ring->slots[ring->head & (kCrRingCapacity - 1)];
+  return CrpLoadAcquire(&slot.sequence) != ring->head + 1;
+}
+
+// Returns true when all consumers drained the batch
+_Use_decl_annotations_ bool CrIsBatchComplete(const CrBatch* batch) {
+  return CrpCompareExchange(const_cast<volatile LONG*>(&batch->pending_count),
+                            0, 0) == 0;
+}
+
+// Returns the first failure status recorded in the batch, or 0
+_Use_decl_annotations_ LONG CrGetBatchStatus(const CrBatch* batch) {
+  for (auto i = 0ul; i < batch->operation_count; ++i) {
+    if (batch->operations[i].status) {
+      return batch->operations[i].status;
+    }
+  }
+  return 0;
+}
+
+#if defined(_MSC_VER)
+
+// Volatile accesses have acquire and release semantics on x86 and x64 as
+// long as they are not reordered by the compiler
+
+_Use_decl_annotations_ static ULONG64 CrpLoadAcquire(
+    const volatile ULONG64* value) {
+  const auto result = *value;
+  _ReadWriteBarrier();
+  return result;
+}
+
+_Use_decl_annotations_ static void CrpStoreRelease(volatile ULONG64* value,
+                                                   ULONG64 new_value) {
+  _ReadWriteBarrier();
+  *value = new_value;
+}
+
+_Use_decl_annotations_ static ULONG64 CrpCompareExchange64(
+    volatile ULONG64* value, ULONG64 new_value, ULONG64 comparand) {
+  return static_cast<ULONG64>(_InterlockedCompareExchange64(
+      reinterpret_cast<volatile __int64*>(value),
+      static_cast<__int64>(new_value), static_cast<__int64>(comparand)));
+}
+
+_Use_decl_annotations_ static LONG CrpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  return _InterlockedCompareExchange(reinterpret_cast<volatile long*>(value),
+                                     new_value, comparand);
+}
+
+_Use_decl_annotations_ static LONG CrpDecrement(volatile LONG* value) {
+  return _InterlockedDecrement(reinterpret_cast<volatile long*>(value));
+}
+
+#else
+
+_Use_decl_annotations_ static ULONG64 CrpLoadAcquire(
+    const volatile ULONG64* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+_Use_decl_annotations_ static void CrpStoreRelease(volatile ULONG64* value,
+                                                   ULONG64 new_value) {
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+_Use_decl_annotations_ static ULONG64 CrpCompareExchange64(
+    volatile ULONG64* value, ULONG64 new_value, ULONG64 comparand) {
+  __atomic_compare_exchange_n(value, &comparand, new_value, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return comparand;
+}
+
+_Use_decl_annotations_ static LONG CrpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  __atomic_compare_exchange_n(value, &comparand, new_value, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return comparand;
+}
+
+_Use_decl_annotations_ static LONG CrpDecrement(volatile LONG* value) {
+  return __atomic_sub_fetch(value, 1, __ATOMIC_ACQ_REL);
+}
+
+#endif
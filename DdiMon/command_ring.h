@@ -0,0 +1,105 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares a command ring and functions to post and drain batches of
+/// operations through it.
+///
+/// A command ring is a bounded queue of pointers to CrBatch that any number of
+/// producers post to concurrently and exactly one consumer drains, using
+/// sequence numbers of slots as Vyukov's bounded MPMC queue does. A batch
+/// carries typed operations whose meaning is given by the consumer's handler,
+/// and may be posted to several rings at once, for example, one per
+/// processor. Each operation keeps the first failure reported by any consumer,
+/// and the batch is complete when every consumer it was posted to drained it.
+/// Functions here depend only on platform.h.
+
+#ifndef DDIMON_COMMAND_RING_H_
+#define DDIMON_COMMAND_RING_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of slots of a ring. Must be a power of two.
+static const ULONG kCrRingCapacity = 64;
+
+static const ULONG kCrMaxOperations = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct CrOperation {
+  ULONG kind;
+  volatile LONG status;  // 0 until a consumer reports a failure
+  ULONG64 arguments[2];
+};
+
+// Must stay valid until CrIsBatchComplete() returns true
+struct CrBatch {
+  ULONG operation_count;
+  volatile LONG pending_count;  // Consumers yet to drain the batch
+  CrOperation operations[kCrMaxOperations];
+};
+
+struct CrSlot {
+  volatile ULONG64 sequence;
+  CrBatch* batch;
+};
+
+struct CrRing {
+  alignas(64) volatile ULONG64 tail;  // Next position to post to
+  alignas(64) ULONG64 head;           // Next position to drain; consumer only
+  alignas(64) CrSlot slots[kCrRingCapacity];
+};
+
+// Applies an operation and returns 0 or a (negative) failure status
+using CrHandler = LONG (*)(void* context, const CrOperation& operation);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void CrInitializeRing(_Out_ CrRing* ring);
+
+void CrInitializeBatch(_Out_ CrBatch* batch, _In_ ULONG consumer_count);
+
+bool CrAddOperation(_Inout_ CrBatch* batch, _In_ ULONG kind,
+                    _In_ ULONG64 argument0, _In_ ULONG64 argument1);
+
+bool CrPost(_Inout_ CrRing* ring, _In_ CrBatch* batch);
+
+ULONG CrDrain(_Inout_ CrRing* ring, _In_ CrHandler handler,
+              _In_opt_ void* context);
+
+void CrCompleteBatch(_Inout_ CrBatch* batch, _In_ LONG status);
+
+bool CrIsRingEmpty(_In_ const CrRing* ring);
+
+bool CrIsBatchComplete(_In_ const CrBatch* batch);
+
+LONG CrGetBatchStatus(_In_ const CrBatch* batch);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_COMMAND_RING_H_
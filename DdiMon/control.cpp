@@ -0,0 +1,461 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements control device functions.
+
+#include "control.h"
+#include <ntstrsafe.h>
+#include <wdmsec.h>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "ddi_mon_ioctl.h"
+#include "ddi_mon.h"
+#include "shadow_hook.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// {5B4F1C2E-8D3A-4E7B-9A61-0C2D7E9F4B13}
+static const GUID kCtlpDeviceClassGuid = {
+    0x5b4f1c2e,
+    0x8d3a,
+    0x4e7b,
+    {0x9a, 0x61, 0x0c, 0x2d, 0x7e, 0x9f, 0x4b, 0x13}};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+// Not documented but exported by ntoskrnl
+EXTERN_C NTKERNELAPI NTSTATUS NTAPI
+ObReferenceObjectByName(_In_ PUNICODE_STRING object_name, _In_ ULONG attributes,
+                        _In_opt_ PACCESS_STATE access_state,
+                        _In_opt_ ACCESS_MASK desired_access,
+                        _In_ POBJECT_TYPE object_type,
+                        _In_ KPROCESSOR_MODE access_mode,
+                        _Inout_opt_ PVOID parse_context, _Out_ PVOID* object);
+
+EXTERN_C NTKERNELAPI POBJECT_TYPE* IoDriverObjectType;
+
+_Dispatch_type_(IRP_MJ_CREATE) _Dispatch_type_(IRP_MJ_CLOSE)
+static DRIVER_DISPATCH CtlpDispatchCreateClose;
+
+_Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
+static DRIVER_DISPATCH CtlpDispatchDeviceControl;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpQueryExitStatistics(_Inout_ PIRP irp,
+                            _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpReadExitTrace(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpQueryCallers(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpQueryLatencies(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpSetExitBudget(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpScanCode(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpSetTargetState(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    CtlpSetTargetScope(_Inout_ PIRP irp, _In_ const IO_STACK_LOCATION& stack);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS CtlpConvertTargetName(
+    _In_reads_(DDIMON_MAX_TARGET_NAME_LENGTH + 1) const char* name,
+    _Out_writes_(DDIMON_MAX_TARGET_NAME_LENGTH + 1) wchar_t* buffer,
+    _Out_ UNICODE_STRING* unicode_name);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, CtlInitialization)
+#pragma alloc_text(PAGE, CtlTermination)
+#pragma alloc_text(PAGE, CtlpDispatchCreateClose)
+#pragma alloc_text(PAGE, CtlpDispatchDeviceControl)
+#pragma alloc_text(PAGE, CtlpQueryExitStatistics)
+#pragma alloc_text(PAGE, CtlpReadExitTrace)
+#pragma alloc_text(PAGE, CtlpQueryCallers)
+#pragma alloc_text(PAGE, CtlpSetExitBudget)
+#pragma alloc_text(PAGE, CtlpQueryLatencies)
+#pragma alloc_text(PAGE, CtlpScanCode)
+#pragma alloc_text(PAGE, CtlpSetTargetState)
+#pragma alloc_text(PAGE, CtlpSetTargetScope)
+#pragma alloc_text(PAGE, CtlpConvertTargetName)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static PDEVICE_OBJECT g_ctlp_device_object;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates the control device accessible only by SYSTEM and administrators.
+// This is called from DriverEntry of HyperPlatform through
+// DdimonInitialization(), which does not pass the driver object, so it is
+// looked up by name. Dispatch routines are set once here, before any device
+// of the driver exists, and never undone: the I/O manager does not unload the
+// driver while a handle to the device is open, so the routines are valid for
+// any IRP it may send.
+_Use_decl_annotations_ NTSTATUS CtlInitialization() {
+  PAGED_CODE();
+
+  UNICODE_STRING driver_name = RTL_CONSTANT_STRING(L"\\Driver\\DdiMon");
+  PDRIVER_OBJECT driver_object = nullptr;
+  auto status = ObReferenceObjectByName(
+      &driver_name, OBJ_CASE_INSENSITIVE, nullptr, 0, *IoDriverObjectType,
+      KernelMode, nullptr, reinterpret_cast<PVOID*>(&driver_object));
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  driver_object->MajorFunction[IRP_MJ_CREATE] = CtlpDispatchCreateClose;
+  driver_object->MajorFunction[IRP_MJ_CLOSE] = CtlpDispatchCreateClose;
+  driver_object->MajorFunction[IRP_MJ_DEVICE_CONTROL] =
+      CtlpDispatchDeviceControl;
+
+  UNICODE_STRING device_name = RTL_CONSTANT_STRING(L"\\Device\\DdiMon");
+  PDEVICE_OBJECT device_object = nullptr;
+  status = IoCreateDeviceSecure(
+      driver_object, 0, &device_name, FILE_DEVICE_UNKNOWN,
+      FILE_DEVICE_SECURE_OPEN, FALSE, &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+      &kCtlpDeviceClassGuid, &device_object);
+  // The device references the driver object from now on
+  ObDereferenceObject(driver_object);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  UNICODE_STRING link_name = RTL_CONSTANT_STRING(L"\\DosDevices\\DdiMon");
+  status = IoCreateSymbolicLink(&link_name, &device_name);
+  if (!NT_SUCCESS(status)) {
+    IoDeleteDevice(device_object);
+    return status;
+  }
+
+  device_object->Flags &= ~DO_DEVICE_INITIALIZING;
+  g_ctlp_device_object = device_object;
+  return STATUS_SUCCESS;
+}
+
+// Deletes the control device. It is called on unload, which the I/O manager
+// defers until no handle to the device remains, so no IRP is in flight.
+_Use_decl_annotations_ void CtlTermination() {
+  PAGED_CODE();
+
+  if (!g_ctlp_device_object) {
+    return;
+  }
+
+  UNICODE_STRING link_name = RTL_CONSTANT_STRING(L"\\DosDevices\\DdiMon");
+  IoDeleteSymbolicLink(&link_name);
+  IoDeleteDevice(g_ctlp_device_object);
+  g_ctlp_device_object = nullptr;
+}
+
+// Accepts any open and close requests
+_Use_decl_annotations_ static NTSTATUS CtlpDispatchCreateClose(
+    PDEVICE_OBJECT device_object, PIRP irp) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(device_object);
+
+  irp->IoStatus.Status = STATUS_SUCCESS;
+  irp->IoStatus.Information = 0;
+  IoCompleteRequest(irp, IO_NO_INCREMENT);
+  return STATUS_SUCCESS;
+}
+
+// Dispatches IOCTLs declared in ddi_mon_ioctl.h
+_Use_decl_annotations_ static NTSTATUS CtlpDispatchDeviceControl(
+    PDEVICE_OBJECT device_object, PIRP irp) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(device_object);
+
+  const auto stack = IoGetCurrentIrpStackLocation(irp);
+  irp->IoStatus.Information = 0;
+
+  NTSTATUS status = STATUS_INVALID_DEVICE_REQUEST;
+  switch (stack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_DDIMON_QUERY_EXIT_STATISTICS:
+      status = CtlpQueryExitStatistics(irp, *stack);
+      break;
+    case IOCTL_DDIMON_READ_EXIT_TRACE:
+      status = CtlpReadExitTrace(irp, *stack);
+      break;
+    case IOCTL_DDIMON_QUERY_CALLERS:
+      status = CtlpQueryCallers(irp, *stack);
+      break;
+    case IOCTL_DDIMON_QUERY_LATENCIES:
+      status = CtlpQueryLatencies(irp, *stack);
+      break;
+    case IOCTL_DDIMON_SET_EXIT_BUDGET:
+      status = CtlpSetExitBudget(irp, *stack);
+      break;
+    case IOCTL_DDIMON_SCAN_CODE:
+      status = CtlpScanCode(irp, *stack);
+      break;
+    case IOCTL_DDIMON_SET_TARGET_STATE:
+      status = CtlpSetTargetState(irp, *stack);
+      break;
+    case IOCTL_DDIMON_SET_TARGET_SCOPE:
+      status = CtlpSetTargetScope(irp, *stack);
+      break;
+    default:
+      break;
+  }
+
+  irp->IoStatus.Status = status;
+  IoCompleteRequest(irp, IO_NO_INCREMENT);
+  return status;
+}
+
+// Fills the system buffer with a DdimonExitSnapshot
+_Use_decl_annotations_ static NTSTATUS CtlpQueryExitStatistics(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto output_length =
+      stack.Parameters.DeviceIoControl.OutputBufferLength;
+  if (output_length < FIELD_OFFSET(DdimonExitSnapshot, records)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto snapshot =
+      reinterpret_cast<DdimonExitSnapshot*>(irp->AssociatedIrp.SystemBuffer);
+  const auto capacity = static_cast<ULONG>(
+      (output_length - FIELD_OFFSET(DdimonExitSnapshot, records)) /
+      sizeof(DdimonExitStatistics));
+  ULONG record_count = 0;
+  ULONG total_count = 0;
+  const auto status = ShQueryExitStatistics(snapshot->records, capacity,
+                                            &record_count, &total_count);
+  snapshot->total_count = total_count;
+  snapshot->record_count = record_count;
+  irp->IoStatus.Information = FIELD_OFFSET(DdimonExitSnapshot, records) +
+                              sizeof(DdimonExitStatistics) * record_count;
+  return status;
+}
+
+// Fills the system buffer with a DdimonExitTrace
+_Use_decl_annotations_ static NTSTATUS CtlpReadExitTrace(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto output_length =
+      stack.Parameters.DeviceIoControl.OutputBufferLength;
+  if (output_length < FIELD_OFFSET(DdimonExitTrace, records)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto trace =
+      reinterpret_cast<DdimonExitTrace*>(irp->AssociatedIrp.SystemBuffer);
+  const auto capacity = static_cast<ULONG>(
+      (output_length - FIELD_OFFSET(DdimonExitTrace, records)) /
+      sizeof(DdimonExitTraceRecord));
+  ULONG record_count = 0;
+  ULONG64 lost_count = 0;
+  const auto status =
+      ShReadExitTrace(trace->records, capacity, &record_count, &lost_count);
+  trace->lost_count = lost_count;
+  trace->record_count = record_count;
+  trace->reserved = 0;
+  irp->IoStatus.Information = FIELD_OFFSET(DdimonExitTrace, records) +
+                              sizeof(DdimonExitTraceRecord) * record_count;
+  return status;
+}
+
+// Fills the system buffer with a DdimonCallerSnapshot
+_Use_decl_annotations_ static NTSTATUS CtlpQueryCallers(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto output_length =
+      stack.Parameters.DeviceIoControl.OutputBufferLength;
+  if (output_length < FIELD_OFFSET(DdimonCallerSnapshot, records)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto snapshot =
+      reinterpret_cast<DdimonCallerSnapshot*>(irp->AssociatedIrp.SystemBuffer);
+  const auto capacity = static_cast<ULONG>(
+      (output_length - FIELD_OFFSET(DdimonCallerSnapshot, records)) /
+      sizeof(DdimonCallerStatistics));
+  ULONG record_count = 0;
+  ULONG total_count = 0;
+  const auto status =
+      ShQueryCallers(snapshot->records, capacity, &record_count, &total_count);
+  snapshot->total_count = total_count;
+  snapshot->record_count = record_count;
+  irp->IoStatus.Information = FIELD_OFFSET(DdimonCallerSnapshot, records) +
+                              sizeof(DdimonCallerStatistics) * record_count;
+  return status;
+}
+
+// Fills the system buffer with a DdimonLatencySnapshot
+_Use_decl_annotations_ static NTSTATUS CtlpQueryLatencies(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto output_length =
+      stack.Parameters.DeviceIoControl.OutputBufferLength;
+  if (output_length < FIELD_OFFSET(DdimonLatencySnapshot, records)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto snapshot = reinterpret_cast<DdimonLatencySnapshot*>(
+      irp->AssociatedIrp.SystemBuffer);
+  const auto capacity = static_cast<ULONG>(
+      (output_length - FIELD_OFFSET(DdimonLatencySnapshot, records)) /
+      sizeof(DdimonLatencyStatistics));
+  ULONG record_count = 0;
+  ULONG total_count = 0;
+  const auto status = DdimonQueryLatencies(snapshot->records, capacity,
+                                           &record_count, &total_count);
+  snapshot->total_count = total_count;
+  snapshot->record_count = record_count;
+  irp->IoStatus.Information = FIELD_OFFSET(DdimonLatencySnapshot, records) +
+                              sizeof(DdimonLatencyStatistics) * record_count;
+  return status;
+}
+
+// Applies a DdimonExitBudget in the system buffer
+_Use_decl_annotations_ static NTSTATUS CtlpSetExitBudget(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  if (stack.Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(DdimonExitBudget)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto budget =
+      reinterpret_cast<DdimonExitBudget*>(irp->AssociatedIrp.SystemBuffer);
+  return ShSetExitBudget(*budget);
+}
+
+// Fills the system buffer with a DdimonCodeScan
+_Use_decl_annotations_ static NTSTATUS CtlpScanCode(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto output_length =
+      stack.Parameters.DeviceIoControl.OutputBufferLength;
+  if (output_length < FIELD_OFFSET(DdimonCodeScan, records)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto scan =
+      reinterpret_cast<DdimonCodeScan*>(irp->AssociatedIrp.SystemBuffer);
+  const auto capacity = static_cast<ULONG>(
+      (output_length - FIELD_OFFSET(DdimonCodeScan, records)) /
+      sizeof(DdimonModifiedCode));
+  DdimonCodeScanStatistics statistics = {};
+  ULONG record_count = 0;
+  const auto status =
+      DdimonScanCode(&statistics, scan->records, capacity, &record_count);
+  scan->statistics = statistics;
+  scan->record_count = record_count;
+  scan->reserved = 0;
+  irp->IoStatus.Information = FIELD_OFFSET(DdimonCodeScan, records) +
+                              sizeof(DdimonModifiedCode) * record_count;
+  return status;
+}
+
+// Enables or disables a target named in DdimonTargetState
+_Use_decl_annotations_ static NTSTATUS CtlpSetTargetState(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  if (stack.Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(DdimonTargetState)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  const auto state =
+      reinterpret_cast<DdimonTargetState*>(irp->AssociatedIrp.SystemBuffer);
+  wchar_t buffer[DDIMON_MAX_TARGET_NAME_LENGTH + 1];
+  UNICODE_STRING name = {};
+  const auto status = CtlpConvertTargetName(state->name, buffer, &name);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  return DdimonSetTargetState(&name, state->enable != 0);
+}
+
+// Limits hooks of a target named in DdimonTargetScope to the processes
+_Use_decl_annotations_ static NTSTATUS CtlpSetTargetScope(
+    PIRP irp, const IO_STACK_LOCATION& stack) {
+  PAGED_CODE();
+
+  const auto input_length = stack.Parameters.DeviceIoControl.InputBufferLength;
+  if (input_length < FIELD_OFFSET(DdimonTargetScope, process_ids)) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+  const auto scope =
+      reinterpret_cast<DdimonTargetScope*>(irp->AssociatedIrp.SystemBuffer);
+  if (scope->process_id_count > DDIMON_MAX_TARGET_SCOPE_PROCESSES) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (input_length < FIELD_OFFSET(DdimonTargetScope, process_ids) +
+                         sizeof(ULONG64) * scope->process_id_count) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  HANDLE process_ids[DDIMON_MAX_TARGET_SCOPE_PROCESSES] = {};
+  for (auto i = 0ul; i < scope->process_id_count; ++i) {
+    process_ids[i] = reinterpret_cast<HANDLE>(
+        static_cast<ULONG_PTR>(scope->process_ids[i]));
+  }
+  wchar_t buffer[DDIMON_MAX_TARGET_NAME_LENGTH + 1];
+  UNICODE_STRING name = {};
+  const auto status = CtlpConvertTargetName(scope->name, buffer, &name);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  return DdimonSetTargetScope(&name, process_ids, scope->process_id_count);
+}
+
+// Converts a target name given by user mode into a UNICODE_STRING referring
+// to the buffer. Fails when the name is not null-terminated.
+_Use_decl_annotations_ static NTSTATUS CtlpConvertTargetName(
+    const char* name, wchar_t* buffer, UNICODE_STRING* unicode_name) {
+  PAGED_CODE();
+
+  auto status =
+      RtlStringCchLengthA(name, DDIMON_MAX_TARGET_NAME_LENGTH + 1, nullptr);
+  if (!NT_SUCCESS(status)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  status = RtlStringCchPrintfW(buffer, DDIMON_MAX_TARGET_NAME_LENGTH + 1,
+                               L"%S", name);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  RtlInitUnicodeString(unicode_name, buffer);
+  return STATUS_SUCCESS;
+}
@@ -0,0 +1,50 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to control device functions.
+///
+/// The control device (\\.\DdiMon) lets administrators query DdiMon from user
+/// mode with IOCTLs declared in ddi_mon_ioctl.h.
+
+#ifndef DDIMON_CONTROL_H_
+#define DDIMON_CONTROL_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS CtlInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void CtlTermination();
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_CONTROL_H_
@@ -7,6 +7,7 @@
 
 #include "ddi_mon.h"
 #include <ntimage.h>
+#include <aux_klib.h>
 #define NTSTRSAFE_NO_CB_FUNCTIONS
 #include <ntstrsafe.h>
 #include "../HyperPlatform/HyperPlatform/common.h"
@@ -16,7 +17,20 @@
 #undef _HAS_EXCEPTIONS
 #define _HAS_EXCEPTIONS 0
 #include <array>
+#include <memory>
+#include <algorithm>
 #include "shadow_hook.h"
+#include "target_table.h"
+#include "hook_chain.h"
+#include "return_recorder.h"
+#include "latency_recorder.h"
+#include "hide_list.h"
+#include "control.h"
+#include "stack_trace.h"
+#include "trace_writer.h"
+#include "ddi_mon_schema.h"
+#include "seen_filter.h"
+#include "code_scanner.h"
 
 #pragma warning(disable:4505)
 ////////////////////////////////////////////////////////////////////////////////
@@ -29,11 +43,26 @@
 // constants and macros
 //
 
+// Interval after which an address is reported again, in 100 ns units
+static const ULONG64 kDdimonpReportPeriod = 60ull * 10 * 1000 * 1000;
+
+// Recorded hooks are validated against what their chains can forward
+static_assert(kTtMaxArguments == kHcMaxArguments, "Value check");
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+// Kinds of suspicious addresses reported by hook handlers. The same address
+// is reported once for each kind.
+enum DdimonpReportKind : ULONG64 {
+  kDdimonpReportWorkerRoutine = 1,
+  kDdimonpReportFreePool,
+  kDdimonpReportFreePoolWithTag,
+  kDdimonpReportAllocatePool,
+};
+
 // A helper type for parsing a PoolTag value
 union PoolTag {
   ULONG value;
@@ -50,19 +79,116 @@ enum SystemInformationClass {
   kSystemProcessInformation = 5,
 };
 
-// For NtQuerySystemInformation
-struct SystemProcessInformation {
-  ULONG next_entry_offset;
-  ULONG number_of_threads;
-  LARGE_INTEGER working_set_private_size;
-  ULONG hard_fault_count;
-  ULONG number_of_threads_high_watermark;
-  ULONG64 cycle_time;
-  LARGE_INTEGER create_time;
-  LARGE_INTEGER user_time;
-  LARGE_INTEGER kernel_time;
-  UNICODE_STRING image_name;
-  // omitted. see ole32!_SYSTEM_PROCESS_INFORMATION
+// A hook for a target table entry without a handler. Calls are recorded by
+// the return recorder through a chain used as a handler of the target, or
+// counted by the shadow hook when chain is nullptr (kTtFlagCount).
+struct DdimonpRecordedHook {
+  ShadowHookTarget target;
+  RrStatistics statistics;
+  HcChain* chain;
+};
+
+// A counting hook installed for an export matching a wildcard entry. Only an
+// address and a trampoline are kept so that thousands of them cost little.
+struct DdimonpMassHook {
+  ULONG64 address;
+  void* original_call;
+};
+
+// Regions of a kTtPatchBundle entry. Regions point into a copy of the entry,
+// which must outlive the patches and so is not moved with
+// DdimonpInstalledEntry.
+struct DdimonpPatchBundle {
+  TtEntry entry;
+  std::vector<ShadowPatchRegion> regions;
+};
+
+// A target installed from a target table
+struct DdimonpInstalledEntry {
+  TtEntry entry;
+  ULONG64 address;  // 0 for kTtFlagWildcard
+  ShadowHookTarget* hook;  // For kTtHook. Points to g_ddimonp_hook_targets
+                           // or recorded->target
+  std::unique_ptr<ShadowPatchTarget> patch;  // For kTtPatch
+  std::unique_ptr<DdimonpPatchBundle> bundle;  // For kTtPatchBundle
+  std::unique_ptr<DdimonpRecordedHook> recorded;  // For kTtHook
+  std::vector<DdimonpMassHook> mass_hooks;  // For kTtFlagWildcard
+};
+
+// A trampoline of an uninstalled hook waiting to be freed
+struct DdimonpRetiredTrampoline {
+  ShadowHookTarget* hook;  // nullptr for a mass hook
+  void* original_call;
+  std::unique_ptr<DdimonpRecordedHook> recorded;  // Freed along with it
+};
+
+// A context of DdimonpFindExportCallback()
+struct DdimonpExportQuery {
+  const char* name;
+  ULONG64 address;  // Set when found
+};
+
+// A context of DdimonpMatchExportCallback()
+struct DdimonpExportMatch {
+  PCUNICODE_STRING expression;  // In upper case
+  std::vector<ULONG64>* addresses;  // Addresses of matching exports
+};
+
+// Consumers attached to a target in g_ddimonp_hook_targets through a chain.
+// The thunk of the chain is used as a handler of the target.
+struct DdimonpHookChainTarget {
+  UNICODE_STRING target_name;
+  ULONG argument_count;  // Arguments the target function takes
+  const HcCallback* callbacks;
+  ULONG callback_count;
+  HcChain* chain;  // Created by DdimonpCreateHookChains()
+};
+
+// Calls ShLeaveHookHandler() when a hook handler returns, however it returns.
+// Also records latencies of the handler and of the original function called
+// through CallOriginal().
+class DdimonpHookHandlerScope {
+ public:
+  explicit DdimonpHookHandlerScope(_In_opt_ LrLatencies* latencies)
+      : latencies_(latencies), start_tsc_(__rdtsc()) {}
+
+  ~DdimonpHookHandlerScope() {
+    if (latencies_) {
+      const auto cycles = __rdtsc() - start_tsc_;
+      LrRecord(latencies_, cycles - original_cycles_, original_cycles_,
+               called_original_);
+    }
+    ShLeaveHookHandler();
+  }
+
+  // Calls the original function, measuring it apart from the handler
+  template <typename T, typename... Args>
+  auto CallOriginal(_In_ T original, _In_ Args... args) {
+    const OriginalTimer timer(this);
+    return original(args...);
+  }
+
+ private:
+  // Adds cycles until it is destroyed to those of the original function
+  class OriginalTimer {
+   public:
+    explicit OriginalTimer(_In_ DdimonpHookHandlerScope* scope)
+        : scope_(scope), start_tsc_(__rdtsc()) {}
+
+    ~OriginalTimer() {
+      scope_->original_cycles_ += __rdtsc() - start_tsc_;
+      scope_->called_original_ = true;
+    }
+
+   private:
+    DdimonpHookHandlerScope* scope_;
+    ULONG64 start_tsc_;
+  };
+
+  LrLatencies* latencies_;
+  ULONG64 start_tsc_;
+  ULONG64 original_cycles_ = 0;
+  bool called_original_ = false;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -70,6 +196,11 @@ struct SystemProcessInformation {
 // prototypes
 //
 
+// Not documented but exported by ntoskrnl. Returns STATUS_PENDING until the
+// process starts exiting.
+EXTERN_C NTKERNELAPI NTSTATUS NTAPI
+PsGetProcessExitStatus(_In_ PEPROCESS process);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C
 static void DdimonpFreeAllocatedTrampolineRegions();
 
@@ -84,11 +215,30 @@ static bool DdimonpEnumExportedSymbolsCallback(
   _In_ PIMAGE_EXPORT_DIRECTORY directory, _In_ ULONG_PTR directory_base,
   _In_ ULONG_PTR directory_end, _In_opt_ void* context);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C
+static bool DdimonpMatchExportCallback(
+  _In_ ULONG index, _In_ ULONG_PTR base_address,
+  _In_ PIMAGE_EXPORT_DIRECTORY directory, _In_ ULONG_PTR directory_base,
+  _In_ ULONG_PTR directory_end, _In_opt_ void* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C
+static bool DdimonpFindExportCallback(
+  _In_ ULONG index, _In_ ULONG_PTR base_address,
+  _In_ PIMAGE_EXPORT_DIRECTORY directory, _In_ ULONG_PTR directory_base,
+  _In_ ULONG_PTR directory_end, _In_opt_ void* context);
+
 static std::array<char, 5> DdimonpTagToString(_In_ ULONG tag_value);
 
 template <typename T>
 static T DdimonpFindOrignal(_In_ T handler);
 
+template <typename T>
+static LrLatencies* DdimonpFindLatencies(_In_ T handler);
+
+template <typename Event, typename... Values>
+static void DdimonpRecordEvent(_In_ void* address,
+                               _In_ const Values&... values);
+
 static bool DdimonpInitAddressKdTrap(ULONG64* ptarget_address);
 static bool DdimonpInitAddressKdDebuggerEnabled(ULONG64* ptarget_address);
 static bool DdimonpInitAddressNtSetSystemTime(ULONG64* ptarget_address);
@@ -98,8 +248,8 @@ static bool DdimonpInitAddressNtQueryInformationThread(
 
 static bool DdimonpInitAddressPspGetContext(ULONG64* ptarget_address);
 
-static VOID DdimonpHandlePspGetContext(ULONG64 a1, ULONG64 a2, ULONG64 a3,
-  ULONG64 a4, ULONG64 a5);
+static void DdimonpLogPspGetContext(_Inout_ HcCallContext* call_context,
+  _In_opt_ void* context);
 
 static VOID DdimonpHandleNtQueryInformationThread(ULONG64 a1, ULONG64 a2,
   ULONG64 a3, ULONG64 a4, ULONG64 a5);
@@ -109,9 +259,21 @@ static VOID DdimonpHandleMemAccessKdDebuggerEnabled(ULONG64 fault_addr, ULONG64
 static VOID DdimonpHandleExQueueWorkItem(_Inout_ PWORK_QUEUE_ITEM work_item,
   _In_ WORK_QUEUE_TYPE queue_type);
 
+static void DdimonpLogExAllocatePoolWithTag(
+  _Inout_ HcCallContext* call_context, _In_opt_ void* context);
+
+#if !defined(_AMD64_)
 static PVOID DdimonpHandleExAllocatePoolWithTag(_In_ POOL_TYPE pool_type,
-  _In_ SIZE_T number_of_bytes,
-  _In_ ULONG tag);
+  _In_ SIZE_T number_of_bytes, _In_ ULONG tag);
+
+static VOID DdimonpHandlePspGetContext(ULONG_PTR a1, ULONG_PTR a2,
+  ULONG_PTR a3);
+#endif
+
+static void DdimonpLogStack(_In_ ULONG stack_id);
+
+static bool DdimonpIsReported(_In_ DdimonpReportKind kind,
+                              _In_ const void* address);
 
 static VOID DdimonpHandleExFreePool(_Pre_notnull_ PVOID p);
 
@@ -129,12 +291,138 @@ EXTERN_C static bool DdimonInstallPatchUnexport(void* context);
 
 EXTERN_C static bool DdimonInstallMemMonitor(void* context);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+DdimonpInstallTargetTable(_In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_ const std::vector<TtEntry>& entries);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool DdimonpInstallEntry(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ const TtEntry& entry);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool DdimonpInstallMassHooks(
+    _In_ SharedShadowHookPatchData* shared_sh_data, _In_ const TtEntry& entry,
+    _Inout_ DdimonpInstalledEntry* installed);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool DdimonpIsCodeAddress(
+    _In_ ULONG_PTR base_address, _In_ ULONG64 address);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpUninstallEntry(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_ DdimonpInstalledEntry* installed);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG64
+DdimonpResolveEntryAddress(_In_ const TtEntry& entry);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void* DdimonpFindSignature(
+  _In_ ULONG_PTR base_address, _In_reads_bytes_(size) const UCHAR* signature,
+  _In_ SIZE_T size);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool DdimonpIsNameEqual(
+  _In_ const UNICODE_STRING& name, _In_ const char* ascii_name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void
+DdimonpFreeRetiredTrampolines();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void
+DdimonpFreeInstalledEntries();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpArmReloadNotification();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpCreateHookChains();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool DdimonpInstallRecordedHook(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ const TtEntry& entry,
+  _Inout_ DdimonpInstalledEntry* installed);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpLogRecordedHook(
+  _In_ const TtEntry& entry, _In_ const RrStatistics& statistics);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpDeleteHookChains();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpCreateHookLatencies();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpDeleteHookLatencies();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpCreateReportFilter();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpDeleteReportFilter();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpAddLatencyStatistics(
+    _Inout_updates_to_(capacity, *record_count)
+        DdimonLatencyStatistics* records,
+    _In_ ULONG capacity, _Inout_ ULONG* record_count,
+    _Inout_ ULONG* total_count, _In_ ULONG64 hook_address,
+    _In_ const LrLatencies* latencies, _Inout_ LhHistogram* handler,
+    _Inout_ LhHistogram* original);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpLoadHideList();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS DdimonpGetProcessCr3(
+  _In_ HANDLE process_id, _Out_ ULONG64* cr3);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG64 DdimonpReadProcessCr3(
+  _In_ PEPROCESS process);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpProcessNotifyRoutine(
+  _Inout_ PEPROCESS process, _In_ HANDLE process_id,
+  _Inout_opt_ PPS_CREATE_NOTIFY_INFO create_info);
+
+static WORKER_THREAD_ROUTINE DdimonpReloadWorkerRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG_PTR DdimonpFindModuleBase(
+  _In_ const char* module_name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG64 DdimonpFindExport(
+  _In_ ULONG_PTR base_address, _In_ const char* name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void DdimonpInstallPendingEntries();
+
+static LOAD_IMAGE_NOTIFY_ROUTINE DdimonpLoadImageNotifyRoutine;
+
+static WORKER_THREAD_ROUTINE DdimonpModuleWorkerRoutine;
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(PAGE, DdimonInitialization)
 #pragma alloc_text(PAGE, DdimonpEnumExportedSymbols)
 #pragma alloc_text(PAGE, DdimonpEnumExportedSymbolsCallback)
 #pragma alloc_text(PAGE, DdimonTermination)
 #pragma alloc_text(PAGE, DdimonpFreeAllocatedTrampolineRegions)
+#pragma alloc_text(PAGE, DdimonReloadTargets)
+#pragma alloc_text(PAGE, DdimonSetTargetState)
+#pragma alloc_text(PAGE, DdimonSetTargetScope)
+#pragma alloc_text(PAGE, DdimonQueryLatencies)
+#pragma alloc_text(PAGE, DdimonScanCode)
+#pragma alloc_text(PAGE, DdimonpGetProcessCr3)
+#pragma alloc_text(PAGE, DdimonpLoadHideList)
+#pragma alloc_text(PAGE, DdimonpInstallTargetTable)
+#pragma alloc_text(PAGE, DdimonpInstallEntry)
+#pragma alloc_text(PAGE, DdimonpInstallMassHooks)
+#pragma alloc_text(PAGE, DdimonpIsCodeAddress)
+#pragma alloc_text(PAGE, DdimonpUninstallEntry)
+#pragma alloc_text(PAGE, DdimonpResolveEntryAddress)
+#pragma alloc_text(PAGE, DdimonpFindSignature)
+#pragma alloc_text(PAGE, DdimonpIsNameEqual)
+#pragma alloc_text(PAGE, DdimonpFreeRetiredTrampolines)
+#pragma alloc_text(PAGE, DdimonpFreeInstalledEntries)
+#pragma alloc_text(PAGE, DdimonpArmReloadNotification)
+#pragma alloc_text(PAGE, DdimonpReloadWorkerRoutine)
+#pragma alloc_text(PAGE, DdimonpCreateHookChains)
+#pragma alloc_text(PAGE, DdimonpInstallRecordedHook)
+#pragma alloc_text(PAGE, DdimonpLogRecordedHook)
+#pragma alloc_text(PAGE, DdimonpDeleteHookChains)
+#pragma alloc_text(PAGE, DdimonpCreateHookLatencies)
+#pragma alloc_text(PAGE, DdimonpDeleteHookLatencies)
+#pragma alloc_text(PAGE, DdimonpCreateReportFilter)
+#pragma alloc_text(PAGE, DdimonpDeleteReportFilter)
+#pragma alloc_text(PAGE, DdimonpAddLatencyStatistics)
+#pragma alloc_text(PAGE, DdimonpFindExportCallback)
+#pragma alloc_text(PAGE, DdimonpMatchExportCallback)
+#pragma alloc_text(PAGE, DdimonpFindModuleBase)
+#pragma alloc_text(PAGE, DdimonpFindExport)
+#pragma alloc_text(PAGE, DdimonpInstallPendingEntries)
+#pragma alloc_text(PAGE, DdimonpLoadImageNotifyRoutine)
+#pragma alloc_text(PAGE, DdimonpReadProcessCr3)
+#pragma alloc_text(PAGE, DdimonpProcessNotifyRoutine)
+#pragma alloc_text(PAGE, DdimonpModuleWorkerRoutine)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -172,7 +460,11 @@ static ShadowHookTarget g_ddimonp_hook_targets[] = {
         RTL_CONSTANT_STRING(L"EXALLOCATEPOOLWITHTAG"),
         NULL,
         nullptr,
+#if defined(_AMD64_)
+        nullptr,  // A thunk of g_ddimonp_hook_chain_targets
+#else
         DdimonpHandleExAllocatePoolWithTag,
+#endif
         nullptr,
     },
     {
@@ -212,7 +504,11 @@ static ShadowHookTarget g_ddimonp_hook_targets[] = {
         RTL_CONSTANT_STRING(L"PSPGETCONTEXT"),
         0x6952B8, //PspGetContext
         DdimonpInitAddressPspGetContext,
+#if defined(_AMD64_)
+        nullptr,  // A thunk of g_ddimonp_hook_chain_targets
+#else
         DdimonpHandlePspGetContext,
+#endif
         nullptr,
     },
 };
@@ -251,6 +547,7 @@ static ShadowPatchTarget g_ddimonp_patch_targets[] = {
 
 static ShadowMemMonitorTarget g_ddimonp_mem_monitor_targets[] = {
     {
+        RTL_CONSTANT_STRING(L"KDDEBUGGERENABLED"),
         NULL,
         1,
         ACCESS_READ,
@@ -259,6 +556,72 @@ static ShadowMemMonitorTarget g_ddimonp_mem_monitor_targets[] = {
     },
 };
 
+// Shared data used to install and uninstall targets on reload
+// Consumers of targets handled by chains, in priority order
+static const HcCallback g_ddimonp_psp_get_context_callbacks[] = {
+    {0, DdimonpLogPspGetContext, nullptr, nullptr},
+};
+
+static const HcCallback g_ddimonp_allocate_pool_callbacks[] = {
+    {0, nullptr, DdimonpLogExAllocatePoolWithTag, nullptr},
+};
+
+static DdimonpHookChainTarget g_ddimonp_hook_chain_targets[] = {
+    {
+        RTL_CONSTANT_STRING(L"EXALLOCATEPOOLWITHTAG"),
+        3,
+        g_ddimonp_allocate_pool_callbacks,
+        RTL_NUMBER_OF(g_ddimonp_allocate_pool_callbacks),
+        nullptr,
+    },
+    {
+        RTL_CONSTANT_STRING(L"PSPGETCONTEXT"),
+        3,
+        g_ddimonp_psp_get_context_callbacks,
+        RTL_NUMBER_OF(g_ddimonp_psp_get_context_callbacks),
+        nullptr,
+    },
+};
+
+// Latencies of hand-written handlers, indexed like g_ddimonp_hook_targets.
+// Latencies of targets handled by chains are kept by the chains.
+static LrLatencies* g_ddimonp_hook_latencies[RTL_NUMBER_OF(
+    g_ddimonp_hook_targets)];
+
+// Addresses already reported by hook handlers. Handlers report every address
+// when it could not be allocated.
+static SfFilter* g_ddimonp_report_filter;
+
+static SharedShadowHookPatchData* g_ddimonp_shared_sh_data;
+
+// Targets installed from a target table, targets waiting for their modules to
+// be loaded, and trampolines of uninstalled hooks. They are only accessed
+// while holding g_ddimonp_reload_lock.
+static std::vector<DdimonpInstalledEntry>* g_ddimonp_installed_entries;
+static std::vector<TtEntry>* g_ddimonp_pending_entries;
+static std::vector<DdimonpRetiredTrampoline>* g_ddimonp_retired_trampolines;
+static KGUARDED_MUTEX g_ddimonp_reload_lock;
+
+// Held by each work item queued by DdimonpLoadImageNotifyRoutine()
+static EX_RUNDOWN_REF g_ddimonp_module_rundown;
+static bool g_ddimonp_module_notify_registered;
+
+// Serializes scoping targets to processes with removing exiting processes
+// from scopes, so that no exiting process is left in a scope. Targets are
+// scoped only while DdimonpProcessNotifyRoutine() is registered.
+static KGUARDED_MUTEX g_ddimonp_scope_lock;
+static bool g_ddimonp_process_notify_registered;
+
+// State of the registry change notification used for hot reload. Protected by
+// g_ddimonp_notify_lock. g_ddimonp_notify_idle_event is signaled while no
+// notification or reload is in flight.
+static KGUARDED_MUTEX g_ddimonp_notify_lock;
+static HANDLE g_ddimonp_parameters_key;
+static bool g_ddimonp_notify_stopping;
+static WORK_QUEUE_ITEM g_ddimonp_notify_work_item;
+static IO_STATUS_BLOCK g_ddimonp_notify_io_status;
+static KEVENT g_ddimonp_notify_idle_event;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -273,16 +636,81 @@ DdimonInitialization(SharedShadowHookPatchData* shared_sh_data) {
   if (!nt_base) {
     return STATUS_UNSUCCESSFUL;
   }
-  NTSTATUS status = 0;
-  //// Install hooks by enumerating exports of ntoskrnl, but not activate them yet
-  //NTSTATUS status = DdimonpEnumExportedSymbols(reinterpret_cast<ULONG_PTR>(nt_base),
-  //  DdimonpEnumExportedSymbolsCallback,
-  //  NULL);
 
-  //DdimonInstallHookUnexport(shared_sh_data);
-  //DdimonInstallPatchUnexport(shared_sh_data);
-  DdimonInstallMemMonitor(shared_sh_data);
+  g_ddimonp_shared_sh_data = shared_sh_data;
+  KeInitializeGuardedMutex(&g_ddimonp_reload_lock);
+  KeInitializeGuardedMutex(&g_ddimonp_notify_lock);
+  KeInitializeGuardedMutex(&g_ddimonp_scope_lock);
+  KeInitializeEvent(&g_ddimonp_notify_idle_event, NotificationEvent, TRUE);
+  g_ddimonp_installed_entries = new std::vector<DdimonpInstalledEntry>();
+  g_ddimonp_pending_entries = new std::vector<TtEntry>();
+  g_ddimonp_retired_trampolines = new std::vector<DdimonpRetiredTrampoline>();
+  auto status = AuxKlibInitialize();
+  if (!NT_SUCCESS(status)) {
+    DdimonpFreeInstalledEntries();
+    return status;
+  }
+  status = RrInitialization();
+  if (!NT_SUCCESS(status)) {
+    DdimonpFreeInstalledEntries();
+    return status;
+  }
+  status = HlInitialization();
+  if (!NT_SUCCESS(status)) {
+    RrTermination();
+    DdimonpFreeInstalledEntries();
+    return status;
+  }
+  DdimonpLoadHideList();
+  DdimonpCreateHookLatencies();
+  DdimonpCreateReportFilter();
+  DdimonpCreateHookChains();
+
+  // Let hook handlers capture stack traces. Events are logged without them
+  // when this fails.
+  const auto stack_trace_status = StInitialization();
+  if (!NT_SUCCESS(stack_trace_status)) {
+    HYPERPLATFORM_LOG_WARN("Stack traces are unavailable (%08x).",
+                           stack_trace_status);
+  }
+
+  // Persist events to a trace file in addition to the log. Events are only
+  // logged when this fails.
+  const auto trace_status = TwInitialization();
+  if (!NT_SUCCESS(trace_status)) {
+    HYPERPLATFORM_LOG_WARN("The trace file is unavailable (%08x).",
+                           trace_status);
+  }
+
+  // Use a target table when it is configured. Otherwise, fall back to targets
+  // built in the driver.
+  std::vector<TtEntry> entries;
+  status = TtLoadFromRegistry(&entries);
+  if (NT_SUCCESS(status)) {
+    status = DdimonpInstallTargetTable(shared_sh_data, entries);
+  } else if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+    //// Install hooks by enumerating exports of ntoskrnl, but not activate them yet
+    //status = DdimonpEnumExportedSymbols(reinterpret_cast<ULONG_PTR>(nt_base),
+    //  DdimonpEnumExportedSymbolsCallback,
+    //  NULL);
+
+    //DdimonInstallHookUnexport(shared_sh_data);
+    //DdimonInstallPatchUnexport(shared_sh_data);
+    DdimonInstallMemMonitor(shared_sh_data);
+    status = STATUS_SUCCESS;
+  } else {
+    HYPERPLATFORM_LOG_ERROR("Failed to load a target table (%08x).", status);
+  }
   if (!NT_SUCCESS(status)) {
+    DdimonpFreeAllocatedTrampolineRegions();
+    DdimonpFreeInstalledEntries();
+    DdimonpDeleteHookChains();
+    DdimonpDeleteHookLatencies();
+    DdimonpDeleteReportFilter();
+    RrTermination();
+    HlTermination();
+    StTermination();
+    TwTermination();
     return status;
   }
 
@@ -290,6 +718,51 @@ DdimonInitialization(SharedShadowHookPatchData* shared_sh_data) {
   status = ShEnableHooks();
   if (!NT_SUCCESS(status)) {
     DdimonpFreeAllocatedTrampolineRegions();
+    DdimonpFreeInstalledEntries();
+    DdimonpDeleteHookChains();
+    DdimonpDeleteHookLatencies();
+    DdimonpDeleteReportFilter();
+    RrTermination();
+    HlTermination();
+    StTermination();
+    TwTermination();
+    return status;
+  }
+
+  // Reload the target table whenever it is updated
+  DdimonpArmReloadNotification();
+
+  // Install targets in modules when they are loaded. Modules loaded before
+  // the notification was registered are checked right after that.
+  ExInitializeRundownProtection(&g_ddimonp_module_rundown);
+  const auto notify_status =
+      PsSetLoadImageNotifyRoutine(DdimonpLoadImageNotifyRoutine);
+  if (NT_SUCCESS(notify_status)) {
+    g_ddimonp_module_notify_registered = true;
+    DdimonpInstallPendingEntries();
+  } else {
+    HYPERPLATFORM_LOG_WARN(
+        "Targets in modules loaded later are not installed (%08x).",
+        notify_status);
+  }
+
+  // Remove exiting processes from scopes of targets, since a page table base
+  // of an exited process may be given to another process
+  const auto process_notify_status =
+      PsSetCreateProcessNotifyRoutineEx(DdimonpProcessNotifyRoutine, FALSE);
+  if (NT_SUCCESS(process_notify_status)) {
+    g_ddimonp_process_notify_registered = true;
+  } else {
+    HYPERPLATFORM_LOG_WARN("Targets cannot be scoped to processes (%08x).",
+                           process_notify_status);
+  }
+
+  // Let user-mode programs query statistics and control targets
+  status = CtlInitialization();
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("Failed to create the control device (%08x).",
+                            status);
+    DdimonTermination();
     return status;
   }
 
@@ -301,12 +774,384 @@ DdimonInitialization(SharedShadowHookPatchData* shared_sh_data) {
 _Use_decl_annotations_ EXTERN_C void DdimonTermination() {
   PAGED_CODE();
 
+  CtlTermination();
+
+  if (g_ddimonp_process_notify_registered) {
+    PsSetCreateProcessNotifyRoutineEx(DdimonpProcessNotifyRoutine, TRUE);
+    g_ddimonp_process_notify_registered = false;
+  }
+
+  // Stop installing targets in newly loaded modules
+  if (g_ddimonp_module_notify_registered) {
+    PsRemoveLoadImageNotifyRoutine(DdimonpLoadImageNotifyRoutine);
+    ExWaitForRundownProtectionRelease(&g_ddimonp_module_rundown);
+    g_ddimonp_module_notify_registered = false;
+  }
+
+  // Stop watching the registry. Closing the key completes a pending
+  // notification with STATUS_NOTIFY_CLEANUP, which signals the idle event.
+  KeAcquireGuardedMutex(&g_ddimonp_notify_lock);
+  g_ddimonp_notify_stopping = true;
+  if (g_ddimonp_parameters_key) {
+    ZwClose(g_ddimonp_parameters_key);
+    g_ddimonp_parameters_key = nullptr;
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_notify_lock);
+  KeWaitForSingleObject(&g_ddimonp_notify_idle_event, Executive, KernelMode,
+                        FALSE, nullptr);
+
   ShDisableHooks();
-  UtilSleep(1000);
+  ShWaitForHookHandlers();
   DdimonpFreeAllocatedTrampolineRegions();
+  DdimonpFreeInstalledEntries();
+  DdimonpDeleteHookChains();
+  DdimonpDeleteHookLatencies();
+  DdimonpDeleteReportFilter();
+  CsTermination();
+  RrTermination();
+  HlTermination();
+  StTermination();
+  TwTermination();
   HYPERPLATFORM_LOG_INFO("DdiMon has been terminated.");
 }
 
+// Reloads the target table and applies only differences against currently
+// installed targets. Targets present in both tables are left untouched.
+_Use_decl_annotations_ EXTERN_C NTSTATUS DdimonReloadTargets() {
+  PAGED_CODE();
+
+  std::vector<TtEntry> next;
+  auto status = TtLoadFromRegistry(&next);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("Failed to load a target table (%08x).", status);
+    return status;
+  }
+
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+
+  std::vector<TtEntry> current;
+  for (const auto& installed : *g_ddimonp_installed_entries) {
+    current.push_back(installed.entry);
+  }
+  auto& pending_entries = *g_ddimonp_pending_entries;
+  current.insert(current.end(), pending_entries.cbegin(),
+                 pending_entries.cend());
+  std::vector<const TtEntry*> removed;
+  std::vector<const TtEntry*> added;
+  TtDiff(current, next, &removed, &added);
+  if (removed.empty() && added.empty()) {
+    KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+    return STATUS_SUCCESS;
+  }
+
+  // Restore all shadowed pages so that hooks can be safely modified
+  status = ShDisableHooks();
+  if (!NT_SUCCESS(status)) {
+    KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+    return status;
+  }
+
+  auto& installed_entries = *g_ddimonp_installed_entries;
+  for (const auto entry : removed) {
+    // A pending entry has nothing to uninstall
+    const auto pending = std::find_if(
+        pending_entries.begin(), pending_entries.end(),
+        [entry](const auto& other) { return TtIsEqualEntry(other, *entry); });
+    if (pending != pending_entries.end()) {
+      pending_entries.erase(pending);
+      continue;
+    }
+
+    const auto found = std::find_if(
+        installed_entries.begin(), installed_entries.end(),
+        [entry](const auto& installed) {
+          return TtIsEqualEntry(installed.entry, *entry);
+        });
+    NT_ASSERT(found != installed_entries.end());
+    DdimonpUninstallEntry(g_ddimonp_shared_sh_data, &*found);
+    installed_entries.erase(found);
+  }
+
+  auto installed_count = 0ul;
+  for (const auto entry : added) {
+    if (DdimonpInstallEntry(g_ddimonp_shared_sh_data, *entry)) {
+      installed_count++;
+    }
+  }
+
+  // Wait for threads executing uninstalled code before hooks are enabled
+  // again, as otherwise new callers could keep handlers from draining
+  ShWaitForHookHandlers();
+  status = ShEnableHooks();
+  DdimonpFreeRetiredTrampolines();
+  ShFreeRetiredHooks(g_ddimonp_shared_sh_data);
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+
+  HYPERPLATFORM_LOG_INFO(
+      "Target table has been reloaded: %Iu removed, %lu of %Iu added.",
+      removed.size(), installed_count, added.size());
+  return status;
+}
+
+// Enables or disables an installed target by its name without reinstalling
+// other targets. Targets in the target table are looked up by their names
+// and built-in targets by target_name when no table is in use.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+DdimonSetTargetState(PCUNICODE_STRING name, bool enable) {
+  PAGED_CODE();
+
+  auto status = STATUS_NOT_FOUND;
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  for (const auto& installed : *g_ddimonp_installed_entries) {
+    if (!DdimonpIsNameEqual(*name, installed.entry.name)) {
+      continue;
+    }
+    // Hooks of an entry are updated together so that processors are
+    // notified once rather than for each of them
+    std::vector<void*> addresses;
+    for (const auto& mass_hook : installed.mass_hooks) {
+      addresses.push_back(reinterpret_cast<void*>(mass_hook.address));
+    }
+    if (installed.bundle) {
+      for (const auto& region : installed.bundle->regions) {
+        addresses.push_back(region.address);
+      }
+    }
+    if (!addresses.empty()) {
+      status = ShSetHookStates(addresses.data(),
+                               static_cast<ULONG>(addresses.size()), enable);
+    }
+    if (installed.bundle) {
+      continue;
+    }
+    if (installed.entry.flags & kTtFlagWildcard) {
+      continue;
+    }
+    const auto address = reinterpret_cast<void*>(installed.address);
+    status = (installed.entry.kind == kTtMemMonitor)
+                 ? ShSetPageState(address, enable)
+                 : ShSetHookState(address, enable);
+  }
+
+  if (g_ddimonp_installed_entries->empty()) {
+    for (const auto& target : g_ddimonp_hook_targets) {
+      if (!target.original_call ||
+          !RtlEqualUnicodeString(&target.target_name, name, TRUE)) {
+        continue;
+      }
+      status = ShSetHookState(reinterpret_cast<void*>(target.target_address),
+                              enable);
+    }
+    for (const auto& target : g_ddimonp_mem_monitor_targets) {
+      if (!target.target_address ||
+          !RtlEqualUnicodeString(&target.target_name, name, TRUE)) {
+        continue;
+      }
+      status = ShSetPageState(reinterpret_cast<void*>(target.target_address),
+                              enable);
+    }
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+
+  HYPERPLATFORM_LOG_INFO("Target %wZ has been %s (%08x).", name,
+                         (enable) ? "enabled" : "disabled", status);
+  return status;
+}
+
+// Limits a hooked target to the processes, or lets it apply to all processes
+// again when process_id_count is 0. Calls from other processes reach the
+// original function without entering the handler. Processes are identified
+// by their address spaces, which are removed from the scope as they exit.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+DdimonSetTargetScope(PCUNICODE_STRING name, const HANDLE* process_ids,
+                     ULONG process_id_count) {
+  PAGED_CODE();
+
+  if (process_id_count && !g_ddimonp_process_notify_registered) {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  // A process exiting after its address space is looked up is removed from
+  // the scope once the scope is set
+  KeAcquireGuardedMutex(&g_ddimonp_scope_lock);
+  std::vector<ULONG64> cr3s(process_id_count);
+  for (auto i = 0ul; i < process_id_count; ++i) {
+    const auto status = DdimonpGetProcessCr3(process_ids[i], &cr3s[i]);
+    if (!NT_SUCCESS(status)) {
+      KeReleaseGuardedMutex(&g_ddimonp_scope_lock);
+      return status;
+    }
+  }
+
+  auto status = STATUS_NOT_FOUND;
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  for (const auto& installed : *g_ddimonp_installed_entries) {
+    if (installed.entry.kind != kTtHook ||
+        !DdimonpIsNameEqual(*name, installed.entry.name)) {
+      continue;
+    }
+    for (const auto& mass_hook : installed.mass_hooks) {
+      status = ShSetHookScope(reinterpret_cast<void*>(mass_hook.address),
+                              cr3s.data(), process_id_count);
+    }
+    if (installed.entry.flags & kTtFlagWildcard) {
+      continue;
+    }
+    status = ShSetHookScope(reinterpret_cast<void*>(installed.address),
+                            cr3s.data(), process_id_count);
+  }
+
+  if (g_ddimonp_installed_entries->empty()) {
+    for (const auto& target : g_ddimonp_hook_targets) {
+      if (!target.original_call ||
+          !RtlEqualUnicodeString(&target.target_name, name, TRUE)) {
+        continue;
+      }
+      status = ShSetHookScope(reinterpret_cast<void*>(target.target_address),
+                              cr3s.data(), process_id_count);
+    }
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+  KeReleaseGuardedMutex(&g_ddimonp_scope_lock);
+
+  HYPERPLATFORM_LOG_INFO("Target %wZ has been scoped to %lu processes (%08x).",
+                         name, process_id_count, status);
+  return status;
+}
+
+// Returns latencies of hooks with handlers, including chains of recorded
+// hooks. Counting hooks have no handler and are not included.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+DdimonQueryLatencies(DdimonLatencyStatistics* records, ULONG capacity,
+                     ULONG* record_count, ULONG* total_count) {
+  PAGED_CODE();
+
+  *record_count = 0;
+  *total_count = 0;
+
+  // Histograms are too large to be on the stack
+  const auto histograms = reinterpret_cast<LhHistogram*>(ExAllocatePoolWithTag(
+      PagedPool, sizeof(LhHistogram) * 2, kHyperPlatformCommonPoolTag));
+  if (!histograms) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  for (auto i = 0ul; i < RTL_NUMBER_OF(g_ddimonp_hook_targets); ++i) {
+    const auto& target = g_ddimonp_hook_targets[i];
+    if (!target.original_call) {
+      continue;
+    }
+    const LrLatencies* latencies = g_ddimonp_hook_latencies[i];
+    for (const auto& chain_target : g_ddimonp_hook_chain_targets) {
+      if (chain_target.chain &&
+          HcGetThunk(chain_target.chain) == target.handler) {
+        latencies = HcGetLatencies(chain_target.chain);
+      }
+    }
+    if (latencies) {
+      DdimonpAddLatencyStatistics(records, capacity, record_count,
+                                  total_count, target.target_address,
+                                  latencies, &histograms[0], &histograms[1]);
+    }
+  }
+  for (const auto& installed : *g_ddimonp_installed_entries) {
+    if (installed.recorded && installed.recorded->chain) {
+      DdimonpAddLatencyStatistics(
+          records, capacity, record_count, total_count, installed.address,
+          HcGetLatencies(installed.recorded->chain), &histograms[0],
+          &histograms[1]);
+    }
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+
+  ExFreePoolWithTag(histograms, kHyperPlatformCommonPoolTag);
+  return (*record_count < *total_count) ? STATUS_BUFFER_OVERFLOW
+                                        : STATUS_SUCCESS;
+}
+
+// Scans code of loaded kernel modules for modifications by others. Holds
+// g_ddimonp_reload_lock so that shadowed pages do not change meanwhile.
+_Use_decl_annotations_ EXTERN_C NTSTATUS
+DdimonScanCode(DdimonCodeScanStatistics* statistics,
+               DdimonModifiedCode* records, ULONG capacity,
+               ULONG* record_count) {
+  PAGED_CODE();
+
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  const auto status = CsScan(g_ddimonp_shared_sh_data, statistics, records,
+                             capacity, record_count);
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+  return status;
+}
+
+// Loads the hide list from the registry. cmd.exe is hidden when the list is
+// not configured.
+_Use_decl_annotations_ static void DdimonpLoadHideList() {
+  PAGED_CODE();
+
+  auto status = HlLoadFromRegistry();
+  if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+    UNICODE_STRING default_name = RTL_CONSTANT_STRING(L"cmd.exe");
+    status = HlAddName(&default_name);
+  }
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("Failed to load a hide list (%08x).", status);
+  }
+}
+
+// Returns a kernel page table base of the process as seen in CR3 while a
+// thread runs in the process. Fails for a process that started exiting,
+// since it may have been removed from scopes already.
+_Use_decl_annotations_ static NTSTATUS DdimonpGetProcessCr3(HANDLE process_id,
+                                                            ULONG64* cr3) {
+  PAGED_CODE();
+
+  PEPROCESS process = nullptr;
+  const auto status = PsLookupProcessByProcessId(process_id, &process);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  if (PsGetProcessExitStatus(process) != STATUS_PENDING) {
+    ObDereferenceObject(process);
+    return STATUS_PROCESS_IS_TERMINATING;
+  }
+
+  *cr3 = DdimonpReadProcessCr3(process);
+  ObDereferenceObject(process);
+  return STATUS_SUCCESS;
+}
+
+// Reads CR3 while attached to the process
+_Use_decl_annotations_ static ULONG64 DdimonpReadProcessCr3(
+    PEPROCESS process) {
+  PAGED_CODE();
+
+  KAPC_STATE apc_state = {};
+  KeStackAttachProcess(process, &apc_state);
+  const auto cr3 = __readcr3();
+  KeUnstackDetachProcess(&apc_state);
+  return cr3;
+}
+
+// Removes an exiting process from scopes of targets
+_Use_decl_annotations_ static void DdimonpProcessNotifyRoutine(
+    PEPROCESS process, HANDLE process_id,
+    PPS_CREATE_NOTIFY_INFO create_info) {
+  PAGED_CODE();
+
+  if (create_info) {
+    return;
+  }
+  const auto cr3 = DdimonpReadProcessCr3(process);
+  KeAcquireGuardedMutex(&g_ddimonp_scope_lock);
+  if (NT_SUCCESS(ShRemoveFromHookScopes(cr3))) {
+    HYPERPLATFORM_LOG_DEBUG("Exiting process %Iu has been unscoped.",
+                            reinterpret_cast<ULONG_PTR>(process_id));
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_scope_lock);
+}
+
 // Frees trampoline code allocated and stored in g_ddimonp_hook_targets by
 // DdimonpEnumExportedSymbolsCallback()
 _Use_decl_annotations_ EXTERN_C static void
@@ -315,7 +1160,7 @@ DdimonpFreeAllocatedTrampolineRegions() {
 
   for (auto& target : g_ddimonp_hook_targets) {
     if (target.original_call) {
-      ExFreePoolWithTag(target.original_call, kHyperPlatformCommonPoolTag);
+      ShFreeTrampoline(target.original_call);
       target.original_call = nullptr;
     }
   }
@@ -347,14 +1192,77 @@ _Use_decl_annotations_ EXTERN_C static NTSTATUS DdimonpEnumExportedSymbols(
   return STATUS_SUCCESS;
 }
 
-// Checks if the export is listed as a hook target, and if so install a hook.
-_Use_decl_annotations_ EXTERN_C static bool DdimonpEnumExportedSymbolsCallback(
+// Checks if the export has the name, and if so, stops enumeration
+_Use_decl_annotations_ EXTERN_C static bool DdimonpFindExportCallback(
   ULONG index, ULONG_PTR base_address, PIMAGE_EXPORT_DIRECTORY directory,
   ULONG_PTR directory_base, ULONG_PTR directory_end, void* context) {
   PAGED_CODE();
 
-  if (!context) {
-    return false;
+  auto query = reinterpret_cast<DdimonpExportQuery*>(context);
+  auto functions =
+    reinterpret_cast<ULONG*>(base_address + directory->AddressOfFunctions);
+  auto ordinals = reinterpret_cast<USHORT*>(base_address +
+    directory->AddressOfNameOrdinals);
+  auto names =
+    reinterpret_cast<ULONG*>(base_address + directory->AddressOfNames);
+
+  auto export_name = reinterpret_cast<const char*>(base_address + names[index]);
+  if (strcmp(export_name, query->name)) {
+    return true;
+  }
+
+  // A forwarded export has no code in this module
+  auto export_address = base_address + functions[ordinals[index]];
+  if (!UtilIsInBounds(export_address, directory_base, directory_end)) {
+    query->address = export_address;
+  }
+  return false;
+}
+
+// Collects an address of the export if its name matches the expression
+_Use_decl_annotations_ EXTERN_C static bool DdimonpMatchExportCallback(
+  ULONG index, ULONG_PTR base_address, PIMAGE_EXPORT_DIRECTORY directory,
+  ULONG_PTR directory_base, ULONG_PTR directory_end, void* context) {
+  PAGED_CODE();
+
+  auto match = reinterpret_cast<DdimonpExportMatch*>(context);
+  auto functions =
+    reinterpret_cast<ULONG*>(base_address + directory->AddressOfFunctions);
+  auto ordinals = reinterpret_cast<USHORT*>(base_address +
+    directory->AddressOfNameOrdinals);
+  auto names =
+    reinterpret_cast<ULONG*>(base_address + directory->AddressOfNames);
+
+  // A forwarded export has no code in this module
+  auto export_address = base_address + functions[ordinals[index]];
+  if (UtilIsInBounds(export_address, directory_base, directory_end)) {
+    return true;
+  }
+
+  wchar_t name[256];
+  auto export_name = reinterpret_cast<const char*>(base_address + names[index]);
+  auto status =
+    RtlStringCchPrintfW(name, RTL_NUMBER_OF(name), L"%S", export_name);
+  if (!NT_SUCCESS(status)) {
+    return true;
+  }
+  UNICODE_STRING name_u = {};
+  RtlInitUnicodeString(&name_u, name);
+  if (FsRtlIsNameInExpression(const_cast<PUNICODE_STRING>(match->expression),
+                              &name_u, TRUE, nullptr)) {
+    match->addresses->push_back(export_address);
+  }
+  return true;
+}
+
+// Checks if the export is listed as a hook target, and if so install a hook.
+_Use_decl_annotations_ EXTERN_C static bool DdimonpEnumExportedSymbolsCallback(
+  ULONG index, ULONG_PTR base_address, PIMAGE_EXPORT_DIRECTORY directory,
+  ULONG_PTR directory_base, ULONG_PTR directory_end, void* context) {
+  PAGED_CODE();
+
+  if (!context) {
+    return false;
   }
 
   auto functions =
@@ -395,6 +1303,11 @@ _Use_decl_annotations_ EXTERN_C static bool DdimonpEnumExportedSymbolsCallback(
       continue;
     }
 
+    // Is a handler available (a chain may not have been created)
+    if (!target.handler) {
+      continue;
+    }
+
     target.target_address = export_address;
     // Yes, install a hook to the export
     if (!ShInstallHook(reinterpret_cast<SharedShadowHookPatchData*>(context),
@@ -444,37 +1357,72 @@ static T DdimonpFindOrignal(T handler) {
   return nullptr;
 }
 
+// Finds latencies of a hand-written handler. Returns nullptr when they could
+// not be allocated, and the handler is not measured.
+template <typename T>
+static LrLatencies* DdimonpFindLatencies(T handler) {
+  for (auto i = 0ul; i < RTL_NUMBER_OF(g_ddimonp_hook_targets); ++i) {
+    if (g_ddimonp_hook_targets[i].handler == handler) {
+      return g_ddimonp_hook_latencies[i];
+    }
+  }
+  return nullptr;
+}
+
+// Marshals values as Event and records it in the trace file
+template <typename Event, typename... Values>
+static void DdimonpRecordEvent(void* address, const Values&... values) {
+  UCHAR record[kTfMaxRecordSize];
+  const auto record_size = Event::Marshal(record, sizeof(record), values...);
+  if (record_size) {
+    TwRecordRecord(Event::kSchemaId, address, record, record_size);
+  }
+}
+
 // The hook handler for ExFreePool(). Logs if ExFreePool() is called from where
-// not backed by any image
+// not backed by any image, once for each caller
 _Use_decl_annotations_ static VOID DdimonpHandleExFreePool(PVOID p) {
+  DdimonpHookHandlerScope scope(DdimonpFindLatencies(DdimonpHandleExFreePool));
   const auto original = DdimonpFindOrignal(DdimonpHandleExFreePool);
-  original(p);
+  scope.CallOriginal(original, p);
 
   // Is inside image?
   auto return_addr = _ReturnAddress();
   if (UtilPcToFileHeader(return_addr)) {
     return;
   }
+  if (DdimonpIsReported(kDdimonpReportFreePool, return_addr)) {
+    return;
+  }
 
   HYPERPLATFORM_LOG_INFO_SAFE("%p: ExFreePool(P= %p)", return_addr, p);
+  TwRecordEvent(kTfEventFreePool, return_addr, reinterpret_cast<ULONG_PTR>(p),
+                0, 0);
 }
 
 // The hook handler for ExFreePoolWithTag(). Logs if ExFreePoolWithTag() is
-// called from where not backed by any image.
+// called from where not backed by any image, once for each caller.
 _Use_decl_annotations_ static VOID DdimonpHandleExFreePoolWithTag(PVOID p,
   ULONG tag) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandleExFreePoolWithTag));
   HYPERPLATFORM_LOG_INFO_SAFE("ExFreePoolWithTag");
   const auto original = DdimonpFindOrignal(DdimonpHandleExFreePoolWithTag);
-  original(p, tag);
+  scope.CallOriginal(original, p, tag);
 
   // Is inside image?
   auto return_addr = _ReturnAddress();
   if (UtilPcToFileHeader(return_addr)) {
     return;
   }
+  if (DdimonpIsReported(kDdimonpReportFreePoolWithTag, return_addr)) {
+    return;
+  }
 
   HYPERPLATFORM_LOG_INFO_SAFE("%p: ExFreePoolWithTag(P= %p, Tag= %s)",
     return_addr, p, DdimonpTagToString(tag).data());
+  TwRecordEvent(kTfEventFreePool, return_addr, reinterpret_cast<ULONG_PTR>(p),
+                0, tag);
 }
 
 _Use_decl_annotations_ static bool DdimonpInitAddressPspGetContext(
@@ -483,16 +1431,33 @@ _Use_decl_annotations_ static bool DdimonpInitAddressPspGetContext(
   return true;
 }
 
-_Use_decl_annotations_ static VOID DdimonpHandlePspGetContext(
-  ULONG64 a1, ULONG64 a2, ULONG64 a3, ULONG64 a4, ULONG64 a5) {
-  const auto original = DdimonpFindOrignal(DdimonpHandlePspGetContext);
+// Logs a call to PspGetContext() before the original is called
+_Use_decl_annotations_ static void DdimonpLogPspGetContext(
+  HcCallContext* call_context, void* context) {
+  UNREFERENCED_PARAMETER(context);
 
-  auto return_addr = _ReturnAddress();
-  HYPERPLATFORM_LOG_INFO_SAFE("%p: DdimonpHandlePspGetContext", return_addr);
+  HYPERPLATFORM_LOG_INFO_SAFE("%p: PspGetContext",
+    call_context->return_address);
+}
+
+#if !defined(_AMD64_)
+
+// The hook handler for PspGetContext() on x86, where chains cannot be created.
+// Calls the same consumer as the chain on x64.
+_Use_decl_annotations_ static VOID DdimonpHandlePspGetContext(ULONG_PTR a1,
+  ULONG_PTR a2, ULONG_PTR a3) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandlePspGetContext));
+  const auto original = DdimonpFindOrignal(DdimonpHandlePspGetContext);
 
-  original(a1, a2, a3, a4, a5);
+  HcCallContext call_context = {{a1, a2, a3}};
+  call_context.return_address = _ReturnAddress();
+  DdimonpLogPspGetContext(&call_context, nullptr);
+  scope.CallOriginal(original, a1, a2, a3);
 }
 
+#endif
+
 _Use_decl_annotations_ static bool DdimonpInitAddressKdTrap(
   ULONG64* ptarget_address) {
   *ptarget_address = (ULONG64)UtilPcToFileHeader(KdDebuggerEnabled) + 0xFEBB8;
@@ -521,6 +1486,8 @@ _Use_decl_annotations_ static bool DdimonpInitAddressNtQueryInformationThread(
 
 _Use_decl_annotations_ static VOID DdimonpHandleNtQueryInformationThread(
   ULONG64 a1, ULONG64 a2, ULONG64 a3, ULONG64 a4, ULONG64 a5) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandleNtQueryInformationThread));
   const auto original =
     DdimonpFindOrignal(DdimonpHandleNtQueryInformationThread);
 
@@ -528,7 +1495,7 @@ _Use_decl_annotations_ static VOID DdimonpHandleNtQueryInformationThread(
   DBG_UNREFERENCED_LOCAL_VARIABLE(return_addr);
   HYPERPLATFORM_LOG_INFO_SAFE(
       "%p: DdimonpHandleNtQueryInformationThread", return_addr);
-  original(a1, a2, a3, a4, a5);
+  scope.CallOriginal(original, a1, a2, a3, a4, a5);
 }
 
 _Use_decl_annotations_ static VOID DdimonpHandleMemAccessKdDebuggerEnabled(
@@ -538,58 +1505,137 @@ _Use_decl_annotations_ static VOID DdimonpHandleMemAccessKdDebuggerEnabled(
 }
 
 // The hook handler for ExQueueWorkItem(). Logs if a WorkerRoutine points to
-// where not backed by any image.
+// where not backed by any image, once for each routine.
 _Use_decl_annotations_ static VOID DdimonpHandleExQueueWorkItem(
   PWORK_QUEUE_ITEM work_item, WORK_QUEUE_TYPE queue_type) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandleExQueueWorkItem));
   const auto original = DdimonpFindOrignal(DdimonpHandleExQueueWorkItem);
 
-  // Is inside image?
-  if (UtilPcToFileHeader(work_item->WorkerRoutine)) {
+  // Is inside image? Or has the routine been reported already?
+  if (UtilPcToFileHeader(work_item->WorkerRoutine) ||
+      DdimonpIsReported(kDdimonpReportWorkerRoutine,
+                        work_item->WorkerRoutine)) {
     // Call an original after checking parameters. It is common that a work
     // routine frees a work_item object resulting in wrong analysis.
-    original(work_item, queue_type);
+    scope.CallOriginal(original, work_item, queue_type);
     return;
   }
 
+  // A return address alone often points to a helper shared by many callers,
+  // so log a stack trace too. It is logged only when first seen, and later
+  // events refer to it by the stack ID.
   auto return_addr = _ReturnAddress();
+  bool is_new_stack = false;
+  const auto stack_id = StCaptureStack(0, &is_new_stack);
   HYPERPLATFORM_LOG_INFO_SAFE(
-    "%p: ExQueueWorkItem({Routine= %p, Parameter= %p}, %d)", return_addr,
-    work_item->WorkerRoutine, work_item->Parameter, queue_type);
+    "%p: ExQueueWorkItem({Routine= %p, Parameter= %p}, %d) Stack= %lu",
+    return_addr, work_item->WorkerRoutine, work_item->Parameter, queue_type,
+    stack_id);
+  if (is_new_stack) {
+    DdimonpLogStack(stack_id);
+  }
+
+  // Leading bytes of the routine tell what kind of code it is. The routine is
+  // about to run and is resident.
+  const auto routine = reinterpret_cast<void*>(work_item->WorkerRoutine);
+  DdimonpRecordEvent<DdimonExQueueWorkItemEvent>(
+      return_addr, routine, work_item->Parameter, queue_type, stack_id,
+      EsBufferValue{routine, kEsMaxBufferSize});
 
-  original(work_item, queue_type);
+  scope.CallOriginal(original, work_item, queue_type);
 }
 
-// The hook handler for ExAllocatePoolWithTag(). Logs if ExAllocatePoolWithTag()
-// is called from where not backed by any image.
-_Use_decl_annotations_ static PVOID DdimonpHandleExAllocatePoolWithTag(
-  POOL_TYPE pool_type, SIZE_T number_of_bytes, ULONG tag) {
-  const auto original = DdimonpFindOrignal(DdimonpHandleExAllocatePoolWithTag);
-  const auto result = original(pool_type, number_of_bytes, tag);
+// Returns true when the address has been reported for the kind within
+// kDdimonpReportPeriod, and remembers it otherwise. Checked before anything is
+// formatted so that a hot caller costs one cache line. Addresses are rarely
+// taken as reported while they are not.
+_Use_decl_annotations_ static bool DdimonpIsReported(DdimonpReportKind kind,
+                                                     const void* address) {
+  if (!g_ddimonp_report_filter) {
+    return false;
+  }
+  const auto key = reinterpret_cast<ULONG64>(address) ^ (kind << 56);
+  return SfTestAndSet(g_ddimonp_report_filter, key, KeQueryInterruptTime());
+}
+
+// Logs frames of the stack trace
+_Use_decl_annotations_ static void DdimonpLogStack(ULONG stack_id) {
+  void* frames[kStMaxStackDepth] = {};
+  const auto depth = StGetStack(stack_id, frames, RTL_NUMBER_OF(frames));
+  for (auto i = 0ul; i < depth; ++i) {
+    HYPERPLATFORM_LOG_INFO_SAFE("Stack %lu #%02lu %p", stack_id, i,
+                                frames[i]);
+  }
+}
+
+// Logs a call to ExAllocatePoolWithTag() if it is called from where not backed
+// by any image, once for each caller.
+_Use_decl_annotations_ static void DdimonpLogExAllocatePoolWithTag(
+  HcCallContext* call_context, void* context) {
+  UNREFERENCED_PARAMETER(context);
 
   // Is inside image?
-  auto return_addr = _ReturnAddress();
+  const auto return_addr = call_context->return_address;
   if (UtilPcToFileHeader(return_addr)) {
-    return result;
+    return;
+  }
+  if (DdimonpIsReported(kDdimonpReportAllocatePool, return_addr)) {
+    return;
   }
 
+  const auto pool_type = static_cast<POOL_TYPE>(call_context->arguments[0]);
+  const auto number_of_bytes = static_cast<SIZE_T>(call_context->arguments[1]);
+  const auto tag = static_cast<ULONG>(call_context->arguments[2]);
+  const auto result = reinterpret_cast<void*>(call_context->return_value);
   HYPERPLATFORM_LOG_INFO_SAFE(
     "%p: ExAllocatePoolWithTag(POOL_TYPE= %08x, NumberOfBytes= %08Ix, Tag= "
     "%s) => %p",
     return_addr, pool_type, number_of_bytes, DdimonpTagToString(tag).data(),
     result);
+  TwRecordEvent(kTfEventAllocatePool, return_addr,
+                reinterpret_cast<ULONG_PTR>(result), number_of_bytes, tag);
+}
+
+#if !defined(_AMD64_)
+
+// The hook handler for ExAllocatePoolWithTag() on x86, where chains cannot be
+// created. Calls the same consumer as the chain on x64.
+_Use_decl_annotations_ static PVOID DdimonpHandleExAllocatePoolWithTag(
+  POOL_TYPE pool_type, SIZE_T number_of_bytes, ULONG tag) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandleExAllocatePoolWithTag));
+  const auto original = DdimonpFindOrignal(DdimonpHandleExAllocatePoolWithTag);
+  const auto result =
+      scope.CallOriginal(original, pool_type, number_of_bytes, tag);
+
+  HcCallContext call_context = {
+      {static_cast<ULONG64>(pool_type), number_of_bytes, tag}};
+  call_context.return_value = reinterpret_cast<ULONG_PTR>(result);
+  call_context.return_address = _ReturnAddress();
+  DdimonpLogExAllocatePoolWithTag(&call_context, nullptr);
   return result;
 }
 
-// The hook handler for NtQuerySystemInformation(). Removes an entry for cmd.exe
-// and hides it from being listed.
+#endif
+
+// The hook handler for NtQuerySystemInformation(). Removes entries for
+// processes in the hide list and hides them from being listed.
 _Use_decl_annotations_ static NTSTATUS DdimonpHandleNtQuerySystemInformation(
   SystemInformationClass system_information_class, PVOID system_information,
   ULONG system_information_length, PULONG return_length) {
+  DdimonpHookHandlerScope scope(
+      DdimonpFindLatencies(DdimonpHandleNtQuerySystemInformation));
   HYPERPLATFORM_LOG_INFO_SAFE("DdimonpHandleNtQuerySystemInformation");
   const auto original =
     DdimonpFindOrignal(DdimonpHandleNtQuerySystemInformation);
-  const auto result = original(system_information_class, system_information,
-    system_information_length, return_length);
+  const auto result =
+      scope.CallOriginal(original, system_information_class,
+                         system_information, system_information_length,
+                         return_length);
+  DdimonpRecordEvent<DdimonNtQuerySystemInformationEvent>(
+      _ReturnAddress(), system_information_class, system_information_length,
+      result);
   if (!NT_SUCCESS(result)) {
     return result;
   }
@@ -597,25 +1643,745 @@ _Use_decl_annotations_ static NTSTATUS DdimonpHandleNtQuerySystemInformation(
     return result;
   }
 
-  auto next = reinterpret_cast<SystemProcessInformation*>(system_information);
-  while (next->next_entry_offset) {
-    auto curr = next;
-    next = reinterpret_cast<SystemProcessInformation*>(
-      reinterpret_cast<UCHAR*>(curr) + curr->next_entry_offset);
-    if (_wcsnicmp(next->image_name.Buffer, L"cmd.exe", 7) == 0) {
-      if (next->next_entry_offset) {
-        curr->next_entry_offset += next->next_entry_offset;
+  HlFilterProcessInformation(system_information, system_information_length);
+  return result;
+}
+
+
+
+// Installs all targets in a target table. Fails if any of them failed
+_Use_decl_annotations_ static NTSTATUS DdimonpInstallTargetTable(
+    SharedShadowHookPatchData* shared_sh_data,
+    const std::vector<TtEntry>& entries) {
+  PAGED_CODE();
+
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  for (const auto& entry : entries) {
+    if (!DdimonpInstallEntry(shared_sh_data, entry)) {
+      KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+      return STATUS_UNSUCCESSFUL;
+    }
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+  return STATUS_SUCCESS;
+}
+
+// Installs a single target described by a target table entry
+_Use_decl_annotations_ static bool DdimonpInstallEntry(
+    SharedShadowHookPatchData* shared_sh_data, const TtEntry& entry) {
+  PAGED_CODE();
+
+  // Install it when the module is loaded. Until then, the target costs no
+  // shadow pages.
+  if (entry.module[0] && !DdimonpFindModuleBase(entry.module)) {
+    HYPERPLATFORM_LOG_INFO("Target %s is deferred until %s is loaded.",
+                           entry.name, entry.module);
+    g_ddimonp_pending_entries->push_back(entry);
+    return true;
+  }
+
+  // A wildcard entry is installed at all matching exports instead of a
+  // single address
+  if (entry.flags & kTtFlagWildcard) {
+    DdimonpInstalledEntry installed = {};
+    installed.entry = entry;
+    if (!DdimonpInstallMassHooks(shared_sh_data, entry, &installed)) {
+      return false;
+    }
+    g_ddimonp_installed_entries->push_back(std::move(installed));
+    return true;
+  }
+
+  const auto address = DdimonpResolveEntryAddress(entry);
+  if (!address) {
+    HYPERPLATFORM_LOG_ERROR("Target %s could not be located.", entry.name);
+    return false;
+  }
+
+  DdimonpInstalledEntry installed = {};
+  installed.entry = entry;
+  installed.address = address;
+
+  switch (entry.kind) {
+    case kTtHook: {
+      // A hook without a handler only records or counts calls
+      if (!entry.handler[0]) {
+        if (!DdimonpInstallRecordedHook(shared_sh_data, entry, &installed)) {
+          return false;
+        }
+        break;
+      }
+
+      // Other hooks can only be handled by handlers built in the driver
+      ShadowHookTarget* hook = nullptr;
+      for (auto& target : g_ddimonp_hook_targets) {
+        if (DdimonpIsNameEqual(target.target_name, entry.handler)) {
+          hook = &target;
+          break;
+        }
+      }
+      if (!hook || !hook->handler) {
+        HYPERPLATFORM_LOG_ERROR("Handler %s does not exist.", entry.handler);
+        return false;
+      }
+      const auto in_use = std::find_if(
+          g_ddimonp_installed_entries->cbegin(),
+          g_ddimonp_installed_entries->cend(),
+          [hook](const auto& other) { return other.hook == hook; });
+      if (in_use != g_ddimonp_installed_entries->cend()) {
+        HYPERPLATFORM_LOG_ERROR("Handler %s is already in use.",
+                                entry.handler);
+        return false;
+      }
+
+      hook->function_type = (entry.flags & kTtFlagExport) ? EXPORT_FUNCTION
+                                                          : UNEXPORT_FUNCTION;
+      hook->target_address = address;
+      if (!ShInstallHook(shared_sh_data, reinterpret_cast<void*>(address),
+                         hook)) {
+        return false;
+      }
+      installed.hook = hook;
+      break;
+    }
+
+    case kTtPatch: {
+      // ShInstallPatch() keeps a pointer to new_code, so the target must
+      // outlive the patch
+      auto patch = std::make_unique<ShadowPatchTarget>();
+      patch->function_type = (entry.flags & kTtFlagExport) ? EXPORT_FUNCTION
+                                                           : UNEXPORT_FUNCTION;
+      patch->target_address = address;
+      patch->patch_length = entry.patch_length;
+      RtlCopyMemory(patch->new_code, entry.patch, entry.patch_length);
+      if (!ShInstallPatch(shared_sh_data, reinterpret_cast<void*>(address),
+                          patch.get())) {
+        return false;
+      }
+      installed.patch = std::move(patch);
+      break;
+    }
+
+    case kTtPatchBundle: {
+      auto bundle = std::make_unique<DdimonpPatchBundle>();
+      bundle->entry = entry;
+      const auto& bundle_entry = bundle->entry;
+      ULONG offset = 0;
+      TtBundleRegion region = {};
+      while (TtcReadBundleRegion(bundle_entry.patch,
+                                 bundle_entry.patch_length, &offset,
+                                 &region)) {
+        bundle->regions.push_back(
+            {reinterpret_cast<void*>(address + region.offset), region.length,
+             region.expected_code, region.new_code});
+      }
+      if (!ShInstallPatchBundle(shared_sh_data, bundle->regions.data(),
+                                static_cast<ULONG>(bundle->regions.size()))) {
+        return false;
+      }
+      installed.bundle = std::move(bundle);
+      break;
+    }
+
+    case kTtMemMonitor: {
+      const ShadowMemMonitorTarget* monitor = nullptr;
+      for (const auto& target : g_ddimonp_mem_monitor_targets) {
+        if (DdimonpIsNameEqual(target.target_name, entry.handler)) {
+          monitor = &target;
+          break;
+        }
+      }
+      if (!monitor) {
+        HYPERPLATFORM_LOG_ERROR("Handler %s does not exist.", entry.handler);
+        return false;
       }
-      else {
-        curr->next_entry_offset = 0;
+
+      ShadowMemMonitorTarget target = *monitor;
+      target.target_address = address;
+      target.len = entry.length;
+      target.access_type = static_cast<ACCESS_TYPE>(entry.access);
+      if (!ShInstallMemMonitor(shared_sh_data, &target)) {
+        return false;
       }
-      next = curr;
+      break;
     }
   }
-  return result;
+
+  HYPERPLATFORM_LOG_INFO("Target %s has been installed at %016Ix.",
+                         entry.name, address);
+  g_ddimonp_installed_entries->push_back(std::move(installed));
+  return true;
+}
+
+// Installs counting hooks at all exports of the module matching the name of
+// a wildcard entry. Exports that cannot be hooked, such as exported data or
+// ones starting with a branch, are skipped. Fails only when none is hooked.
+_Use_decl_annotations_ static bool DdimonpInstallMassHooks(
+    SharedShadowHookPatchData* shared_sh_data, const TtEntry& entry,
+    DdimonpInstalledEntry* installed) {
+  PAGED_CODE();
+
+  LARGE_INTEGER frequency = {};
+  const auto begin = KeQueryPerformanceCounter(&frequency);
+  const auto module_base =
+      (entry.module[0])
+          ? DdimonpFindModuleBase(entry.module)
+          : reinterpret_cast<ULONG_PTR>(UtilPcToFileHeader(KdDebuggerEnabled));
+  if (!module_base) {
+    return false;
+  }
+
+  // FsRtlIsNameInExpression() requires an upper case expression to ignore
+  // case
+  wchar_t name[kTtMaxNameLength + 1];
+  wchar_t upcased_name[kTtMaxNameLength + 1];
+  auto status =
+      RtlStringCchPrintfW(name, RTL_NUMBER_OF(name), L"%S", entry.name);
+  if (!NT_SUCCESS(status)) {
+    return false;
+  }
+  UNICODE_STRING name_u = {};
+  RtlInitUnicodeString(&name_u, name);
+  UNICODE_STRING expression = {0, sizeof(upcased_name), upcased_name};
+  status = RtlUpcaseUnicodeString(&expression, &name_u, FALSE);
+  if (!NT_SUCCESS(status)) {
+    return false;
+  }
+
+  // Exports with more than one name are hooked once
+  std::vector<ULONG64> addresses;
+  DdimonpExportMatch match = {&expression, &addresses};
+  DdimonpEnumExportedSymbols(module_base, DdimonpMatchExportCallback, &match);
+  std::sort(addresses.begin(), addresses.end());
+  addresses.erase(std::unique(addresses.begin(), addresses.end()),
+                  addresses.end());
+
+  // Hooks do not have handlers, so the trampoline is the only per-hook code
+  auto page_count = 0ul;
+  ULONG64 last_page = 0;
+  auto& mass_hooks = installed->mass_hooks;
+  mass_hooks.reserve(addresses.size());
+  for (const auto address : addresses) {
+    if (!DdimonpIsCodeAddress(module_base, address)) {
+      continue;
+    }
+    ShadowHookTarget target = {};
+    target.function_type = EXPORT_FUNCTION;
+    target.target_address = address;
+    target.count_callers = (entry.flags & kTtFlagCallers) != 0;
+    if (!ShInstallHook(shared_sh_data, reinterpret_cast<void*>(address),
+                       &target)) {
+      continue;
+    }
+    mass_hooks.push_back({address, target.original_call});
+    const auto page = address & ~static_cast<ULONG64>(PAGE_SIZE - 1);
+    if (page != last_page) {
+      page_count++;
+      last_page = page;
+    }
+  }
+  if (mass_hooks.empty()) {
+    HYPERPLATFORM_LOG_ERROR("Target %s matched no export to hook.",
+                            entry.name);
+    return false;
+  }
+
+  // Two shadow pages are used for each page unless it was already shadowed.
+  // Cost of each call is reported by IOCTL_DDIMON_QUERY_EXIT_STATISTICS.
+  const auto elapsed = KeQueryPerformanceCounter(nullptr).QuadPart -
+                       begin.QuadPart;
+  HYPERPLATFORM_LOG_INFO(
+      "Target %s has been installed at %Iu of %Iu exports on %lu pages "
+      "(%lu KB of shadow pages) in %I64d ms.",
+      entry.name, mass_hooks.size(), addresses.size(), page_count,
+      page_count * 2 * PAGE_SIZE / 1024,
+      elapsed * 1000 / frequency.QuadPart);
+  return true;
+}
+
+// Checks if the address is in a section of the module that is executable and
+// is not discarded
+_Use_decl_annotations_ static bool DdimonpIsCodeAddress(
+    ULONG_PTR base_address, ULONG64 address) {
+  PAGED_CODE();
+
+  auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base_address);
+  auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base_address + dos->e_lfanew);
+  auto section = IMAGE_FIRST_SECTION(nt);
+  for (auto i = 0; i < nt->FileHeader.NumberOfSections; ++i, ++section) {
+    const auto section_base = base_address + section->VirtualAddress;
+    if (address < section_base ||
+        address >= section_base + section->Misc.VirtualSize) {
+      continue;
+    }
+    return (section->Characteristics & IMAGE_SCN_MEM_EXECUTE) &&
+           !(section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE);
+  }
+  return false;
+}
+
+// Uninstalls a single target. Hooks must be disabled.
+_Use_decl_annotations_ static void DdimonpUninstallEntry(
+    SharedShadowHookPatchData* shared_sh_data,
+    DdimonpInstalledEntry* installed) {
+  PAGED_CODE();
+
+  // Trampolines of mass hooks may still be in use as well
+  if (installed->entry.flags & kTtFlagWildcard) {
+    for (const auto& mass_hook : installed->mass_hooks) {
+      ShUninstallHook(shared_sh_data,
+                      reinterpret_cast<void*>(mass_hook.address));
+      g_ddimonp_retired_trampolines->push_back(
+          {nullptr, mass_hook.original_call, nullptr});
+    }
+    HYPERPLATFORM_LOG_INFO("Target %s has been uninstalled from %Iu exports.",
+                           installed->entry.name,
+                           installed->mass_hooks.size());
+    return;
+  }
+
+  switch (installed->entry.kind) {
+    case kTtHook:
+      ShUninstallHook(shared_sh_data,
+                      reinterpret_cast<void*>(installed->address));
+
+      // A trampoline may still be in use. Free it later, leaving
+      // original_call as it is for threads running the handler.
+      if (installed->recorded && installed->recorded->chain) {
+        DdimonpLogRecordedHook(installed->entry,
+                               installed->recorded->statistics);
+      }
+      g_ddimonp_retired_trampolines->push_back(
+          {installed->hook, installed->hook->original_call,
+           std::move(installed->recorded)});
+      break;
+
+    case kTtPatch:
+      ShUninstallHook(shared_sh_data,
+                      reinterpret_cast<void*>(installed->address));
+      break;
+
+    case kTtPatchBundle:
+      for (const auto& region : installed->bundle->regions) {
+        ShUninstallHook(shared_sh_data, region.address);
+      }
+      break;
+
+    case kTtMemMonitor:
+      ShUninstallMemMonitor(shared_sh_data, installed->address);
+      break;
+  }
+
+  HYPERPLATFORM_LOG_INFO("Target %s has been uninstalled from %016Ix.",
+                         installed->entry.name, installed->address);
+}
+
+// Returns an address of a target table entry, or 0 when it is not found or
+// its signature does not match contents of the address
+_Use_decl_annotations_ static ULONG64 DdimonpResolveEntryAddress(
+    const TtEntry& entry) {
+  PAGED_CODE();
+
+  const auto module_base =
+      (entry.module[0])
+          ? DdimonpFindModuleBase(entry.module)
+          : reinterpret_cast<ULONG_PTR>(UtilPcToFileHeader(KdDebuggerEnabled));
+  if (!module_base) {
+    return 0;
+  }
+
+  ULONG64 address = 0;
+  if ((entry.flags & kTtFlagExport) && entry.module[0]) {
+    address = DdimonpFindExport(module_base, entry.name);
+  } else if (entry.flags & kTtFlagExport) {
+    wchar_t name[kTtMaxNameLength + 1];
+    auto status =
+        RtlStringCchPrintfW(name, RTL_NUMBER_OF(name), L"%S", entry.name);
+    if (!NT_SUCCESS(status)) {
+      return 0;
+    }
+    UNICODE_STRING name_u = {};
+    RtlInitUnicodeString(&name_u, name);
+    address = reinterpret_cast<ULONG64>(MmGetSystemRoutineAddress(&name_u));
+  } else if (entry.flags & kTtFlagAbsolute) {
+    address = entry.location;
+  } else if (entry.flags & kTtFlagScan) {
+    // location is a displacement from where the signature was found
+    const auto found = DdimonpFindSignature(module_base, entry.signature,
+                                            entry.signature_length);
+    if (found) {
+      address = reinterpret_cast<ULONG64>(found) + entry.location;
+    }
+  } else {
+    address = module_base + entry.location;
+  }
+  if (!address) {
+    return 0;
+  }
+
+  if (entry.signature_length && !(entry.flags & kTtFlagScan)) {
+    const auto signature_end = address + entry.signature_length - 1;
+    if (!MmIsAddressValid(reinterpret_cast<void*>(address)) ||
+        !MmIsAddressValid(reinterpret_cast<void*>(signature_end))) {
+      return 0;
+    }
+    if (!RtlEqualMemory(reinterpret_cast<void*>(address), entry.signature,
+                        entry.signature_length)) {
+      HYPERPLATFORM_LOG_ERROR("Signature of %s does not match at %016Ix.",
+                              entry.name, address);
+      return 0;
+    }
+  }
+  return address;
+}
+
+// Searches a signature in executable sections of a module
+_Use_decl_annotations_ static void* DdimonpFindSignature(
+    ULONG_PTR base_address, const UCHAR* signature, SIZE_T size) {
+  PAGED_CODE();
+
+  auto dos = reinterpret_cast<PIMAGE_DOS_HEADER>(base_address);
+  auto nt = reinterpret_cast<PIMAGE_NT_HEADERS>(base_address + dos->e_lfanew);
+  auto section = IMAGE_FIRST_SECTION(nt);
+  for (auto i = 0; i < nt->FileHeader.NumberOfSections; ++i, ++section) {
+    // Skip sections that are not code or already unmapped
+    if (!(section->Characteristics & IMAGE_SCN_MEM_EXECUTE) ||
+        (section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE)) {
+      continue;
+    }
+    const auto found = UtilMemMem(
+        reinterpret_cast<void*>(base_address + section->VirtualAddress),
+        section->Misc.VirtualSize, signature, size);
+    if (found) {
+      return found;
+    }
+  }
+  return nullptr;
+}
+
+// Compares a UNICODE_STRING with an ASCII string case-insensitively
+_Use_decl_annotations_ static bool DdimonpIsNameEqual(
+    const UNICODE_STRING& name, const char* ascii_name) {
+  PAGED_CODE();
+
+  wchar_t buffer[kTtMaxNameLength + 1];
+  auto status =
+      RtlStringCchPrintfW(buffer, RTL_NUMBER_OF(buffer), L"%S", ascii_name);
+  if (!NT_SUCCESS(status)) {
+    return false;
+  }
+  UNICODE_STRING name_u = {};
+  RtlInitUnicodeString(&name_u, buffer);
+  return !!RtlEqualUnicodeString(&name, &name_u, TRUE);
 }
 
+// Frees trampolines of hooks uninstalled by the last reload
+_Use_decl_annotations_ static void DdimonpFreeRetiredTrampolines() {
+  PAGED_CODE();
+
+  for (const auto& retired : *g_ddimonp_retired_trampolines) {
+    // original_call may already be replaced if the hook was re-installed
+    if (retired.hook && retired.hook->original_call == retired.original_call) {
+      retired.hook->original_call = nullptr;
+    }
+    ShFreeTrampoline(retired.original_call);
+    if (retired.recorded && retired.recorded->chain) {
+      HcDeleteChain(retired.recorded->chain);
+    }
+  }
+  g_ddimonp_retired_trampolines->clear();
+}
 
+// Frees bookkeeping of targets installed from a target table
+_Use_decl_annotations_ static void DdimonpFreeInstalledEntries() {
+  PAGED_CODE();
+
+  if (g_ddimonp_retired_trampolines) {
+    DdimonpFreeRetiredTrampolines();
+    delete g_ddimonp_retired_trampolines;
+    g_ddimonp_retired_trampolines = nullptr;
+  }
+  if (g_ddimonp_installed_entries) {
+    // Unlike hooks in g_ddimonp_hook_targets, trampolines and chains of
+    // recorded hooks are owned by entries
+    for (const auto& installed : *g_ddimonp_installed_entries) {
+      for (const auto& mass_hook : installed.mass_hooks) {
+        ShFreeTrampoline(mass_hook.original_call);
+      }
+      if (!installed.recorded) {
+        continue;
+      }
+      if (installed.recorded->target.original_call) {
+        ShFreeTrampoline(installed.recorded->target.original_call);
+      }
+      if (installed.recorded->chain) {
+        DdimonpLogRecordedHook(installed.entry,
+                               installed.recorded->statistics);
+        HcDeleteChain(installed.recorded->chain);
+      }
+    }
+    delete g_ddimonp_installed_entries;
+    g_ddimonp_installed_entries = nullptr;
+  }
+  if (g_ddimonp_pending_entries) {
+    delete g_ddimonp_pending_entries;
+    g_ddimonp_pending_entries = nullptr;
+  }
+}
+
+// Requests a notification of changes of the Parameters key. The notification
+// queues DdimonpReloadWorkerRoutine() as a work item.
+_Use_decl_annotations_ static void DdimonpArmReloadNotification() {
+  PAGED_CODE();
+
+  KeAcquireGuardedMutex(&g_ddimonp_notify_lock);
+  if (g_ddimonp_notify_stopping) {
+    KeSetEvent(&g_ddimonp_notify_idle_event, IO_NO_INCREMENT, FALSE);
+    KeReleaseGuardedMutex(&g_ddimonp_notify_lock);
+    return;
+  }
+
+  if (!g_ddimonp_parameters_key) {
+    auto status =
+        TtOpenParametersKey(KEY_NOTIFY, &g_ddimonp_parameters_key);
+    if (!NT_SUCCESS(status)) {
+      // Hot reload is simply unavailable without the key
+      g_ddimonp_parameters_key = nullptr;
+      KeSetEvent(&g_ddimonp_notify_idle_event, IO_NO_INCREMENT, FALSE);
+      KeReleaseGuardedMutex(&g_ddimonp_notify_lock);
+      return;
+    }
+  }
+
+  KeClearEvent(&g_ddimonp_notify_idle_event);
+#pragma warning(push)
+#pragma warning(disable : 4995)
+  ExInitializeWorkItem(&g_ddimonp_notify_work_item, DdimonpReloadWorkerRoutine,
+                       nullptr);
+#pragma warning(pop)
+  auto status = ZwNotifyChangeKey(
+      g_ddimonp_parameters_key, nullptr,
+      reinterpret_cast<PIO_APC_ROUTINE>(&g_ddimonp_notify_work_item),
+      reinterpret_cast<void*>(DelayedWorkQueue), &g_ddimonp_notify_io_status,
+      REG_NOTIFY_CHANGE_LAST_SET, FALSE, nullptr, 0, TRUE);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("ZwNotifyChangeKey failed (%08x).", status);
+    KeSetEvent(&g_ddimonp_notify_idle_event, IO_NO_INCREMENT, FALSE);
+  }
+  KeReleaseGuardedMutex(&g_ddimonp_notify_lock);
+}
+
+// Reloads the target table on change of the Parameters key, and re-arms the
+// notification
+_Use_decl_annotations_ static void DdimonpReloadWorkerRoutine(void* context) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(context);
+
+  KeAcquireGuardedMutex(&g_ddimonp_notify_lock);
+  const auto stopping = g_ddimonp_notify_stopping ||
+                        g_ddimonp_notify_io_status.Status ==
+                            STATUS_NOTIFY_CLEANUP;
+  KeReleaseGuardedMutex(&g_ddimonp_notify_lock);
+  if (stopping) {
+    KeSetEvent(&g_ddimonp_notify_idle_event, IO_NO_INCREMENT, FALSE);
+    return;
+  }
+
+  DdimonReloadTargets();
+  DdimonpLoadHideList();
+  DdimonpArmReloadNotification();
+}
+
+// Creates chains and sets their thunks as handlers of corresponding targets.
+// A target is left without a handler when its chain cannot be created, and is
+// not installed. On x86, those targets have hand-written handlers instead.
+_Use_decl_annotations_ static void DdimonpCreateHookChains() {
+  PAGED_CODE();
+
+#if defined(_AMD64_)
+  for (auto& chain_target : g_ddimonp_hook_chain_targets) {
+    for (auto& target : g_ddimonp_hook_targets) {
+      if (!RtlEqualUnicodeString(&target.target_name,
+                                 &chain_target.target_name, TRUE)) {
+        continue;
+      }
+
+      chain_target.chain = HcCreateChain(
+          chain_target.callbacks, chain_target.callback_count,
+          &target.original_call, chain_target.argument_count);
+      if (!chain_target.chain) {
+        HYPERPLATFORM_LOG_WARN("A chain for %wZ could not be created.",
+                               &chain_target.target_name);
+        break;
+      }
+      target.handler = HcGetThunk(chain_target.chain);
+      break;
+    }
+  }
+#endif
+}
+
+// Installs a hook recording calls for a target table entry without a handler.
+// With kTtFlagCount, the hook has neither a chain nor a handler, and calls are
+// counted in VMX-root mode.
+_Use_decl_annotations_ static bool DdimonpInstallRecordedHook(
+    SharedShadowHookPatchData* shared_sh_data, const TtEntry& entry,
+    DdimonpInstalledEntry* installed) {
+  PAGED_CODE();
+
+  auto recorded = std::make_unique<DdimonpRecordedHook>();
+  RtlZeroMemory(recorded.get(), sizeof(DdimonpRecordedHook));
+
+  if (!(entry.flags & kTtFlagCount)) {
+    const auto callback = RrMakeCallback(&recorded->statistics);
+    recorded->chain = HcCreateChain(&callback, 1,
+                                    &recorded->target.original_call,
+                                    entry.argument_count);
+    if (!recorded->chain) {
+      HYPERPLATFORM_LOG_ERROR("A chain for %s could not be created.",
+                              entry.name);
+      return false;
+    }
+  }
+
+  auto& target = recorded->target;
+  target.function_type =
+      (entry.flags & kTtFlagExport) ? EXPORT_FUNCTION : UNEXPORT_FUNCTION;
+  target.target_address = installed->address;
+  if (recorded->chain) {
+    target.handler = HcGetThunk(recorded->chain);
+  }
+  target.count_callers = (entry.flags & kTtFlagCallers) != 0;
+  if (!ShInstallHook(shared_sh_data,
+                     reinterpret_cast<void*>(installed->address), &target)) {
+    if (recorded->chain) {
+      HcDeleteChain(recorded->chain);
+    }
+    return false;
+  }
+
+  installed->hook = &target;
+  installed->recorded = std::move(recorded);
+  return true;
+}
+
+// Logs calls recorded for a target table entry
+_Use_decl_annotations_ static void DdimonpLogRecordedHook(
+    const TtEntry& entry, const RrStatistics& statistics) {
+  PAGED_CODE();
+
+  const auto call_count = statistics.call_count;
+  HYPERPLATFORM_LOG_INFO(
+      "Target %s: %I64d calls, %I64d cycles on average, %I64d cycles at max, "
+      "last returned %016I64x, %I64d not recorded.",
+      entry.name, call_count,
+      (call_count) ? statistics.total_cycles / call_count : 0,
+      statistics.max_cycles, statistics.last_return_value,
+      statistics.dropped_count);
+}
+
+// Deletes chains. Hooks using them must have been uninstalled or disabled.
+_Use_decl_annotations_ static void DdimonpDeleteHookChains() {
+  PAGED_CODE();
+
+  for (auto& chain_target : g_ddimonp_hook_chain_targets) {
+    if (chain_target.chain) {
+      HcDeleteChain(chain_target.chain);
+      chain_target.chain = nullptr;
+    }
+  }
+}
+
+// Allocates latencies of targets with hand-written handlers. Must be called
+// before chains are created so that thunks are not mistaken for them. A
+// handler is not measured when its latencies cannot be allocated.
+_Use_decl_annotations_ static void DdimonpCreateHookLatencies() {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < RTL_NUMBER_OF(g_ddimonp_hook_targets); ++i) {
+    if (!g_ddimonp_hook_targets[i].handler) {
+      continue;
+    }
+    g_ddimonp_hook_latencies[i] = LrCreateLatencies();
+    if (!g_ddimonp_hook_latencies[i]) {
+      HYPERPLATFORM_LOG_WARN("Latencies of %wZ are not recorded.",
+                             &g_ddimonp_hook_targets[i].target_name);
+    }
+  }
+}
+
+// Frees latencies of hand-written handlers. Handlers must not be running.
+_Use_decl_annotations_ static void DdimonpDeleteHookLatencies() {
+  PAGED_CODE();
+
+  for (auto& latencies : g_ddimonp_hook_latencies) {
+    if (latencies) {
+      LrDeleteLatencies(latencies);
+      latencies = nullptr;
+    }
+  }
+}
+
+// Allocates the filter of reported addresses. Handlers report every address
+// when it cannot be allocated.
+_Use_decl_annotations_ static void DdimonpCreateReportFilter() {
+  PAGED_CODE();
+
+  const auto filter = static_cast<SfFilter*>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(SfFilter), kHyperPlatformCommonPoolTag));
+  if (!filter) {
+    HYPERPLATFORM_LOG_WARN("Duplicated events are not suppressed.");
+    return;
+  }
+  SfInitialize(filter, kDdimonpReportPeriod, KeQueryInterruptTime());
+  g_ddimonp_report_filter = filter;
+}
+
+// Frees the filter of reported addresses. Handlers must not be running.
+_Use_decl_annotations_ static void DdimonpDeleteReportFilter() {
+  PAGED_CODE();
+
+  if (g_ddimonp_report_filter) {
+    ExFreePoolWithTag(g_ddimonp_report_filter, kHyperPlatformCommonPoolTag);
+    g_ddimonp_report_filter = nullptr;
+  }
+}
+
+// Merges latencies of a hook and appends records of the handler and of the
+// original function as far as capacity allows. histograms are used as work
+// areas.
+_Use_decl_annotations_ static void DdimonpAddLatencyStatistics(
+    DdimonLatencyStatistics* records, ULONG capacity, ULONG* record_count,
+    ULONG* total_count, ULONG64 hook_address, const LrLatencies* latencies,
+    LhHistogram* handler, LhHistogram* original) {
+  PAGED_CODE();
+
+  LrMerge(latencies, handler, original);
+  const struct {
+    DdimonLatencyKind kind;
+    const LhHistogram* histogram;
+  } kinds[] = {
+      {kDdimonLatencyHandler, handler},
+      {kDdimonLatencyOriginal, original},
+  };
+  for (const auto& kind : kinds) {
+    if (*total_count < capacity) {
+      const auto& histogram = *kind.histogram;
+      records[*total_count] = {
+          hook_address,
+          kind.kind,
+          0,
+          histogram.count,
+          LhValueAtPermille(histogram, 500),
+          LhValueAtPermille(histogram, 990),
+          LhValueAtPermille(histogram, 999),
+          histogram.max_value,
+      };
+      (*record_count)++;
+    }
+    (*total_count)++;
+  }
+}
 
 _Use_decl_annotations_ EXTERN_C static bool DdimonInstallMemMonitor(
   void* context) {
@@ -675,8 +2441,8 @@ _Use_decl_annotations_ EXTERN_C static bool DdimonInstallHookUnexport(
   }
 
   for (auto& target : g_ddimonp_hook_targets) {
-    // only process unexport function
-    if (target.function_type == EXPORT_FUNCTION) {
+    // only process unexport function with a handler
+    if (target.function_type == EXPORT_FUNCTION || !target.handler) {
       continue;
     }
 
@@ -695,4 +2461,130 @@ _Use_decl_annotations_ EXTERN_C static bool DdimonInstallHookUnexport(
       target.target_address);
   }
   return true;
-}
\ No newline at end of file
+}
+
+// Returns a base address of a loaded kernel module with the file name (eg,
+// ndis.sys), or 0 when it is not loaded
+_Use_decl_annotations_ static ULONG_PTR DdimonpFindModuleBase(
+    const char* module_name) {
+  PAGED_CODE();
+
+  ULONG size = 0;
+  auto status = AuxKlibQueryModuleInformation(
+      &size, sizeof(AUX_MODULE_EXTENDED_INFO), nullptr);
+  if (!NT_SUCCESS(status) || !size) {
+    return 0;
+  }
+  auto modules = reinterpret_cast<AUX_MODULE_EXTENDED_INFO*>(
+      ExAllocatePoolWithTag(PagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!modules) {
+    return 0;
+  }
+
+  ULONG_PTR base = 0;
+  status = AuxKlibQueryModuleInformation(
+      &size, sizeof(AUX_MODULE_EXTENDED_INFO), modules);
+  if (NT_SUCCESS(status)) {
+    for (auto i = 0ul; i < size / sizeof(AUX_MODULE_EXTENDED_INFO); ++i) {
+      const auto file_name = reinterpret_cast<const char*>(
+          modules[i].FullPathName + modules[i].FileNameOffset);
+      if (!_stricmp(file_name, module_name)) {
+        base = reinterpret_cast<ULONG_PTR>(modules[i].BasicInfo.ImageBase);
+        break;
+      }
+    }
+  }
+  ExFreePoolWithTag(modules, kHyperPlatformCommonPoolTag);
+  return base;
+}
+
+// Returns an address of an export of a module, or 0 when it is not found.
+// Unlike MmGetSystemRoutineAddress(), works with any module.
+_Use_decl_annotations_ static ULONG64 DdimonpFindExport(
+    ULONG_PTR base_address, const char* name) {
+  PAGED_CODE();
+
+  DdimonpExportQuery query = {name, 0};
+  DdimonpEnumExportedSymbols(base_address, DdimonpFindExportCallback, &query);
+  return query.address;
+}
+
+// Installs pending entries whose modules have been loaded. VM-exit handlers
+// keep running meanwhile; this is safe since hooks are disabled while being
+// installed, and ShInstall*() publish each hook to the handlers while other
+// processors are stopped.
+_Use_decl_annotations_ static void DdimonpInstallPendingEntries() {
+  PAGED_CODE();
+
+  KeAcquireGuardedMutex(&g_ddimonp_reload_lock);
+  auto& pending_entries = *g_ddimonp_pending_entries;
+  std::vector<TtEntry> loaded;
+  for (auto it = pending_entries.begin(); it != pending_entries.end();) {
+    if (DdimonpFindModuleBase(it->module)) {
+      loaded.push_back(*it);
+      it = pending_entries.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (loaded.empty()) {
+    KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+    return;
+  }
+
+  // Restore all shadowed pages so that hooks can be safely installed
+  auto status = ShDisableHooks();
+  if (!NT_SUCCESS(status)) {
+    pending_entries.insert(pending_entries.end(), loaded.cbegin(),
+                           loaded.cend());
+    KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+    return;
+  }
+
+  auto installed_count = 0ul;
+  for (const auto& entry : loaded) {
+    if (DdimonpInstallEntry(g_ddimonp_shared_sh_data, entry)) {
+      installed_count++;
+    }
+  }
+  status = ShEnableHooks();
+  KeReleaseGuardedMutex(&g_ddimonp_reload_lock);
+
+  HYPERPLATFORM_LOG_INFO(
+      "Targets in loaded modules have been installed: %lu of %Iu (%08x).",
+      installed_count, loaded.size(), status);
+}
+
+// Queues installation of pending entries when a kernel module is loaded.
+// Installation is left to a work item so that the loader is not held up.
+_Use_decl_annotations_ static void DdimonpLoadImageNotifyRoutine(
+    PUNICODE_STRING full_image_name, HANDLE process_id,
+    PIMAGE_INFO image_info) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(full_image_name);
+  UNREFERENCED_PARAMETER(process_id);
+
+  if (!image_info->SystemModeImage) {
+    return;
+  }
+  if (!ExAcquireRundownProtection(&g_ddimonp_module_rundown)) {
+    return;
+  }
+  auto work_item = reinterpret_cast<PWORK_QUEUE_ITEM>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(WORK_QUEUE_ITEM), kHyperPlatformCommonPoolTag));
+  if (!work_item) {
+    ExReleaseRundownProtection(&g_ddimonp_module_rundown);
+    return;
+  }
+  ExInitializeWorkItem(work_item, DdimonpModuleWorkerRoutine, work_item);
+  ExQueueWorkItem(work_item, DelayedWorkQueue);
+}
+
+// Installs pending entries whose modules have been loaded
+_Use_decl_annotations_ static void DdimonpModuleWorkerRoutine(void* context) {
+  PAGED_CODE();
+
+  ExFreePoolWithTag(context, kHyperPlatformCommonPoolTag);
+  DdimonpInstallPendingEntries();
+  ExReleaseRundownProtection(&g_ddimonp_module_rundown);
+}
@@ -9,6 +9,7 @@
 #define DDIMON_DDI_MON_H_
 
 #include <fltKernel.h>
+#include "ddi_mon_ioctl.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -37,6 +38,28 @@ _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
 
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void DdimonTermination();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS DdimonReloadTargets();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    DdimonSetTargetState(_In_ PCUNICODE_STRING name, _In_ bool enable);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    DdimonSetTargetScope(_In_ PCUNICODE_STRING name,
+                         _In_reads_(process_id_count) const HANDLE* process_ids,
+                         _In_ ULONG process_id_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    DdimonQueryLatencies(_Out_writes_to_(capacity, *record_count)
+                             DdimonLatencyStatistics* records,
+                         _In_ ULONG capacity, _Out_ ULONG* record_count,
+                         _Out_ ULONG* total_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+    DdimonScanCode(_Out_ DdimonCodeScanStatistics* statistics,
+                   _Out_writes_to_(capacity, *record_count)
+                       DdimonModifiedCode* records,
+                   _In_ ULONG capacity, _Out_ ULONG* record_count);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -0,0 +1,267 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares IOCTL codes and structures of the DdiMon control device.
+///
+/// This header is shared with user-mode programs. It depends only on types
+/// and macros defined by both <fltKernel.h> and <windows.h> with
+/// <winioctl.h>, which must be included beforehand. Types are also usable
+/// with platform.h alone.
+
+#ifndef DDIMON_DDI_MON_IOCTL_H_
+#define DDIMON_DDI_MON_IOCTL_H_
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A path to open the control device from user mode
+#define DDIMON_CONTROL_DEVICE_PATH L"\\\\.\\DdiMon"
+
+// Returns a DdimonExitSnapshot. When the output buffer cannot hold all
+// records, as many records as fit are returned with STATUS_BUFFER_OVERFLOW
+// (ERROR_MORE_DATA in user mode), and total_count tells how many exist.
+#define IOCTL_DDIMON_QUERY_EXIT_STATISTICS \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Returns a DdimonExitTrace and removes returned records from the trace.
+// Records are returned processor by processor, in order of occurrence on each
+// processor. Records overwritten before being read are counted in lost_count.
+#define IOCTL_DDIMON_READ_EXIT_TRACE \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Returns a DdimonCallerSnapshot of calls counted by counting hooks, which are
+// handled in VMX-root mode without entering a hook handler. Truncated as
+// IOCTL_DDIMON_QUERY_EXIT_STATISTICS.
+#define IOCTL_DDIMON_QUERY_CALLERS \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Returns a DdimonLatencySnapshot of hooks with handlers. Truncated as
+// IOCTL_DDIMON_QUERY_EXIT_STATISTICS.
+#define IOCTL_DDIMON_QUERY_LATENCIES \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Takes a DdimonExitBudget and applies it to all memory monitors
+#define IOCTL_DDIMON_SET_EXIT_BUDGET \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+// Scans code of loaded kernel modules against their files and returns a
+// DdimonCodeScan of pages that differ. Truncated as
+// IOCTL_DDIMON_QUERY_EXIT_STATISTICS.
+#define IOCTL_DDIMON_SCAN_CODE \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Takes a DdimonTargetState and enables or disables the target as
+// DdimonSetTargetState() does, without reinstalling other targets
+#define IOCTL_DDIMON_SET_TARGET_STATE \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+// Takes a DdimonTargetScope and limits hooks of the target to the processes
+// as DdimonSetTargetScope() does
+#define IOCTL_DDIMON_SET_TARGET_SCOPE \
+  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+// Maximum number of characters of a target name, as in a target table
+#define DDIMON_MAX_TARGET_NAME_LENGTH 63
+
+// Maximum number of processes a target can be limited to
+#define DDIMON_MAX_TARGET_SCOPE_PROCESSES 32
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// What DdimonExitStatistics::address refers to
+enum DdimonExitStatisticsKind : ULONG {
+  kDdimonExitStatisticsHook = 1,  // An address where a hook is installed
+  kDdimonExitStatisticsPage = 2,  // A base address of a shadowed page
+};
+
+// VM-exits handled by the shadow hook for a hook or a page, summed over all
+// processors. Cycles are TSC cycles spent in VMX-root mode to handle them.
+struct DdimonExitStatistics {
+  ULONG64 address;
+  DdimonExitStatisticsKind kind;
+  ULONG reserved;
+  ULONG64 breakpoint_count;
+  ULONG64 breakpoint_cycles;
+  ULONG64 ept_violation_count;
+  ULONG64 ept_violation_cycles;
+  ULONG64 mtf_count;
+  ULONG64 mtf_cycles;
+  ULONG64 demotion_count;   // Times the page exceeded DdimonExitBudget
+  ULONG64 promotion_count;  // Times the page was monitored again
+};
+static_assert(sizeof(DdimonExitStatistics) == 80, "Size check");
+
+// An output of IOCTL_DDIMON_QUERY_EXIT_STATISTICS
+struct DdimonExitSnapshot {
+  ULONG total_count;   // Number of hooks and pages
+  ULONG record_count;  // Number of records returned in records
+  DdimonExitStatistics records[1];  // Hooks followed by pages
+};
+
+// A kind of VM-exit recorded in DdimonExitTraceRecord
+enum DdimonExitTraceKind : ULONG {
+  kDdimonExitTraceBreakpoint = 1,       // A hook handler was entered
+  kDdimonExitTraceOutOfScope = 2,       // A hit ran the original function
+  kDdimonExitTraceEptViolation = 3,     // A shadowed page was read or written
+  kDdimonExitTraceMonitorTrapFlag = 4,  // A shadowed page was hidden again
+  kDdimonExitTraceCounted = 5,          // A call was counted by a counting
+                                        // hook and ran the original function
+};
+
+// A VM-exit handled by the shadow hook. page_number is bits 12-55 of a guest
+// virtual address: guest IP for #BP and a fault address for EPT violation,
+// or a page hidden again for MTF. Sign-extend bit 47 to restore an address.
+struct DdimonExitTraceRecord {
+  ULONG64 tsc;
+  ULONG64 page_number : 44;
+  ULONG64 processor : 16;
+  ULONG64 kind : 4;  // DdimonExitTraceKind
+};
+static_assert(sizeof(DdimonExitTraceRecord) == 16, "Size check");
+
+// An output of IOCTL_DDIMON_READ_EXIT_TRACE
+struct DdimonExitTrace {
+  ULONG64 lost_count;  // Number of records overwritten before being read
+  ULONG record_count;  // Number of records returned in records
+  ULONG reserved;
+  DdimonExitTraceRecord records[1];
+};
+
+// An input of IOCTL_DDIMON_SET_EXIT_BUDGET. A page of a memory monitor that
+// causes more than max_exits EPT violation VM-exits within window_cycles TSC
+// cycles on a processor is demoted: it is not monitored on the processor for
+// min_demoted_windows windows, doubled on each demotion up to
+// max_demoted_windows and halved for each window the page stays within the
+// budget. max_exits of 0 lets pages cause any number of VM-exits.
+struct DdimonExitBudget {
+  ULONG64 window_cycles;
+  ULONG max_exits;
+  ULONG min_demoted_windows;
+  ULONG max_demoted_windows;
+  ULONG reserved;
+};
+static_assert(sizeof(DdimonExitBudget) == 24, "Size check");
+
+// Calls of a counting hook from a return address, summed over all processors
+struct DdimonCallerStatistics {
+  ULONG64 hook_address;    // An address where a hook is installed
+  ULONG64 return_address;  // 0 for calls whose callers were not kept
+  ULONG64 call_count;
+};
+static_assert(sizeof(DdimonCallerStatistics) == 24, "Size check");
+
+// An output of IOCTL_DDIMON_QUERY_CALLERS
+struct DdimonCallerSnapshot {
+  ULONG total_count;   // Number of records available
+  ULONG record_count;  // Number of records returned in records
+  DdimonCallerStatistics records[1];  // Grouped by hook_address
+};
+
+// What DdimonLatencyStatistics measures
+enum DdimonLatencyKind : ULONG {
+  kDdimonLatencyHandler = 1,   // A hook handler, excluding the original
+  kDdimonLatencyOriginal = 2,  // The original function called by a handler
+};
+
+// Latencies of calls through a hook in TSC cycles, merged over all
+// processors. Percentiles are accurate to about 3%.
+struct DdimonLatencyStatistics {
+  ULONG64 hook_address;  // An address where a hook is installed
+  DdimonLatencyKind kind;
+  ULONG reserved;
+  ULONG64 count;
+  ULONG64 p50;
+  ULONG64 p99;
+  ULONG64 p999;
+  ULONG64 max;
+};
+static_assert(sizeof(DdimonLatencyStatistics) == 56, "Size check");
+
+// An output of IOCTL_DDIMON_QUERY_LATENCIES
+struct DdimonLatencySnapshot {
+  ULONG total_count;   // Number of records available
+  ULONG record_count;  // Number of records returned in records
+  DdimonLatencyStatistics records[1];  // A handler followed by its original
+};
+
+// Pages of executable and non-discardable sections of kernel modules counted
+// by a scan. Each page is counted in page_count and at most one other count.
+struct DdimonCodeScanStatistics {
+  ULONG module_count;
+  ULONG page_count;
+  ULONG shadowed_count;    // Skipped as shadowed by DdiMon
+  ULONG paged_out_count;   // Skipped as not resident
+  ULONG unverified_count;  // Skipped as their files could not be read
+  ULONG cached_count;      // Unchanged since the last scan compared them
+  ULONG compared_count;    // Compared against files
+  ULONG modified_count;    // Found different from files, cached or not
+  ULONG64 elapsed_us;
+};
+static_assert(sizeof(DdimonCodeScanStatistics) == 40, "Size check");
+
+// Bytes of a page that differ from the file after relocations are applied
+struct DdimonModifiedCode {
+  ULONG64 address;      // The first byte that differs
+  ULONG64 module_base;  // An address the module is loaded at
+  ULONG size;           // Bytes from the first to the last byte that differ
+  ULONG changed_count;  // Bytes that differ
+};
+static_assert(sizeof(DdimonModifiedCode) == 24, "Size check");
+
+// An output of IOCTL_DDIMON_SCAN_CODE. modified_count of statistics tells how
+// many records exist.
+struct DdimonCodeScan {
+  DdimonCodeScanStatistics statistics;
+  ULONG record_count;  // Number of records returned in records
+  ULONG reserved;
+  DdimonModifiedCode records[1];  // Grouped by module_base
+};
+
+// An input of IOCTL_DDIMON_SET_TARGET_STATE. name is a null-terminated ASCII
+// name of an entry of the target table, or of a built-in target.
+struct DdimonTargetState {
+  char name[DDIMON_MAX_TARGET_NAME_LENGTH + 1];
+  ULONG enable;  // Non-zero to enable the target
+  ULONG reserved;
+};
+static_assert(sizeof(DdimonTargetState) == 72, "Size check");
+
+// An input of IOCTL_DDIMON_SET_TARGET_SCOPE, followed by process_id_count
+// process IDs. A process_id_count of 0 lets hooks apply to all processes
+// again.
+struct DdimonTargetScope {
+  char name[DDIMON_MAX_TARGET_NAME_LENGTH + 1];
+  ULONG process_id_count;  // Up to DDIMON_MAX_TARGET_SCOPE_PROCESSES
+  ULONG reserved;
+  ULONG64 process_ids[1];
+};
+static_assert(sizeof(DdimonTargetScope) == 80, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_DDI_MON_IOCTL_H_
@@ -0,0 +1,79 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares events recorded by hook handlers of DdiMon.
+///
+/// This header is shared by DdiMon and consumers of its trace files. An event
+/// is marshaled by a hook handler with Marshal() of its type, and decoded by a
+/// consumer with a schema found in kDdimonSchemas by the ID.
+
+#ifndef DDIMON_DDI_MON_SCHEMA_H_
+#define DDIMON_DDI_MON_SCHEMA_H_
+
+#include "event_schema.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// IDs of events. Never reuse an ID for a different list of fields.
+enum DdimonSchemaId : USHORT {
+  kDdimonSchemaExQueueWorkItem = 1,
+  kDdimonSchemaNtQuerySystemInformation = 2,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A work item queued from where not backed by any image, with leading bytes
+// of its worker routine
+using DdimonExQueueWorkItemEvent =
+    EsEvent<kDdimonSchemaExQueueWorkItem, EsPointer, EsPointer, EsInteger,
+            EsInteger, EsBuffer>;
+
+using DdimonNtQuerySystemInformationEvent =
+    EsEvent<kDdimonSchemaNtQuerySystemInformation, EsInteger, EsInteger,
+            EsInteger>;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const char* const kDdimonExQueueWorkItemFields[] = {
+    "WorkerRoutine", "Parameter", "QueueType", "StackId", "RoutineBytes",
+};
+
+static const char* const kDdimonNtQuerySystemInformationFields[] = {
+    "SystemInformationClass", "SystemInformationLength", "Status",
+};
+
+// A registry of all events
+static const EsSchema kDdimonSchemas[] = {
+    EsMakeSchema<DdimonExQueueWorkItemEvent>("ExQueueWorkItem",
+                                             kDdimonExQueueWorkItemFields),
+    EsMakeSchema<DdimonNtQuerySystemInformationEvent>(
+        "NtQuerySystemInformation", kDdimonNtQuerySystemInformationFields),
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_DDI_MON_SCHEMA_H_
@@ -0,0 +1,156 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to marshal and decode event records.
+
+#include "event_schema.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool EspReadInteger(_Inout_ EsDecoder* decoder, _In_ ULONG width,
+                           _Out_ ULONG64* value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Writes the lower width bytes of value in little-endian
+_Use_decl_annotations_ ULONG EsWriteInteger(UCHAR* buffer, ULONG capacity,
+                                            ULONG64 value, ULONG width) {
+  if (capacity < width) {
+    return 0;
+  }
+  for (auto i = 0ul; i < width; ++i) {
+    buffer[i] = static_cast<UCHAR>(value >> (i * 8));
+  }
+  return width;
+}
+
+// Writes size, truncated to max_size, followed by bytes of data
+_Use_decl_annotations_ ULONG EsWriteBytes(UCHAR* buffer, ULONG capacity,
+                                          const void* data, ULONG size,
+                                          ULONG max_size) {
+  if (!data) {
+    size = 0;
+  }
+  if (size > max_size) {
+    size = max_size;
+  }
+  if (!EsWriteInteger(buffer, capacity, size, sizeof(USHORT)) ||
+      capacity - sizeof(USHORT) < size) {
+    return 0;
+  }
+  const auto bytes = static_cast<const UCHAR*>(data);
+  for (auto i = 0ul; i < size; ++i) {
+    buffer[sizeof(USHORT) + i] = bytes[i];
+  }
+  return sizeof(USHORT) + size;
+}
+
+// Returns a schema with the ID, or nullptr
+_Use_decl_annotations_ const EsSchema* EsFindSchema(const EsSchema* schemas,
+                                                    ULONG schema_count,
+                                                    USHORT id) {
+  for (auto i = 0ul; i < schema_count; ++i) {
+    if (schemas[i].id == id) {
+      return &schemas[i];
+    }
+  }
+  return nullptr;
+}
+
+// Prepares to decode fields of the record described by the schema
+_Use_decl_annotations_ void EsInitializeDecoder(EsDecoder* decoder,
+                                                const EsSchema* schema,
+                                                const void* record,
+                                                ULONG record_size) {
+  decoder->schema = schema;
+  decoder->record = static_cast<const UCHAR*>(record);
+  decoder->record_size = record_size;
+  decoder->offset = 0;
+  decoder->field_index = 0;
+}
+
+// Decodes the next field. Returns false after the last field or when the
+// record does not match the schema.
+_Use_decl_annotations_ bool EsDecodeField(EsDecoder* decoder, EsValue* value) {
+  if (decoder->field_index >= decoder->schema->field_count) {
+    return false;
+  }
+
+  const auto type = decoder->schema->field_types[decoder->field_index];
+  *value = {};
+  value->type = type;
+  switch (type) {
+    case kEsFieldInteger:
+    case kEsFieldPointer:
+      if (!EspReadInteger(decoder, sizeof(ULONG64), &value->integer)) {
+        return false;
+      }
+      break;
+    case kEsFieldTag:
+      if (!EspReadInteger(decoder, sizeof(ULONG), &value->integer)) {
+        return false;
+      }
+      break;
+    case kEsFieldString:
+    case kEsFieldBuffer: {
+      ULONG64 size = 0;
+      if (!EspReadInteger(decoder, sizeof(USHORT), &size) ||
+          decoder->record_size - decoder->offset < size) {
+        return false;
+      }
+      value->data = decoder->record + decoder->offset;
+      value->size = static_cast<ULONG>(size);
+      decoder->offset += value->size;
+      break;
+    }
+    default:
+      return false;
+  }
+  decoder->field_index++;
+  return true;
+}
+
+// Reads a little-endian integer of width bytes
+_Use_decl_annotations_ static bool EspReadInteger(EsDecoder* decoder,
+                                                  ULONG width,
+                                                  ULONG64* value) {
+  if (decoder->record_size - decoder->offset < width) {
+    return false;
+  }
+  ULONG64 result = 0;
+  for (auto i = 0ul; i < width; ++i) {
+    result |= static_cast<ULONG64>(decoder->record[decoder->offset + i])
+              << (i * 8);
+  }
+  decoder->offset += width;
+  *value = result;
+  return true;
+}
@@ -0,0 +1,224 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares typed event schemas, and functions to marshal and decode
+/// event records.
+///
+/// An event is declared as EsEvent with an ID and a list of field types, for
+/// example:
+///
+///   using FooEvent = EsEvent<1, EsPointer, EsTag, EsString>;
+///
+/// FooEvent::Marshal() then takes exactly a pointer, a tag and a string and
+/// serializes them into a record without formatting text. A consumer finds an
+/// EsSchema made of the same EsEvent by the ID and decodes fields of a record
+/// with EsDecodeField(). Functions here depend only on platform.h.
+///
+/// A record is a sequence of fields without padding, all little-endian:
+///
+///   EsInteger, EsPointer  8 bytes
+///   EsTag                 4 bytes
+///   EsString, EsBuffer    2 bytes of size followed by bytes, truncated to
+///                         kEsMaxStringSize or kEsMaxBufferSize
+
+#ifndef DDIMON_EVENT_SCHEMA_H_
+#define DDIMON_EVENT_SCHEMA_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Maximum bytes of an EsString and an EsBuffer in a record
+static const ULONG kEsMaxStringSize = 128;
+static const ULONG kEsMaxBufferSize = 64;
+
+// A type of a field
+enum EsFieldType : UCHAR {
+  kEsFieldEnd = 0,  // Terminates EsEvent::kFieldTypes
+  kEsFieldInteger = 1,
+  kEsFieldPointer = 2,
+  kEsFieldTag = 3,     // A pool tag
+  kEsFieldString = 4,  // UTF-16LE characters, such as UNICODE_STRING
+  kEsFieldBuffer = 5,  // Bytes copied from memory
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A value of EsString. length is in bytes as UNICODE_STRING::Length.
+struct EsStringValue {
+  const void* buffer;
+  USHORT length;
+};
+
+// A value of EsBuffer. Bytes beyond kEsMaxBufferSize are not copied.
+struct EsBufferValue {
+  const void* data;
+  ULONG size;
+};
+
+// A description of an event used by a consumer to decode its records
+struct EsSchema {
+  USHORT id;
+  UCHAR field_count;
+  const char* name;
+  const EsFieldType* field_types;
+  const char* const* field_names;
+};
+
+// A decoded field
+struct EsValue {
+  EsFieldType type;
+  ULONG64 integer;    // A value of EsInteger, EsPointer and EsTag
+  const UCHAR* data;  // Bytes of EsString and EsBuffer in the record
+  ULONG size;
+};
+
+// A position in a record being decoded by EsDecodeField()
+struct EsDecoder {
+  const EsSchema* schema;
+  const UCHAR* record;
+  ULONG record_size;
+  ULONG offset;
+  ULONG field_index;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+ULONG EsWriteInteger(_Out_writes_bytes_(capacity) UCHAR* buffer,
+                     _In_ ULONG capacity, _In_ ULONG64 value,
+                     _In_ ULONG width);
+
+ULONG EsWriteBytes(_Out_writes_bytes_(capacity) UCHAR* buffer,
+                   _In_ ULONG capacity, _In_reads_bytes_(size) const void* data,
+                   _In_ ULONG size, _In_ ULONG max_size);
+
+const EsSchema* EsFindSchema(_In_reads_(schema_count) const EsSchema* schemas,
+                             _In_ ULONG schema_count, _In_ USHORT id);
+
+void EsInitializeDecoder(_Out_ EsDecoder* decoder,
+                         _In_ const EsSchema* schema,
+                         _In_reads_bytes_(record_size) const void* record,
+                         _In_ ULONG record_size);
+
+bool EsDecodeField(_Inout_ EsDecoder* decoder, _Out_ EsValue* value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Field types. Each has a type of a value to marshal and writes the value to
+// a buffer, returning bytes written, or 0 when the buffer is too small.
+
+struct EsInteger {
+  using Value = ULONG64;
+  static const EsFieldType kType = kEsFieldInteger;
+  static ULONG Write(UCHAR* buffer, ULONG capacity, Value value) {
+    return EsWriteInteger(buffer, capacity, value, sizeof(ULONG64));
+  }
+};
+
+struct EsPointer {
+  using Value = const void*;
+  static const EsFieldType kType = kEsFieldPointer;
+  static ULONG Write(UCHAR* buffer, ULONG capacity, Value value) {
+    return EsWriteInteger(buffer, capacity,
+                          reinterpret_cast<ULONG_PTR>(value), sizeof(ULONG64));
+  }
+};
+
+struct EsTag {
+  using Value = ULONG;
+  static const EsFieldType kType = kEsFieldTag;
+  static ULONG Write(UCHAR* buffer, ULONG capacity, Value value) {
+    return EsWriteInteger(buffer, capacity, value, sizeof(ULONG));
+  }
+};
+
+struct EsString {
+  using Value = EsStringValue;
+  static const EsFieldType kType = kEsFieldString;
+  static ULONG Write(UCHAR* buffer, ULONG capacity, const Value& value) {
+    // Do not split a character when truncated
+    return EsWriteBytes(buffer, capacity, value.buffer, value.length & ~1u,
+                        kEsMaxStringSize);
+  }
+};
+
+struct EsBuffer {
+  using Value = EsBufferValue;
+  static const EsFieldType kType = kEsFieldBuffer;
+  static ULONG Write(UCHAR* buffer, ULONG capacity, const Value& value) {
+    return EsWriteBytes(buffer, capacity, value.data, value.size,
+                        kEsMaxBufferSize);
+  }
+};
+
+// An event with an ID and fields of the given types
+template <USHORT kId, typename... Fields>
+struct EsEvent {
+  static const USHORT kSchemaId = kId;
+  static const UCHAR kFieldCount = sizeof...(Fields);
+  static constexpr EsFieldType kFieldTypes[sizeof...(Fields) + 1] = {
+      Fields::kType..., kEsFieldEnd,
+  };
+
+  // Serializes values into buffer and returns the size of the record, or 0
+  // when buffer is too small
+  static ULONG Marshal(UCHAR* buffer, ULONG capacity,
+                       const typename Fields::Value&... values) {
+    ULONG size = 0;
+    bool fits = true;
+    const bool results[] = {
+        fits, (fits = fits && Append<Fields>(buffer, capacity, &size,
+                                             values))...,
+    };
+    static_cast<void>(results);
+    return (fits) ? size : 0;
+  }
+
+ private:
+  template <typename Field>
+  static bool Append(UCHAR* buffer, ULONG capacity, ULONG* size,
+                     const typename Field::Value& value) {
+    const auto written =
+        Field::Write(buffer + *size, capacity - *size, value);
+    *size += written;
+    return written != 0;
+  }
+};
+
+template <USHORT kId, typename... Fields>
+constexpr EsFieldType EsEvent<kId, Fields...>::kFieldTypes[];
+
+// Makes a schema of an event with names of its fields
+template <typename Event, ULONG kNameCount>
+constexpr EsSchema EsMakeSchema(const char* name,
+                                const char* const (&field_names)[kNameCount]) {
+  static_assert(kNameCount == Event::kFieldCount, "Field count mismatch");
+  return {Event::kSchemaId, Event::kFieldCount, name, Event::kFieldTypes,
+          field_names};
+}
+
+#endif  // DDIMON_EVENT_SCHEMA_H_
@@ -0,0 +1,345 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements hide list functions.
+
+#include "hide_list.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "hide_list_core.h"
+#include "target_table.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Maximum size of the HiddenProcesses value
+static const ULONG kHlpMaxValueSize = 0x100000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static HlcTable* HlpCreateTable();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void HlpDeleteTable(
+    _In_opt_ HlcTable* table);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    HlpInsertName(_Inout_ HlcTable* table, _In_ const UNICODE_STRING& name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    HlpInsertProcessId(_Inout_ HlcTable* table, _In_ HANDLE process_id);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS HlpParseMultiSz(
+    _Inout_ HlcTable* table, _In_reads_bytes_(size) const wchar_t* strings,
+    _In_ ULONG size);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, HlInitialization)
+#pragma alloc_text(PAGE, HlTermination)
+#pragma alloc_text(PAGE, HlLoadFromRegistry)
+#pragma alloc_text(PAGE, HlAddName)
+#pragma alloc_text(PAGE, HlFilterProcessInformation)
+#pragma alloc_text(PAGE, HlpCreateTable)
+#pragma alloc_text(PAGE, HlpDeleteTable)
+#pragma alloc_text(PAGE, HlpInsertName)
+#pragma alloc_text(PAGE, HlpInsertProcessId)
+#pragma alloc_text(PAGE, HlpParseMultiSz)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Protects g_hlp_table. Shared by filtering and exclusive for updates.
+static ERESOURCE g_hlp_lock;
+
+static HlcTable* g_hlp_table;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates an empty hide list
+_Use_decl_annotations_ NTSTATUS HlInitialization() {
+  PAGED_CODE();
+
+  g_hlp_table = HlpCreateTable();
+  if (!g_hlp_table) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  const auto status = ExInitializeResourceLite(&g_hlp_lock);
+  if (!NT_SUCCESS(status)) {
+    HlpDeleteTable(g_hlp_table);
+    g_hlp_table = nullptr;
+  }
+  return status;
+}
+
+// Frees the hide list. No filtering may be in progress.
+_Use_decl_annotations_ void HlTermination() {
+  PAGED_CODE();
+
+  if (g_hlp_table) {
+    ExDeleteResourceLite(&g_hlp_lock);
+    HlpDeleteTable(g_hlp_table);
+    g_hlp_table = nullptr;
+  }
+}
+
+// Replaces the hide list with the HiddenProcesses value of the service.
+// Returns STATUS_OBJECT_NAME_NOT_FOUND when the value does not exist, and
+// leaves the current list on any error.
+_Use_decl_annotations_ NTSTATUS HlLoadFromRegistry() {
+  PAGED_CODE();
+
+  HANDLE key = nullptr;
+  auto status = TtOpenParametersKey(KEY_READ, &key);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  UNICODE_STRING value_name = RTL_CONSTANT_STRING(L"HiddenProcesses");
+  ULONG info_size = 0;
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation,
+                           nullptr, 0, &info_size);
+  if (status != STATUS_BUFFER_TOO_SMALL && status != STATUS_BUFFER_OVERFLOW) {
+    ZwClose(key);
+    return status;
+  }
+  if (info_size > kHlpMaxValueSize) {
+    ZwClose(key);
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  auto info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(
+      ExAllocatePoolWithTag(PagedPool, info_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!info) {
+    ZwClose(key);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation, info,
+                           info_size, &info_size);
+  ZwClose(key);
+
+  HlcTable* table = nullptr;
+  if (NT_SUCCESS(status)) {
+    if (info->Type != REG_MULTI_SZ) {
+      status = STATUS_INVALID_PARAMETER;
+    } else if ((table = HlpCreateTable()) == nullptr) {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+      status =
+          HlpParseMultiSz(table, reinterpret_cast<const wchar_t*>(info->Data),
+                          info->DataLength);
+    }
+  }
+  ExFreePoolWithTag(info, kHyperPlatformCommonPoolTag);
+  if (!NT_SUCCESS(status)) {
+    HlpDeleteTable(table);
+    return status;
+  }
+
+  const auto entry_count = table->entry_count;
+  ExEnterCriticalRegionAndAcquireResourceExclusive(&g_hlp_lock);
+  const auto old_table = g_hlp_table;
+  g_hlp_table = table;
+  ExReleaseResourceAndLeaveCriticalRegion(&g_hlp_lock);
+  HlpDeleteTable(old_table);
+
+  HYPERPLATFORM_LOG_INFO("Hide list has been loaded with %lu entries.",
+                         entry_count);
+  return STATUS_SUCCESS;
+}
+
+// Adds an image name to the hide list
+_Use_decl_annotations_ NTSTATUS HlAddName(PCUNICODE_STRING name) {
+  PAGED_CODE();
+
+  ExEnterCriticalRegionAndAcquireResourceExclusive(&g_hlp_lock);
+  const auto status = HlpInsertName(g_hlp_table, *name);
+  ExReleaseResourceAndLeaveCriticalRegion(&g_hlp_lock);
+  return status;
+}
+
+// Unlinks all entries of hidden processes from a SystemProcessInformation
+// list. The list is in user memory when the caller is in user mode, where
+// another thread may free or change it at any time.
+_Use_decl_annotations_ void HlFilterProcessInformation(
+    void* system_information, ULONG system_information_length) {
+  PAGED_CODE();
+
+  ExEnterCriticalRegionAndAcquireResourceShared(&g_hlp_lock);
+  const auto table = g_hlp_table;
+  if (!table->entry_count) {
+    ExReleaseResourceAndLeaveCriticalRegion(&g_hlp_lock);
+    return;
+  }
+
+  auto well_formed = true;
+  ULONG hidden_count = 0;
+  if (ExGetPreviousMode() == KernelMode) {
+    well_formed = HlcFilterProcessInformation(
+        *table, system_information, system_information_length, &hidden_count);
+  } else {
+    __try {
+      well_formed = HlcFilterProcessInformation(*table, system_information,
+                                                system_information_length,
+                                                &hidden_count);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+      well_formed = false;
+    }
+  }
+  ExReleaseResourceAndLeaveCriticalRegion(&g_hlp_lock);
+  if (!well_formed) {
+    HYPERPLATFORM_LOG_WARN_SAFE(
+        "A process list at %p could not be filtered completely.",
+        system_information);
+  }
+}
+
+// Allocates an empty table
+_Use_decl_annotations_ static HlcTable* HlpCreateTable() {
+  PAGED_CODE();
+
+  const auto table = reinterpret_cast<HlcTable*>(ExAllocatePoolWithTag(
+      PagedPool, sizeof(HlcTable), kHyperPlatformCommonPoolTag));
+  if (table) {
+    RtlZeroMemory(table, sizeof(HlcTable));
+  }
+  return table;
+}
+
+// Frees a table and all of its entries
+_Use_decl_annotations_ static void HlpDeleteTable(HlcTable* table) {
+  PAGED_CODE();
+
+  if (!table) {
+    return;
+  }
+  for (auto entry : table->buckets) {
+    while (entry) {
+      const auto next = entry->next;
+      ExFreePoolWithTag(entry, kHyperPlatformCommonPoolTag);
+      entry = next;
+    }
+  }
+  ExFreePoolWithTag(table, kHyperPlatformCommonPoolTag);
+}
+
+// Adds a copy of name to a table unless it is already there
+_Use_decl_annotations_ static NTSTATUS HlpInsertName(
+    HlcTable* table, const UNICODE_STRING& name) {
+  PAGED_CODE();
+
+  if (!name.Length) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  const HlcName hlc_name = {name.Length, name.MaximumLength,
+                            reinterpret_cast<const USHORT*>(name.Buffer)};
+  const auto hash = HlcHashName(hlc_name);
+  if (HlcContainsName(*table, hlc_name, hash)) {
+    return STATUS_SUCCESS;
+  }
+
+  const auto entry = reinterpret_cast<HlcEntry*>(
+      ExAllocatePoolWithTag(PagedPool, sizeof(HlcEntry) + name.Length,
+                            kHyperPlatformCommonPoolTag));
+  if (!entry) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(entry, sizeof(HlcEntry));
+  const auto buffer = reinterpret_cast<USHORT*>(entry + 1);
+  RtlCopyMemory(buffer, name.Buffer, name.Length);
+  entry->hash = hash;
+  entry->name.length = name.Length;
+  entry->name.maximum_length = name.Length;
+  entry->name.buffer = buffer;
+  HlcInsertEntry(table, entry);
+  return STATUS_SUCCESS;
+}
+
+// Adds a process ID to a table unless it is already there
+_Use_decl_annotations_ static NTSTATUS HlpInsertProcessId(HlcTable* table,
+                                                          HANDLE process_id) {
+  PAGED_CODE();
+
+  const auto id = reinterpret_cast<ULONG_PTR>(process_id);
+  if (HlcContainsProcessId(*table, id)) {
+    return STATUS_SUCCESS;
+  }
+
+  const auto entry = reinterpret_cast<HlcEntry*>(ExAllocatePoolWithTag(
+      PagedPool, sizeof(HlcEntry), kHyperPlatformCommonPoolTag));
+  if (!entry) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(entry, sizeof(HlcEntry));
+  entry->hash = HlcHashProcessId(id);
+  entry->process_id = id;
+  HlcInsertEntry(table, entry);
+  return STATUS_SUCCESS;
+}
+
+// Adds each string of REG_MULTI_SZ data to a table as a process ID when it is
+// made of digits only, or as an image name otherwise
+_Use_decl_annotations_ static NTSTATUS HlpParseMultiSz(HlcTable* table,
+                                                       const wchar_t* strings,
+                                                       ULONG size) {
+  PAGED_CODE();
+
+  const auto count = size / sizeof(wchar_t);
+  for (auto i = 0ul; i < count;) {
+    auto length = 0ul;
+    auto is_number = true;
+    for (; i + length < count && strings[i + length]; ++length) {
+      const auto c = strings[i + length];
+      is_number = is_number && c >= L'0' && c <= L'9';
+    }
+    if (length > MAXUSHORT / sizeof(wchar_t)) {
+      return STATUS_INVALID_PARAMETER;
+    }
+
+    if (length) {
+      UNICODE_STRING string = {
+          static_cast<USHORT>(length * sizeof(wchar_t)),
+          static_cast<USHORT>(length * sizeof(wchar_t)),
+          const_cast<wchar_t*>(&strings[i]),
+      };
+      auto status = STATUS_SUCCESS;
+      if (is_number) {
+        ULONG process_id = 0;
+        status = RtlUnicodeStringToInteger(&string, 10, &process_id);
+        if (NT_SUCCESS(status)) {
+          status = HlpInsertProcessId(table, ULongToHandle(process_id));
+        }
+      } else {
+        status = HlpInsertName(table, string);
+      }
+      if (!NT_SUCCESS(status)) {
+        return status;
+      }
+    }
+    i += length + 1;
+  }
+  return STATUS_SUCCESS;
+}
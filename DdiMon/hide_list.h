@@ -0,0 +1,62 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to hide list functions.
+///
+/// A hide list holds image names and process IDs of processes removed from
+/// results of NtQuerySystemInformation(SystemProcessInformation). It is read
+/// from the HiddenProcesses (REG_MULTI_SZ) value under the Parameters key of
+/// the service. A string made of digits only is a process ID, and any other
+/// string is an image name compared case-insensitively.
+
+#ifndef DDIMON_HIDE_LIST_H_
+#define DDIMON_HIDE_LIST_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS HlInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void HlTermination();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS HlLoadFromRegistry();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    HlAddName(_In_ PCUNICODE_STRING name);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void HlFilterProcessInformation(
+    _Inout_updates_bytes_(system_information_length) void* system_information,
+    _In_ ULONG system_information_length);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HIDE_LIST_H_
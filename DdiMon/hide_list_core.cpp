@@ -0,0 +1,206 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements a hide list table and functions to filter process lists.
+
+#include "hide_list_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static USHORT HlcpUpcase(_In_ USHORT c);
+
+static bool HlcpEqualNames(_In_ const HlcName& name1,
+                           _In_ const HlcName& name2);
+
+static bool HlcpIsHidden(_In_ const HlcTable& table, _In_ const HlcName& name,
+                         _In_ ULONG_PTR process_id);
+
+static bool HlcpIsNameInside(_In_ const HlcName& name,
+                             _In_ const UCHAR* information, _In_ ULONG size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Computes FNV-1a (32bit) of an upper-cased name
+_Use_decl_annotations_ ULONG HlcHashName(const HlcName& name) {
+  auto hash = 2166136261ul;
+  for (auto i = 0ul; i < name.length / sizeof(USHORT); ++i) {
+    hash ^= HlcpUpcase(name.buffer[i]);
+    hash *= 16777619ul;
+  }
+  return hash;
+}
+
+// Returns a process ID as a hash. Process IDs are multiples of 4 and mostly
+// sequential, so they spread over buckets evenly as they are.
+_Use_decl_annotations_ ULONG HlcHashProcessId(ULONG_PTR process_id) {
+  return static_cast<ULONG>(process_id >> 2);
+}
+
+// Checks if a table has an image name. hash is HlcHashName() of name.
+_Use_decl_annotations_ bool HlcContainsName(const HlcTable& table,
+                                            const HlcName& name, ULONG hash) {
+  for (auto entry = table.buckets[hash % kHlcBucketCount]; entry;
+       entry = entry->next) {
+    if (entry->hash == hash && entry->name.length &&
+        HlcpEqualNames(entry->name, name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Checks if a table has a process ID
+_Use_decl_annotations_ bool HlcContainsProcessId(const HlcTable& table,
+                                                 ULONG_PTR process_id) {
+  const auto hash = HlcHashProcessId(process_id);
+  for (auto entry = table.buckets[hash % kHlcBucketCount]; entry;
+       entry = entry->next) {
+    if (!entry->name.length && entry->process_id == process_id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Links an entry whose hash is set into a table. The entry must not be in the
+// table yet.
+_Use_decl_annotations_ void HlcInsertEntry(HlcTable* table, HlcEntry* entry) {
+  auto& bucket = table->buckets[entry->hash % kHlcBucketCount];
+  entry->next = bucket;
+  bucket = entry;
+  table->entry_count++;
+}
+
+// Checks if a process is hidden by its image name or process ID
+_Use_decl_annotations_ bool HlcIsHidden(const HlcTable& table,
+                                        const HlcProcessInformation& process) {
+  return HlcpIsHidden(table, process.image_name, process.unique_process_id);
+}
+
+// Unlinks all entries of hidden processes from a SystemProcessInformation
+// list of size bytes in a single pass. The first entry (System Idle Process)
+// is always kept since the list starts there. Each field is read once, and
+// an image name is only compared when it lies in the list, so that the list
+// can be changed by another thread while it is filtered.
+//
+// Returns false when an entry does not fit in size bytes, or its offset is
+// misaligned or would not move forward. The list is then terminated at the
+// last entry kept, so that no hidden process remains in it.
+_Use_decl_annotations_ bool HlcFilterProcessInformation(
+    const HlcTable& table, void* information, ULONG size,
+    ULONG* hidden_count) {
+  *hidden_count = 0;
+  if (size < sizeof(HlcProcessInformation)) {
+    return false;
+  }
+
+  const auto base = static_cast<UCHAR*>(information);
+  auto kept = reinterpret_cast<HlcProcessInformation*>(base);
+  auto offset = 0ul;
+  auto well_formed = true;
+  for (;;) {
+    const auto current =
+        reinterpret_cast<HlcProcessInformation*>(base + offset);
+    const ULONG next_entry_offset = current->next_entry_offset;
+    if (!next_entry_offset) {
+      break;
+    }
+    if (next_entry_offset < sizeof(HlcProcessInformation) ||
+        next_entry_offset % alignof(HlcProcessInformation) ||
+        next_entry_offset > size - offset - sizeof(HlcProcessInformation)) {
+      well_formed = false;
+      break;
+    }
+    offset += next_entry_offset;
+
+    const auto next = reinterpret_cast<HlcProcessInformation*>(base + offset);
+    auto image_name = next->image_name;
+    if (!HlcpIsNameInside(image_name, base, size)) {
+      image_name = {};
+    }
+    if (HlcpIsHidden(table, image_name, next->unique_process_id)) {
+      (*hidden_count)++;
+      continue;
+    }
+    kept->next_entry_offset =
+        static_cast<ULONG>(reinterpret_cast<UCHAR*>(next) -
+                           reinterpret_cast<UCHAR*>(kept));
+    kept = next;
+  }
+  kept->next_entry_offset = 0;
+  return well_formed;
+}
+
+// Upper-cases a character as RtlUpcaseUnicodeChar() does. On a host, only
+// ASCII letters are changed.
+_Use_decl_annotations_ static USHORT HlcpUpcase(USHORT c) {
+#if defined(_KERNEL_MODE)
+  return RtlUpcaseUnicodeChar(c);
+#else
+  return (c >= 'a' && c <= 'z') ? static_cast<USHORT>(c - 'a' + 'A') : c;
+#endif
+}
+
+// Compares names case-insensitively
+_Use_decl_annotations_ static bool HlcpEqualNames(const HlcName& name1,
+                                                  const HlcName& name2) {
+  if (name1.length != name2.length) {
+    return false;
+  }
+  for (auto i = 0ul; i < name1.length / sizeof(USHORT); ++i) {
+    if (HlcpUpcase(name1.buffer[i]) != HlcpUpcase(name2.buffer[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Checks if an image name or a process ID is in a table. An image name may be
+// empty with a null buffer (eg, System Idle Process).
+_Use_decl_annotations_ static bool HlcpIsHidden(const HlcTable& table,
+                                                const HlcName& name,
+                                                ULONG_PTR process_id) {
+  if (name.length && name.buffer &&
+      HlcContainsName(table, name, HlcHashName(name))) {
+    return true;
+  }
+  return HlcContainsProcessId(table, process_id);
+}
+
+// Checks if an image name is aligned and within size bytes of a list
+_Use_decl_annotations_ static bool HlcpIsNameInside(const HlcName& name,
+                                                    const UCHAR* information,
+                                                    ULONG size) {
+  const auto address = reinterpret_cast<ULONG_PTR>(name.buffer);
+  const auto start = reinterpret_cast<ULONG_PTR>(information);
+  return !(address % sizeof(USHORT)) && address >= start &&
+         name.length <= size && address - start <= size - name.length;
+}
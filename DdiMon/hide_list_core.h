@@ -0,0 +1,113 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares a hide list table and functions to filter process lists.
+///
+/// A hide list table is a hash table of image names and process IDs chained
+/// in buckets. Entries are allocated by the caller and linked into the table
+/// with HlcInsertEntry(). HlcFilterProcessInformation() unlinks entries of
+/// hidden processes from a list returned by
+/// NtQuerySystemInformation(SystemProcessInformation), reading nothing beyond
+/// the size of the buffer even when offsets in it are corrupted. Functions
+/// here depend only on platform.h.
+
+#ifndef DDIMON_HIDE_LIST_CORE_H_
+#define DDIMON_HIDE_LIST_CORE_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of buckets of a hash table. Must be a power of 2.
+static const ULONG kHlcBucketCount = 4096;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A counted UTF-16 string laid out as UNICODE_STRING
+struct HlcName {
+  USHORT length;  // In bytes
+  USHORT maximum_length;
+  const USHORT* buffer;
+};
+
+// An image name or a process ID to hide. Unused fields are zero.
+struct HlcEntry {
+  HlcEntry* next;
+  ULONG hash;
+  ULONG_PTR process_id;  // Used when name is empty
+  HlcName name;          // An image name, or empty for a process ID
+};
+
+struct HlcTable {
+  ULONG entry_count;
+  HlcEntry* buckets[kHlcBucketCount];
+};
+
+// For NtQuerySystemInformation
+struct HlcProcessInformation {
+  ULONG next_entry_offset;
+  ULONG number_of_threads;
+  ULONG64 working_set_private_size;
+  ULONG hard_fault_count;
+  ULONG number_of_threads_high_watermark;
+  ULONG64 cycle_time;
+  ULONG64 create_time;
+  ULONG64 user_time;
+  ULONG64 kernel_time;
+  HlcName image_name;
+  LONG base_priority;
+  ULONG_PTR unique_process_id;
+  // omitted. see ole32!_SYSTEM_PROCESS_INFORMATION
+};
+static_assert(offsetof(HlcProcessInformation, unique_process_id) ==
+                  (sizeof(void*) == 8 ? 0x50 : 0x44),
+              "Offset check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+ULONG HlcHashName(_In_ const HlcName& name);
+
+ULONG HlcHashProcessId(_In_ ULONG_PTR process_id);
+
+bool HlcContainsName(_In_ const HlcTable& table, _In_ const HlcName& name,
+                     _In_ ULONG hash);
+
+bool HlcContainsProcessId(_In_ const HlcTable& table,
+                          _In_ ULONG_PTR process_id);
+
+void HlcInsertEntry(_Inout_ HlcTable* table, _Inout_ HlcEntry* entry);
+
+bool HlcIsHidden(_In_ const HlcTable& table,
+                 _In_ const HlcProcessInformation& process);
+
+bool HlcFilterProcessInformation(_In_ const HlcTable& table,
+                                 _Inout_updates_bytes_(size) void* information,
+                                 _In_ ULONG size, _Out_ ULONG* hidden_count);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HIDE_LIST_CORE_H_
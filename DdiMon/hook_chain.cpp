@@ -0,0 +1,195 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements hook chain functions.
+
+#include "hook_chain.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "shadow_hook.h"
+#include "latency_recorder.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A function hooked by a chain, called with kHcMaxArguments arguments of
+// which only the first argument_count come from the caller and the rest are
+// zero. It is harmless on x64 since a caller owns the stack arguments, and
+// HcCreateChain() refuses functions taking more than kHcMaxArguments, whose
+// further stack arguments would not be passed.
+using HcpOriginalType = ULONG64 (*)(ULONG64, ULONG64, ULONG64, ULONG64,
+                                    ULONG64, ULONG64, ULONG64, ULONG64);
+
+struct HcChain {
+  void* thunk;                  // Executable code used as a handler
+  void* const* original_call;   // Points to ShadowHookTarget::original_call
+  ULONG argument_count;         // Arguments the hooked function takes
+  ULONG callback_count;
+  HcCallback callbacks[kHcMaxCallbacks];  // Sorted by priority
+  LrLatencies* latencies;  // Of callbacks and of the original function
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+#if defined(_AMD64_)
+static ULONG64 HcpDispatch(_In_ const HcChain* chain,
+                           _Inout_ HcCallContext* call_context);
+
+static ULONG64 HcpLeave(_In_ ULONG64 return_value);
+#endif
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, HcCreateChain)
+#pragma alloc_text(PAGE, HcDeleteChain)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates a chain for a function taking argument_count integer arguments and
+// generates its thunk. Returns nullptr when the function takes more arguments
+// than the thunk can forward, or on x86 where the thunk is not implemented.
+_Use_decl_annotations_ HcChain* HcCreateChain(const HcCallback* callbacks,
+                                              ULONG callback_count,
+                                              void* const* original_call,
+                                              ULONG argument_count) {
+  PAGED_CODE();
+
+#if defined(_AMD64_)
+  if (!callback_count || callback_count > kHcMaxCallbacks ||
+      argument_count > kHcMaxArguments) {
+    return nullptr;
+  }
+
+  const auto chain = reinterpret_cast<HcChain*>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(HcChain), kHyperPlatformCommonPoolTag));
+  if (!chain) {
+    return nullptr;
+  }
+  RtlZeroMemory(chain, sizeof(HcChain));
+  chain->original_call = original_call;
+  chain->argument_count = argument_count;
+  chain->latencies = LrCreateLatencies();
+  if (!chain->latencies) {
+    ExFreePoolWithTag(chain, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+
+  for (auto i = 0ul; i < callback_count; ++i) {
+    HccInsertCallback(chain->callbacks, &chain->callback_count,
+                      callbacks[i]);
+  }
+
+  HccThunkCode code = {};
+  HccBuildThunk(&code, chain, reinterpret_cast<void*>(HcpDispatch),
+                reinterpret_cast<void*>(HcpLeave));
+
+#pragma warning(push)
+#pragma warning(disable : 30030)  // Allocating executable POOL_TYPE memory
+  chain->thunk = ExAllocatePoolWithTag(NonPagedPoolExecute, sizeof(code),
+                                       kHyperPlatformCommonPoolTag);
+#pragma warning(pop)
+  if (!chain->thunk) {
+    LrDeleteLatencies(chain->latencies);
+    ExFreePoolWithTag(chain, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+  RtlCopyMemory(chain->thunk, &code, sizeof(code));
+  KeInvalidateAllCaches();
+  return chain;
+
+#else
+  UNREFERENCED_PARAMETER(callbacks);
+  UNREFERENCED_PARAMETER(callback_count);
+  UNREFERENCED_PARAMETER(original_call);
+  UNREFERENCED_PARAMETER(argument_count);
+  return nullptr;
+#endif
+}
+
+// Frees a chain. Its thunk must not be in use, which ShWaitForHookHandlers()
+// ensures once the hook is uninstalled or hooks are disabled.
+_Use_decl_annotations_ void HcDeleteChain(HcChain* chain) {
+  PAGED_CODE();
+
+  LrDeleteLatencies(chain->latencies);
+  ExFreePoolWithTag(chain->thunk, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(chain, kHyperPlatformCommonPoolTag);
+}
+
+// Returns an address of the thunk to use as a handler
+_Use_decl_annotations_ void* HcGetThunk(const HcChain* chain) {
+  return chain->thunk;
+}
+
+// Returns latencies of callbacks and of the original function of the chain
+_Use_decl_annotations_ const LrLatencies* HcGetLatencies(const HcChain* chain) {
+  return chain->latencies;
+}
+
+#if defined(_AMD64_)
+
+// Calls pre-call callbacks, the original function and post-call callbacks in
+// sequence. Called by the thunk as a hook handler. Time spent in callbacks is
+// recorded as latencies of the handler.
+_Use_decl_annotations_ static ULONG64 HcpDispatch(
+    const HcChain* chain, HcCallContext* call_context) {
+  const auto start_tsc = __rdtsc();
+  HccCallPreCallbacks(chain->callbacks, chain->callback_count,
+                      chain->argument_count, call_context);
+
+  ULONG64 original_cycles = 0;
+  const auto called_original = !call_context->skip_original;
+  if (called_original) {
+    const auto original =
+        reinterpret_cast<HcpOriginalType>(*chain->original_call);
+    const auto args = call_context->arguments;
+    const auto original_tsc = __rdtsc();
+    call_context->return_value = original(args[0], args[1], args[2], args[3],
+                                          args[4], args[5], args[6], args[7]);
+    original_cycles = __rdtsc() - original_tsc;
+  }
+
+  HccCallPostCallbacks(chain->callbacks, chain->callback_count,
+                       call_context);
+
+  const auto cycles = __rdtsc() - start_tsc;
+  LrRecord(chain->latencies, cycles - original_cycles, original_cycles,
+           called_original);
+  return call_context->return_value;
+}
+
+// Marks that the thunk entered through ShHandleBreakpoint() is returning, and
+// returns return_value to a caller of the hooked function. The thunk jumps
+// here after its last instruction that uses it, since the chain may be
+// deleted as soon as ShWaitForHookHandlers() sees this thread leave.
+_Use_decl_annotations_ static ULONG64 HcpLeave(ULONG64 return_value) {
+  ShLeaveHookHandler();
+  return return_value;
+}
+
+#endif
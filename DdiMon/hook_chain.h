@@ -0,0 +1,66 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to hook chain functions.
+///
+/// A hook chain lets more than one consumer observe calls to a hooked function
+/// with pre- and post-call callbacks in priority order. A thunk generated when
+/// the chain is created is used as a handler of ShadowHookTarget. It saves
+/// arguments and calls the callbacks and the original function in sequence.
+/// Only integer and pointer arguments, up to kHcMaxArguments, are supported.
+/// A chain is created with the number of arguments the function takes, and
+/// forwards only those to the original function.
+
+#ifndef DDIMON_HOOK_CHAIN_H_
+#define DDIMON_HOOK_CHAIN_H_
+
+#include <fltKernel.h>
+#include "hook_chain_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct HcChain;
+struct LrLatencies;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) HcChain* HcCreateChain(
+    _In_reads_(callback_count) const HcCallback* callbacks,
+    _In_ ULONG callback_count, _In_ void* const* original_call,
+    _In_ ULONG argument_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void HcDeleteChain(_In_ HcChain* chain);
+
+void* HcGetThunk(_In_ const HcChain* chain);
+
+const LrLatencies* HcGetLatencies(_In_ const HcChain* chain);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HOOK_CHAIN_H_
@@ -0,0 +1,136 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements types and functions shared by hook chains and their thunks.
+
+#include "hook_chain_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Inserts a callback in priority order, keeping given order for ties. There
+// must be room for it.
+_Use_decl_annotations_ void HccInsertCallback(HcCallback* callbacks,
+                                              ULONG* callback_count,
+                                              const HcCallback& callback) {
+  auto i = *callback_count;
+  for (; i > 0 && callbacks[i - 1].priority > callback.priority; --i) {
+    callbacks[i] = callbacks[i - 1];
+  }
+  callbacks[i] = callback;
+  (*callback_count)++;
+}
+
+// Prepares a context saved by a thunk and calls pre-call callbacks in order.
+// The thunk saves kHcMaxArguments arguments. Those beyond the count are
+// whatever the caller had on its stack, and are not passed on.
+_Use_decl_annotations_ void HccCallPreCallbacks(const HcCallback* callbacks,
+                                                ULONG callback_count,
+                                                ULONG argument_count,
+                                                HcCallContext* call_context) {
+  call_context->return_value = 0;
+  call_context->skip_original = false;
+  for (auto i = argument_count; i < kHcMaxArguments; ++i) {
+    call_context->arguments[i] = 0;
+  }
+
+  for (auto i = 0ul; i < callback_count; ++i) {
+    if (callbacks[i].pre_call) {
+      callbacks[i].pre_call(call_context, callbacks[i].context);
+    }
+  }
+}
+
+// Calls post-call callbacks in reverse order
+_Use_decl_annotations_ void HccCallPostCallbacks(const HcCallback* callbacks,
+                                                 ULONG callback_count,
+                                                 HcCallContext* call_context) {
+  for (auto i = callback_count; i > 0; --i) {
+    if (callbacks[i - 1].post_call) {
+      callbacks[i - 1].post_call(call_context, callbacks[i - 1].context);
+    }
+  }
+}
+
+#if defined(_AMD64_)
+
+// Generates a thunk calling dispatch(chain, call_context) and jumping to
+// leave(return_value). dispatch and leave use the x64 calling convention.
+_Use_decl_annotations_ void HccBuildThunk(HccThunkCode* code,
+                                          const void* chain, void* dispatch,
+                                          void* leave) {
+  // Stack layout after sub rsp, 0x78:
+  //   rsp+0x00 - 0x1f: home space for dispatch()
+  //   rsp+0x20 - 0x77: HcCallContext
+  //   rsp+0x78       : a return address
+  //   rsp+0xa0 -     : stack arguments (the 5th and later)
+  *code = {
+      {
+          0x48, 0x83, 0xec, 0x78,                          // sub rsp, 78h
+          0x48, 0x89, 0x4c, 0x24, 0x20,                    // mov [rsp+20h], rcx
+          0x48, 0x89, 0x54, 0x24, 0x28,                    // mov [rsp+28h], rdx
+          0x4c, 0x89, 0x44, 0x24, 0x30,                    // mov [rsp+30h], r8
+          0x4c, 0x89, 0x4c, 0x24, 0x38,                    // mov [rsp+38h], r9
+          0x48, 0x8b, 0x84, 0x24, 0xa0, 0x00, 0x00, 0x00,  // mov rax, [rsp+0a0h]
+          0x48, 0x89, 0x44, 0x24, 0x40,                    // mov [rsp+40h], rax
+          0x48, 0x8b, 0x84, 0x24, 0xa8, 0x00, 0x00, 0x00,  // mov rax, [rsp+0a8h]
+          0x48, 0x89, 0x44, 0x24, 0x48,                    // mov [rsp+48h], rax
+          0x48, 0x8b, 0x84, 0x24, 0xb0, 0x00, 0x00, 0x00,  // mov rax, [rsp+0b0h]
+          0x48, 0x89, 0x44, 0x24, 0x50,                    // mov [rsp+50h], rax
+          0x48, 0x8b, 0x84, 0x24, 0xb8, 0x00, 0x00, 0x00,  // mov rax, [rsp+0b8h]
+          0x48, 0x89, 0x44, 0x24, 0x58,                    // mov [rsp+58h], rax
+          0x48, 0x8b, 0x44, 0x24, 0x78,                    // mov rax, [rsp+78h]
+          0x48, 0x89, 0x44, 0x24, 0x68,                    // mov [rsp+68h], rax
+      },
+      {
+          0x48, 0xb9,  // mov rcx, chain
+      },
+      chain,
+      {
+          0x48, 0x8d, 0x54, 0x24, 0x20,  // lea rdx, [rsp+20h]
+          0x48, 0xb8,                    // mov rax, dispatch
+      },
+      dispatch,
+      {
+          0xff, 0xd0,              // call rax
+          0x48, 0x83, 0xc4, 0x78,  // add rsp, 78h
+          0x48, 0x89, 0xc1,        // mov rcx, rax
+          0x48, 0xb8,              // mov rax, leave
+      },
+      leave,
+      {
+          0xff, 0xe0,  // jmp rax
+      },
+  };
+}
+
+#endif
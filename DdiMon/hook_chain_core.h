@@ -0,0 +1,115 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares types and functions shared by hook chains and their thunks.
+///
+/// A thunk saves arguments and a return address of a call into HcCallContext
+/// on the stack, calls a dispatcher with the chain and the context using the
+/// x64 calling convention, and jumps to a leave function with the result,
+/// which returns it to the caller. The dispatcher runs callbacks with
+/// HccCallPreCallbacks() and HccCallPostCallbacks() around the original
+/// function. Functions here depend only on platform.h.
+
+#ifndef DDIMON_HOOK_CHAIN_CORE_H_
+#define DDIMON_HOOK_CHAIN_CORE_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kHcMaxArguments = 8;
+static const ULONG kHcMaxCallbacks = 8;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Arguments and a result of a call observed by callbacks. The layout is
+// referenced by the generated thunk and must not be changed.
+struct HcCallContext {
+  ULONG64 arguments[kHcMaxArguments];  // rcx, rdx, r8, r9 and stack
+                                       // arguments. Zero beyond the
+                                       // argument count of the chain.
+  ULONG64 return_value;  // Valid in post-call callbacks, or set with skip
+  void* return_address;  // An address the hooked function returns to
+  bool skip_original;    // Set by a pre-call callback not to call an original
+};
+static_assert(sizeof(void*) != 8 || sizeof(HcCallContext) == 0x58,
+              "Size check");
+
+// A type of pre- and post-call callbacks
+using HcCallbackType = void (*)(_Inout_ HcCallContext* call_context,
+                                _In_opt_ void* context);
+
+// A consumer attached to a chain. Callbacks with lower priority run first for
+// pre-call and last for post-call. Either callback may be nullptr.
+struct HcCallback {
+  ULONG priority;
+  HcCallbackType pre_call;
+  HcCallbackType post_call;
+  void* context;
+};
+
+#if defined(_AMD64_)
+
+// A code generated for each chain. See HccBuildThunk().
+#pragma pack(push, 1)
+struct HccThunkCode {
+  UCHAR save_arguments[86];
+  UCHAR mov_rcx[2];
+  const void* chain;
+  UCHAR lea_rdx_mov_rax[7];
+  void* dispatch;
+  UCHAR call_and_mov_rax[11];
+  void* leave;
+  UCHAR jmp_rax[2];
+};
+static_assert(sizeof(HccThunkCode) == 132, "Size check");
+#pragma pack(pop)
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void HccInsertCallback(_Inout_updates_(kHcMaxCallbacks) HcCallback* callbacks,
+                       _Inout_ ULONG* callback_count,
+                       _In_ const HcCallback& callback);
+
+void HccCallPreCallbacks(_In_reads_(callback_count) const HcCallback* callbacks,
+                         _In_ ULONG callback_count, _In_ ULONG argument_count,
+                         _Inout_ HcCallContext* call_context);
+
+void HccCallPostCallbacks(
+    _In_reads_(callback_count) const HcCallback* callbacks,
+    _In_ ULONG callback_count, _Inout_ HcCallContext* call_context);
+
+#if defined(_AMD64_)
+void HccBuildThunk(_Out_ HccThunkCode* code, _In_ const void* chain,
+                   _In_ void* dispatch, _In_ void* leave);
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_HOOK_CHAIN_CORE_H_
@@ -0,0 +1,142 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to record and query latency histograms.
+
+#include "latency_histogram.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG LhpGetBucketIndex(_In_ ULONG64 value);
+
+static ULONG64 LhpGetBucketMiddle(_In_ ULONG index);
+
+static ULONG LhpFindHighestBit(_In_ ULONG64 value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Counts the value. The histogram is not protected from concurrent updates.
+_Use_decl_annotations_ void LhRecord(LhHistogram* histogram, ULONG64 value) {
+  histogram->buckets[LhpGetBucketIndex(value)]++;
+  histogram->count++;
+  if (value > histogram->max_value) {
+    histogram->max_value = value;
+  }
+}
+
+// Adds counts of source to the histogram
+_Use_decl_annotations_ void LhMerge(LhHistogram* histogram,
+                                    const LhHistogram& source) {
+  for (auto i = 0ul; i < kLhBucketCount; ++i) {
+    histogram->buckets[i] += source.buckets[i];
+  }
+  histogram->count += source.count;
+  if (source.max_value > histogram->max_value) {
+    histogram->max_value = source.max_value;
+  }
+}
+
+// Returns a value that permille / 1000 of counted values are at or below, for
+// example, 990 for p99. Returns 0 for an empty histogram.
+_Use_decl_annotations_ ULONG64 LhValueAtPermille(const LhHistogram& histogram,
+                                                 ULONG permille) {
+  if (!histogram.count) {
+    return 0;
+  }
+
+  auto rank = (histogram.count * permille + 999) / 1000;
+  if (!rank) {
+    rank = 1;
+  }
+  ULONG64 seen = 0;
+  for (auto i = 0ul; i < kLhBucketCount - 1; ++i) {
+    seen += histogram.buckets[i];
+    if (seen >= rank) {
+      const auto value = LhpGetBucketMiddle(i);
+      return (value < histogram.max_value) ? value : histogram.max_value;
+    }
+  }
+  // The last bucket has no upper bound
+  return histogram.max_value;
+}
+
+// Returns an index of a bucket counting the value
+_Use_decl_annotations_ static ULONG LhpGetBucketIndex(ULONG64 value) {
+  if (value < kLhSubBucketCount) {
+    return static_cast<ULONG>(value);
+  }
+  if (value >> kLhMaxValueBits) {
+    return kLhBucketCount - 1;
+  }
+
+  // Keep the highest kLhSubBucketBits + 1 bits; the top one selects the range
+  const auto exponent = LhpFindHighestBit(value);
+  const auto shift = exponent - kLhSubBucketBits;
+  const auto sub_bucket =
+      static_cast<ULONG>(value >> shift) - kLhSubBucketCount;
+  return kLhSubBucketCount * (shift + 1) + sub_bucket;
+}
+
+// Returns the middle of values counted in the bucket, reversing
+// LhpGetBucketIndex()
+_Use_decl_annotations_ static ULONG64 LhpGetBucketMiddle(ULONG index) {
+  if (index < kLhSubBucketCount) {
+    return index;
+  }
+
+  const auto shift = index / kLhSubBucketCount - 1;
+  const auto sub_bucket = index % kLhSubBucketCount;
+  const auto lowest = static_cast<ULONG64>(kLhSubBucketCount + sub_bucket)
+                      << shift;
+  return lowest + ((1ull << shift) >> 1);
+}
+
+// Returns an index of the highest set bit of a non-zero value
+_Use_decl_annotations_ static ULONG LhpFindHighestBit(ULONG64 value) {
+#if defined(_MSC_VER) && defined(_AMD64_)
+  unsigned long index = 0;
+  _BitScanReverse64(&index, value);
+  return index;
+#elif defined(_MSC_VER)
+  // _BitScanReverse64() is only available on x64
+  unsigned long index = 0;
+  if (_BitScanReverse(&index, static_cast<unsigned long>(value >> 32))) {
+    return index + 32;
+  }
+  _BitScanReverse(&index, static_cast<unsigned long>(value));
+  return index;
+#else
+  return 63 - static_cast<ULONG>(__builtin_clzll(value));
+#endif
+}
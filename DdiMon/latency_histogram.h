@@ -0,0 +1,74 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares a latency histogram and functions to record and query it.
+///
+/// A latency histogram counts values in log-linear buckets as HdrHistogram
+/// does: values below kLhSubBucketCount have their own buckets, and each
+/// larger power of two range is split into kLhSubBucketCount buckets of equal
+/// width. A value reported for a percentile is the middle of its bucket, which
+/// is within 1 / (2 * kLhSubBucketCount) of any value counted in the bucket.
+/// Recording never allocates and histograms are merged by adding buckets, so
+/// one can be kept for each processor and merged when queried. Functions here
+/// depend only on platform.h.
+
+#ifndef DDIMON_LATENCY_HISTOGRAM_H_
+#define DDIMON_LATENCY_HISTOGRAM_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kLhSubBucketBits = 4;
+static const ULONG kLhSubBucketCount = 1ul << kLhSubBucketBits;
+
+// Values at or above 2^kLhMaxValueBits are counted in the last bucket
+static const ULONG kLhMaxValueBits = 32;
+
+static const ULONG kLhBucketCount =
+    kLhSubBucketCount * (kLhMaxValueBits - kLhSubBucketBits + 1);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct LhHistogram {
+  ULONG64 count;
+  ULONG64 max_value;
+  ULONG64 buckets[kLhBucketCount];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void LhRecord(_Inout_ LhHistogram* histogram, _In_ ULONG64 value);
+
+void LhMerge(_Inout_ LhHistogram* histogram, _In_ const LhHistogram& source);
+
+ULONG64 LhValueAtPermille(_In_ const LhHistogram& histogram,
+                          _In_ ULONG permille);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_LATENCY_HISTOGRAM_H_
@@ -0,0 +1,129 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements latency recorder functions.
+
+#include "latency_recorder.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Histograms updated only by a single processor. Aligned so that processors
+// do not share cache lines.
+struct DECLSPEC_CACHEALIGN LrpProcessor {
+  LhHistogram handler;
+  LhHistogram original;
+};
+
+struct LrLatencies {
+  ULONG processor_count;
+  LrpProcessor* processors;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, LrCreateLatencies)
+#pragma alloc_text(PAGE, LrDeleteLatencies)
+#pragma alloc_text(PAGE, LrMerge)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates empty histograms for all processors
+_Use_decl_annotations_ LrLatencies* LrCreateLatencies() {
+  PAGED_CODE();
+
+  const auto latencies = reinterpret_cast<LrLatencies*>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(LrLatencies), kHyperPlatformCommonPoolTag));
+  if (!latencies) {
+    return nullptr;
+  }
+
+  latencies->processor_count =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto processors_size =
+      sizeof(LrpProcessor) * latencies->processor_count;
+  latencies->processors = reinterpret_cast<LrpProcessor*>(
+      ExAllocatePoolWithTag(NonPagedPoolCacheAligned, processors_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!latencies->processors) {
+    ExFreePoolWithTag(latencies, kHyperPlatformCommonPoolTag);
+    return nullptr;
+  }
+  RtlZeroMemory(latencies->processors, processors_size);
+  return latencies;
+}
+
+// Frees histograms. No hook handler may be recording into them.
+_Use_decl_annotations_ void LrDeleteLatencies(LrLatencies* latencies) {
+  PAGED_CODE();
+
+  ExFreePoolWithTag(latencies->processors, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(latencies, kHyperPlatformCommonPoolTag);
+}
+
+// Records a call into histograms of the current processor. original_cycles is
+// ignored unless called_original is true. Calls above DISPATCH_LEVEL are not
+// recorded since they may interrupt recording on the same processor.
+_Use_decl_annotations_ void LrRecord(LrLatencies* latencies,
+                                     ULONG64 handler_cycles,
+                                     ULONG64 original_cycles,
+                                     bool called_original) {
+  if (KeGetCurrentIrql() > DISPATCH_LEVEL) {
+    return;
+  }
+
+  KIRQL old_irql = 0;
+  KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index < latencies->processor_count) {
+    auto& processor = latencies->processors[index];
+    LhRecord(&processor.handler, handler_cycles);
+    if (called_original) {
+      LhRecord(&processor.original, original_cycles);
+    }
+  }
+  KeLowerIrql(old_irql);
+}
+
+// Sums histograms of all processors. Calls being recorded concurrently may or
+// may not be included.
+_Use_decl_annotations_ void LrMerge(const LrLatencies* latencies,
+                                    LhHistogram* handler,
+                                    LhHistogram* original) {
+  PAGED_CODE();
+
+  RtlZeroMemory(handler, sizeof(*handler));
+  RtlZeroMemory(original, sizeof(*original));
+  for (auto i = 0ul; i < latencies->processor_count; ++i) {
+    LhMerge(handler, latencies->processors[i].handler);
+    LhMerge(original, latencies->processors[i].original);
+  }
+}
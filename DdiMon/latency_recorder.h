@@ -0,0 +1,66 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to latency recorder functions.
+///
+/// A latency recorder keeps a pair of latency histograms for a hook on each
+/// processor: TSC cycles spent in a hook handler excluding the original
+/// function, and cycles spent in the original function. Each processor only
+/// updates its own histograms, so recording takes no locks and no
+/// interlocked operations. Histograms are merged when queried.
+
+#ifndef DDIMON_LATENCY_RECORDER_H_
+#define DDIMON_LATENCY_RECORDER_H_
+
+#include <fltKernel.h>
+#include "latency_histogram.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct LrLatencies;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) LrLatencies* LrCreateLatencies();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void LrDeleteLatencies(
+    _In_ LrLatencies* latencies);
+
+_IRQL_requires_max_(HIGH_LEVEL) void LrRecord(_In_ LrLatencies* latencies,
+                                              _In_ ULONG64 handler_cycles,
+                                              _In_ ULONG64 original_cycles,
+                                              _In_ bool called_original);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void LrMerge(
+    _In_ const LrLatencies* latencies, _Out_ LhHistogram* handler,
+    _Out_ LhHistogram* original);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_LATENCY_RECORDER_H_
@@ -0,0 +1,99 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares types used by platform independent code.
+///
+/// Code that includes only this header can be compiled both into the driver
+/// and into a user-mode program on any host, for example, to measure or
+/// check its logic without VT-x. Inside the driver, it is just <fltKernel.h>.
+
+#ifndef DDIMON_PLATFORM_H_
+#define DDIMON_PLATFORM_H_
+
+#if defined(_KERNEL_MODE)
+#include <fltKernel.h>
+#else
+#include <cstddef>
+#include <cstdint>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+#if !defined(_KERNEL_MODE)
+
+#if !defined(_AMD64_) && (defined(_M_X64) || defined(__x86_64__))
+#define _AMD64_
+#endif
+
+#if !defined(_In_)
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Out_
+#define _In_reads_(size)
+#define _Inout_updates_(size)
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_(size)
+#define _Inout_updates_bytes_(size)
+#define _Use_decl_annotations_
+#endif
+
+#if !defined(PAGE_SHIFT)
+#define PAGE_SHIFT 12
+#endif
+
+#endif  // !defined(_KERNEL_MODE)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#if !defined(_KERNEL_MODE) && !defined(_WINDEF_)
+
+using UCHAR = std::uint8_t;
+using USHORT = std::uint16_t;
+using ULONG = std::uint32_t;
+using LONG = std::int32_t;
+using ULONG64 = std::uint64_t;
+using ULONG_PTR = std::uintptr_t;
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a magic number of a file format whose bytes are laid out in memory
+// in the order given. Unlike a multi-character literal, its value does not
+// depend on the compiler.
+constexpr ULONG DdimonMakeTag(char c0, char c1, char c2, char c3) {
+  return static_cast<ULONG>(static_cast<UCHAR>(c0)) |
+         static_cast<ULONG>(static_cast<UCHAR>(c1)) << 8 |
+         static_cast<ULONG>(static_cast<UCHAR>(c2)) << 16 |
+         static_cast<ULONG>(static_cast<UCHAR>(c3)) << 24;
+}
+
+#endif  // DDIMON_PLATFORM_H_
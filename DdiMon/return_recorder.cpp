@@ -0,0 +1,177 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements return recorder functions.
+
+#include "return_recorder.h"
+#include "return_recorder_core.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static void RrpPreCall(_Inout_ HcCallContext* call_context,
+                       _In_opt_ void* context);
+
+static void RrpPostCall(_Inout_ HcCallContext* call_context,
+                        _In_opt_ void* context);
+
+static void RrpCountAbandoned(_In_ const RrcFrame* frames, _In_ ULONG count);
+
+static void RrpThreadNotifyRoutine(_In_ HANDLE process_id,
+                                   _In_ HANDLE thread_id, _In_ BOOLEAN create);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, RrInitialization)
+#pragma alloc_text(PAGE, RrTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static RrcSlot* g_rrp_slots;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Preallocates slots of shadow return stacks, and registers a routine to
+// free a slot of a thread that exits in recorded calls
+_Use_decl_annotations_ NTSTATUS RrInitialization() {
+  PAGED_CODE();
+
+  const auto slots_size = sizeof(RrcSlot) * kRrcSlotCount;
+  const auto slots = reinterpret_cast<RrcSlot*>(ExAllocatePoolWithTag(
+      NonPagedPool, slots_size, kHyperPlatformCommonPoolTag));
+  if (!slots) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(slots, slots_size);
+  g_rrp_slots = slots;
+
+  const auto status = PsSetCreateThreadNotifyRoutine(RrpThreadNotifyRoutine);
+  if (!NT_SUCCESS(status)) {
+    g_rrp_slots = nullptr;
+    ExFreePoolWithTag(slots, kHyperPlatformCommonPoolTag);
+  }
+  return status;
+}
+
+// Frees slots. No recorded call may be in progress.
+_Use_decl_annotations_ void RrTermination() {
+  PAGED_CODE();
+
+  if (g_rrp_slots) {
+    PsRemoveCreateThreadNotifyRoutine(RrpThreadNotifyRoutine);
+    ExFreePoolWithTag(g_rrp_slots, kHyperPlatformCommonPoolTag);
+    g_rrp_slots = nullptr;
+  }
+}
+
+// Returns a consumer recording calls into statistics. It has the highest
+// priority value so that only the original function is measured.
+_Use_decl_annotations_ HcCallback RrMakeCallback(RrStatistics* statistics) {
+  return {MAXULONG, RrpPreCall, RrpPostCall, statistics};
+}
+
+// Pushes the start of a call onto the shadow return stack of the thread. The
+// call context lives on the stack of the thread for the duration of the
+// call, so it identifies the call to RrpPostCall().
+_Use_decl_annotations_ static void RrpPreCall(HcCallContext* call_context,
+                                              void* context) {
+  const auto statistics = reinterpret_cast<RrStatistics*>(context);
+  const auto slot =
+      g_rrp_slots ? RrcFindSlot(g_rrp_slots, PsGetCurrentThread(), true)
+                  : nullptr;
+  if (!slot || !RrcPushFrame(slot, {call_context, statistics, __rdtsc()})) {
+    InterlockedIncrement64(&statistics->dropped_count);
+  }
+}
+
+// Pops the call from the shadow return stack and records its result
+_Use_decl_annotations_ static void RrpPostCall(HcCallContext* call_context,
+                                               void* context) {
+  const auto end_tsc = __rdtsc();
+  const auto statistics = reinterpret_cast<RrStatistics*>(context);
+  const auto slot =
+      g_rrp_slots ? RrcFindSlot(g_rrp_slots, PsGetCurrentThread(), false)
+                  : nullptr;
+
+  // The call was dropped by RrpPreCall()
+  RrcFrame frame = {};
+  ULONG abandoned_count = 0;
+  if (!slot || !RrcPopFrame(slot, call_context, &frame, &abandoned_count)) {
+    return;
+  }
+
+  RrpCountAbandoned(&slot->frames[slot->depth + 1], abandoned_count);
+  if (!slot->depth) {
+    RrcReleaseSlot(slot);
+  }
+
+  const auto cycles = static_cast<LONG64>(end_tsc - frame.start_tsc);
+  InterlockedIncrement64(&statistics->call_count);
+  InterlockedAdd64(&statistics->total_cycles, cycles);
+  InterlockedExchange64(&statistics->last_return_value,
+                        static_cast<LONG64>(call_context->return_value));
+  for (auto max_cycles = statistics->max_cycles; cycles > max_cycles;) {
+    const auto old_value = InterlockedCompareExchange64(
+        &statistics->max_cycles, cycles, max_cycles);
+    if (old_value == max_cycles) {
+      break;
+    }
+    max_cycles = old_value;
+  }
+}
+
+// Counts calls that never returned through the hook as dropped
+_Use_decl_annotations_ static void RrpCountAbandoned(const RrcFrame* frames,
+                                                     ULONG count) {
+  for (auto i = 0ul; i < count; ++i) {
+    const auto statistics = reinterpret_cast<RrStatistics*>(frames[i].context);
+    InterlockedIncrement64(&statistics->dropped_count);
+  }
+}
+
+// Frees a slot of an exiting thread that is still in recorded calls, such as
+// one that called PsTerminateSystemThread() from a hooked function. This is
+// called in the context of the exiting thread, so it still owns the slot.
+_Use_decl_annotations_ static void RrpThreadNotifyRoutine(HANDLE process_id,
+                                                          HANDLE thread_id,
+                                                          BOOLEAN create) {
+  UNREFERENCED_PARAMETER(process_id);
+  UNREFERENCED_PARAMETER(thread_id);
+
+  if (create) {
+    return;
+  }
+  const auto slot = RrcFindSlot(g_rrp_slots, PsGetCurrentThread(), false);
+  if (!slot) {
+    return;
+  }
+  RrpCountAbandoned(slot->frames, slot->depth);
+  RrcReleaseSlot(slot);
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to return recorder functions.
+///
+/// A return recorder is a consumer of a hook chain that records return values
+/// and durations of calls to any hooked function, so that no hand-written
+/// handler is required. The start of each call is kept on a per-thread shadow
+/// return stack taken from slots preallocated in non-paged pool. See
+/// return_recorder_core.h.
+
+#ifndef DDIMON_RETURN_RECORDER_H_
+#define DDIMON_RETURN_RECORDER_H_
+
+#include <fltKernel.h>
+#include "hook_chain.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Results recorded for a single hook
+struct RrStatistics {
+  volatile LONG64 call_count;
+  volatile LONG64 total_cycles;  // TSC cycles spent in the original function
+  volatile LONG64 max_cycles;
+  volatile LONG64 last_return_value;
+  // Calls not recorded due to lack of slots, or that never returned through
+  // the hook
+  volatile LONG64 dropped_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS RrInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void RrTermination();
+
+HcCallback RrMakeCallback(_In_ RrStatistics* statistics);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_RETURN_RECORDER_H_
@@ -0,0 +1,142 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements shadow return stacks of return recorders.
+
+#include "return_recorder_core.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static void* RrcpCompareExchangePointer(_Inout_ void* volatile* value,
+                                        _In_opt_ void* new_value,
+                                        _In_opt_ void* comparand);
+
+static void RrcpStoreRelease(_Inout_ void* volatile* value,
+                             _In_opt_ void* new_value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Finds a slot owned by the thread, or claims a free one when claim is true.
+// A thread only claims a slot when it does not own any within the probed
+// range, so that it never owns two slots.
+_Use_decl_annotations_ RrcSlot* RrcFindSlot(RrcSlot* slots, void* owner,
+                                            bool claim) {
+  const auto start =
+      static_cast<ULONG>(reinterpret_cast<ULONG_PTR>(owner) >> 4);
+  for (auto i = 0ul; i < kRrcMaxProbes; ++i) {
+    const auto slot = &slots[(start + i) % kRrcSlotCount];
+    if (slot->owner == owner) {
+      return slot;
+    }
+  }
+  if (!claim) {
+    return nullptr;
+  }
+
+  for (auto i = 0ul; i < kRrcMaxProbes; ++i) {
+    const auto slot = &slots[(start + i) % kRrcSlotCount];
+    if (!slot->owner &&
+        !RrcpCompareExchangePointer(&slot->owner, owner, nullptr)) {
+      return slot;
+    }
+  }
+  return nullptr;
+}
+
+// Pushes the start of a call, or returns false when the stack is full
+_Use_decl_annotations_ bool RrcPushFrame(RrcSlot* slot,
+                                         const RrcFrame& frame) {
+  if (slot->depth == kRrcMaxDepth) {
+    return false;
+  }
+  slot->frames[slot->depth] = frame;
+  slot->depth++;
+  return true;
+}
+
+// Pops the call of the token, or returns false when it was never pushed.
+// Frames above it are of calls that left without returning through the hook,
+// such as by an exception, and are popped together. They are counted in
+// abandoned_count and remain readable at frames[depth + 1] and above until
+// the next push.
+_Use_decl_annotations_ bool RrcPopFrame(RrcSlot* slot, const void* token,
+                                        RrcFrame* frame,
+                                        ULONG* abandoned_count) {
+  *abandoned_count = 0;
+  for (auto index = slot->depth; index > 0; --index) {
+    if (slot->frames[index - 1].token != token) {
+      continue;
+    }
+    *frame = slot->frames[index - 1];
+    *abandoned_count = slot->depth - index;
+    slot->depth = index - 1;
+    return true;
+  }
+  return false;
+}
+
+// Frees the slot for other threads, discarding any frames left in it. Called
+// by the owner once its depth is 0, or on behalf of an owner that exited.
+_Use_decl_annotations_ void RrcReleaseSlot(RrcSlot* slot) {
+  slot->depth = 0;
+  RrcpStoreRelease(&slot->owner, nullptr);
+}
+
+#if defined(_MSC_VER)
+
+_Use_decl_annotations_ static void* RrcpCompareExchangePointer(
+    void* volatile* value, void* new_value, void* comparand) {
+  return _InterlockedCompareExchangePointer(value, new_value, comparand);
+}
+
+_Use_decl_annotations_ static void RrcpStoreRelease(void* volatile* value,
+                                                    void* new_value) {
+  _InterlockedExchangePointer(value, new_value);
+}
+
+#else
+
+_Use_decl_annotations_ static void* RrcpCompareExchangePointer(
+    void* volatile* value, void* new_value, void* comparand) {
+  __atomic_compare_exchange_n(value, &comparand, new_value, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return comparand;
+}
+
+_Use_decl_annotations_ static void RrcpStoreRelease(void* volatile* value,
+                                                    void* new_value) {
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,83 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares shadow return stacks of return recorders.
+///
+/// A thread in recorded calls owns a slot taken from a fixed table and keeps
+/// the start of each call in it until the call returns. A call is identified
+/// by a token unique among calls in progress on the thread, such as its
+/// HcCallContext, so that a return is never paired with another call even
+/// when inner calls were dropped or never returned through the hook.
+/// Functions here depend only on platform.h.
+
+#ifndef DDIMON_RETURN_RECORDER_CORE_H_
+#define DDIMON_RETURN_RECORDER_CORE_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of threads that can be in recorded calls at the same time
+static const ULONG kRrcSlotCount = 256;
+
+// Number of nested recorded calls kept for a single thread
+static const ULONG kRrcMaxDepth = 16;
+
+// Number of slots examined to find or claim a slot for a thread
+static const ULONG kRrcMaxProbes = 8;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A recorded call that has not returned yet
+struct RrcFrame {
+  const void* token;  // Identifies the call among calls of the thread
+  void* context;      // Given by the caller, such as RrStatistics
+  ULONG64 start_tsc;
+};
+
+// A shadow return stack owned by a thread while it is in recorded calls
+struct RrcSlot {
+  void* volatile owner;  // nullptr when the slot is free
+  ULONG depth;
+  RrcFrame frames[kRrcMaxDepth];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+RrcSlot* RrcFindSlot(_Inout_ RrcSlot* slots, _In_ void* owner,
+                     _In_ bool claim);
+
+bool RrcPushFrame(_Inout_ RrcSlot* slot, _In_ const RrcFrame& frame);
+
+bool RrcPopFrame(_Inout_ RrcSlot* slot, _In_ const void* token,
+                 _Out_ RrcFrame* frame, _Out_ ULONG* abandoned_count);
+
+void RrcReleaseSlot(_Inout_ RrcSlot* slot);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_RETURN_RECORDER_CORE_H_
@@ -0,0 +1,237 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to test and remember keys with a seen filter.
+
+#include "seen_filter.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Odd multipliers selecting a bit in each word of a block from a hash, as in
+// split block Bloom filters of Apache Parquet
+static const ULONG kSfpSalts[kSfWordsPerBlock] = {
+    0x47b6137bul, 0x44974d91ul, 0x8824ad5bul, 0xa2b7289dul,
+    0x705495c7ul, 0x2df1424bul, 0x9efc4947ul, 0x5c6bfb31ul,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG64 SfpHash(_In_ ULONG64 key);
+
+static ULONG64 SfpMask(_In_ ULONG64 hash, _In_ ULONG word);
+
+static bool SfpTest(_In_ const SfBlock& block, _In_ ULONG64 hash);
+
+static bool SfpSet(_Inout_ SfBlock* block, _In_ ULONG64 hash);
+
+static void SfpAge(_Inout_ SfFilter* filter, _In_ ULONG64 now);
+
+static ULONG64 SfpOr64(_Inout_ volatile ULONG64* value, _In_ ULONG64 mask);
+
+static LONG SfpIncrement(_Inout_ volatile LONG* value);
+
+static LONG SfpCompareExchange(_Inout_ volatile LONG* value,
+                               _In_ LONG new_value, _In_ LONG comparand);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes an empty filter aged every period. now is in any unit that
+// increases monotonically, such as interrupt time.
+_Use_decl_annotations_ void SfInitialize(SfFilter* filter, ULONG64 period,
+                                         ULONG64 now) {
+  filter->period = period;
+  filter->generation_start = now;
+  filter->current = 0;
+  filter->rotating = 0;
+  filter->inserted_count = 0;
+  for (auto& generation : filter->generations) {
+    for (auto& block : generation) {
+      for (auto& word : block.words) {
+        word = 0;
+      }
+    }
+  }
+}
+
+// Remembers the key and returns whether it had been seen. Safe to call from
+// any number of threads at once. The same key tested by two threads at once
+// may be reported unseen to both.
+_Use_decl_annotations_ bool SfTestAndSet(SfFilter* filter, ULONG64 key,
+                                         ULONG64 now) {
+  if (now - filter->generation_start >= filter->period) {
+    SfpAge(filter, now);
+  }
+
+  const auto hash = SfpHash(key);
+  const auto index = static_cast<ULONG>(hash >> (64 - kSfBlockShift));
+  const auto current = filter->current;
+  const auto seen = SfpSet(&filter->generations[current][index], hash);
+  if (seen) {
+    return true;
+  }
+
+  // The key is kept in the current generation even when it was seen in the
+  // older one, so that a key seen continuously is never forgotten
+  const auto seen_before =
+      SfpTest(filter->generations[1 - current][index], hash);
+  if (SfpIncrement(&filter->inserted_count) >=
+      static_cast<LONG>(kSfGenerationCapacity)) {
+    SfpAge(filter, now);
+  }
+  return seen_before;
+}
+
+// Returns whether the key has been seen without remembering it
+_Use_decl_annotations_ bool SfContains(const SfFilter* filter, ULONG64 key) {
+  const auto hash = SfpHash(key);
+  const auto index = static_cast<ULONG>(hash >> (64 - kSfBlockShift));
+  return SfpTest(filter->generations[0][index], hash) ||
+         SfpTest(filter->generations[1][index], hash);
+}
+
+// Mixes bits of the key as the finalizer of SplitMix64
+_Use_decl_annotations_ static ULONG64 SfpHash(ULONG64 key) {
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ull;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebull;
+  return key ^ (key >> 31);
+}
+
+// Returns a bit the hash sets in the word of a block. Uses the lower half of
+// the hash, while the upper half selects a block.
+_Use_decl_annotations_ static ULONG64 SfpMask(ULONG64 hash, ULONG word) {
+  const auto bit = (static_cast<ULONG>(hash) * kSfpSalts[word]) >> 26;
+  return 1ull << bit;
+}
+
+// Returns whether all bits of the hash are set in the block
+_Use_decl_annotations_ static bool SfpTest(const SfBlock& block,
+                                          ULONG64 hash) {
+  for (auto i = 0ul; i < kSfWordsPerBlock; ++i) {
+    const auto mask = SfpMask(hash, i);
+    if ((block.words[i] & mask) != mask) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sets bits of the hash in the block and returns whether all of them had
+// been set
+_Use_decl_annotations_ static bool SfpSet(SfBlock* block, ULONG64 hash) {
+  auto seen = true;
+  for (auto i = 0ul; i < kSfWordsPerBlock; ++i) {
+    const auto mask = SfpMask(hash, i);
+    if ((block->words[i] & mask) == mask) {
+      continue;  // Avoid writing a cache line shared by all processors
+    }
+    if ((SfpOr64(&block->words[i], mask) & mask) != mask) {
+      seen = false;
+    }
+  }
+  return seen;
+}
+
+// Clears the older generation and makes it the current one. Clears both when
+// no key has been tested for two periods. Only one caller ages the filter at
+// a time, and others return without waiting. Keys tested while a generation
+// is cleared may be reported unseen.
+//
+// A caller of SfTestAndSet() that read current before the previous aging may
+// still be setting bits in next while it is cleared here. Its key is then
+// left with some of its bits and reported unseen once more later. That only
+// duplicates a report of the key, which is accepted so that testers never
+// wait for aging.
+_Use_decl_annotations_ static void SfpAge(SfFilter* filter, ULONG64 now) {
+  if (SfpCompareExchange(&filter->rotating, 1, 0) != 0) {
+    return;
+  }
+
+  const auto elapsed = now - filter->generation_start;
+  const auto idle =
+      elapsed >= filter->period && elapsed - filter->period >= filter->period;
+  const auto next = 1 - filter->current;
+  for (auto generation = 0; generation < 2; ++generation) {
+    if (generation != next && !idle) {
+      continue;
+    }
+    for (auto& block : filter->generations[generation]) {
+      for (auto& word : block.words) {
+        word = 0;
+      }
+    }
+  }
+  filter->inserted_count = 0;
+  filter->generation_start = now;
+  SfpCompareExchange(&filter->current, next, 1 - next);
+  SfpCompareExchange(&filter->rotating, 0, 1);
+}
+
+#if defined(_MSC_VER)
+
+_Use_decl_annotations_ static ULONG64 SfpOr64(volatile ULONG64* value,
+                                             ULONG64 mask) {
+  return static_cast<ULONG64>(
+      _InterlockedOr64(reinterpret_cast<volatile __int64*>(value),
+                       static_cast<__int64>(mask)));
+}
+
+_Use_decl_annotations_ static LONG SfpIncrement(volatile LONG* value) {
+  return _InterlockedIncrement(reinterpret_cast<volatile long*>(value));
+}
+
+_Use_decl_annotations_ static LONG SfpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  return _InterlockedCompareExchange(reinterpret_cast<volatile long*>(value),
+                                     new_value, comparand);
+}
+
+#else
+
+_Use_decl_annotations_ static ULONG64 SfpOr64(volatile ULONG64* value,
+                                             ULONG64 mask) {
+  return __atomic_fetch_or(value, mask, __ATOMIC_RELAXED);
+}
+
+_Use_decl_annotations_ static LONG SfpIncrement(volatile LONG* value) {
+  return __atomic_add_fetch(value, 1, __ATOMIC_RELAXED);
+}
+
+_Use_decl_annotations_ static LONG SfpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  __atomic_compare_exchange_n(value, &comparand, new_value, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return comparand;
+}
+
+#endif
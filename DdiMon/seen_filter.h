@@ -0,0 +1,87 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares a seen filter and functions to test and remember keys.
+///
+/// A seen filter is a blocked Bloom filter that tells whether a 64-bit key
+/// has been seen, in fixed memory and without locks. A key sets one bit in
+/// each of kSfWordsPerBlock words of a single cache line, so a test costs one
+/// cache miss. It may answer that an unseen key has been seen at a rate that
+/// grows with the number of keys, but never the opposite, except for keys
+/// forgotten by aging.
+///
+/// Keys are remembered in two generations. A key is tested against both and
+/// set in the current one, and the older generation is cleared and becomes
+/// the current one once a period passed or the current one holds
+/// kSfGenerationCapacity keys. A key is thus forgotten after it has not been
+/// seen for one to two periods. Functions here depend only on platform.h.
+
+#ifndef DDIMON_SEEN_FILTER_H_
+#define DDIMON_SEEN_FILTER_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of blocks of a generation, as a power of 2
+static const ULONG kSfBlockShift = 9;
+static const ULONG kSfBlockCount = 1ul << kSfBlockShift;
+
+static const ULONG kSfWordsPerBlock = 8;
+
+// Keys a generation holds before it is aged, giving 16 bits for each key
+static const ULONG kSfGenerationCapacity =
+    kSfBlockCount * kSfWordsPerBlock * 64 / 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct SfBlock {
+  alignas(64) volatile ULONG64 words[kSfWordsPerBlock];
+};
+
+struct SfFilter {
+  ULONG64 period;  // In units of now given to SfTestAndSet()
+  volatile ULONG64 generation_start;
+  volatile LONG current;        // An index of the current generation
+  volatile LONG rotating;       // 1 while a generation is being aged
+  volatile LONG inserted_count;  // Keys newly set in the current generation
+  SfBlock generations[2][kSfBlockCount];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void SfInitialize(_Out_ SfFilter* filter, _In_ ULONG64 period,
+                  _In_ ULONG64 now);
+
+bool SfTestAndSet(_Inout_ SfFilter* filter, _In_ ULONG64 key,
+                  _In_ ULONG64 now);
+
+bool SfContains(_In_ const SfFilter* filter, _In_ ULONG64 key);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_SEEN_FILTER_H_
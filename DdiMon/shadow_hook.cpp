@@ -19,6 +19,8 @@
 #include <memory>
 #include <algorithm>
 #include "capstone.h"
+#include "shadow_hook_core.h"
+#include "command_ring.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -29,6 +31,45 @@
 //
 // constants and macros
 //
+
+// Set 1 to give each processor a second EPT hierarchy (the data view) that
+// maps shadowed pages to their read/write copies. EPT violation and MTF then
+// switch EPTP between views instead of editing an EPT entry and invalidating
+// EPT derived translations on each access.
+#if !defined(DDIMON_SH_USE_DUAL_EPT_VIEWS)
+#define DDIMON_SH_USE_DUAL_EPT_VIEWS 0
+#endif
+
+// Number of records of the exit trace kept for each processor
+static const ULONG kShpExitTraceRecordCount = 1024;
+
+// Number of exit counters in a chunk allocated for each processor, and the
+// number of chunks, which bounds hooks and pages that can be installed
+static const ULONG kShpExitCountersPerChunk = 256;
+static const ULONG kShpMaxExitCounterChunks = 256;
+
+// Interval to look for demoted pages whose demotion ended
+static const LONG kShpGovernorPeriodMs = 100;
+
+// Code every trampoline leaves through. It is placed in the code section of
+// the driver image rather than in pool, so that a thread preempted between
+// decrementing in_flight of a trampoline and returning never resumes in freed
+// memory, however late after trampolines and shared data are freed.
+#pragma section(".text")
+__declspec(allocate(".text")) static const ShcTrampolineExit
+  kShpTrampolineExit = ShcMakeTrampolineExit();
+
+// Kinds of operations carried by command rings
+enum ShpCommandKind : ULONG {
+  // Write EPT entries without invalidating EPT derived translations.
+  // arguments[0] points to ShpEptEdit owned by the batch, and arguments[1] is
+  // the number of them.
+  kShpCommandWriteEptEdits = 1,         // To the EPT used by the VMM
+  kShpCommandInvalidateEpt = 2,  // Invalidates EPT derived translations
+  kShpCommandPromotePages = 3,   // Promotes pages whose demotion ended
+  kShpCommandWriteDataViewEdits = 4,    // To the data view
+};
+
 enum HOOK_TYPE {
   FUNC_HOOK,
   MEM_HOOK,
@@ -48,6 +89,47 @@ struct Page {
   ~Page();
 };
 
+// VM-exit counts and TSC cycles spent in VMX-root mode to handle them, for a
+// hook or a page on a single processor, and a state of the exit governor for
+// a page of a memory monitor
+struct ShpExitCounter {
+  ULONG64 breakpoint_count;
+  ULONG64 breakpoint_cycles;
+  ULONG64 ept_violation_count;
+  ULONG64 ept_violation_cycles;
+  ULONG64 mtf_count;
+  ULONG64 mtf_cycles;
+  ULONG64 counted_count;  // Calls counted by a counting hook
+  ULONG64 demotion_count;
+  ULONG64 promotion_count;
+  ShcGovernorState governor;
+  UCHAR padding[SYSTEM_CACHE_ALIGNMENT_SIZE * 2 - sizeof(ULONG64) * 9 -
+                sizeof(ShcGovernorState)];
+};
+static_assert(sizeof(ShpExitCounter) == SYSTEM_CACHE_ALIGNMENT_SIZE * 2,
+              "Size check");
+
+// Per-processor VM-exit counters of a hook or a page. Each processor updates
+// only its own counter, kept in ShpProcessorData of the processor, and
+// ShQueryExitStatistics() sums them on demand.
+struct ShpExitCounters {
+  ULONG index;  // An index in exit_counter_chunks of ShpProcessorData
+  ShpExitCounters();
+  ~ShpExitCounters();
+  ShpExitCounters(const ShpExitCounters&) = delete;
+  ShpExitCounters& operator=(const ShpExitCounters&) = delete;
+};
+
+// Per-processor calls of a counting hook. Each processor updates only its own
+// histogram, and ShQueryCallers() merges them on demand.
+struct ShpCallerHistograms {
+  ShcCallerHistogram* histograms;  // One per processor
+  ShpCallerHistograms();
+  ~ShpCallerHistograms();
+  ShpCallerHistograms(const ShpCallerHistograms&) = delete;
+  ShpCallerHistograms& operator=(const ShpCallerHistograms&) = delete;
+};
+
 struct MemBPInformation {
   ULONG64 mem_address;
   ULONG64 mem_len;
@@ -60,6 +142,8 @@ struct MemBPInformation {
 struct MemHookInformation {
   void* va_base_page_hook;
   HOOK_TYPE hook_type;
+  bool enabled;  // false when the page is disabled by ShSetPageState()
+  ShpExitCounters exit_counters;  // EPT violation and MTF VM-exits
 };
 
 // Contains a single steal hook information
@@ -68,6 +152,23 @@ struct FunctionHookInformation {
   void* handler;        // An address of the handler routine
   ULONG64 patch_length;
   UCHAR* new_code;  //a pointer to the patch code
+  bool enabled;     // false when the hook is disabled by ShSetHookState()
+
+  // A trampoline code to call an original function, used for hits out of
+  // scope. nullptr for patches.
+  void* original_call;
+
+  // Processes the hook applies to, or nullptr for all processes. Replaced
+  // only by ShSetHookScope(), and pruned by ShRemoveFromHookScopes().
+  std::unique_ptr<ShcHookScope> scope;
+
+  // #BP VM-exits caused by the hook
+  ShpExitCounters exit_counters;
+
+  // Calls counted by return addresses by a counting hook, which has no
+  // handler, or nullptr. Other counting hooks only count calls in
+  // exit_counters so that thousands of them cost little memory.
+  std::unique_ptr<ShpCallerHistograms> callers;
 
   // A copy of a pages where patch_address belongs to. shadow_page_base_for_rw
   // is exposed to a guest for read and write operation against the page of
@@ -80,42 +181,218 @@ struct FunctionHookInformation {
   ULONG64 pa_base_for_exec;
 };
 
+// An EPT entry modification computed at PASSIVE_LEVEL and applied by each
+// processor in VMX-root mode, so that no per-page translation is needed there
+struct ShpEptEdit {
+  ULONG64 guest_pa;  // A guest physical address of a page to modify
+  PFN_NUMBER pfn;    // A page frame number the entry refers to
+  bool read_access;
+  bool write_access;
+};
+
+// A batch posted by ShpSubmitBatch() and EPT modifications it carries,
+// allocated at once by ShpAllocateBatch(). The batch owns a copy of the
+// modifications, since a batch left in a ring by a failed doorbell may be
+// drained after later ones were staged. Such a batch is kept in
+// abandoned_batches until all processors drained it.
+struct ShpBatch {
+  CrBatch batch;
+  LIST_ENTRY abandoned_entry;
+  ULONG edit_count;
+  ShpEptEdit edits[ANYSIZE_ARRAY];
+};
+
+// A number of hook handlers being executed, counted per processor to avoid
+// sharing a cache line. A handler may return on a different processor from
+// where it was entered, so only a sum of all counters is meaningful.
+struct ShpInFlightCounter {
+  volatile LONG64 count;
+  UCHAR padding[SYSTEM_CACHE_ALIGNMENT_SIZE - sizeof(LONG64)];
+};
+static_assert(sizeof(ShpInFlightCounter) == SYSTEM_CACHE_ALIGNMENT_SIZE,
+              "Size check");
+
+// A ring of VM-exits handled on a single processor. VMX-root mode on the
+// processor is the only writer, and ShReadExitTrace() is the only reader.
+struct DECLSPEC_CACHEALIGN ShpExitTrace {
+  volatile ULONG64 write_index;  // Published after a record is written
+  ULONG64 read_index;
+  DECLSPEC_CACHEALIGN DdimonExitTraceRecord records[kShpExitTraceRecordCount];
+};
+
+// Data of a single processor updated in VM-exit handlers on it. It is
+// allocated on the NUMA node of the processor by ShpAllocateProcessorData()
+// so that neither its memory nor its cache lines are shared with other
+// processors.
+struct ShpProcessorData {
+  // Incremented by ShHandleBreakpoint() and decremented by
+  // ShLeaveHookHandler()
+  ShpInFlightCounter in_flight_counter;
+
+  // VM-exits handled by the shadow hook
+  ShpExitTrace exit_trace;
+
+  // Batches of operations drained in VMX-root mode on kShEnablePageShadowing
+  // and kShDisablePageShadowing
+  CrRing command_ring;
+
+  // Exit counters of hooks and pages, kShpExitCountersPerChunk each, added by
+  // ShpAllocateExitCounter() and freed with the processor data
+  ShpExitCounter* exit_counter_chunks[kShpMaxExitCounterChunks];
+};
+
 // Data structure shared across all processors
 struct SharedShadowHookPatchData {
+  // Sorted by pages and addresses so that VM-exit handlers find a hook with a
+  // binary search however many hooks are installed. Modified only while
+  // other processors are stopped by ShpRunExclusively().
   std::vector<std::unique_ptr<MemHookInformation>> all_page_hooks;  // Hold installed hooks
   std::vector<std::unique_ptr<FunctionHookInformation>> func_hooks;  // Hold all hooks include the hooks with the same page
   std::vector<std::unique_ptr<MemBPInformation>> mem_hooks;  // Hold all hooks include the hooks with the same page
 
+  // Uninstalled hooks that may still be referenced by other processors. They
+  // are freed by ShFreeRetiredHooks() after a grace period.
+  std::vector<std::unique_ptr<MemHookInformation>> retired_page_hooks;
+  std::vector<std::unique_ptr<FunctionHookInformation>> retired_func_hooks;
+  std::vector<std::unique_ptr<MemBPInformation>> retired_mem_hooks;
+
+  // EPT modifications staged by ShpStageEptEdits() and copied into a batch
+  // posted to command rings by ShpSubmitStagedEdits()
+  std::vector<ShpEptEdit> staged_edits;
+
+  // Serializes installation, uninstallation and changes of state of hooks,
+  // and readers of the vectors above outside VM-exit handlers
+  KGUARDED_MUTEX state_lock;
+  bool hooks_active;  // true between ShEnableHooks() and ShDisableHooks()
+
+  // Data of each processor, indexed by processor numbers
+  ShpProcessorData** processor_data;
+  ULONG processor_count;
+
+  // Exit counters in chunks of processor_data. Indexes below
+  // exit_counter_count are either used or in free_exit_counters.
+  KGUARDED_MUTEX exit_counter_lock;
+  ULONG exit_counter_count;
+  ULONG exit_counter_chunk_count;
+  std::vector<ULONG> free_exit_counters;
+
+  // Batches left incomplete by ShpSubmitBatch(), freed once drained by all
+  // processors
+  LIST_ENTRY abandoned_batches;
+  KSPIN_LOCK abandoned_batches_lock;
+
+  // A budget of VM-exits of memory monitors, and a timer to promote demoted
+  // pages while hooks are active
+  DdimonExitBudget exit_budget;
+  KTIMER governor_timer;
+  KDPC governor_dpc;
+
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  // EPT hierarchies used while a guest reads or writes a shadowed page, one
+  // per processor, and modifications applied to them along with staged_edits
+  EptData** data_views;
+  ULONG data_view_count;
+  std::vector<ShpEptEdit> staged_data_view_edits;
+#endif
+};
+
+// A context of ShpSubmitStagedEdits()
+struct ShpDoorbellContext {
+  HypercallNumber hypercall_number;
+  volatile LONG failures;
 };
 
-// Data structure for each processor
-struct LastShadowHookData {
-  const MemHookInformation* last_page_hook_info;  // Remember which hook hit the last
+// A context of ShpHandleCommand()
+struct ShpCommandContext {
+  EptData* ept_data;
+  const SharedShadowHookPatchData* shared_sh_data;
 };
 
-// A structure reflects inline hook code.
-#include <pshpack1.h>
-#if defined(_AMD64_)
+// A context of ShpRunExclusively()
+struct ShpExclusiveContext {
+  void (*callback)(void* context);
+  void* context;
+  volatile LONG owner;  // Set by a processor running callback
+  volatile LONG done;   // Set when callback completed
+};
 
-struct TrampolineCode {
-  UCHAR nop;
-  UCHAR jmp[6];
-  void* address;
+// A context of ShpAttachHooks(). The grown_* vectors have enough capacity for
+// the live vectors and hooks to attach, or are empty when the live vectors
+// have enough capacity themselves.
+struct ShpAttachContext {
+  SharedShadowHookPatchData* shared_sh_data;
+  std::vector<std::unique_ptr<MemHookInformation>>* page_hooks;
+  std::vector<std::unique_ptr<FunctionHookInformation>>* func_hooks;
+  std::unique_ptr<MemBPInformation>* mem_hook;  // nullptr when none
+  std::vector<std::unique_ptr<MemHookInformation>> grown_page_hooks;
+  std::vector<std::unique_ptr<FunctionHookInformation>> grown_func_hooks;
+  std::vector<std::unique_ptr<MemBPInformation>> grown_mem_hooks;
 };
-static_assert(sizeof(TrampolineCode) == 15, "Size check");
 
-#else
+// A context of ShpDetachFuncHook() and ShpDetachMemMonitor()
+struct ShpDetachContext {
+  SharedShadowHookPatchData* shared_sh_data;
+  const void* info;
+};
 
-struct TrampolineCode {
-  UCHAR nop;
-  UCHAR push;
-  void* address;
-  UCHAR ret;
+// A context of ShpWriteHookCodes()
+struct ShpWriteCodeContext {
+  FunctionHookInformation* const* infos;
+  ULONG info_count;
+  bool enable;
+};
+
+// A context of ShpRefreshShadowPages()
+struct ShpRefreshContext {
+  const SharedShadowHookPatchData* shared_sh_data;
+  const MemHookInformation* const* page_hook_infos;
+  ULONG page_count;
+};
+
+// A context of ShpSwapHookScope()
+struct ShpScopeContext {
+  FunctionHookInformation* info;
+  std::unique_ptr<ShcHookScope>* scope;
+};
+
+// A context of ShpRemoveFromHookScopesRoutine()
+struct ShpScopeRemovalContext {
+  SharedShadowHookPatchData* shared_sh_data;
+  ULONG64 cr3;
+};
+
+// Data structure for each processor. It is allocated on the NUMA node of the
+// processor by ShAllocateShadowHookData() and aligned to a page, so that it
+// never shares a cache line with that of another processor.
+struct DECLSPEC_CACHEALIGN LastShadowHookData {
+  const MemHookInformation* last_page_hook_info;  // Remember which hook hit the last
+
+  // TSC cycles spent to expose and hide read/write views of shadowed pages
+  ULONG64 view_switch_count;
+  ULONG64 view_switch_cycles;
+};
+static_assert(sizeof(LastShadowHookData) <= PAGE_SIZE, "Size check");
+
+// Holds state_lock of shared data until it goes out of scope
+class ShpStateLockScope {
+ public:
+  explicit ShpStateLockScope(
+      _In_ const SharedShadowHookPatchData* shared_sh_data)
+      : state_lock_(
+            &const_cast<SharedShadowHookPatchData*>(shared_sh_data)
+                 ->state_lock) {
+    KeAcquireGuardedMutex(state_lock_);
+  }
+
+  ~ShpStateLockScope() { KeReleaseGuardedMutex(state_lock_); }
+
+  ShpStateLockScope(const ShpStateLockScope&) = delete;
+  ShpStateLockScope& operator=(const ShpStateLockScope&) = delete;
+
+ private:
+  PKGUARDED_MUTEX state_lock_;
 };
-static_assert(sizeof(TrampolineCode) == 7, "Size check");
 
-#endif
-#include <poppack.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -151,9 +428,6 @@ _Success_(return) static bool ShpSetupInlineHook(
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C static SIZE_T
 ShpGetInstructionSize(_In_ void* address);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C static TrampolineCode
-ShpMakeTrampolineCode(_In_ void* hook_handler);
-
 static MemHookInformation* ShpFindPageHookInfoByPage(
   _In_ const SharedShadowHookPatchData* shared_sh_data, _In_ void* address);
 
@@ -164,8 +438,13 @@ static void ShpEnablePageShadowingForExec(_In_ void* patch_address,
 static void ShpEnablePageShadowingForRW(_In_ const FunctionHookInformation& info,
   _In_ EptData* ept_data);
 
-static void ShpDisablePageShadowingForFuncHook(_In_ const FunctionHookInformation& info,
-  _In_ EptData* ept_data);
+static void ShpShowRWView(_In_ LastShadowHookData* sh_data,
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ EptData* ept_data, _In_ const MemHookInformation& info);
+
+static void ShpShowExecView(_In_ LastShadowHookData* sh_data,
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ EptData* ept_data, _In_ const MemHookInformation& info);
 
 static void ShpSetMonitorTrapFlag(_In_ LastShadowHookData* sh_data,
   _In_ bool enable);
@@ -176,15 +455,84 @@ static void ShpSaveLastHookInfo(_In_ LastShadowHookData* sh_data,
 static const MemHookInformation* ShpRestoreLastHookInfo(
   _In_ LastShadowHookData* sh_data);
 
+static void ShpRecordExit(
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ DdimonExitTraceKind kind, _In_ void* address);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG ShpReadExitTrace(
+  _Inout_ ShpExitTrace* trace, _Out_ DdimonExitTraceRecord* records,
+  _In_ ULONG capacity, _Inout_ ULONG64* lost_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static USHORT ShpGetProcessorNode(
+  _In_ ULONG processor);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void* ShpAllocateOnNode(
+  _In_ SIZE_T size, _In_ USHORT node);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool ShpAllocateProcessorData(
+  _Inout_ SharedShadowHookPatchData* shared_sh_data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpFreeProcessorData(
+  _Inout_ SharedShadowHookPatchData* shared_sh_data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG ShpAllocateExitCounter(
+  _Inout_ SharedShadowHookPatchData* shared_sh_data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpFreeExitCounter(
+  _Inout_ SharedShadowHookPatchData* shared_sh_data, _In_ ULONG index);
+
+static ShpExitCounter& ShpGetExitCounterOf(_In_ ULONG index,
+                                           _In_ ULONG processor);
+
+static ShpExitCounter& ShpGetExitCounter(
+  _In_ const ShpExitCounters& exit_counters);
+
+static ULONG_PTR ShpReadReturnAddress();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpMergeCallers(
+  _Inout_ std::vector<DdimonCallerStatistics>* merged,
+  _In_ const FunctionHookInformation& info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpAddExitCounter(
+  _Inout_ DdimonExitStatistics* statistics,
+  _In_ const ShpExitCounters& exit_counters);
+
 static bool ShpIsShadowHookActive(
   _In_ const SharedShadowHookPatchData* shared_sh_data);
 
+static bool ShpIsPageHookBefore(
+  _In_ const std::unique_ptr<MemHookInformation>& info, _In_ ULONG_PTR page);
+
+static bool ShpIsFuncHookBefore(
+  _In_ const std::unique_ptr<FunctionHookInformation>& info,
+  _In_ ULONG_PTR address);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpPublishHooks(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _Inout_ std::vector<std::unique_ptr<MemHookInformation>>* page_hooks,
+  _Inout_ std::vector<std::unique_ptr<FunctionHookInformation>>* func_hooks,
+  _Inout_opt_ std::unique_ptr<MemBPInformation>* mem_hook);
+
+static void ShpAttachHooks(_In_ void* context);
+
+static void ShpInsertPageHook(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_ std::unique_ptr<MemHookInformation> info);
+
+static void ShpInsertFuncHook(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_ std::unique_ptr<FunctionHookInformation> info);
+
 static FunctionHookInformation* ShpFindFuncHookInfoByPage(
   _In_ const SharedShadowHookPatchData* shared_sh_data, _In_ void *address);
 
 static FunctionHookInformation* ShpFindFuncHookInfoByAddress(
   _In_ const SharedShadowHookPatchData* shared_sh_data, _In_ void *address);
 
+static bool ShpOverlapsFuncHook(
+  _In_ const SharedShadowHookPatchData* shared_sh_data, _In_ void* address,
+  _In_ ULONG length);
+
 static void ShpDisablePageMonitorForRW(
   _In_ MemBPInformation *info, _In_ EptData* ept_data);
 
@@ -198,17 +546,137 @@ static MemBPInformation* ShpFindMemMonInfoByPage(
 static void ShpEnablePageMonitorForRW(
   MemBPInformation* info, EptData* ept_data);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpStageEptEdits(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_opt_ const MemHookInformation* page_hook_info);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static bool ShpIsPageActive(
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ const MemHookInformation& page_hook_info);
+
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS ShpCreateDataViews(
+  _In_ SharedShadowHookPatchData* shared_sh_data);
+
+static EptData* ShpGetDataView(
+  _In_ const SharedShadowHookPatchData* shared_sh_data);
+#endif
+
+static void ShpWriteEptEdits(_In_ EptData* ept_data,
+  _In_reads_(edit_count) const ShpEptEdit* edits, _In_ ULONG64 edit_count);
+
+static void ShpWriteHookCode(_In_ const FunctionHookInformation& info,
+                             _In_ bool enable);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpWriteHookCodes(
+  _In_reads_(info_count) FunctionHookInformation* const* infos,
+  _In_ ULONG info_count, _In_ bool enable);
+
+static void ShpWriteHookCodesRoutine(_In_ void* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpRefreshShadowPages(
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_reads_(page_count) const MemHookInformation* const* page_hook_infos,
+  _In_ ULONG page_count);
+
+static void ShpRefreshShadowPagesRoutine(_In_ void* context);
+
+static void ShpDrainCommands(_In_ EptData* ept_data,
+  _In_ const SharedShadowHookPatchData* shared_sh_data);
+
+static LONG ShpHandleCommand(_In_ void* context,
+                             _In_ const CrOperation& operation);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS ShpSubmitStagedEdits(
+  _In_ HypercallNumber doorbell, _In_ const char* operation);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static ShpBatch* ShpAllocateBatch(
+  _In_ ULONG edit_count);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static NTSTATUS ShpSubmitBatch(
+  _In_ ShpBatch* batch, _In_ HypercallNumber doorbell);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static void ShpFreeAbandonedBatches(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ bool all);
+
+static void ShpGovernExit(
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ EptData* ept_data, _In_ const MemHookInformation& info,
+  _Inout_ ShpExitCounter* exit_counter);
+
+static void ShpPromotePages(
+  _In_ const SharedShadowHookPatchData* shared_sh_data,
+  _In_ EptData* ept_data);
+
+static void ShpDemotePage(_In_ EptData* ept_data,
+                          _In_ const MemBPInformation& info,
+                          _In_ bool demote);
+
+static KDEFERRED_ROUTINE ShpGovernorDpcRoutine;
+
+static ULONG_PTR ShpRingDoorbellRoutine(_In_ ULONG_PTR argument);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ShpRunExclusively(
+  _In_ void (*callback)(void* context), _In_opt_ void* context);
+
+static ULONG_PTR ShpRunExclusivelyBroadcastRoutine(_In_ ULONG_PTR argument);
+
+static void ShpDetachFuncHook(_In_ void* context);
+
+static void ShpDetachMemMonitor(_In_ void* context);
+
+static void ShpRetirePageHookIfUnused(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ void* address);
+
+static void ShpSwapHookScope(_In_ void* context);
+
+static void ShpRemoveFromHookScopesRoutine(_In_ void* context);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(PAGE, ShAllocateShadowHookData)
 #pragma alloc_text(PAGE, ShAllocateSharedShaowHookData)
 #pragma alloc_text(PAGE, ShEnableHooks)
 #pragma alloc_text(PAGE, ShInstallHook)
 #pragma alloc_text(PAGE, ShpSetupInlineHook)
+#pragma alloc_text(PAGE, ShInstallPatchBundle)
 #pragma alloc_text(PAGE, ShpGetInstructionSize)
-#pragma alloc_text(PAGE, ShpMakeTrampolineCode)
 #pragma alloc_text(PAGE, ShFreeShadowHookData)
 #pragma alloc_text(PAGE, ShFreeSharedShadowHookData)
 #pragma alloc_text(PAGE, ShDisableHooks)
+#pragma alloc_text(PAGE, ShUninstallHook)
+#pragma alloc_text(PAGE, ShUninstallMemMonitor)
+#pragma alloc_text(PAGE, ShFreeRetiredHooks)
+#pragma alloc_text(PAGE, ShIsShadowedPage)
+#pragma alloc_text(PAGE, ShpRunExclusively)
+#pragma alloc_text(PAGE, ShpPublishHooks)
+#pragma alloc_text(PAGE, ShpStageEptEdits)
+#pragma alloc_text(PAGE, ShpIsPageActive)
+#pragma alloc_text(PAGE, ShpWriteHookCodes)
+#pragma alloc_text(PAGE, ShpRefreshShadowPages)
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+#pragma alloc_text(PAGE, ShpCreateDataViews)
+#endif
+#pragma alloc_text(PAGE, ShSetHookState)
+#pragma alloc_text(PAGE, ShWaitForHookHandlers)
+#pragma alloc_text(PAGE, ShFreeTrampoline)
+#pragma alloc_text(PAGE, ShSetPageState)
+#pragma alloc_text(PAGE, ShSetHookScope)
+#pragma alloc_text(PAGE, ShRemoveFromHookScopes)
+#pragma alloc_text(PAGE, ShQueryExitStatistics)
+#pragma alloc_text(PAGE, ShpAddExitCounter)
+#pragma alloc_text(PAGE, ShpGetProcessorNode)
+#pragma alloc_text(PAGE, ShpAllocateOnNode)
+#pragma alloc_text(PAGE, ShpAllocateProcessorData)
+#pragma alloc_text(PAGE, ShpFreeProcessorData)
+#pragma alloc_text(PAGE, ShpAllocateExitCounter)
+#pragma alloc_text(PAGE, ShpFreeExitCounter)
+#pragma alloc_text(PAGE, ShReadExitTrace)
+#pragma alloc_text(PAGE, ShpReadExitTrace)
+#pragma alloc_text(PAGE, ShQueryCallers)
+#pragma alloc_text(PAGE, ShpMergeCallers)
+#pragma alloc_text(PAGE, ShSetHookStates)
+#pragma alloc_text(PAGE, ShSetExitBudget)
+#pragma alloc_text(PAGE, ShpSubmitStagedEdits)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -216,16 +684,35 @@ static void ShpEnablePageMonitorForRW(
 // variables
 //
 
+// Processor-shared data allocated by ShAllocateSharedShaowHookData()
+static SharedShadowHookPatchData* g_shp_shared_sh_data;
+
+// Number of pages demoted on any processor, to skip looking for pages to
+// promote when none is
+static volatile LONG g_shp_demoted_page_count;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
 //
 
-// Allocates per-processor shadow hook data
+// Allocates per-processor shadow hook data. It is called on each processor
+// and allocates memory from the NUMA node of the current processor.
 _Use_decl_annotations_ LastShadowHookData* ShAllocateShadowHookData() {
   PAGED_CODE();
 
-  auto p = new LastShadowHookData();
+  PHYSICAL_ADDRESS lowest_acceptable_address = {};
+  PHYSICAL_ADDRESS highest_acceptable_address = {};
+  highest_acceptable_address.QuadPart = -1;
+  PHYSICAL_ADDRESS boundary_address_multiple = {};
+  auto p = reinterpret_cast<LastShadowHookData*>(
+    MmAllocateContiguousMemorySpecifyCacheNode(
+      sizeof(LastShadowHookData), lowest_acceptable_address,
+      highest_acceptable_address, boundary_address_multiple, MmCached,
+      KeGetCurrentNodeNumber()));
+  if (!p) {
+    return nullptr;
+  }
   RtlFillMemory(p, sizeof(LastShadowHookData), 0);
   return p;
 }
@@ -234,7 +721,14 @@ _Use_decl_annotations_ LastShadowHookData* ShAllocateShadowHookData() {
 _Use_decl_annotations_ void ShFreeShadowHookData(LastShadowHookData* sh_data) {
   PAGED_CODE();
 
-  delete sh_data;
+  if (sh_data->view_switch_count) {
+    HYPERPLATFORM_LOG_INFO(
+      "Read/write views were switched %I64u times, %I64u cycles each (%s).",
+      sh_data->view_switch_count,
+      sh_data->view_switch_cycles / sh_data->view_switch_count,
+      (DDIMON_SH_USE_DUAL_EPT_VIEWS) ? "EPTP switch" : "EPT edit and INVEPT");
+  }
+  MmFreeContiguousMemory(sh_data);
 }
 
 // Allocates processor-shared shadow hook data
@@ -244,6 +738,19 @@ ShAllocateSharedShaowHookData() {
 
   auto p = new SharedShadowHookPatchData();
   RtlFillMemory(p, sizeof(SharedShadowHookPatchData), 0);
+  KeInitializeGuardedMutex(&p->state_lock);
+  KeInitializeGuardedMutex(&p->exit_counter_lock);
+  if (!ShpAllocateProcessorData(p)) {
+    delete p;
+    return nullptr;
+  }
+
+  InitializeListHead(&p->abandoned_batches);
+  KeInitializeSpinLock(&p->abandoned_batches_lock);
+  KeInitializeTimer(&p->governor_timer);
+  KeInitializeDpc(&p->governor_dpc, ShpGovernorDpcRoutine, nullptr);
+
+  g_shp_shared_sh_data = p;
   return p;
 }
 
@@ -252,74 +759,476 @@ _Use_decl_annotations_ void ShFreeSharedShadowHookData(
   SharedShadowHookPatchData* shared_sh_data) {
   PAGED_CODE();
 
+  KeCancelTimer(&shared_sh_data->governor_timer);
+  KeFlushQueuedDpcs();
+  if (g_shp_shared_sh_data == shared_sh_data) {
+    g_shp_shared_sh_data = nullptr;
+  }
+  // No processor drains command rings any longer
+  ShpFreeAbandonedBatches(shared_sh_data, true);
+  // Exit counters of hooks freed below are no longer returned to the free
+  // list, since g_shp_shared_sh_data is cleared
+  ShpFreeProcessorData(shared_sh_data);
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  if (shared_sh_data->data_views) {
+    for (auto i = 0ul; i < shared_sh_data->data_view_count; ++i) {
+      if (shared_sh_data->data_views[i]) {
+        EptTermination(shared_sh_data->data_views[i]);
+      }
+    }
+    ExFreePoolWithTag(shared_sh_data->data_views,
+                      kHyperPlatformCommonPoolTag);
+  }
+#endif
   delete shared_sh_data;
 }
 
+// Marks that a hook handler entered by ShHandleBreakpoint() is returning.
+// Every hook handler must call this exactly once before it returns.
+_Use_decl_annotations_ void ShLeaveHookHandler() {
+  const auto shared_sh_data = g_shp_shared_sh_data;
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  InterlockedDecrement64(
+    &shared_sh_data->processor_data[index]->in_flight_counter.count);
+}
+
+// Waits until all hook handlers return. Trampolines called by them may still
+// be running, and are waited for by ShFreeTrampoline(). Hooks must be
+// disabled so that no new handler is entered while waiting.
+_Use_decl_annotations_ void ShWaitForHookHandlers() {
+  PAGED_CODE();
+
+  const auto shared_sh_data = g_shp_shared_sh_data;
+  for (;;) {
+    LONG64 in_flight = 0;
+    for (auto i = 0ul; i < shared_sh_data->processor_count; ++i) {
+      in_flight += shared_sh_data->processor_data[i]->in_flight_counter.count;
+    }
+    NT_ASSERT(in_flight >= 0);
+    if (in_flight <= 0) {
+      break;
+    }
+    UtilSleep(1);
+  }
+}
+
+// Frees a trampoline returned as original_call of a hook once no thread is
+// executing it. The hook must be uninstalled or hooks must be disabled, and
+// ShWaitForHookHandlers() must have returned, so that no thread enters it.
+_Use_decl_annotations_ void ShFreeTrampoline(void* original_call) {
+  PAGED_CODE();
+
+  const auto trampoline = ShcGetTrampolineFromEntry(original_call);
+  while (trampoline->in_flight) {
+    UtilSleep(1);
+  }
+  ExFreePoolWithTag(trampoline, kHyperPlatformCommonPoolTag);
+}
+
 // Enables page shadowing for all hooks
 _Use_decl_annotations_ NTSTATUS ShEnableHooks() {
   PAGED_CODE();
 
-  return UtilForEachProcessor(
-    [](void* context) {
-    UNREFERENCED_PARAMETER(context);
-    return UtilVmCall(HypercallNumber::kShEnablePageShadowing, nullptr);
-  },
-    nullptr);
+  LARGE_INTEGER frequency = {};
+  const auto begin = KeQueryPerformanceCounter(&frequency);
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  if (!shared_sh_data->data_views) {
+    const auto status = ShpCreateDataViews(shared_sh_data);
+    if (!NT_SUCCESS(status)) {
+      KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+      return status;
+    }
+  }
+#endif
+  // Pages of hooks were not shadowed while hooks were disabled, and may have
+  // been written through their original frames since the shadow pages were
+  // copied. Take fresh copies of those to be shadowed again.
+  std::vector<const MemHookInformation*> activated_pages;
+  if (!shared_sh_data->hooks_active) {
+    shared_sh_data->hooks_active = true;
+    for (const auto& info : shared_sh_data->all_page_hooks) {
+      if (info->hook_type == FUNC_HOOK &&
+          ShpIsPageActive(shared_sh_data, *info)) {
+        activated_pages.push_back(info.get());
+      }
+    }
+    if (!activated_pages.empty()) {
+      ShpRefreshShadowPages(shared_sh_data, activated_pages.data(),
+                            static_cast<ULONG>(activated_pages.size()));
+    }
+  }
+
+  // Hook code written since hooks were disabled becomes visible from here, so
+  // caches are invalidated once rather than for each of (possibly thousands
+  // of) installed hooks
+  KeInvalidateAllCaches();
+  ShpStageEptEdits(shared_sh_data, nullptr);
+  const auto status = ShpSubmitStagedEdits(
+    HypercallNumber::kShEnablePageShadowing, "enabled");
+  LARGE_INTEGER due_time = {};
+  due_time.QuadPart = -10000ll * kShpGovernorPeriodMs;
+  KeSetTimerEx(&shared_sh_data->governor_timer, due_time,
+               kShpGovernorPeriodMs, &shared_sh_data->governor_dpc);
+
+  // Includes refreshing shadow pages and invalidating caches, which grow with
+  // the number of hooks, on top of the broadcast itself
+  if (NT_SUCCESS(status)) {
+    const auto elapsed_us =
+      (KeQueryPerformanceCounter(nullptr).QuadPart - begin.QuadPart) *
+      1000000 / frequency.QuadPart;
+    HYPERPLATFORM_LOG_INFO(
+      "Enabling %Iu hooks and %Iu monitors on %Iu pages (%Iu refreshed) on "
+      "%lu processors took %I64d us.",
+      shared_sh_data->func_hooks.size(), shared_sh_data->mem_hooks.size(),
+      shared_sh_data->all_page_hooks.size(), activated_pages.size(),
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS), elapsed_us);
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return status;
 }
 
 // Disables page shadowing for all hooks
 _Use_decl_annotations_ NTSTATUS ShDisableHooks() {
   PAGED_CODE();
 
-  return UtilForEachProcessor(
-    [](void* context) {
-    UNREFERENCED_PARAMETER(context);
-    return UtilVmCall(HypercallNumber::kShDisablePageShadowing, nullptr);
-  },
-    nullptr);
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  KeCancelTimer(&shared_sh_data->governor_timer);
+  KeFlushQueuedDpcs();
+  shared_sh_data->hooks_active = false;
+  ShpStageEptEdits(shared_sh_data, nullptr);
+  const auto status = ShpSubmitStagedEdits(
+    HypercallNumber::kShDisablePageShadowing, "disabled");
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return status;
 }
 
-// Enables page shadowing for all hooks
-_Use_decl_annotations_ NTSTATUS ShEnablePageShadowing(
-  EptData* ept_data, const SharedShadowHookPatchData* shared_sh_data) {
-  // HYPERPLATFORM_COMMON_DBG_BREAK();
+// Enables or disables a single hook or patch at the address. A disabled hook
+// no longer has 0xcc (or patch bytes) on the exec shadow page, and when no
+// enabled hook remains on the page, the page is no longer shadowed so that it
+// causes no VM-exit at all. Only the EPT entry of the page is updated, after
+// its shadow pages are copied again when it is shadowed again.
+_Use_decl_annotations_ NTSTATUS ShSetHookState(void* address, bool enable) {
+  PAGED_CODE();
 
-  for (auto& info : shared_sh_data->all_page_hooks) {
-    switch (info->hook_type) {
-      case FUNC_HOOK: {
-        FunctionHookInformation *func_hook_info = ShpFindFuncHookInfoByPage(shared_sh_data, info->va_base_page_hook);
-        ShpEnablePageShadowingForExec(func_hook_info->patch_address, func_hook_info->pa_base_for_exec,
-          ept_data);
-        break;
+  return ShSetHookStates(&address, 1, enable);
+}
+
+// Enables or disables hooks or patches at the addresses as ShSetHookState()
+// does, updating EPT entries of all pages whose state changed with a single
+// batch of commands for each processor. Hooks found are updated even when
+// some addresses have no hook, in which case STATUS_NOT_FOUND is returned.
+_Use_decl_annotations_ NTSTATUS ShSetHookStates(void* const* addresses,
+                                                ULONG address_count,
+                                                bool enable) {
+  PAGED_CODE();
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+
+  auto status = STATUS_SUCCESS;
+  std::vector<const MemHookInformation*> changed_pages;
+  std::vector<FunctionHookInformation*> changed_hooks;
+  for (auto i = 0ul; i < address_count; ++i) {
+    const auto info =
+      ShpFindFuncHookInfoByAddress(shared_sh_data, addresses[i]);
+    if (!info) {
+      status = STATUS_NOT_FOUND;
+      continue;
+    }
+    if (info->enabled == enable) {
+      continue;
+    }
+
+    const auto page_hook_info =
+      ShpFindPageHookInfoByPage(shared_sh_data, addresses[i]);
+    const auto was_active = ShpIsPageActive(shared_sh_data, *page_hook_info);
+    info->enabled = enable;
+    changed_hooks.push_back(info);
+
+    // A page changes its state at most once since all hooks move toward the
+    // same state
+    if (was_active != ShpIsPageActive(shared_sh_data, *page_hook_info)) {
+      changed_pages.push_back(page_hook_info);
+    }
+  }
+
+  if (!changed_hooks.empty()) {
+    ShpWriteHookCodes(changed_hooks.data(),
+                      static_cast<ULONG>(changed_hooks.size()), enable);
+  }
+
+  if (shared_sh_data->hooks_active && !changed_pages.empty()) {
+    // Pages to be shadowed again were exposed through their original frames
+    if (enable) {
+      ShpRefreshShadowPages(shared_sh_data, changed_pages.data(),
+                            static_cast<ULONG>(changed_pages.size()));
+    }
+
+    // Staging all pages costs less than a batch for each changed page
+    ShpStageEptEdits(shared_sh_data, (changed_pages.size() == 1)
+                                         ? changed_pages.front()
+                                         : nullptr);
+    const auto submit_status =
+      ShpSubmitStagedEdits(HypercallNumber::kShEnablePageShadowing,
+                           (enable) ? "enabled" : "disabled");
+    if (!NT_SUCCESS(submit_status)) {
+      status = submit_status;
+    }
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return status;
+}
+
+// Replaces the budget of VM-exits applied to pages of memory monitors. Pages
+// already demoted stay demoted until their demotions end.
+_Use_decl_annotations_ NTSTATUS ShSetExitBudget(
+  const DdimonExitBudget& budget) {
+  PAGED_CODE();
+
+  if (budget.max_exits &&
+      (!budget.window_cycles ||
+       budget.min_demoted_windows > budget.max_demoted_windows)) {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  // Processors may read a budget being replaced for a single VM-exit, which
+  // only makes a decision for the exit either way
+  shared_sh_data->exit_budget = budget;
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+
+  HYPERPLATFORM_LOG_INFO(
+    "Exit budget has been set to %lu VM-exits in %I64u cycles.",
+    budget.max_exits, budget.window_cycles);
+  return STATUS_SUCCESS;
+}
+
+// Enables or disables shadowing of a page where the address belongs to,
+// regardless of state of each hook on the page. Only the EPT entry of the
+// page is updated, after its shadow pages are copied again when it is
+// shadowed again.
+_Use_decl_annotations_ NTSTATUS ShSetPageState(void* address, bool enable) {
+  PAGED_CODE();
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+
+  const auto page_hook_info = ShpFindPageHookInfoByPage(shared_sh_data, address);
+  if (!page_hook_info) {
+    KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+    return STATUS_NOT_FOUND;
+  }
+
+  const auto was_active = ShpIsPageActive(shared_sh_data, *page_hook_info);
+  page_hook_info->enabled = enable;
+
+  auto status = STATUS_SUCCESS;
+  if (shared_sh_data->hooks_active &&
+      was_active != ShpIsPageActive(shared_sh_data, *page_hook_info)) {
+    // The page was exposed through its original frame while disabled
+    if (enable && page_hook_info->hook_type == FUNC_HOOK) {
+      ShpRefreshShadowPages(shared_sh_data, &page_hook_info, 1);
+    }
+    ShpStageEptEdits(shared_sh_data, page_hook_info);
+    status = ShpSubmitStagedEdits(HypercallNumber::kShEnablePageShadowing,
+                                  (enable) ? "enabled" : "disabled");
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return status;
+}
+
+// Limits a hook at the address to address spaces given as CR3 values, or lets
+// it apply to all of them again when cr3_count is 0. A hit from any other
+// address space is sent to the original function by ShHandleBreakpoint()
+// without entering the handler. Fails with STATUS_QUOTA_EXCEEDED when CR3
+// values collide too often to be found in constant time.
+_Use_decl_annotations_ NTSTATUS ShSetHookScope(void* address,
+                                              const ULONG64* cr3s,
+                                              ULONG cr3_count) {
+  PAGED_CODE();
+
+  std::unique_ptr<ShcHookScope> scope;
+  if (cr3_count) {
+    scope = std::make_unique<ShcHookScope>();
+    if (!scope) {
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    for (auto i = 0ul; i < cr3_count; ++i) {
+      if (!ShcNormalizeCr3(cr3s[i])) {
+        return STATUS_INVALID_PARAMETER;
       }
-      case MEM_HOOK: {
-        MemBPInformation *mem_hook_info = ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
-        ShpDisablePageMonitorForRW(mem_hook_info, ept_data);
-        break;
+      if (!ShcAddToScope(scope.get(), cr3s[i])) {
+        return STATUS_QUOTA_EXCEEDED;
       }
     }
   }
 
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  const auto info = ShpFindFuncHookInfoByAddress(shared_sh_data, address);
+  if (!info || !info->original_call) {
+    KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+    return STATUS_NOT_FOUND;
+  }
+
+  // The previous scope is swapped into scope and freed on return, after no
+  // processor can be reading it in ShHandleBreakpoint()
+  ShpScopeContext context = {info, &scope};
+  ShpRunExclusively(ShpSwapHookScope, &context);
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
   return STATUS_SUCCESS;
 }
 
-// Disables page shadowing for all hooks
-_Use_decl_annotations_ void ShVmCallDisablePageShadowing(
-  EptData* ept_data, const SharedShadowHookPatchData* shared_sh_data) {
-  // HYPERPLATFORM_COMMON_DBG_BREAK();
+// Removes an address space given as a CR3 value from scopes of all hooks, as
+// its process exits, so that a process later given the same page table base
+// is not taken to be in them. A scope left empty keeps applying to no
+// process. Returns STATUS_NOT_FOUND when no scope had it.
+_Use_decl_annotations_ NTSTATUS ShRemoveFromHookScopes(ULONG64 cr3) {
+  PAGED_CODE();
 
-  for (auto& info : shared_sh_data->all_page_hooks) {
-    switch (info->hook_type) {
-    case FUNC_HOOK:
-      ShpDisablePageShadowingForFuncHook(*ShpFindFuncHookInfoByPage(shared_sh_data, info->va_base_page_hook), ept_data);
-      break;
-    case MEM_HOOK:
-      MemBPInformation *mem_monitor_info= ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
-      ShpEnablePageMonitorForRW(mem_monitor_info, ept_data);
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+
+  // Stop processors only when a scope has it, which is rare for processes
+  // exiting
+  auto found = false;
+  for (const auto& info : shared_sh_data->func_hooks) {
+    if (info->scope && ShcIsInScope(*info->scope, cr3)) {
+      found = true;
       break;
     }
+  }
+  if (found) {
+    // Scopes are updated in place while no processor can be reading them in
+    // ShHandleBreakpoint()
+    ShpScopeRemovalContext context = {shared_sh_data, cr3};
+    ShpRunExclusively(ShpRemoveFromHookScopesRoutine, &context);
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return (found) ? STATUS_SUCCESS : STATUS_NOT_FOUND;
+}
+
+// Takes a snapshot of VM-exit statistics of all hooks followed by all pages.
+// Counters are read while processors may be updating them, so a snapshot is
+// not exact. Returns STATUS_BUFFER_OVERFLOW when records were truncated.
+_Use_decl_annotations_ NTSTATUS ShQueryExitStatistics(
+  DdimonExitStatistics* records, ULONG capacity, ULONG* record_count,
+  ULONG* total_count) {
+  PAGED_CODE();
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  *record_count = 0;
+  *total_count = 0;
+  for (const auto& info : shared_sh_data->func_hooks) {
+    if (!info->original_call) {
+      continue;  // A patch never causes #BP
+    }
+    if (*total_count < capacity) {
+      auto& record = records[*total_count];
+      RtlZeroMemory(&record, sizeof(record));
+      record.address = reinterpret_cast<ULONG64>(info->patch_address);
+      record.kind = kDdimonExitStatisticsHook;
+      ShpAddExitCounter(&record, info->exit_counters);
+      (*record_count)++;
+    }
+    (*total_count)++;
+  }
+  for (const auto& info : shared_sh_data->all_page_hooks) {
+    if (*total_count < capacity) {
+      auto& record = records[*total_count];
+      RtlZeroMemory(&record, sizeof(record));
+      record.address =
+        reinterpret_cast<ULONG64>(PAGE_ALIGN(info->va_base_page_hook));
+      record.kind = kDdimonExitStatisticsPage;
+      ShpAddExitCounter(&record, info->exit_counters);
+      (*record_count)++;
+    }
+    (*total_count)++;
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return (*record_count < *total_count) ? STATUS_BUFFER_OVERFLOW
+                                        : STATUS_SUCCESS;
+}
+
+// Moves unread records of the exit trace of all processors to records, up to
+// capacity. Returns STATUS_BUFFER_OVERFLOW when records did not fit.
+_Use_decl_annotations_ NTSTATUS ShReadExitTrace(
+  DdimonExitTraceRecord* records, ULONG capacity, ULONG* record_count,
+  ULONG64* lost_count) {
+  PAGED_CODE();
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  *record_count = 0;
+  *lost_count = 0;
+  auto remaining = false;
+  for (auto i = 0ul; i < shared_sh_data->processor_count; ++i) {
+    auto& trace = shared_sh_data->processor_data[i]->exit_trace;
+    *record_count += ShpReadExitTrace(&trace, records + *record_count,
+                                      capacity - *record_count, lost_count);
+    if (*record_count == capacity && trace.write_index != trace.read_index) {
+      remaining = true;
+    }
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return (remaining) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+// Takes a snapshot of calls counted by counting hooks, merged over all
+// processors for each hook. Returns STATUS_BUFFER_OVERFLOW when records were
+// truncated.
+_Use_decl_annotations_ NTSTATUS ShQueryCallers(DdimonCallerStatistics* records,
+                                              ULONG capacity,
+                                              ULONG* record_count,
+                                              ULONG* total_count) {
+  PAGED_CODE();
 
+  auto shared_sh_data = g_shp_shared_sh_data;
+  KeAcquireGuardedMutex(&shared_sh_data->state_lock);
+  *record_count = 0;
+  *total_count = 0;
+  std::vector<DdimonCallerStatistics> merged;
+  for (const auto& info : shared_sh_data->func_hooks) {
+    if (info->handler || !info->original_call) {
+      continue;  // Neither a handler hook nor a patch counts calls
+    }
+    merged.clear();
+    ShpMergeCallers(&merged, *info);
+    for (const auto& record : merged) {
+      if (*total_count < capacity) {
+        records[*total_count] = record;
+        (*record_count)++;
+      }
+      (*total_count)++;
+    }
   }
+  KeReleaseGuardedMutex(&shared_sh_data->state_lock);
+  return (*record_count < *total_count) ? STATUS_BUFFER_OVERFLOW
+                                        : STATUS_SUCCESS;
+}
+
+// Enables page shadowing for hooks by applying commands posted to the
+// command ring of the current processor
+_Use_decl_annotations_ NTSTATUS ShEnablePageShadowing(
+  EptData* ept_data, const SharedShadowHookPatchData* shared_sh_data) {
+  // HYPERPLATFORM_COMMON_DBG_BREAK();
+
+  ShpDrainCommands(ept_data, shared_sh_data);
+  return STATUS_SUCCESS;
+}
+
+// Disables page shadowing for hooks by applying commands posted to the
+// command ring of the current processor
+_Use_decl_annotations_ void ShVmCallDisablePageShadowing(
+  EptData* ept_data, const SharedShadowHookPatchData* shared_sh_data) {
+  // HYPERPLATFORM_COMMON_DBG_BREAK();
+
+  ShpDrainCommands(ept_data, shared_sh_data);
 }
 
 // Handles #BP. Checks if the #BP happened on where DdiMon set a break point,
@@ -329,7 +1238,7 @@ _Use_decl_annotations_ bool ShHandleBreakpoint(
   LastShadowHookData* sh_data, const SharedShadowHookPatchData* shared_sh_data,
   void* guest_ip) {
   UNREFERENCED_PARAMETER(sh_data);
-
+  const auto begin = __rdtsc();
   if (!ShpIsShadowHookActive(shared_sh_data)) {
     return false;
   }
@@ -344,8 +1253,55 @@ _Use_decl_annotations_ bool ShHandleBreakpoint(
     return false;
   }
 
+  // Patches and entries of bundles have neither a handler nor a trampoline to
+  // redirect to, and a #BP in them was not put there by a hook. Reinject it.
+  if (!func_hook_info->original_call || func_hook_info->patch_length) {
+    return false;
+  }
+  auto& exit_counter = ShpGetExitCounter(func_hook_info->exit_counters);
+
+  // Let a hit from a process out of the scope, or a hit of a counting hook,
+  // run the original function through the trampoline. The thread is counted
+  // in the trampoline here since it may be preempted before executing any
+  // instruction of it, and the trampoline counts it out when it leaves.
+  const auto action = ShcDispatchBreakpoint(
+      func_hook_info->scope.get(), UtilVmRead(VmcsField::kGuestCr3),
+      func_hook_info->handler != nullptr);
+  if (action != kShcBreakpointHandler) {
+    auto kind = kDdimonExitTraceOutOfScope;
+    if (action == kShcBreakpointCount) {
+      exit_counter.counted_count++;
+      if (func_hook_info->callers) {
+        const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+        ShcCountCaller(&func_hook_info->callers->histograms[index],
+                       ShpReadReturnAddress());
+      }
+      kind = kDdimonExitTraceCounted;
+    }
+    const auto trampoline =
+        ShcGetTrampolineFromEntry(func_hook_info->original_call);
+    InterlockedIncrementSizeT(&trampoline->in_flight);
+    UtilVmWrite(VmcsField::kGuestRip,
+                reinterpret_cast<ULONG_PTR>(
+                    ShcGetCountedTrampolineEntry(trampoline)));
+    ShpRecordExit(shared_sh_data, kind, guest_ip);
+    exit_counter.breakpoint_count++;
+    exit_counter.breakpoint_cycles += __rdtsc() - begin;
+    return true;
+  }
+
+  // Count the thread as one executing the handler until it calls
+  // ShLeaveHookHandler(). Doing it here rather than in the handler closes a
+  // window between the redirect and the first instruction of the handler.
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  InterlockedIncrement64(
+    &shared_sh_data->processor_data[index]->in_flight_counter.count);
+
   // Update guest's IP
   UtilVmWrite(VmcsField::kGuestRip, reinterpret_cast<ULONG_PTR>(func_hook_info->handler));
+  ShpRecordExit(shared_sh_data, kDdimonExitTraceBreakpoint, guest_ip);
+  exit_counter.breakpoint_count++;
+  exit_counter.breakpoint_cycles += __rdtsc() - begin;
   return true;
 }
 
@@ -353,35 +1309,29 @@ _Use_decl_annotations_ bool ShHandleBreakpoint(
 _Use_decl_annotations_ void ShHandleMonitorTrapFlag(
   LastShadowHookData* sh_data, const SharedShadowHookPatchData* shared_sh_data,
   EptData* ept_data) {
+  const auto begin = __rdtsc();
   NT_VERIFY(ShpIsShadowHookActive(shared_sh_data));
 
   //HYPERPLATFORM_LOG_INFO_SAFE("ShHandleMonitorTrapFlag");
   const auto info = ShpRestoreLastHookInfo(sh_data);
-  switch (info->hook_type)
-  {
-    case FUNC_HOOK:
-    {
-      FunctionHookInformation *func_hook_info = ShpFindFuncHookInfoByPage(shared_sh_data, info->va_base_page_hook);
-      ShpEnablePageShadowingForExec(func_hook_info->patch_address, func_hook_info->pa_base_for_exec,
-        ept_data);
-      break;
-    }
-    case MEM_HOOK:
-    {
-      MemBPInformation *mem_monitor_info = ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
-      ShpDisablePageMonitorForRW(mem_monitor_info, ept_data);
-      break;
-    }
+  ShpShowExecView(sh_data, shared_sh_data, ept_data, *info);
+  ShpSetMonitorTrapFlag(sh_data, false);
+  ShpRecordExit(shared_sh_data, kDdimonExitTraceMonitorTrapFlag,
+                info->va_base_page_hook);
 
+  auto& exit_counter = ShpGetExitCounter(info->exit_counters);
+  if (info->hook_type == MEM_HOOK) {
+    ShpGovernExit(shared_sh_data, ept_data, *info, &exit_counter);
   }
-
-  ShpSetMonitorTrapFlag(sh_data, false);
+  exit_counter.mtf_count++;
+  exit_counter.mtf_cycles += __rdtsc() - begin;
 }
 
 // Handles EPT violation VM-exit.
 _Use_decl_annotations_ void ShHandleEptViolation(
   LastShadowHookData* sh_data, const SharedShadowHookPatchData* shared_sh_data,
   EptData* ept_data, void* fault_va) {
+  const auto begin = __rdtsc();
   //HYPERPLATFORM_LOG_INFO_SAFE("ShHandleEptViolation");
   if (!ShpIsShadowHookActive(shared_sh_data)) {
     return;
@@ -395,31 +1345,84 @@ _Use_decl_annotations_ void ShHandleEptViolation(
   // where currently set as execute only for protecting a hook. Let a guest
   // read or write a page from a read/write shadow page and run a single
   // instruction.
-  switch (info->hook_type) {
+  ShpShowRWView(sh_data, shared_sh_data, ept_data, *info);
+  ShpSetMonitorTrapFlag(sh_data, true);
+  ShpSaveLastHookInfo(sh_data, *info);
+  ShpRecordExit(shared_sh_data, kDdimonExitTraceEptViolation, fault_va);
+
+  if (info->hook_type == MEM_HOOK) {
+    MemBPInformation *mem_monitor_info = ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
+    if ((ULONG64)fault_va >= mem_monitor_info->mem_address &&
+      (ULONG64)fault_va <= mem_monitor_info->mem_address + mem_monitor_info->mem_len) {
+      mem_monitor_info->handler((ULONG64)fault_va, UtilVmRead(VmcsField::kGuestRip));
+    }
+  }
+
+  auto& exit_counter = ShpGetExitCounter(info->exit_counters);
+  exit_counter.ept_violation_count++;
+  exit_counter.ept_violation_cycles += __rdtsc() - begin;
+}
+
+// Exposes the page for read and write, either by switching to the data view
+// or by editing the EPT entry, and accounts cycles it took
+_Use_decl_annotations_ static void ShpShowRWView(
+  LastShadowHookData* sh_data, const SharedShadowHookPatchData* shared_sh_data,
+  EptData* ept_data, const MemHookInformation& info) {
+  const auto begin = __rdtsc();
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  // The data view already maps the page to the read/write copy (or the
+  // original page for a memory monitor) with full access
+  UNREFERENCED_PARAMETER(ept_data);
+  UNREFERENCED_PARAMETER(info);
+  UtilVmWrite64(VmcsField::kEptPointer,
+                EptGetEptPointer(ShpGetDataView(shared_sh_data)));
+#else
+  switch (info.hook_type) {
     case FUNC_HOOK:
-    {
-      ShpEnablePageShadowingForRW(*ShpFindFuncHookInfoByPage(shared_sh_data, info->va_base_page_hook), ept_data);
-      ShpSetMonitorTrapFlag(sh_data, true);
-      ShpSaveLastHookInfo(sh_data, *info);
+      ShpEnablePageShadowingForRW(
+        *ShpFindFuncHookInfoByPage(shared_sh_data, info.va_base_page_hook),
+        ept_data);
       break;
-    }
     case MEM_HOOK:
-    {
-      MemBPInformation *mem_monitor_info = ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
-      ShpEnablePageMonitorForRW(mem_monitor_info, ept_data);
-      ShpSetMonitorTrapFlag(sh_data, true);
-      ShpSaveLastHookInfo(sh_data, *info);
-      if ((ULONG64)fault_va >= mem_monitor_info->mem_address &&
-        (ULONG64)fault_va <= mem_monitor_info->mem_address + mem_monitor_info->mem_len) {
-        mem_monitor_info->handler((ULONG64)fault_va, UtilVmRead(VmcsField::kGuestRip));
-      }
+      ShpEnablePageMonitorForRW(
+        ShpFindMemMonInfoByPage(shared_sh_data, info.va_base_page_hook),
+        ept_data);
       break;
-    }
-
   }
-
+#endif
+  sh_data->view_switch_cycles += __rdtsc() - begin;
+  sh_data->view_switch_count++;
 }
 
+// Hides the page for read and write again, and accounts cycles it took
+_Use_decl_annotations_ static void ShpShowExecView(
+  LastShadowHookData* sh_data, const SharedShadowHookPatchData* shared_sh_data,
+  EptData* ept_data, const MemHookInformation& info) {
+  const auto begin = __rdtsc();
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  // EPT derived translations are tagged with EPTP, so switching back to the
+  // exec view needs no invalidation
+  UNREFERENCED_PARAMETER(shared_sh_data);
+  UNREFERENCED_PARAMETER(info);
+  UtilVmWrite64(VmcsField::kEptPointer, EptGetEptPointer(ept_data));
+#else
+  switch (info.hook_type) {
+    case FUNC_HOOK: {
+      const auto func_hook_info =
+        ShpFindFuncHookInfoByPage(shared_sh_data, info.va_base_page_hook);
+      ShpEnablePageShadowingForExec(func_hook_info->patch_address,
+                                    func_hook_info->pa_base_for_exec, ept_data);
+      break;
+    }
+    case MEM_HOOK:
+      ShpDisablePageMonitorForRW(
+        ShpFindMemMonInfoByPage(shared_sh_data, info.va_base_page_hook),
+        ept_data);
+      break;
+  }
+#endif
+  sh_data->view_switch_cycles += __rdtsc() - begin;
+}
 
 // Set up inline hook at the address without activating it
 _Use_decl_annotations_ bool ShInstallPatch(
@@ -427,6 +1430,18 @@ _Use_decl_annotations_ bool ShInstallPatch(
   ShadowPatchTarget* target) {
   PAGED_CODE();
 
+  const ShpStateLockScope lock(shared_sh_data);
+  // 0xcc or patch bytes written to an exec shadow page in use would be
+  // executed before the hook is published, so hooks must be disabled
+  if (shared_sh_data->hooks_active) {
+    return false;
+  }
+
+  // Only one hook or patch can be installed at an address
+  if (ShpFindFuncHookInfoByAddress(shared_sh_data, address)) {
+    return false;
+  }
+
   auto mem_info = ShpFindPageHookInfoByPage(shared_sh_data, address);
   auto info = ShpCreateHookInformationPatch(
     shared_sh_data, reinterpret_cast<void*>(address), target, mem_info);
@@ -439,18 +1454,135 @@ _Use_decl_annotations_ bool ShInstallPatch(
     return false;
   }
 
+  std::vector<std::unique_ptr<MemHookInformation>> page_infos;
   if (!mem_info) {
     auto new_mem_info = std::make_unique<MemHookInformation>();
     new_mem_info->va_base_page_hook = PAGE_ALIGN((void*)target->target_address);
     new_mem_info->hook_type = FUNC_HOOK;
-    shared_sh_data->all_page_hooks.push_back(std::move(new_mem_info));
+    new_mem_info->enabled = true;
+    page_infos.push_back(std::move(new_mem_info));
   }
 
   HYPERPLATFORM_LOG_DEBUG(
     "Patch = %p, Exec = %p, RW = %p", info->patch_address,
     info->shadow_page_base_for_exec->page + BYTE_OFFSET(info->patch_address),
     info->shadow_page_base_for_rw->page + BYTE_OFFSET(info->patch_address));
-  shared_sh_data->func_hooks.push_back(std::move(info));
+  std::vector<std::unique_ptr<FunctionHookInformation>> infos;
+  infos.push_back(std::move(info));
+  ShpPublishHooks(shared_sh_data, &page_infos, &infos, nullptr);
+  return true;
+}
+
+// Installs patches at all regions without activating them. Every region is
+// verified before any of them is written, so either all regions are patched
+// or none is. Regions on the same page share a pair of shadow pages, and
+// caches are invalidated once by ShEnableHooks().
+_Use_decl_annotations_ bool ShInstallPatchBundle(
+  SharedShadowHookPatchData* shared_sh_data, const ShadowPatchRegion* regions,
+  ULONG region_count) {
+  PAGED_CODE();
+
+  const ShpStateLockScope lock(shared_sh_data);
+  // 0xcc or patch bytes written to an exec shadow page in use would be
+  // executed before the hook is published, so hooks must be disabled
+  if (shared_sh_data->hooks_active) {
+    return false;
+  }
+
+  if (!region_count) {
+    return false;
+  }
+
+  // Visit regions in order of address so that ones on a page are adjacent
+  std::vector<const ShadowPatchRegion*> sorted_regions(region_count);
+  for (auto i = 0ul; i < region_count; ++i) {
+    sorted_regions[i] = &regions[i];
+  }
+  std::sort(sorted_regions.begin(), sorted_regions.end(),
+            [](const auto lhs, const auto rhs) {
+              return lhs->address < rhs->address;
+            });
+
+  // Build all hooks first. Returning from this loop discards them and leaves
+  // every shadow page untouched.
+  std::vector<std::unique_ptr<FunctionHookInformation>> infos;
+  std::vector<std::unique_ptr<MemHookInformation>> page_infos;
+  infos.reserve(region_count);
+  for (auto i = 0ul; i < region_count; ++i) {
+    const auto& region = *sorted_regions[i];
+    const auto address = static_cast<UCHAR*>(region.address);
+    if (!region.length || BYTE_OFFSET(address) + region.length > PAGE_SIZE) {
+      HYPERPLATFORM_LOG_ERROR("Patch region at %p crosses a page.", address);
+      return false;
+    }
+    if ((i && static_cast<UCHAR*>(sorted_regions[i - 1]->address) +
+                      sorted_regions[i - 1]->length > address) ||
+        ShpOverlapsFuncHook(shared_sh_data, address, region.length)) {
+      HYPERPLATFORM_LOG_ERROR("Patch region at %p overlaps another.",
+                              address);
+      return false;
+    }
+
+    auto info = std::make_unique<FunctionHookInformation>();
+    const FunctionHookInformation* reusable_info = nullptr;
+    if (!infos.empty() &&
+        PAGE_ALIGN(infos.back()->patch_address) == PAGE_ALIGN(address)) {
+      reusable_info = infos.back().get();
+    } else if (const auto page_hook_info =
+                   ShpFindPageHookInfoByPage(shared_sh_data, address)) {
+      if (page_hook_info->hook_type != FUNC_HOOK) {
+        HYPERPLATFORM_LOG_ERROR("Patch region at %p is on a monitored page.",
+                                address);
+        return false;
+      }
+      reusable_info = ShpFindFuncHookInfoByPage(shared_sh_data, address);
+    }
+    if (reusable_info) {
+      info->shadow_page_base_for_rw = reusable_info->shadow_page_base_for_rw;
+      info->shadow_page_base_for_exec =
+        reusable_info->shadow_page_base_for_exec;
+    } else {
+      info->shadow_page_base_for_rw = std::make_shared<Page>();
+      info->shadow_page_base_for_exec = std::make_shared<Page>();
+      const auto page_base = PAGE_ALIGN(address);
+      RtlCopyMemory(info->shadow_page_base_for_rw->page, page_base, PAGE_SIZE);
+      RtlCopyMemory(info->shadow_page_base_for_exec->page, page_base,
+                    PAGE_SIZE);
+
+      auto page_info = std::make_unique<MemHookInformation>();
+      page_info->va_base_page_hook = page_base;
+      page_info->hook_type = FUNC_HOOK;
+      page_info->enabled = true;
+      page_infos.push_back(std::move(page_info));
+    }
+
+    // Compare with the RW shadow page, which always holds what a guest sees
+    const auto current_code =
+      info->shadow_page_base_for_rw->page + BYTE_OFFSET(address);
+    if (!RtlEqualMemory(current_code, region.expected_code, region.length)) {
+      HYPERPLATFORM_LOG_ERROR("Patch region at %p has unexpected bytes.",
+                              address);
+      return false;
+    }
+
+    info->patch_address = address;
+    info->pa_base_for_rw = UtilPaFromVa(info->shadow_page_base_for_rw->page);
+    info->pa_base_for_exec =
+      UtilPaFromVa(info->shadow_page_base_for_exec->page);
+    info->patch_length = region.length;
+    info->new_code = const_cast<UCHAR*>(region.new_code);
+    info->enabled = true;
+    infos.push_back(std::move(info));
+  }
+
+  // All regions are verified. Write them in one pass and publish the hooks.
+  for (const auto& info : infos) {
+    ShpSetupPatch(info->patch_address, info->shadow_page_base_for_exec->page,
+                  info->new_code, info->patch_length);
+  }
+  HYPERPLATFORM_LOG_DEBUG("Patch bundle = %lu regions on %Iu new pages",
+                          region_count, page_infos.size());
+  ShpPublishHooks(shared_sh_data, &page_infos, &infos, nullptr);
   return true;
 }
 
@@ -460,6 +1592,17 @@ _Use_decl_annotations_ bool ShInstallHook(
   ShadowHookTarget* target) {
   PAGED_CODE();
 
+  const ShpStateLockScope lock(shared_sh_data);
+  // 0xcc or patch bytes written to an exec shadow page in use would be
+  // executed before the hook is published, so hooks must be disabled
+  if (shared_sh_data->hooks_active) {
+    return false;
+  }
+
+  if (ShpFindFuncHookInfoByAddress(shared_sh_data, address)) {
+    return false;
+  }
+
   auto mem_info = ShpFindPageHookInfoByPage(shared_sh_data, address);
   auto info = ShpCreateHookInformation(
     shared_sh_data, reinterpret_cast<void*>(address), target, mem_info);
@@ -478,15 +1621,20 @@ _Use_decl_annotations_ bool ShInstallHook(
     info->shadow_page_base_for_exec->page + BYTE_OFFSET(info->patch_address),
     info->shadow_page_base_for_rw->page + BYTE_OFFSET(info->patch_address),
     target->original_call);
+  info->original_call = target->original_call;
 
+  std::vector<std::unique_ptr<MemHookInformation>> page_infos;
   if (!mem_info) {
     auto new_mem_info = std::make_unique<MemHookInformation>();
     new_mem_info->va_base_page_hook = (void*)target->target_address;
     new_mem_info->hook_type = FUNC_HOOK;
-    shared_sh_data->all_page_hooks.push_back(std::move(new_mem_info));
+    new_mem_info->enabled = true;
+    page_infos.push_back(std::move(new_mem_info));
   }
 
-  shared_sh_data->func_hooks.push_back(std::move(info));
+  std::vector<std::unique_ptr<FunctionHookInformation>> infos;
+  infos.push_back(std::move(info));
+  ShpPublishHooks(shared_sh_data, &page_infos, &infos, nullptr);
   return true;
 }
 
@@ -526,6 +1674,7 @@ ShpCreateHookInformationPatch(SharedShadowHookPatchData* shared_sh_data,
   info->pa_base_for_exec = UtilPaFromVa(info->shadow_page_base_for_exec->page);
   info->patch_length = target->patch_length;
   info->new_code = target->new_code;
+  info->enabled = true;
 
   return info;
 }
@@ -564,6 +1713,10 @@ ShpCreateHookInformation(SharedShadowHookPatchData* shared_sh_data,
   info->pa_base_for_rw = UtilPaFromVa(info->shadow_page_base_for_rw->page);
   info->pa_base_for_exec = UtilPaFromVa(info->shadow_page_base_for_exec->page);
   info->handler = target->handler;
+  info->enabled = true;
+  if (!target->handler && target->count_callers) {
+    info->callers = std::make_unique<ShpCallerHistograms>();
+  }
 
   return info;
 }
@@ -582,8 +1735,6 @@ _Use_decl_annotations_ static bool ShpSetupPatch(void* patch_address,
 
   RtlCopyMemory(shadow_exec_page + BYTE_OFFSET(patch_address), patch_code,
     code_len);
-
-  KeInvalidateAllCaches();
   return true;
 }
 
@@ -599,29 +1750,23 @@ _Use_decl_annotations_ static bool ShpSetupInlineHook(
   }
 
   // Build trampoline code (copied stub -> in the middle of original)
-  const auto jmp_to_original = ShpMakeTrampolineCode(
-    reinterpret_cast<UCHAR*>(patch_address) + patch_size);
 #pragma warning(push)
 #pragma warning(disable : 30030)  // Allocating executable POOL_TYPE memory
-  const auto original_call = ExAllocatePoolWithTag(
-    NonPagedPoolExecute, patch_size + sizeof(jmp_to_original),
-    kHyperPlatformCommonPoolTag);
+  const auto trampoline = reinterpret_cast<ShcTrampoline*>(
+    ExAllocatePoolWithTag(NonPagedPoolExecute, sizeof(ShcTrampoline),
+                          kHyperPlatformCommonPoolTag));
 #pragma warning(pop)
-  if (!original_call) {
+  if (!trampoline) {
+    return false;
+  }
+  if (!ShcBuildTrampoline(
+          trampoline, reinterpret_cast<UCHAR*>(patch_address),
+          static_cast<ULONG>(patch_size),
+          reinterpret_cast<UCHAR*>(patch_address) + patch_size,
+          const_cast<ShcTrampolineExit*>(&kShpTrampolineExit))) {
+    ExFreePoolWithTag(trampoline, kHyperPlatformCommonPoolTag);
     return false;
   }
-
-  // Copy original code and embed jump code following original code
-  RtlCopyMemory(original_call, patch_address, patch_size);
-#pragma warning(push)
-#pragma warning(disable : 6386)
-  // Buffer overrun while writing to 'reinterpret_cast<UCHAR
-  // *>original_call+patch_size':  the writable size is
-  // 'patch_size+sizeof((jmp_to_original))' bytes, but '15' bytes might be
-  // written.
-  RtlCopyMemory(reinterpret_cast<UCHAR*>(original_call) + patch_size,
-    &jmp_to_original, sizeof(jmp_to_original));
-#pragma warning(pop)
 
   // install patch to shadow page
   static const UCHAR kBreakpoint[] = {
@@ -630,9 +1775,7 @@ _Use_decl_annotations_ static bool ShpSetupInlineHook(
   RtlCopyMemory(shadow_exec_page + BYTE_OFFSET(patch_address), kBreakpoint,
     sizeof(kBreakpoint));
 
-  KeInvalidateAllCaches();
-
-  *original_call_ptr = original_call;
+  *original_call_ptr = ShcGetTrampolineEntry(trampoline);
   return true;
 }
 
@@ -666,8 +1809,15 @@ _Use_decl_annotations_ static SIZE_T ShpGetInstructionSize(void* address) {
     return 0;
   }
 
-  // Get a size of the first instruction
-  const auto size = instructions[0].size;
+  // Get a size of the first instruction. A branch or an instruction relative
+  // to RIP cannot be copied to a trampoline as it is, and is refused.
+  const auto& instruction = instructions[0];
+  const auto is_relative = strstr(instruction.op_str, "rip") ||
+                           instruction.mnemonic[0] == 'j' ||
+                           !strncmp(instruction.mnemonic, "call", 4) ||
+                           !strncmp(instruction.mnemonic, "loop", 4) ||
+                           !strcmp(instruction.mnemonic, "xbegin");
+  const auto size = (is_relative) ? 0 : instruction.size;
   cs_free(instructions, count);
   cs_close(&handle);
 
@@ -676,55 +1826,133 @@ _Use_decl_annotations_ static SIZE_T ShpGetInstructionSize(void* address) {
   return size;
 }
 
-// Returns code bytes for inline hooking
-_Use_decl_annotations_ static TrampolineCode ShpMakeTrampolineCode(
-  void* hook_handler) {
-  PAGED_CODE();
-
-#if defined(_AMD64_)
-  // 90               nop
-  // ff2500000000     jmp     qword ptr cs:jmp_addr
-  // jmp_addr:
-  // 0000000000000000 dq 0
-  return {
-      0x90,
-      {
-          0xff,
-          0x25,
-          0x00,
-          0x00,
-          0x00,
-          0x00,
-      },
-      hook_handler,
-  };
-#else
-  // 90               nop
-  // 6832e30582       push    offset nt!ExFreePoolWithTag + 0x2 (8205e332)
-  // c3               ret
-  return {
-      0x90,
-      0x68,
-      hook_handler,
-      0xc3,
-  };
-#endif
-}
-
 // Find a HookInformation instance by address
 _Use_decl_annotations_ static MemHookInformation* ShpFindPageHookInfoByPage(
   const SharedShadowHookPatchData* shared_sh_data, void* address) {
-  const auto found = std::find_if(
-    shared_sh_data->all_page_hooks.cbegin(), shared_sh_data->all_page_hooks.cend(),
-    [address](const auto& info) {
-    return PAGE_ALIGN(info->va_base_page_hook) == PAGE_ALIGN(address);
-  });
-  if (found == shared_sh_data->all_page_hooks.cend()) {
+  const auto& all_page_hooks = shared_sh_data->all_page_hooks;
+  const auto page = reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(address));
+  const auto found = std::lower_bound(
+    all_page_hooks.cbegin(), all_page_hooks.cend(), page, ShpIsPageHookBefore);
+  if (found == all_page_hooks.cend() ||
+      PAGE_ALIGN((*found)->va_base_page_hook) != PAGE_ALIGN(address)) {
     return nullptr;
   }
   return found->get();
 }
 
+// Orders page hooks by their pages
+_Use_decl_annotations_ static bool ShpIsPageHookBefore(
+  const std::unique_ptr<MemHookInformation>& info, ULONG_PTR page) {
+  return reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(info->va_base_page_hook)) <
+         page;
+}
+
+// Orders hooks and patches by their addresses
+_Use_decl_annotations_ static bool ShpIsFuncHookBefore(
+  const std::unique_ptr<FunctionHookInformation>& info, ULONG_PTR address) {
+  return reinterpret_cast<ULONG_PTR>(info->patch_address) < address;
+}
+
+// Adds a page hook to all_page_hooks keeping it sorted. Called by
+// ShpAttachHooks() with enough capacity reserved.
+_Use_decl_annotations_ static void ShpInsertPageHook(
+  SharedShadowHookPatchData* shared_sh_data,
+  std::unique_ptr<MemHookInformation> info) {
+  auto& all_page_hooks = shared_sh_data->all_page_hooks;
+  const auto page =
+    reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(info->va_base_page_hook));
+  const auto position = std::lower_bound(
+    all_page_hooks.begin(), all_page_hooks.end(), page, ShpIsPageHookBefore);
+  all_page_hooks.insert(position, std::move(info));
+}
+
+// Adds a hook or a patch to func_hooks keeping it sorted. Called by
+// ShpAttachHooks() with enough capacity reserved.
+_Use_decl_annotations_ static void ShpInsertFuncHook(
+  SharedShadowHookPatchData* shared_sh_data,
+  std::unique_ptr<FunctionHookInformation> info) {
+  auto& func_hooks = shared_sh_data->func_hooks;
+  const auto address = reinterpret_cast<ULONG_PTR>(info->patch_address);
+  const auto position = std::lower_bound(
+    func_hooks.begin(), func_hooks.end(), address, ShpIsFuncHookBefore);
+  func_hooks.insert(position, std::move(info));
+}
+
+// Returns storage that has capacity for live and count more elements when
+// live does not, or an empty vector. ShpAttachHooks() moves elements into it.
+template <typename T>
+static std::vector<T> ShpReserveGrowth(const std::vector<T>& live,
+                                       size_t count) {
+  std::vector<T> grown;
+  if (live.capacity() < live.size() + count) {
+    grown.reserve(std::max(live.size() + count, live.capacity() * 2));
+  }
+  return grown;
+}
+
+// Moves elements of live into grown and exchanges them, unless grown is
+// empty. The old storage is left in grown to be freed later.
+template <typename T>
+static void ShpAdoptGrowth(std::vector<T>* live, std::vector<T>* grown) {
+  if (!grown->capacity()) {
+    return;
+  }
+  for (auto& element : *live) {
+    grown->push_back(std::move(element));
+  }
+  live->swap(*grown);
+}
+
+// Adds new page hooks, hooks or patches and a memory monitor to the sorted
+// vectors searched by VM-exit handlers. Handlers search them in VMX-root mode
+// at any time, even while hooks are disabled (eg, on int3 in user-mode), so
+// they are modified only while other processors are stopped. Memory needed
+// for that is allocated here beforehand, and old storage is freed after.
+_Use_decl_annotations_ static void ShpPublishHooks(
+  SharedShadowHookPatchData* shared_sh_data,
+  std::vector<std::unique_ptr<MemHookInformation>>* page_hooks,
+  std::vector<std::unique_ptr<FunctionHookInformation>>* func_hooks,
+  std::unique_ptr<MemBPInformation>* mem_hook) {
+  PAGED_CODE();
+
+  ShpAttachContext context = {shared_sh_data, page_hooks, func_hooks,
+                              mem_hook};
+  context.grown_page_hooks =
+    ShpReserveGrowth(shared_sh_data->all_page_hooks, page_hooks->size());
+  context.grown_func_hooks =
+    ShpReserveGrowth(shared_sh_data->func_hooks, func_hooks->size());
+  context.grown_mem_hooks =
+    ShpReserveGrowth(shared_sh_data->mem_hooks, (mem_hook) ? 1 : 0);
+  ShpRunExclusively(ShpAttachHooks, &context);
+  page_hooks->clear();
+  func_hooks->clear();
+}
+
+// Moves hooks of ShpAttachContext into the vectors of shared data without
+// allocating memory
+_Use_decl_annotations_ static void ShpAttachHooks(void* context) {
+  const auto attach_context = reinterpret_cast<ShpAttachContext*>(context);
+  auto shared_sh_data = attach_context->shared_sh_data;
+
+  ShpAdoptGrowth(&shared_sh_data->all_page_hooks,
+                 &attach_context->grown_page_hooks);
+  ShpAdoptGrowth(&shared_sh_data->func_hooks,
+                 &attach_context->grown_func_hooks);
+  ShpAdoptGrowth(&shared_sh_data->mem_hooks,
+                 &attach_context->grown_mem_hooks);
+  for (auto& page_hook : *attach_context->page_hooks) {
+    ShpInsertPageHook(shared_sh_data, std::move(page_hook));
+  }
+  for (auto& func_hook : *attach_context->func_hooks) {
+    ShpInsertFuncHook(shared_sh_data, std::move(func_hook));
+  }
+  if (attach_context->mem_hook) {
+    shared_sh_data->mem_hooks.push_back(std::move(*attach_context->mem_hook));
+  }
+}
+
+#if !DDIMON_SH_USE_DUAL_EPT_VIEWS
+
 _Use_decl_annotations_ static void ShpEnablePageMonitorForRW(
   MemBPInformation* info, EptData* ept_data) {
   const auto pa_base = UtilPaFromVa(PAGE_ALIGN(info->mem_address));
@@ -776,18 +2004,6 @@ _Use_decl_annotations_ static void ShpEnablePageShadowingForRW(
   UtilInveptGlobal();
 }
 
-// Stop showing a shadow page
-_Use_decl_annotations_ static void ShpDisablePageShadowingForFuncHook(
-  const FunctionHookInformation& info, EptData* ept_data) {
-  const auto pa_base = UtilPaFromVa(PAGE_ALIGN(info.patch_address));
-  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, pa_base);
-  ept_pt_entry->fields.write_access = true;
-  ept_pt_entry->fields.read_access = true;
-  ept_pt_entry->fields.physial_address = UtilPfnFromPa(pa_base);
-
-  UtilInveptGlobal();
-}
-
 // Stop showing a shadow page
 _Use_decl_annotations_ static void ShpDisablePageMonitorForRW(
   MemBPInformation *info, EptData* ept_data) {
@@ -807,6 +2023,8 @@ _Use_decl_annotations_ static void ShpDisablePageMonitorForRW(
   UtilInveptGlobal();
 }
 
+#endif  // !DDIMON_SH_USE_DUAL_EPT_VIEWS
+
 // Set MTF on the current processor
 _Use_decl_annotations_ static void ShpSetMonitorTrapFlag(
   LastShadowHookData* sh_data, bool enable) {
@@ -832,6 +2050,64 @@ _Use_decl_annotations_ static const MemHookInformation* ShpRestoreLastHookInfo(
   return info;
 }
 
+// Records a VM-exit in the trace of the current processor, overwriting the
+// oldest record when the trace is full
+_Use_decl_annotations_ static void ShpRecordExit(
+  const SharedShadowHookPatchData* shared_sh_data, DdimonExitTraceKind kind,
+  void* address) {
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  auto& trace = shared_sh_data->processor_data[processor]->exit_trace;
+  const auto index = trace.write_index;
+  auto& record = trace.records[index % kShpExitTraceRecordCount];
+  record.tsc = __rdtsc();
+  record.page_number = reinterpret_cast<ULONG_PTR>(address) >> PAGE_SHIFT;
+  record.processor = processor;
+  record.kind = kind;
+
+  // Let the reader see the record before the index. Stores are not reordered
+  // with other stores on x86, so only the compiler needs to be stopped.
+  _WriteBarrier();
+  trace.write_index = index + 1;
+}
+
+// Moves unread records of a single processor to records, up to capacity, and
+// returns the number of moved records. Records the processor overwrote before
+// or while being copied are discarded and added to lost_count.
+_Use_decl_annotations_ static ULONG ShpReadExitTrace(
+  ShpExitTrace* trace, DdimonExitTraceRecord* records, ULONG capacity,
+  ULONG64* lost_count) {
+  PAGED_CODE();
+
+  auto write_index = trace->write_index;
+  _ReadBarrier();
+  auto read_index = trace->read_index;
+  if (write_index - read_index > kShpExitTraceRecordCount) {
+    *lost_count += write_index - read_index - kShpExitTraceRecordCount;
+    read_index = write_index - kShpExitTraceRecordCount;
+  }
+
+  auto count = static_cast<ULONG>(
+    std::min<ULONG64>(capacity, write_index - read_index));
+  for (auto i = 0ul; i < count; ++i) {
+    records[i] = trace->records[(read_index + i) % kShpExitTraceRecordCount];
+  }
+
+  // Records older than a ring behind the latest index may have been
+  // overwritten while being copied
+  _ReadBarrier();
+  write_index = trace->write_index;
+  if (write_index - read_index > kShpExitTraceRecordCount) {
+    const auto overwritten = static_cast<ULONG>(std::min<ULONG64>(
+      count, write_index - read_index - kShpExitTraceRecordCount));
+    *lost_count += overwritten;
+    read_index += overwritten;
+    count -= overwritten;
+    RtlMoveMemory(records, records + overwritten, sizeof(*records) * count);
+  }
+  trace->read_index = read_index + count;
+  return count;
+}
+
 // Checks if DdiMon is already initialized
 _Use_decl_annotations_ static bool ShpIsShadowHookActive(
   const SharedShadowHookPatchData* shared_sh_data) {
@@ -851,26 +2127,341 @@ Page::Page()
 // De-allocates the allocated page
 Page::~Page() { ExFreePoolWithTag(page, kHyperPlatformCommonPoolTag); }
 
+// Allocates zeroed counters, one for each processor
+ShpExitCounters::ShpExitCounters()
+  : index(ShpAllocateExitCounter(g_shp_shared_sh_data)) {
+  if (index == MAXULONG) {
+    HYPERPLATFORM_COMMON_BUG_CHECK(
+      HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
+  }
+}
+
+// De-allocates the counters
+ShpExitCounters::~ShpExitCounters() {
+  ShpFreeExitCounter(g_shp_shared_sh_data, index);
+}
+
+// Allocates histograms for all processors
+ShpCallerHistograms::ShpCallerHistograms() {
+  const auto histograms_size = sizeof(ShcCallerHistogram) *
+    KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  histograms = reinterpret_cast<ShcCallerHistogram*>(ExAllocatePoolWithTag(
+    NonPagedPoolCacheAligned, histograms_size, kHyperPlatformCommonPoolTag));
+  if (!histograms) {
+    HYPERPLATFORM_COMMON_BUG_CHECK(
+      HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
+  }
+  RtlZeroMemory(histograms, histograms_size);
+}
+
+// De-allocates the histograms
+ShpCallerHistograms::~ShpCallerHistograms() {
+  ExFreePoolWithTag(histograms, kHyperPlatformCommonPoolTag);
+}
+
+// Returns the NUMA node of the processor, or 0 when it is not found
+_Use_decl_annotations_ static USHORT ShpGetProcessorNode(ULONG processor) {
+  PAGED_CODE();
+
+  PROCESSOR_NUMBER number = {};
+  if (!NT_SUCCESS(KeGetProcessorNumberFromIndex(processor, &number))) {
+    return 0;
+  }
+  const auto highest_node = KeQueryHighestNodeNumber();
+  for (USHORT node = 0; node <= highest_node; ++node) {
+    GROUP_AFFINITY affinity = {};
+    KeQueryNodeActiveAffinity(node, &affinity, nullptr);
+    if (affinity.Group == number.Group &&
+        (affinity.Mask & (static_cast<KAFFINITY>(1) << number.Number))) {
+      return node;
+    }
+  }
+  return 0;
+}
+
+// Allocates zeroed, page-aligned memory from the NUMA node. It is freed with
+// MmFreeContiguousMemory().
+_Use_decl_annotations_ static void* ShpAllocateOnNode(SIZE_T size,
+                                                      USHORT node) {
+  PAGED_CODE();
+
+  PHYSICAL_ADDRESS lowest_acceptable_address = {};
+  PHYSICAL_ADDRESS highest_acceptable_address = {};
+  highest_acceptable_address.QuadPart = -1;
+  PHYSICAL_ADDRESS boundary_address_multiple = {};
+  const auto p = MmAllocateContiguousMemorySpecifyCacheNode(
+    size, lowest_acceptable_address, highest_acceptable_address,
+    boundary_address_multiple, MmCached, node);
+  if (p) {
+    RtlZeroMemory(p, size);
+  }
+  return p;
+}
+
+// Allocates ShpProcessorData of each processor from the NUMA node of the
+// processor
+_Use_decl_annotations_ static bool ShpAllocateProcessorData(
+  SharedShadowHookPatchData* shared_sh_data) {
+  PAGED_CODE();
+
+  const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  shared_sh_data->processor_data = reinterpret_cast<ShpProcessorData**>(
+    ExAllocatePoolWithTag(NonPagedPool, sizeof(ShpProcessorData*) * count,
+                          kHyperPlatformCommonPoolTag));
+  if (!shared_sh_data->processor_data) {
+    return false;
+  }
+  RtlZeroMemory(shared_sh_data->processor_data,
+                sizeof(ShpProcessorData*) * count);
+  shared_sh_data->processor_count = count;
+
+  for (auto i = 0ul; i < count; ++i) {
+    const auto processor_data = reinterpret_cast<ShpProcessorData*>(
+      ShpAllocateOnNode(sizeof(ShpProcessorData), ShpGetProcessorNode(i)));
+    if (!processor_data) {
+      ShpFreeProcessorData(shared_sh_data);
+      return false;
+    }
+    CrInitializeRing(&processor_data->command_ring);
+    shared_sh_data->processor_data[i] = processor_data;
+  }
+  return true;
+}
+
+// Frees ShpProcessorData of all processors along with their exit counters
+_Use_decl_annotations_ static void ShpFreeProcessorData(
+  SharedShadowHookPatchData* shared_sh_data) {
+  PAGED_CODE();
+
+  if (!shared_sh_data->processor_data) {
+    return;
+  }
+  for (auto i = 0ul; i < shared_sh_data->processor_count; ++i) {
+    const auto processor_data = shared_sh_data->processor_data[i];
+    if (!processor_data) {
+      continue;
+    }
+    for (auto chunk = 0ul; chunk < kShpMaxExitCounterChunks; ++chunk) {
+      if (processor_data->exit_counter_chunks[chunk]) {
+        MmFreeContiguousMemory(processor_data->exit_counter_chunks[chunk]);
+      }
+    }
+    MmFreeContiguousMemory(processor_data);
+  }
+  ExFreePoolWithTag(shared_sh_data->processor_data,
+                    kHyperPlatformCommonPoolTag);
+  shared_sh_data->processor_data = nullptr;
+}
+
+// Takes an exit counter from the free list, or from a chunk added on the
+// NUMA node of each processor when none is free, and zeroes it on all
+// processors. Returns MAXULONG when no chunk can be added.
+_Use_decl_annotations_ static ULONG ShpAllocateExitCounter(
+  SharedShadowHookPatchData* shared_sh_data) {
+  PAGED_CODE();
+
+  KeAcquireGuardedMutex(&shared_sh_data->exit_counter_lock);
+  ULONG index = MAXULONG;
+  if (!shared_sh_data->free_exit_counters.empty()) {
+    index = shared_sh_data->free_exit_counters.back();
+    shared_sh_data->free_exit_counters.pop_back();
+  } else if (shared_sh_data->exit_counter_count <
+             shared_sh_data->exit_counter_chunk_count *
+                 kShpExitCountersPerChunk) {
+    index = shared_sh_data->exit_counter_count++;
+  } else if (shared_sh_data->exit_counter_chunk_count <
+             kShpMaxExitCounterChunks) {
+    // A new chunk is written to slots no VM-exit handler reads yet, and is
+    // published to them with the hook that uses it
+    const auto chunk = shared_sh_data->exit_counter_chunk_count;
+    auto allocated = true;
+    for (auto i = 0ul; i < shared_sh_data->processor_count; ++i) {
+      const auto counters = reinterpret_cast<ShpExitCounter*>(
+        ShpAllocateOnNode(sizeof(ShpExitCounter) * kShpExitCountersPerChunk,
+                          ShpGetProcessorNode(i)));
+      if (!counters) {
+        allocated = false;
+        break;
+      }
+      shared_sh_data->processor_data[i]->exit_counter_chunks[chunk] =
+        counters;
+    }
+    // Chunks allocated for some processors are kept for the next attempt
+    if (allocated) {
+      shared_sh_data->exit_counter_chunk_count++;
+      index = shared_sh_data->exit_counter_count++;
+    }
+  }
+  KeReleaseGuardedMutex(&shared_sh_data->exit_counter_lock);
+  if (index == MAXULONG) {
+    return index;
+  }
+
+  for (auto i = 0ul; i < shared_sh_data->processor_count; ++i) {
+    RtlZeroMemory(&ShpGetExitCounterOf(index, i), sizeof(ShpExitCounter));
+  }
+  return index;
+}
+
+// Returns an exit counter to the free list. Counters are not freed during
+// ShFreeSharedShadowHookData(), which frees all chunks at once.
+_Use_decl_annotations_ static void ShpFreeExitCounter(
+  SharedShadowHookPatchData* shared_sh_data, ULONG index) {
+  PAGED_CODE();
+
+  if (!shared_sh_data) {
+    return;
+  }
+  KeAcquireGuardedMutex(&shared_sh_data->exit_counter_lock);
+  shared_sh_data->free_exit_counters.push_back(index);
+  KeReleaseGuardedMutex(&shared_sh_data->exit_counter_lock);
+}
+
+// Returns an exit counter of the index on the processor
+_Use_decl_annotations_ static ShpExitCounter& ShpGetExitCounterOf(
+  ULONG index, ULONG processor) {
+  const auto chunks =
+    g_shp_shared_sh_data->processor_data[processor]->exit_counter_chunks;
+  return chunks[index / kShpExitCountersPerChunk]
+               [index % kShpExitCountersPerChunk];
+}
+
+// Returns a counter of the current processor
+_Use_decl_annotations_ static ShpExitCounter& ShpGetExitCounter(
+  const ShpExitCounters& exit_counters) {
+  return ShpGetExitCounterOf(exit_counters.index,
+                             KeGetCurrentProcessorNumberEx(nullptr));
+}
+
+// Adds counters of all processors to statistics
+_Use_decl_annotations_ static void ShpAddExitCounter(
+  DdimonExitStatistics* statistics, const ShpExitCounters& exit_counters) {
+  PAGED_CODE();
+
+  const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  for (auto i = 0ul; i < count; ++i) {
+    const auto& counter = ShpGetExitCounterOf(exit_counters.index, i);
+    statistics->breakpoint_count += counter.breakpoint_count;
+    statistics->breakpoint_cycles += counter.breakpoint_cycles;
+    statistics->ept_violation_count += counter.ept_violation_count;
+    statistics->ept_violation_cycles += counter.ept_violation_cycles;
+    statistics->mtf_count += counter.mtf_count;
+    statistics->mtf_cycles += counter.mtf_cycles;
+    statistics->demotion_count += counter.demotion_count;
+    statistics->promotion_count += counter.promotion_count;
+  }
+}
+
+// Reads an address the hooked function returns to, or returns 0 when it
+// cannot be read safely. #BP is raised on the first instruction of the
+// function, so it is at the top of the guest stack. A kernel stack of the
+// running thread is resident and mapped in any address space.
+static ULONG_PTR ShpReadReturnAddress() {
+  const auto guest_sp = UtilVmRead(VmcsField::kGuestRsp);
+  if (guest_sp < reinterpret_cast<ULONG_PTR>(MmSystemRangeStart) ||
+      BYTE_OFFSET(guest_sp) > PAGE_SIZE - sizeof(ULONG_PTR)) {
+    return 0;
+  }
+  return *reinterpret_cast<const ULONG_PTR*>(guest_sp);
+}
+
+// Appends calls of the counting hook summed over all processors to merged,
+// one record for each return address followed by calls from other callers
+_Use_decl_annotations_ static void ShpMergeCallers(
+  std::vector<DdimonCallerStatistics>* merged,
+  const FunctionHookInformation& info) {
+  PAGED_CODE();
+
+  const auto hook_address = reinterpret_cast<ULONG64>(info.patch_address);
+  ULONG64 other_count = 0;
+  const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+  // Without histograms, all calls are reported as not keyed by callers
+  if (!info.callers) {
+    for (auto i = 0ul; i < count; ++i) {
+      other_count +=
+        ShpGetExitCounterOf(info.exit_counters.index, i).counted_count;
+    }
+    merged->push_back({hook_address, 0, other_count});
+    return;
+  }
+
+  for (auto i = 0ul; i < count; ++i) {
+    const auto& histogram = info.callers->histograms[i];
+    other_count += histogram.other_count;
+    for (auto slot = 0ul; slot < kShcCallerSlotCount; ++slot) {
+      const auto return_address = histogram.return_addresses[slot];
+      if (!return_address) {
+        continue;
+      }
+      auto record = std::find_if(
+        merged->begin(), merged->end(), [return_address](const auto& other) {
+          return other.return_address == return_address;
+        });
+      if (record == merged->end()) {
+        merged->push_back({hook_address, return_address, 0});
+        record = merged->end() - 1;
+      }
+      record->call_count += histogram.counts[slot];
+    }
+  }
+  if (other_count || merged->empty()) {
+    merged->push_back({hook_address, 0, other_count});
+  }
+}
+
+// Returns the first hook (in address order) on the page
 _Use_decl_annotations_ static FunctionHookInformation* ShpFindFuncHookInfoByPage(
   const SharedShadowHookPatchData* shared_sh_data, void *address) {
 
-  auto func_hook = std::find_if(
-    shared_sh_data->func_hooks.cbegin(), shared_sh_data->func_hooks.cend(),
-    [address](const auto& info) { return PAGE_ALIGN(info->patch_address) == PAGE_ALIGN(address); });
-  if (func_hook == shared_sh_data->func_hooks.cend()) {
+  const auto& func_hooks = shared_sh_data->func_hooks;
+  const auto page = reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(address));
+  auto func_hook = std::lower_bound(func_hooks.cbegin(), func_hooks.cend(),
+                                    page, ShpIsFuncHookBefore);
+  if (func_hook == func_hooks.cend() ||
+      PAGE_ALIGN((*func_hook)->patch_address) != PAGE_ALIGN(address)) {
     return nullptr;
   }
 
   return func_hook->get();
 }
 
+// Checks if any byte of the range is modified by a hook or a patch
+_Use_decl_annotations_ static bool ShpOverlapsFuncHook(
+  const SharedShadowHookPatchData* shared_sh_data, void* address,
+  ULONG length) {
+  const auto& func_hooks = shared_sh_data->func_hooks;
+  const auto begin = reinterpret_cast<ULONG_PTR>(address);
+  const auto end = begin + length;
+  for (auto func_hook = std::lower_bound(
+           func_hooks.cbegin(), func_hooks.cend(),
+           reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(address)),
+           ShpIsFuncHookBefore);
+       func_hook != func_hooks.cend(); ++func_hook) {
+    const auto hook_begin =
+      reinterpret_cast<ULONG_PTR>((*func_hook)->patch_address);
+    if (hook_begin >= end) {
+      break;
+    }
+    // A hook without patch bytes writes a single breakpoint
+    const auto hook_length =
+      ((*func_hook)->patch_length) ? (*func_hook)->patch_length : 1;
+    if (hook_begin + hook_length > begin) {
+      return true;
+    }
+  }
+  return false;
+}
+
 _Use_decl_annotations_ static FunctionHookInformation* ShpFindFuncHookInfoByAddress(
   const SharedShadowHookPatchData* shared_sh_data, void *address) {
 
-  auto func_hook = std::find_if(
-    shared_sh_data->func_hooks.cbegin(), shared_sh_data->func_hooks.cend(),
-    [address](const auto& info) { return info->patch_address == address; });
-  if (func_hook == shared_sh_data->func_hooks.cend()) {
+  const auto& func_hooks = shared_sh_data->func_hooks;
+  auto func_hook = std::lower_bound(func_hooks.cbegin(), func_hooks.cend(),
+                                    reinterpret_cast<ULONG_PTR>(address),
+                                    ShpIsFuncHookBefore);
+  if (func_hook == func_hooks.cend() ||
+      (*func_hook)->patch_address != address) {
     return nullptr;
   }
 
@@ -881,23 +2472,32 @@ _Use_decl_annotations_ EXTERN_C bool ShInstallMemMonitor(
   SharedShadowHookPatchData* shared_sh_data, ShadowMemMonitorTarget *target) {
   PAGED_CODE();
 
+  const ShpStateLockScope lock(shared_sh_data);
+  // Hooks must be disabled as other install functions require
+  if (shared_sh_data->hooks_active) {
+    return false;
+  }
+
   auto mem_info = ShpFindPageHookInfoByPage(shared_sh_data, (void*)target->target_address);
   auto info = ShpCreateMemMonitorInformation(shared_sh_data, target, mem_info);
   if (!info) {
     return false;
   }
 
+  std::vector<std::unique_ptr<MemHookInformation>> page_infos;
   if (!mem_info) {
     auto new_mem_info = std::make_unique<MemHookInformation>();
     new_mem_info->va_base_page_hook = PAGE_ALIGN((void*)target->target_address);
     new_mem_info->hook_type = MEM_HOOK;
-    shared_sh_data->all_page_hooks.push_back(std::move(new_mem_info));
+    new_mem_info->enabled = true;
+    page_infos.push_back(std::move(new_mem_info));
   }
 
   HYPERPLATFORM_LOG_DEBUG(
     "MemMon = %p, RW = %p", info->mem_address,
     info->shadow_page_base_for_rw->page + BYTE_OFFSET(info->mem_address));
-  shared_sh_data->mem_hooks.push_back(std::move(info));
+  std::vector<std::unique_ptr<FunctionHookInformation>> infos;
+  ShpPublishHooks(shared_sh_data, &page_infos, &infos, &info);
   return true;
 }
 
@@ -949,4 +2549,704 @@ _Use_decl_annotations_ static MemBPInformation* ShpFindMemMonInfoByPage(
     return nullptr;
   }
   return found->get();
-}
\ No newline at end of file
+}
+
+// Removes a hook or a patch installed at the address. Hooks must be disabled
+// with ShDisableHooks() beforehand. Removed data is kept until
+// ShFreeRetiredHooks() is called as other processors may still refer to it.
+_Use_decl_annotations_ bool ShUninstallHook(
+  SharedShadowHookPatchData* shared_sh_data, void* address) {
+  PAGED_CODE();
+
+  const ShpStateLockScope lock(shared_sh_data);
+  const auto info = ShpFindFuncHookInfoByAddress(shared_sh_data, address);
+  if (!info) {
+    return false;
+  }
+
+  // Restore original bytes on the exec shadow page from the RW shadow page,
+  // which always holds what a guest sees
+  ShpWriteHookCodes(&info, 1, false);
+
+  // Make sure that moving entries to the retired lists never allocates memory
+  // while other processors are stopped
+  auto& retired_func_hooks = shared_sh_data->retired_func_hooks;
+  auto& retired_page_hooks = shared_sh_data->retired_page_hooks;
+  retired_func_hooks.reserve(retired_func_hooks.size() + 1);
+  retired_page_hooks.reserve(retired_page_hooks.size() + 1);
+
+  ShpDetachContext context = {shared_sh_data, info};
+  ShpRunExclusively(ShpDetachFuncHook, &context);
+  return true;
+}
+
+// Removes a memory monitor installed at the address. Hooks must be disabled
+// with ShDisableHooks() beforehand.
+_Use_decl_annotations_ bool ShUninstallMemMonitor(
+  SharedShadowHookPatchData* shared_sh_data, ULONG64 address) {
+  PAGED_CODE();
+
+  const ShpStateLockScope lock(shared_sh_data);
+  const auto found = std::find_if(
+    shared_sh_data->mem_hooks.cbegin(), shared_sh_data->mem_hooks.cend(),
+    [address](const auto& info) { return info->mem_address == address; });
+  if (found == shared_sh_data->mem_hooks.cend()) {
+    return false;
+  }
+
+  auto& retired_mem_hooks = shared_sh_data->retired_mem_hooks;
+  auto& retired_page_hooks = shared_sh_data->retired_page_hooks;
+  retired_mem_hooks.reserve(retired_mem_hooks.size() + 1);
+  retired_page_hooks.reserve(retired_page_hooks.size() + 1);
+
+  ShpDetachContext context = {shared_sh_data, found->get()};
+  ShpRunExclusively(ShpDetachMemMonitor, &context);
+  return true;
+}
+
+// Frees hooks removed by ShUninstallHook() and ShUninstallMemMonitor()
+_Use_decl_annotations_ void ShFreeRetiredHooks(
+  SharedShadowHookPatchData* shared_sh_data) {
+  PAGED_CODE();
+
+  const ShpStateLockScope lock(shared_sh_data);
+  shared_sh_data->retired_func_hooks.clear();
+  shared_sh_data->retired_mem_hooks.clear();
+  shared_sh_data->retired_page_hooks.clear();
+}
+
+// Returns true when the page of the address is shadowed by a hook, a patch or
+// a memory monitor, enabled or not
+_Use_decl_annotations_ bool ShIsShadowedPage(
+  const SharedShadowHookPatchData* shared_sh_data, void* address) {
+  PAGED_CODE();
+
+  const ShpStateLockScope lock(shared_sh_data);
+  return ShpFindPageHookInfoByPage(shared_sh_data, address) != nullptr;
+}
+
+// Runs callback on a single processor while all other processors spin at
+// IPI_LEVEL so that no VM-exit handler reads data being modified. callback
+// must not allocate or free memory.
+_Use_decl_annotations_ static void ShpRunExclusively(
+  void (*callback)(void* context), void* context) {
+  PAGED_CODE();
+
+  ShpExclusiveContext exclusive_context = {callback, context, FALSE, FALSE};
+  KeIpiGenericCall(ShpRunExclusivelyBroadcastRoutine,
+                   reinterpret_cast<ULONG_PTR>(&exclusive_context));
+}
+
+// Runs on all processors at IPI_LEVEL. The first one runs a callback and the
+// others wait for completion of it.
+_Use_decl_annotations_ static ULONG_PTR ShpRunExclusivelyBroadcastRoutine(
+  ULONG_PTR argument) {
+  auto context = reinterpret_cast<ShpExclusiveContext*>(argument);
+  if (InterlockedCompareExchange(&context->owner, TRUE, FALSE) == FALSE) {
+    context->callback(context->context);
+    InterlockedExchange(&context->done, TRUE);
+  } else {
+    while (!InterlockedCompareExchange(&context->done, FALSE, FALSE)) {
+      YieldProcessor();
+    }
+  }
+  return 0;
+}
+
+// Moves FunctionHookInformation and its page (if no longer used) to the
+// retired lists
+_Use_decl_annotations_ static void ShpDetachFuncHook(void* context) {
+  const auto detach_context = reinterpret_cast<ShpDetachContext*>(context);
+  auto shared_sh_data = detach_context->shared_sh_data;
+  auto& func_hooks = shared_sh_data->func_hooks;
+
+  const auto found = std::find_if(
+    func_hooks.begin(), func_hooks.end(),
+    [detach_context](const auto& info) {
+    return info.get() == detach_context->info;
+  });
+  NT_ASSERT(found != func_hooks.end());
+  const auto address = (*found)->patch_address;
+  shared_sh_data->retired_func_hooks.push_back(std::move(*found));
+  func_hooks.erase(found);
+
+  if (!ShpFindFuncHookInfoByPage(shared_sh_data, address)) {
+    ShpRetirePageHookIfUnused(shared_sh_data, address);
+  }
+}
+
+// Moves MemBPInformation and its page (if no longer used) to the retired lists
+_Use_decl_annotations_ static void ShpDetachMemMonitor(void* context) {
+  const auto detach_context = reinterpret_cast<ShpDetachContext*>(context);
+  auto shared_sh_data = detach_context->shared_sh_data;
+  auto& mem_hooks = shared_sh_data->mem_hooks;
+
+  const auto found = std::find_if(
+    mem_hooks.begin(), mem_hooks.end(),
+    [detach_context](const auto& info) {
+    return info.get() == detach_context->info;
+  });
+  NT_ASSERT(found != mem_hooks.end());
+  const auto address = reinterpret_cast<void*>((*found)->mem_address);
+  shared_sh_data->retired_mem_hooks.push_back(std::move(*found));
+  mem_hooks.erase(found);
+
+  if (!ShpFindMemMonInfoByPage(shared_sh_data, address)) {
+    ShpRetirePageHookIfUnused(shared_sh_data, address);
+  }
+}
+
+// Moves MemHookInformation for the page to the retired list
+_Use_decl_annotations_ static void ShpRetirePageHookIfUnused(
+  SharedShadowHookPatchData* shared_sh_data, void* address) {
+  auto& all_page_hooks = shared_sh_data->all_page_hooks;
+  const auto found = std::lower_bound(
+    all_page_hooks.begin(), all_page_hooks.end(),
+    reinterpret_cast<ULONG_PTR>(PAGE_ALIGN(address)), ShpIsPageHookBefore);
+  if (found == all_page_hooks.end() ||
+      PAGE_ALIGN((*found)->va_base_page_hook) != PAGE_ALIGN(address)) {
+    return;
+  }
+  shared_sh_data->retired_page_hooks.push_back(std::move(*found));
+  all_page_hooks.erase(found);
+}
+
+// Removes a CR3 value in ShpScopeRemovalContext from scopes of all hooks
+_Use_decl_annotations_ static void ShpRemoveFromHookScopesRoutine(
+  void* context) {
+  const auto removal_context =
+    reinterpret_cast<ShpScopeRemovalContext*>(context);
+  for (auto& info : removal_context->shared_sh_data->func_hooks) {
+    if (info->scope) {
+      ShcRemoveFromScope(info->scope.get(), removal_context->cr3);
+    }
+  }
+}
+
+// Exchanges the scope of a hook with a new one without freeing either
+_Use_decl_annotations_ static void ShpSwapHookScope(void* context) {
+  const auto scope_context = reinterpret_cast<ShpScopeContext*>(context);
+  scope_context->info->scope.swap(*scope_context->scope);
+}
+
+// Computes EPT modifications for all pages, or only for page_hook_info when
+// specified, according to current state of hooks. Translation of addresses is
+// done here once instead of on each processor in VMX-root mode.
+_Use_decl_annotations_ static void ShpStageEptEdits(
+  SharedShadowHookPatchData* shared_sh_data,
+  const MemHookInformation* page_hook_info) {
+  PAGED_CODE();
+
+  auto& edits = shared_sh_data->staged_edits;
+  edits.clear();
+  edits.reserve(shared_sh_data->all_page_hooks.size());
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  auto& data_view_edits = shared_sh_data->staged_data_view_edits;
+  data_view_edits.clear();
+  data_view_edits.reserve(shared_sh_data->all_page_hooks.size());
+#endif
+
+  for (auto& info : shared_sh_data->all_page_hooks) {
+    if (page_hook_info && info.get() != page_hook_info) {
+      continue;
+    }
+
+    const auto active =
+      shared_sh_data->hooks_active && ShpIsPageActive(shared_sh_data, *info);
+    switch (info->hook_type) {
+      case FUNC_HOOK: {
+        const auto func_hook_info =
+          ShpFindFuncHookInfoByPage(shared_sh_data, info->va_base_page_hook);
+        const auto pa_base =
+          UtilPaFromVa(PAGE_ALIGN(func_hook_info->patch_address));
+
+        // Only execution is allowed, against the copied page for exec
+        const auto permission = ShcGetFuncPagePermission(active);
+        edits.push_back(
+          {pa_base,
+           UtilPfnFromPa((permission.exec_view)
+                           ? func_hook_info->pa_base_for_exec
+                           : pa_base),
+           permission.read_access, permission.write_access});
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+        // The data view shows the copied page for read and write instead
+        data_view_edits.push_back(
+          {pa_base,
+           UtilPfnFromPa((active) ? func_hook_info->pa_base_for_rw : pa_base),
+           true, true});
+#endif
+        break;
+      }
+      case MEM_HOOK: {
+        const auto mem_hook_info =
+          ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook);
+        const auto pa_base =
+          UtilPaFromVa(PAGE_ALIGN(mem_hook_info->mem_address));
+
+        // Deny access being monitored, as ShpDisablePageMonitorForRW() does
+        const auto permission = ShcGetMemPagePermission(
+          active, !!(mem_hook_info->access_type & ACCESS_READ),
+          !!(mem_hook_info->access_type & ACCESS_WRITE));
+        edits.push_back({pa_base, UtilPfnFromPa(pa_base),
+                         permission.read_access, permission.write_access});
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+        data_view_edits.push_back(
+          {pa_base, UtilPfnFromPa(pa_base), true, true});
+#endif
+        break;
+      }
+    }
+  }
+}
+
+// Checks if the page should be shadowed (or monitored) as ShcIsPageActive()
+// decides, looking for an enabled hook on it only when that matters
+_Use_decl_annotations_ static bool ShpIsPageActive(
+  const SharedShadowHookPatchData* shared_sh_data,
+  const MemHookInformation& page_hook_info) {
+  PAGED_CODE();
+
+  const auto func_page = page_hook_info.hook_type == FUNC_HOOK;
+  if (!page_hook_info.enabled || !func_page) {
+    return ShcIsPageActive(page_hook_info.enabled, func_page, false);
+  }
+  const auto& func_hooks = shared_sh_data->func_hooks;
+  const auto page = PAGE_ALIGN(page_hook_info.va_base_page_hook);
+  for (auto it = std::lower_bound(func_hooks.cbegin(), func_hooks.cend(),
+                                  reinterpret_cast<ULONG_PTR>(page),
+                                  ShpIsFuncHookBefore);
+       it != func_hooks.cend() && PAGE_ALIGN((*it)->patch_address) == page;
+       ++it) {
+    if ((*it)->enabled) {
+      return ShcIsPageActive(true, true, true);
+    }
+  }
+  return ShcIsPageActive(true, true, false);
+}
+
+// Embeds 0xcc (or patch bytes) on the exec shadow page, or restores original
+// bytes from the RW shadow page. May run at IPI_LEVEL.
+_Use_decl_annotations_ static void ShpWriteHookCode(
+  const FunctionHookInformation& info, bool enable) {
+  static const UCHAR kBreakpoint[] = {
+      0xcc,
+  };
+  const auto offset = BYTE_OFFSET(info.patch_address);
+  const auto exec_code = info.shadow_page_base_for_exec->page + offset;
+  if (!enable) {
+    const auto size = (info.patch_length) ? info.patch_length : 1;
+    RtlCopyMemory(exec_code, info.shadow_page_base_for_rw->page + offset, size);
+  } else if (info.patch_length) {
+    RtlCopyMemory(exec_code, info.new_code, info.patch_length);
+  } else {
+    RtlCopyMemory(exec_code, kBreakpoint, sizeof(kBreakpoint));
+  }
+}
+
+// Writes code of the hooks and invalidates caches once for all of them. A
+// single byte is written atomically, but a patch or original bytes longer
+// than that on an exec shadow page that may be live are written while other
+// processors are stopped, so that none executes a mix of old and new bytes.
+_Use_decl_annotations_ static void ShpWriteHookCodes(
+  FunctionHookInformation* const* infos, ULONG info_count, bool enable) {
+  PAGED_CODE();
+
+  auto multi_byte = false;
+  for (auto i = 0ul; i < info_count; ++i) {
+    multi_byte |= (infos[i]->patch_length > 1);
+  }
+
+  ShpWriteCodeContext context = {infos, info_count, enable};
+  if (multi_byte) {
+    ShpRunExclusively(ShpWriteHookCodesRoutine, &context);
+  } else {
+    ShpWriteHookCodesRoutine(&context);
+  }
+  KeInvalidateAllCaches();
+}
+
+// Writes code of hooks in ShpWriteCodeContext
+_Use_decl_annotations_ static void ShpWriteHookCodesRoutine(void* context) {
+  const auto write_context = reinterpret_cast<ShpWriteCodeContext*>(context);
+  for (auto i = 0ul; i < write_context->info_count; ++i) {
+    ShpWriteHookCode(*write_context->infos[i], write_context->enable);
+  }
+}
+
+// Copies original pages of hooks into both of their shadow pages and embeds
+// code of enabled hooks again, before the pages are shadowed again. While a
+// page is not shadowed, its original frame is mapped for read and write, and
+// writes to it are missing from the shadow pages. Other processors are
+// stopped so that none writes the original page while it is copied.
+_Use_decl_annotations_ static void ShpRefreshShadowPages(
+  const SharedShadowHookPatchData* shared_sh_data,
+  const MemHookInformation* const* page_hook_infos, ULONG page_count) {
+  PAGED_CODE();
+
+  ShpRefreshContext context = {shared_sh_data, page_hook_infos, page_count};
+  ShpRunExclusively(ShpRefreshShadowPagesRoutine, &context);
+  KeInvalidateAllCaches();
+}
+
+// Refreshes shadow pages of pages in ShpRefreshContext
+_Use_decl_annotations_ static void ShpRefreshShadowPagesRoutine(
+  void* context) {
+  const auto refresh_context = reinterpret_cast<ShpRefreshContext*>(context);
+  const auto& func_hooks = refresh_context->shared_sh_data->func_hooks;
+  for (auto i = 0ul; i < refresh_context->page_count; ++i) {
+    const auto page =
+      PAGE_ALIGN(refresh_context->page_hook_infos[i]->va_base_page_hook);
+    auto it = std::lower_bound(func_hooks.cbegin(), func_hooks.cend(),
+                               reinterpret_cast<ULONG_PTR>(page),
+                               ShpIsFuncHookBefore);
+    if (it == func_hooks.cend() || PAGE_ALIGN((*it)->patch_address) != page) {
+      continue;
+    }
+
+    // All hooks on the page share the shadow pages
+    RtlCopyMemory((*it)->shadow_page_base_for_rw->page, page, PAGE_SIZE);
+    RtlCopyMemory((*it)->shadow_page_base_for_exec->page, page, PAGE_SIZE);
+    for (; it != func_hooks.cend() && PAGE_ALIGN((*it)->patch_address) == page;
+         ++it) {
+      if ((*it)->enabled) {
+        ShpWriteHookCode(**it, true);
+      }
+    }
+  }
+}
+
+// Applies all batches posted to the command ring of the current processor
+_Use_decl_annotations_ static void ShpDrainCommands(
+  EptData* ept_data, const SharedShadowHookPatchData* shared_sh_data) {
+  ShpCommandContext context = {ept_data, shared_sh_data};
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  CrDrain(&shared_sh_data->processor_data[processor]->command_ring,
+          ShpHandleCommand, &context);
+}
+
+// Applies an operation of a batch in VMX-root mode
+_Use_decl_annotations_ static LONG ShpHandleCommand(
+  void* context, const CrOperation& operation) {
+  const auto command_context = reinterpret_cast<ShpCommandContext*>(context);
+  switch (operation.kind) {
+    case kShpCommandWriteEptEdits:
+      ShpWriteEptEdits(
+        command_context->ept_data,
+        reinterpret_cast<const ShpEptEdit*>(operation.arguments[0]),
+        operation.arguments[1]);
+      return STATUS_SUCCESS;
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+    case kShpCommandWriteDataViewEdits:
+      ShpWriteEptEdits(
+        ShpGetDataView(command_context->shared_sh_data),
+        reinterpret_cast<const ShpEptEdit*>(operation.arguments[0]),
+        operation.arguments[1]);
+      return STATUS_SUCCESS;
+#endif
+    case kShpCommandInvalidateEpt:
+      UtilInveptGlobal();
+      return STATUS_SUCCESS;
+    case kShpCommandPromotePages:
+      ShpPromotePages(command_context->shared_sh_data,
+                      command_context->ept_data);
+      return STATUS_SUCCESS;
+  }
+  return STATUS_INVALID_PARAMETER;
+}
+
+// Modifies EPT entries without invalidating EPT derived translations
+_Use_decl_annotations_ static void ShpWriteEptEdits(
+  EptData* ept_data, const ShpEptEdit* edits, ULONG64 edit_count) {
+  for (auto i = 0ull; i < edit_count; ++i) {
+    const auto& edit = edits[i];
+    const auto ept_pt_entry = EptGetEptPtEntry(ept_data, edit.guest_pa);
+    ept_pt_entry->fields.read_access = edit.read_access;
+    ept_pt_entry->fields.write_access = edit.write_access;
+    ept_pt_entry->fields.physial_address = edit.pfn;
+  }
+}
+
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+
+// Builds a data view for each processor. They are identity mapped like EPT
+// built by HyperPlatform until ShpStageEptEdits() stages modifications.
+_Use_decl_annotations_ static NTSTATUS ShpCreateDataViews(
+  SharedShadowHookPatchData* shared_sh_data) {
+  PAGED_CODE();
+
+  const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto views_size = sizeof(EptData*) * count;
+  const auto views = reinterpret_cast<EptData**>(ExAllocatePoolWithTag(
+    NonPagedPool, views_size, kHyperPlatformCommonPoolTag));
+  if (!views) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(views, views_size);
+
+  for (auto i = 0ul; i < count; ++i) {
+    views[i] = EptInitialization();
+    if (!views[i]) {
+      for (auto j = 0ul; j < i; ++j) {
+        EptTermination(views[j]);
+      }
+      ExFreePoolWithTag(views, kHyperPlatformCommonPoolTag);
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+  }
+
+  shared_sh_data->data_view_count = count;
+  shared_sh_data->data_views = views;
+  return STATUS_SUCCESS;
+}
+
+// Returns the data view of the current processor
+_Use_decl_annotations_ static EptData* ShpGetDataView(
+  const SharedShadowHookPatchData* shared_sh_data) {
+  return shared_sh_data->data_views[KeGetCurrentProcessorNumberEx(nullptr)];
+}
+
+#endif
+
+// Posts a batch applying staged EPT modifications to the command ring of
+// every processor, and rings a doorbell with the hypercall on all of them at
+// once to drain it. Logs how long it took with the number of processors and
+// hooked pages.
+_Use_decl_annotations_ static NTSTATUS ShpSubmitStagedEdits(
+  HypercallNumber doorbell, const char* operation) {
+  PAGED_CODE();
+
+  auto shared_sh_data = g_shp_shared_sh_data;
+  if (shared_sh_data->staged_edits.empty()) {
+    return STATUS_SUCCESS;
+  }
+
+  const auto& edits = shared_sh_data->staged_edits;
+#if DDIMON_SH_USE_DUAL_EPT_VIEWS
+  const auto& data_view_edits = shared_sh_data->staged_data_view_edits;
+#else
+  const std::vector<ShpEptEdit> data_view_edits;
+#endif
+  const auto batch = ShpAllocateBatch(
+    static_cast<ULONG>(edits.size() + data_view_edits.size()));
+  if (!batch) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  auto copied_edits = batch->edits;
+  for (const auto& edit : edits) {
+    *copied_edits++ = edit;
+  }
+  for (const auto& edit : data_view_edits) {
+    *copied_edits++ = edit;
+  }
+  CrAddOperation(&batch->batch, kShpCommandWriteEptEdits,
+                 reinterpret_cast<ULONG_PTR>(batch->edits), edits.size());
+  if (!data_view_edits.empty()) {
+    CrAddOperation(&batch->batch, kShpCommandWriteDataViewEdits,
+                   reinterpret_cast<ULONG_PTR>(batch->edits + edits.size()),
+                   data_view_edits.size());
+  }
+  CrAddOperation(&batch->batch, kShpCommandInvalidateEpt, 0, 0);
+
+  LARGE_INTEGER frequency = {};
+  const auto begin = KeQueryPerformanceCounter(&frequency);
+  const auto status = ShpSubmitBatch(batch, doorbell);
+  const auto end = KeQueryPerformanceCounter(nullptr);
+
+  const auto elapsed_us =
+    (end.QuadPart - begin.QuadPart) * 1000000 / frequency.QuadPart;
+  HYPERPLATFORM_LOG_INFO(
+    "Hooks have been %s on %lu processors for %Iu pages in %I64d us.",
+    operation, KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+    edits.size(), elapsed_us);
+  return status;
+}
+
+// Allocates an empty batch to be posted to all active processors, with room
+// for edit_count EPT modifications. It is not on the stack, since a batch left
+// in a ring by a failed doorbell may be drained later.
+_Use_decl_annotations_ static ShpBatch* ShpAllocateBatch(ULONG edit_count) {
+  const auto size =
+    FIELD_OFFSET(ShpBatch, edits) + sizeof(ShpEptEdit) * edit_count;
+  const auto batch = reinterpret_cast<ShpBatch*>(ExAllocatePoolWithTag(
+    NonPagedPool, size, kHyperPlatformCommonPoolTag));
+  if (batch) {
+    CrInitializeBatch(&batch->batch,
+                      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    InitializeListHead(&batch->abandoned_entry);
+    batch->edit_count = edit_count;
+  }
+  return batch;
+}
+
+// Posts the batch to the command ring of every active processor, rings a
+// doorbell with the hypercall on all of them at once to drain it, and frees
+// the batch. A batch not drained everywhere is abandoned instead, and freed by
+// a later call once it is.
+_Use_decl_annotations_ static NTSTATUS ShpSubmitBatch(
+  ShpBatch* batch, HypercallNumber doorbell) {
+  auto shared_sh_data = g_shp_shared_sh_data;
+  ShpFreeAbandonedBatches(shared_sh_data, false);
+
+  const auto processor_count =
+    KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  for (auto i = 0ul; i < processor_count; ++i) {
+    // Rings have far more slots than batches submitted at once
+    if (!CrPost(&shared_sh_data->processor_data[i]->command_ring,
+                &batch->batch)) {
+      CrCompleteBatch(&batch->batch, STATUS_DEVICE_BUSY);
+    }
+  }
+  ShpDoorbellContext context = {doorbell, 0};
+  KeIpiGenericCall(ShpRingDoorbellRoutine,
+                   reinterpret_cast<ULONG_PTR>(&context));
+
+  // KeIpiGenericCall() returns after all processors ran the routine, so the
+  // batch has been drained everywhere unless a doorbell failed
+  if (!CrIsBatchComplete(&batch->batch)) {
+    KIRQL old_irql = 0;
+    KeAcquireSpinLock(&shared_sh_data->abandoned_batches_lock, &old_irql);
+    InsertTailList(&shared_sh_data->abandoned_batches,
+                   &batch->abandoned_entry);
+    KeReleaseSpinLock(&shared_sh_data->abandoned_batches_lock, old_irql);
+    return STATUS_UNSUCCESSFUL;
+  }
+  const auto status = (context.failures) ? STATUS_UNSUCCESSFUL
+                                         : CrGetBatchStatus(&batch->batch);
+  ExFreePoolWithTag(batch, kHyperPlatformCommonPoolTag);
+  return status;
+}
+
+// Frees abandoned batches drained by all processors since, or all of them
+// when no processor drains command rings any longer
+_Use_decl_annotations_ static void ShpFreeAbandonedBatches(
+  SharedShadowHookPatchData* shared_sh_data, bool all) {
+  LIST_ENTRY completed_batches;
+  InitializeListHead(&completed_batches);
+
+  KIRQL old_irql = 0;
+  KeAcquireSpinLock(&shared_sh_data->abandoned_batches_lock, &old_irql);
+  for (auto entry = shared_sh_data->abandoned_batches.Flink;
+       entry != &shared_sh_data->abandoned_batches;) {
+    const auto next = entry->Flink;
+    const auto batch = CONTAINING_RECORD(entry, ShpBatch, abandoned_entry);
+    if (all || CrIsBatchComplete(&batch->batch)) {
+      RemoveEntryList(entry);
+      InsertTailList(&completed_batches, entry);
+    }
+    entry = next;
+  }
+  KeReleaseSpinLock(&shared_sh_data->abandoned_batches_lock, old_irql);
+
+  while (!IsListEmpty(&completed_batches)) {
+    const auto entry = RemoveHeadList(&completed_batches);
+    ExFreePoolWithTag(CONTAINING_RECORD(entry, ShpBatch, abandoned_entry),
+                      kHyperPlatformCommonPoolTag);
+  }
+}
+
+// Runs on all processors at IPI_LEVEL and issues the hypercall when a batch
+// waits in the command ring of the processor
+_Use_decl_annotations_ static ULONG_PTR ShpRingDoorbellRoutine(
+  ULONG_PTR argument) {
+  auto context = reinterpret_cast<ShpDoorbellContext*>(argument);
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  const auto ring =
+    &g_shp_shared_sh_data->processor_data[processor]->command_ring;
+  if (CrIsRingEmpty(ring)) {
+    return 0;
+  }
+
+  const auto status = UtilVmCall(context->hypercall_number, nullptr);
+  if (!NT_SUCCESS(status)) {
+    InterlockedIncrement(&context->failures);
+  }
+  return 0;
+}
+
+// Counts an access to a page of a memory monitor against the exit budget when
+// the page was hidden again, and demotes the page on the current processor by
+// allowing any access to it when it exceeded the budget
+_Use_decl_annotations_ static void ShpGovernExit(
+  const SharedShadowHookPatchData* shared_sh_data, EptData* ept_data,
+  const MemHookInformation& info, ShpExitCounter* exit_counter) {
+  const auto mem_monitor_info =
+    ShpFindMemMonInfoByPage(shared_sh_data, info.va_base_page_hook);
+  if (exit_counter->governor.demoted_until) {
+    // The page has been hidden by ShEnableHooks() or ShSetPageState() while
+    // demoted
+    ShpDemotePage(ept_data, *mem_monitor_info, true);
+    return;
+  }
+  if (ShcGovernExit(shared_sh_data->exit_budget, &exit_counter->governor,
+                    __rdtsc()) != kShcGovernorDemote) {
+    return;
+  }
+
+  ShpDemotePage(ept_data, *mem_monitor_info, true);
+  exit_counter->demotion_count++;
+  InterlockedIncrement(&g_shp_demoted_page_count);
+}
+
+// Promotes pages of memory monitors demoted on the current processor whose
+// demotion ended. A page disabled meanwhile is left accessible.
+_Use_decl_annotations_ static void ShpPromotePages(
+  const SharedShadowHookPatchData* shared_sh_data, EptData* ept_data) {
+  const auto now = __rdtsc();
+  for (const auto& info : shared_sh_data->all_page_hooks) {
+    if (info->hook_type != MEM_HOOK) {
+      continue;
+    }
+    auto& exit_counter = ShpGetExitCounter(info->exit_counters);
+    if (ShcGovernPromotion(&exit_counter.governor, now) !=
+        kShcGovernorPromote) {
+      continue;
+    }
+
+    exit_counter.promotion_count++;
+    InterlockedDecrement(&g_shp_demoted_page_count);
+    if (shared_sh_data->hooks_active && info->enabled) {
+      ShpDemotePage(
+        ept_data,
+        *ShpFindMemMonInfoByPage(shared_sh_data, info->va_base_page_hook),
+        false);
+    }
+  }
+}
+
+// Allows any access to a page of a memory monitor on the current processor,
+// or denies access being monitored again as ShpDisablePageMonitorForRW() does
+_Use_decl_annotations_ static void ShpDemotePage(EptData* ept_data,
+                                                 const MemBPInformation& info,
+                                                 bool demote) {
+  const auto pa_base = UtilPaFromVa(PAGE_ALIGN(info.mem_address));
+  const auto ept_pt_entry = EptGetEptPtEntry(ept_data, pa_base);
+  const auto permission = ShcGetMemPagePermission(
+    !demote, !!(info.access_type & ACCESS_READ),
+    !!(info.access_type & ACCESS_WRITE));
+  ept_pt_entry->fields.read_access = permission.read_access;
+  ept_pt_entry->fields.write_access = permission.write_access;
+  ept_pt_entry->fields.physial_address = UtilPfnFromPa(pa_base);
+  UtilInveptGlobal();
+}
+
+// Runs every kShpGovernorPeriodMs while hooks are active, and lets all
+// processors promote pages whose demotion ended, if any page is demoted
+_Use_decl_annotations_ static void ShpGovernorDpcRoutine(
+  PKDPC dpc, PVOID deferred_context, PVOID system_argument1,
+  PVOID system_argument2) {
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(deferred_context);
+  UNREFERENCED_PARAMETER(system_argument1);
+  UNREFERENCED_PARAMETER(system_argument2);
+
+  if (!g_shp_demoted_page_count) {
+    return;
+  }
+
+  const auto batch = ShpAllocateBatch(0);
+  if (!batch) {
+    return;
+  }
+  CrAddOperation(&batch->batch, kShpCommandPromotePages, 0, 0);
+  ShpSubmitBatch(batch, HypercallNumber::kShEnablePageShadowing);
+}
@@ -9,6 +9,7 @@
 #define DDIMON_SHADOW_HOOK_H_
 
 #include <fltKernel.h>
+#include "ddi_mon_ioctl.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -55,20 +56,34 @@ struct ShadowPatchTarget {
   TargetInitCallback target_init_callback; // only for unexported function which need to be located
 };
 
+// A region of a patch bundle. new_code is written only when a guest sees
+// expected_code at address. Both must outlive the patch.
+struct ShadowPatchRegion {
+  void* address;
+  ULONG length;  // Must not cross a page boundary
+  const UCHAR* expected_code;
+  const UCHAR* new_code;
+};
+
 // Expresses where to install hooks by a function name or function address, and its handlers
 struct ShadowHookTarget {
   HOOKED_FUNC_TYPE function_type;
   UNICODE_STRING target_name;  // An exported name to hook
   ULONG64 target_address;  //An unexported function address to hook
   TargetInitCallback target_init_callback; // only for unexported function which need to be located
-  void *handler;               // An address of a hook handler
+  void *handler;               // An address of a hook handler, or nullptr
+                               // for a counting hook
 
   // An address of a trampoline code to call original function. Initialized by
   // a successful call of ShInstallHook().
   void *original_call;
+
+  // For a counting hook, also count calls by return address
+  bool count_callers;
 };
 
 struct ShadowMemMonitorTarget {
+  UNICODE_STRING target_name;  // A name of the monitor used by target tables
   ULONG64 target_address;  //An unexported function address to hook
   ULONG64 len;
   ACCESS_TYPE access_type;  //1:read 2:write 4:exec
@@ -97,6 +112,44 @@ _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS ShEnableHooks();
 
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS ShDisableHooks();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShSetHookState(_In_ void* address, _In_ bool enable);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShSetHookStates(_In_reads_(address_count) void* const* addresses,
+                _In_ ULONG address_count, _In_ bool enable);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShSetExitBudget(_In_ const DdimonExitBudget& budget);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShSetPageState(_In_ void* address, _In_ bool enable);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShSetHookScope(_In_ void* address, _In_reads_(cr3_count) const ULONG64* cr3s,
+               _In_ ULONG cr3_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShRemoveFromHookScopes(_In_ ULONG64 cr3);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShQueryExitStatistics(_Out_writes_to_(capacity, *record_count)
+                        DdimonExitStatistics* records,
+                      _In_ ULONG capacity, _Out_ ULONG* record_count,
+                      _Out_ ULONG* total_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShReadExitTrace(_Out_writes_to_(capacity, *record_count)
+                  DdimonExitTraceRecord* records,
+                _In_ ULONG capacity, _Out_ ULONG* record_count,
+                _Out_ ULONG64* lost_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS
+ShQueryCallers(_Out_writes_to_(capacity, *record_count)
+                 DdimonCallerStatistics* records,
+               _In_ ULONG capacity, _Out_ ULONG* record_count,
+               _Out_ ULONG* total_count);
+
 _IRQL_requires_min_(DISPATCH_LEVEL) NTSTATUS
 ShEnablePageShadowing(_In_ EptData* ept_data,
   _In_ const SharedShadowHookPatchData* shared_sh_data);
@@ -108,6 +161,11 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
 bool ShInstallPatch(_In_ SharedShadowHookPatchData* shared_sh_data,
   _In_ void* address, _In_ ShadowPatchTarget *ShadowPatchTarget);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) bool ShInstallPatchBundle(
+  _In_ SharedShadowHookPatchData* shared_sh_data,
+  _In_reads_(region_count) const ShadowPatchRegion* regions,
+  _In_ ULONG region_count);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C
 bool ShInstallHook(_In_ SharedShadowHookPatchData* shared_sh_data,
   _In_ void* address, _In_ ShadowHookTarget *ShadowHookTarget);
@@ -128,6 +186,25 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void ShHandleEptViolation(
 EXTERN_C bool ShInstallMemMonitor(
   SharedShadowHookPatchData* shared_sh_data, ShadowMemMonitorTarget *target);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool ShUninstallHook(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ void* address);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool ShUninstallMemMonitor(
+  _In_ SharedShadowHookPatchData* shared_sh_data, _In_ ULONG64 address);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void ShFreeRetiredHooks(
+  _In_ SharedShadowHookPatchData* shared_sh_data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool ShIsShadowedPage(
+  _In_ const SharedShadowHookPatchData* shared_sh_data, _In_ void* address);
+
+EXTERN_C void ShLeaveHookHandler();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void ShWaitForHookHandlers();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void ShFreeTrampoline(
+  _In_ void* original_call);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
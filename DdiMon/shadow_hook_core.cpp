@@ -0,0 +1,508 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements platform independent shadow hook functions.
+
+#include "shadow_hook_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Set in a pending page of ShcReplayExitTrace() when the EPT violation was
+// avoided by a demotion, so that the following MTF is avoided as well
+static const ULONG64 kShcpAvoidedPage = 1ull << 63;
+
+// Sizes of code incrementing ShcTrampoline::in_flight, and code following
+// stolen instructions
+#if defined(_AMD64_)
+static const ULONG kShcpTrampolineEntrySize = 8;
+static const ULONG kShcpTrampolineExitJumpSize = 18;
+#else
+static const ULONG kShcpTrampolineEntrySize = 7;
+static const ULONG kShcpTrampolineExitJumpSize = 16;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static void ShcpPutBytes(_Inout_ UCHAR** code,
+                         _In_reads_bytes_(size) const void* bytes,
+                         _In_ ULONG size);
+
+#if defined(_AMD64_)
+static void ShcpPutRelative(_Inout_ UCHAR** code,
+                            _In_ const volatile void* target);
+#else
+static void ShcpPutAbsolute(_Inout_ UCHAR** code,
+                            _In_ const volatile void* target);
+#endif
+
+static ULONG ShcpHashCr3(_In_ ULONG64 normalized_cr3);
+
+static ULONG ShcpHashReturnAddress(_In_ ULONG64 return_address);
+
+static bool ShcpGovernReplayedExit(_Inout_ ShcReplayGovernor* governor,
+                                   _In_ const DdimonExitTraceRecord& record,
+                                   _Inout_ ShcReplayResult* result);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a page table base address in CR3 without PCID and flag bits
+_Use_decl_annotations_ ULONG64 ShcNormalizeCr3(ULONG64 cr3) {
+  return cr3 & 0x000ffffffffff000ull;
+}
+
+// Adds cr3 to the scope. Returns false when cr3 is not a valid CR3 value or
+// collides with other values too often to be found in constant time.
+_Use_decl_annotations_ bool ShcAddToScope(ShcHookScope* scope, ULONG64 cr3) {
+  const auto normalized_cr3 = ShcNormalizeCr3(cr3);
+  if (!normalized_cr3) {
+    return false;
+  }
+
+  const auto start = ShcpHashCr3(normalized_cr3);
+  for (auto probe = 0ul; probe < kShcScopeMaxProbes; ++probe) {
+    auto& slot = scope->cr3s[(start + probe) % kShcScopeSize];
+    if (!slot || slot == normalized_cr3) {
+      slot = normalized_cr3;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Removes cr3 from the scope, as a process exits. Values probed past it are
+// moved back into the freed slot when that is closer to where their probes
+// start, so that each is still found within kShcScopeMaxProbes probes.
+// Returns false when cr3 is not in the scope.
+_Use_decl_annotations_ bool ShcRemoveFromScope(ShcHookScope* scope,
+                                               ULONG64 cr3) {
+  const auto normalized_cr3 = ShcNormalizeCr3(cr3);
+  if (!normalized_cr3) {
+    return false;
+  }
+
+  const auto start = ShcpHashCr3(normalized_cr3);
+  auto hole = kShcScopeSize;
+  for (auto probe = 0ul; probe < kShcScopeMaxProbes; ++probe) {
+    const auto index = (start + probe) % kShcScopeSize;
+    if (scope->cr3s[index] == normalized_cr3) {
+      hole = index;
+      break;
+    }
+    if (!scope->cr3s[index]) {
+      return false;
+    }
+  }
+  if (hole == kShcScopeSize) {
+    return false;
+  }
+
+  scope->cr3s[hole] = 0;
+  for (auto index = (hole + 1) % kShcScopeSize; scope->cr3s[index];
+       index = (index + 1) % kShcScopeSize) {
+    const auto home = ShcpHashCr3(scope->cr3s[index]);
+    if (((hole - home) & (kShcScopeSize - 1)) <
+        ((index - home) & (kShcScopeSize - 1))) {
+      scope->cr3s[hole] = scope->cr3s[index];
+      scope->cr3s[index] = 0;
+      hole = index;
+    }
+  }
+  return true;
+}
+
+// Checks if cr3 is in the scope with at most kShcScopeMaxProbes probes
+_Use_decl_annotations_ bool ShcIsInScope(const ShcHookScope& scope,
+                                         ULONG64 cr3) {
+  const auto normalized_cr3 = ShcNormalizeCr3(cr3);
+  const auto start = ShcpHashCr3(normalized_cr3);
+  for (auto probe = 0ul; probe < kShcScopeMaxProbes; ++probe) {
+    const auto slot = scope.cr3s[(start + probe) % kShcScopeSize];
+    if (slot == normalized_cr3) {
+      return true;
+    }
+    if (!slot) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Builds a trampoline in place, running stolen_code and returning to
+// resume_address through exit_code. Returns false when stolen_code does not
+// fit.
+_Use_decl_annotations_ bool ShcBuildTrampoline(ShcTrampoline* trampoline,
+                                               const UCHAR* stolen_code,
+                                               ULONG stolen_size,
+                                               void* resume_address,
+                                               void* exit_code) {
+  if (stolen_size > sizeof(trampoline->code) - kShcpTrampolineEntrySize -
+                        kShcpTrampolineExitJumpSize) {
+    return false;
+  }
+
+  trampoline->in_flight = 0;
+  trampoline->in_flight_address = &trampoline->in_flight;
+  trampoline->resume_address = resume_address;
+  trampoline->exit_code = exit_code;
+
+  auto code = trampoline->code;
+#if defined(_AMD64_)
+  // f048ff05xxxxxxxx lock inc qword ptr [in_flight]
+  ShcpPutBytes(&code, "\xf0\x48\xff\x05", 4);
+  ShcpPutRelative(&code, &trampoline->in_flight);
+#else
+  // f0ff05xxxxxxxx   lock inc dword ptr [in_flight]
+  ShcpPutBytes(&code, "\xf0\xff\x05", 3);
+  ShcpPutAbsolute(&code, &trampoline->in_flight);
+#endif
+
+  ShcpPutBytes(&code, stolen_code, stolen_size);
+
+#if defined(_AMD64_)
+  // ff35xxxxxxxx     push    qword ptr [resume_address]
+  // ff35xxxxxxxx     push    qword ptr [in_flight_address]
+  // ff25xxxxxxxx     jmp     qword ptr [exit_code]
+  ShcpPutBytes(&code, "\xff\x35", 2);
+  ShcpPutRelative(&code, &trampoline->resume_address);
+  ShcpPutBytes(&code, "\xff\x35", 2);
+  ShcpPutRelative(&code, &trampoline->in_flight_address);
+  ShcpPutBytes(&code, "\xff\x25", 2);
+  ShcpPutRelative(&code, &trampoline->exit_code);
+#else
+  // 68xxxxxxxx       push    resume_address
+  // 68xxxxxxxx       push    offset in_flight
+  // 68xxxxxxxx       push    exit_code
+  // c3               ret
+  ShcpPutBytes(&code, "\x68", 1);
+  ShcpPutAbsolute(&code, resume_address);
+  ShcpPutBytes(&code, "\x68", 1);
+  ShcpPutAbsolute(&code, &trampoline->in_flight);
+  ShcpPutBytes(&code, "\x68", 1);
+  ShcpPutAbsolute(&code, exit_code);
+  ShcpPutBytes(&code, "\xc3", 1);
+#endif
+  return true;
+}
+
+// Returns an entry of the trampoline for a caller not counted in in_flight
+_Use_decl_annotations_ void* ShcGetTrampolineEntry(ShcTrampoline* trampoline) {
+  return trampoline->code;
+}
+
+// Returns an entry of the trampoline for a caller already counted in
+// in_flight, skipping the increment
+_Use_decl_annotations_ void* ShcGetCountedTrampolineEntry(
+    ShcTrampoline* trampoline) {
+  return trampoline->code + kShcpTrampolineEntrySize;
+}
+
+// Returns a trampoline from an entry returned by ShcGetTrampolineEntry()
+_Use_decl_annotations_ ShcTrampoline* ShcGetTrampolineFromEntry(void* entry) {
+  return reinterpret_cast<ShcTrampoline*>(static_cast<UCHAR*>(entry) -
+                                          offsetof(ShcTrampoline, code));
+}
+
+// Appends size bytes to code
+_Use_decl_annotations_ static void ShcpPutBytes(UCHAR** code,
+                                                const void* bytes,
+                                                ULONG size) {
+  for (auto i = 0ul; i < size; ++i) {
+    (*code)[i] = static_cast<const UCHAR*>(bytes)[i];
+  }
+  *code += size;
+}
+
+#if defined(_AMD64_)
+
+// Appends a displacement of a RIP relative operand referring to target. It
+// must be the last field of an instruction.
+_Use_decl_annotations_ static void ShcpPutRelative(
+    UCHAR** code, const volatile void* target) {
+  const auto next_instruction = reinterpret_cast<ULONG_PTR>(*code) + 4;
+  const auto displacement = static_cast<ULONG>(
+      reinterpret_cast<ULONG_PTR>(target) - next_instruction);
+  for (auto i = 0ul; i < 4; ++i) {
+    (*code)[i] = static_cast<UCHAR>(displacement >> (i * 8));
+  }
+  *code += 4;
+}
+
+#else
+
+// Appends an absolute address of target
+_Use_decl_annotations_ static void ShcpPutAbsolute(
+    UCHAR** code, const volatile void* target) {
+  const auto address = reinterpret_cast<ULONG_PTR>(target);
+  for (auto i = 0ul; i < 4; ++i) {
+    (*code)[i] = static_cast<UCHAR>(address >> (i * 8));
+  }
+  *code += 4;
+}
+
+#endif
+
+// Checks if a page should be shadowed (or monitored) while hooks are active. A
+// page of function hooks is shadowed only when at least one hook on it is
+// enabled, so that disabled hooks cause no VM-exit.
+_Use_decl_annotations_ bool ShcIsPageActive(bool page_enabled, bool func_page,
+                                            bool any_hook_enabled) {
+  return page_enabled && (!func_page || any_hook_enabled);
+}
+
+// Returns an EPT entry of a page of function hooks. An active page is only
+// executable, against the exec shadow page, and an inactive one is the
+// original page with any access allowed.
+_Use_decl_annotations_ ShcEptPermission ShcGetFuncPagePermission(bool active) {
+  if (active) {
+    return {false, false, true};
+  }
+  return {true, true, false};
+}
+
+// Returns an EPT entry of a page of a memory monitor, denying access being
+// monitored while active
+_Use_decl_annotations_ ShcEptPermission ShcGetMemPagePermission(
+    bool active, bool monitor_read, bool monitor_write) {
+  if (!active) {
+    return {true, true, false};
+  }
+  return {!monitor_read, !monitor_read && !monitor_write, false};
+}
+
+// Decides what a #BP VM-exit on a hook does. A hit out of the scope is not
+// counted even by a counting hook, which has no handler.
+_Use_decl_annotations_ ShcBreakpointAction ShcDispatchBreakpoint(
+    const ShcHookScope* scope, ULONG64 cr3, bool has_handler) {
+  if (scope && !ShcIsInScope(*scope, cr3)) {
+    return kShcBreakpointOutOfScope;
+  }
+  return (has_handler) ? kShcBreakpointHandler : kShcBreakpointCount;
+}
+
+// Counts a call from return_address. A call is counted in other_count when
+// its return address is unknown (0) or no slot is found within
+// kShcCallerMaxProbes probes.
+_Use_decl_annotations_ void ShcCountCaller(ShcCallerHistogram* histogram,
+                                           ULONG64 return_address) {
+  if (!return_address) {
+    histogram->other_count++;
+    return;
+  }
+
+  const auto start = ShcpHashReturnAddress(return_address);
+  for (auto probe = 0ul; probe < kShcCallerMaxProbes; ++probe) {
+    const auto index = (start + probe) % kShcCallerSlotCount;
+    auto& slot = histogram->return_addresses[index];
+    if (!slot) {
+      slot = return_address;
+    }
+    if (slot == return_address) {
+      histogram->counts[index]++;
+      return;
+    }
+  }
+  histogram->other_count++;
+}
+
+// Counts a VM-exit of a monitored page at the TSC value now against the
+// budget, and returns kShcGovernorDemote when the page exceeded it. A demoted
+// page is promoted by ShcGovernPromotion() after the demotion ends.
+_Use_decl_annotations_ ShcGovernorDecision ShcGovernExit(
+    const DdimonExitBudget& budget, ShcGovernorState* state, ULONG64 now) {
+  if (!budget.max_exits || !budget.window_cycles) {
+    return kShcGovernorKeep;
+  }
+
+  const auto elapsed_windows =
+      (now - state->window_start) / budget.window_cycles;
+  if (elapsed_windows) {
+    // Each window that ended within the budget halves the next demotion
+    state->demoted_windows = (elapsed_windows < 32)
+                                 ? state->demoted_windows >> elapsed_windows
+                                 : 0;
+    state->window_start = now;
+    state->exit_count = 0;
+  }
+  if (++state->exit_count <= budget.max_exits) {
+    return kShcGovernorKeep;
+  }
+
+  auto windows = (state->demoted_windows) ? state->demoted_windows * 2
+                                          : budget.min_demoted_windows;
+  if (windows > budget.max_demoted_windows) {
+    windows = budget.max_demoted_windows;
+  }
+  if (!windows) {
+    windows = 1;
+  }
+  state->demoted_windows = windows;
+  state->demoted_until = now + budget.window_cycles * windows;
+  return kShcGovernorDemote;
+}
+
+// Returns kShcGovernorPromote when a demotion of the page ended by the TSC
+// value now, and starts a new window for the page
+_Use_decl_annotations_ ShcGovernorDecision ShcGovernPromotion(
+    ShcGovernorState* state, ULONG64 now) {
+  if (!state->demoted_until || now < state->demoted_until) {
+    return kShcGovernorKeep;
+  }
+
+  state->demoted_until = 0;
+  state->window_start = now;
+  state->exit_count = 0;
+  return kShcGovernorPromote;
+}
+
+// Replays an exit trace as the shadow hook handles VM-exits and accumulates
+// numbers of exits, view switches and invalidations under the policy to
+// result. pending_pages simulates last_page_hook_info of each processor: a
+// page number + 1 an EPT violation exposed, or 0. An EPT violation while a
+// page is pending, or MTF without the page pending, means two VM-exits shared
+// last_page_hook_info, and is counted as a race. pending_pages is updated so
+// that traces read in chunks can be replayed one after another.
+//
+// When governor is specified, EPT violations are also counted against its
+// budget as if every page in the trace were a memory monitor, and VM-exits a
+// demoted page would not have caused are counted as avoided instead of
+// exits. A promotion is assumed to happen right when a demotion ends.
+_Use_decl_annotations_ void ShcReplayExitTrace(
+    const DdimonExitTraceRecord* records, ULONG record_count,
+    ShcViewPolicy policy, ULONG64* pending_pages, ULONG processor_count,
+    ShcReplayGovernor* governor, ShcReplayResult* result) {
+  // INVEPT is needed only when an EPT entry is edited. EPT derived
+  // translations are tagged with EPTP, so switching EPTP needs none.
+  const auto invalidations_per_switch =
+      (policy == kShcViewPolicyEptEdit) ? 1 : 0;
+
+  for (auto i = 0ul; i < record_count; ++i) {
+    const auto& record = records[i];
+    if (record.processor >= processor_count) {
+      result->invalid_count++;
+      continue;
+    }
+    auto& pending_page = pending_pages[record.processor];
+    switch (record.kind) {
+      case kDdimonExitTraceBreakpoint:
+        result->breakpoint_count++;
+        break;
+      case kDdimonExitTraceOutOfScope:
+        result->out_of_scope_count++;
+        break;
+      case kDdimonExitTraceCounted:
+        result->counted_count++;
+        break;
+      case kDdimonExitTraceEptViolation:
+        if (governor && ShcpGovernReplayedExit(governor, record, result)) {
+          result->avoided_count++;
+          pending_page = (record.page_number + 1) | kShcpAvoidedPage;
+          break;
+        }
+        result->ept_violation_count++;
+        result->view_switch_count++;
+        result->invalidation_count += invalidations_per_switch;
+        if (pending_page) {
+          result->race_count++;
+        }
+        pending_page = record.page_number + 1;
+        break;
+      case kDdimonExitTraceMonitorTrapFlag:
+        if (pending_page == ((record.page_number + 1) | kShcpAvoidedPage)) {
+          result->avoided_count++;
+          pending_page = 0;
+          break;
+        }
+        result->mtf_count++;
+        result->view_switch_count++;
+        result->invalidation_count += invalidations_per_switch;
+        if (pending_page != record.page_number + 1) {
+          result->race_count++;
+        }
+        pending_page = 0;
+        break;
+      default:
+        result->invalid_count++;
+        break;
+    }
+  }
+}
+
+// Returns a start index in ShcHookScope for a normalized CR3 value
+_Use_decl_annotations_ static ULONG ShcpHashCr3(ULONG64 normalized_cr3) {
+  return static_cast<ULONG>(
+      ((normalized_cr3 >> PAGE_SHIFT) * 0x9e3779b97f4a7c15ull) >>
+      (64 - kShcScopeShift));
+}
+
+// Returns a start index in ShcCallerHistogram for a return address
+_Use_decl_annotations_ static ULONG ShcpHashReturnAddress(
+    ULONG64 return_address) {
+  return static_cast<ULONG>(((return_address * 0x9e3779b97f4a7c15ull) >> 32) %
+                            kShcCallerSlotCount);
+}
+
+// Applies the governor to an EPT violation in the trace, and returns true when
+// the page is demoted on the processor and would not have caused it
+_Use_decl_annotations_ static bool ShcpGovernReplayedExit(
+    ShcReplayGovernor* governor, const DdimonExitTraceRecord& record,
+    ShcReplayResult* result) {
+  const auto key =
+      ((static_cast<ULONG64>(record.processor) << 44) | record.page_number) +
+      1;
+  const auto start = static_cast<ULONG>((key * 0x9e3779b97f4a7c15ull) >>
+                                        (64 - kShcReplayGovernorShift));
+  ShcGovernorState* state = nullptr;
+  for (auto probe = 0ul; probe < kShcReplayGovernorSize; ++probe) {
+    const auto index = (start + probe) % kShcReplayGovernorSize;
+    auto& slot = governor->keys[index];
+    if (!slot) {
+      slot = key;
+    }
+    if (slot == key) {
+      state = &governor->states[index];
+      break;
+    }
+  }
+  if (!state) {
+    result->ungoverned_count++;
+    return false;
+  }
+
+  if (state->demoted_until) {
+    if (ShcGovernPromotion(state, record.tsc) != kShcGovernorPromote) {
+      return true;
+    }
+    result->promotion_count++;
+  }
+  if (ShcGovernExit(governor->budget, state, record.tsc) ==
+      kShcGovernorDemote) {
+    result->demotion_count++;
+  }
+  return false;
+}
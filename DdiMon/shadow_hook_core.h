@@ -0,0 +1,264 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to platform independent shadow hook functions.
+///
+/// Functions here compute results only from their arguments and depend on
+/// nothing but platform.h, so that decisions made on the hot paths of the
+/// shadow hook can be built and measured outside the kernel.
+
+#ifndef DDIMON_SHADOW_HOOK_CORE_H_
+#define DDIMON_SHADOW_HOOK_CORE_H_
+
+#include "platform.h"
+#include "ddi_mon_ioctl.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Size of a hash table of ShcHookScope, as a power of 2
+static const ULONG kShcScopeShift = 7;
+static const ULONG kShcScopeSize = 1ul << kShcScopeShift;
+
+// Number of slots of ShcHookScope examined for a single CR3 value
+static const ULONG kShcScopeMaxProbes = 4;
+
+// Number of distinct callers of a counting hook counted on a single processor
+static const ULONG kShcCallerSlotCount = 15;
+
+// Number of slots of ShcCallerHistogram examined for a single return address
+static const ULONG kShcCallerMaxProbes = 4;
+
+// What a #BP VM-exit on a hook does
+enum ShcBreakpointAction {
+  kShcBreakpointOutOfScope,  // Run the original function
+  kShcBreakpointCount,       // Count the call and run the original function
+  kShcBreakpointHandler,     // Enter the hook handler
+};
+
+// Size of a hash table of ShcReplayGovernor, as a power of 2
+static const ULONG kShcReplayGovernorShift = 10;
+static const ULONG kShcReplayGovernorSize = 1ul << kShcReplayGovernorShift;
+
+// What the exit governor does to a page on a processor
+enum ShcGovernorDecision {
+  kShcGovernorKeep,     // Leave the page as it is
+  kShcGovernorDemote,   // Stop monitoring the page on the processor
+  kShcGovernorPromote,  // Monitor the page on the processor again
+};
+
+// How a replayed EPT violation and MTF VM-exit switch views of a page
+enum ShcViewPolicy {
+  // Edit an EPT entry and invalidate EPT derived translations on each switch,
+  // as DDIMON_SH_USE_DUAL_EPT_VIEWS=0
+  kShcViewPolicyEptEdit,
+
+  // Switch EPTP between two EPT hierarchies, as DDIMON_SH_USE_DUAL_EPT_VIEWS=1
+  kShcViewPolicyDualEptViews,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A set of address spaces a hook applies to, keyed by page table base
+// addresses taken from CR3. It is an open addressing hash table probed at most
+// kShcScopeMaxProbes times so that a #BP VM-exit spends constant time.
+struct ShcHookScope {
+  ULONG64 cr3s[kShcScopeSize];  // 0 for an unused slot
+};
+
+// Calls of a counting hook on a single processor keyed by return addresses.
+// It is updated only in VMX-root mode of the processor.
+struct ShcCallerHistogram {
+  ULONG64 other_count;  // Calls from callers that did not fit or were unknown
+  ULONG64 return_addresses[kShcCallerSlotCount];  // 0 for an unused slot
+  ULONG64 counts[kShcCallerSlotCount];
+};
+static_assert(sizeof(ShcCallerHistogram) == 248, "Size check");
+
+// A state of the exit governor for a page on a single processor. It is
+// updated only in VMX-root mode of the processor.
+struct ShcGovernorState {
+  ULONG64 window_start;   // TSC when the current window started
+  ULONG64 demoted_until;  // TSC when a demoted page is promoted, or 0
+  ULONG exit_count;       // VM-exits in the current window
+  ULONG demoted_windows;  // Length of the last demotion in windows
+};
+static_assert(sizeof(ShcGovernorState) == 24, "Size check");
+
+// Code a trampoline jumps to after stolen instructions. It decrements
+// ShcTrampoline::in_flight and returns to the original function, so that a
+// thread leaving a trampoline no longer touches it once it is counted out.
+// Built by ShcMakeTrampolineExit() and placed in executable memory that
+// outlives all trampolines and threads leaving them.
+struct ShcTrampolineExit {
+#if defined(_AMD64_)
+  UCHAR code[19];
+#else
+  UCHAR code[16];
+#endif
+};
+
+// Code running instructions stolen from an original function and jumping
+// back to it, and a number of threads executing it. Built by
+// ShcBuildTrampoline() in executable memory, and must not be freed while
+// in_flight is not 0.
+//
+// A hook handler calls an entry returned by ShcGetTrampolineEntry(), which
+// increments in_flight itself. ShHandleBreakpoint() increments in_flight on
+// behalf of a thread it redirects to ShcGetCountedTrampolineEntry(), since the
+// thread can be preempted before it executes any instruction there.
+struct ShcTrampoline {
+  volatile ULONG_PTR in_flight;
+  volatile ULONG_PTR* in_flight_address;  // &in_flight, pushed for the exit
+  void* resume_address;  // Where in the original function to return to
+  void* exit_code;       // ShcTrampolineExit
+  UCHAR code[64];
+};
+
+// An EPT entry of a hooked page computed by ShcGetFuncPagePermission() or
+// ShcGetMemPagePermission()
+struct ShcEptPermission {
+  bool read_access;
+  bool write_access;
+  bool exec_view;  // Maps the exec shadow page instead of the original page
+};
+
+// Numbers of VM-exits and their consequences computed from an exit trace
+struct ShcReplayResult {
+  ULONG64 breakpoint_count;
+  ULONG64 out_of_scope_count;
+  ULONG64 counted_count;
+  ULONG64 ept_violation_count;
+  ULONG64 mtf_count;
+  ULONG64 view_switch_count;   // Switches between exec and read/write views
+  ULONG64 invalidation_count;  // INVEPT executed
+  ULONG64 race_count;  // Records inconsistent with a pending page of the CPU
+  ULONG64 invalid_count;  // Records of unknown kinds or processors
+
+  // Decisions of ShcReplayGovernor, and EPT violation and MTF VM-exits a
+  // demoted page would not have caused
+  ULONG64 demotion_count;
+  ULONG64 promotion_count;
+  ULONG64 avoided_count;
+  ULONG64 ungoverned_count;  // EPT violations on pages that did not fit
+};
+
+// The exit governor applied to pages on processors by ShcReplayExitTrace().
+// Initialize it with a budget and zeros.
+struct ShcReplayGovernor {
+  DdimonExitBudget budget;
+  ULONG64 keys[kShcReplayGovernorSize];  // 0 for an unused slot
+  ShcGovernorState states[kShcReplayGovernorSize];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+ULONG64 ShcNormalizeCr3(_In_ ULONG64 cr3);
+
+bool ShcAddToScope(_Inout_ ShcHookScope* scope, _In_ ULONG64 cr3);
+
+bool ShcRemoveFromScope(_Inout_ ShcHookScope* scope, _In_ ULONG64 cr3);
+
+bool ShcIsInScope(_In_ const ShcHookScope& scope, _In_ ULONG64 cr3);
+
+bool ShcBuildTrampoline(_Out_ ShcTrampoline* trampoline,
+                        _In_reads_(stolen_size) const UCHAR* stolen_code,
+                        _In_ ULONG stolen_size, _In_ void* resume_address,
+                        _In_ void* exit_code);
+
+void* ShcGetTrampolineEntry(_In_ ShcTrampoline* trampoline);
+
+void* ShcGetCountedTrampolineEntry(_In_ ShcTrampoline* trampoline);
+
+ShcTrampoline* ShcGetTrampolineFromEntry(_In_ void* entry);
+
+bool ShcIsPageActive(_In_ bool page_enabled, _In_ bool func_page,
+                     _In_ bool any_hook_enabled);
+
+ShcEptPermission ShcGetFuncPagePermission(_In_ bool active);
+
+ShcEptPermission ShcGetMemPagePermission(_In_ bool active,
+                                         _In_ bool monitor_read,
+                                         _In_ bool monitor_write);
+
+ShcBreakpointAction ShcDispatchBreakpoint(_In_opt_ const ShcHookScope* scope,
+                                          _In_ ULONG64 cr3,
+                                          _In_ bool has_handler);
+
+void ShcCountCaller(_Inout_ ShcCallerHistogram* histogram,
+                    _In_ ULONG64 return_address);
+
+ShcGovernorDecision ShcGovernExit(_In_ const DdimonExitBudget& budget,
+                                  _Inout_ ShcGovernorState* state,
+                                  _In_ ULONG64 now);
+
+ShcGovernorDecision ShcGovernPromotion(_Inout_ ShcGovernorState* state,
+                                       _In_ ULONG64 now);
+
+void ShcReplayExitTrace(_In_reads_(record_count)
+                            const DdimonExitTraceRecord* records,
+                        _In_ ULONG record_count, _In_ ShcViewPolicy policy,
+                        _Inout_updates_(processor_count) ULONG64* pending_pages,
+                        _In_ ULONG processor_count,
+                        _Inout_opt_ ShcReplayGovernor* governor,
+                        _Inout_ ShcReplayResult* result);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns code decrementing a counter at [rsp+8] (x64) or [esp+4] (x86),
+// removing it and returning to an address under it without changing flags.
+// It is constexpr so that the driver can place the code in its image.
+constexpr ShcTrampolineExit ShcMakeTrampolineExit() {
+#if defined(_AMD64_)
+  // 9c               pushfq
+  // 50               push    rax
+  // 488b442410       mov     rax, qword ptr [rsp+10h]
+  // f048ff08         lock dec qword ptr [rax]
+  // 58               pop     rax
+  // 9d               popfq
+  // 488d642408       lea     rsp, [rsp+8]
+  // c3               ret
+  return {{
+      0x9c, 0x50, 0x48, 0x8b, 0x44, 0x24, 0x10, 0xf0, 0x48, 0xff,
+      0x08, 0x58, 0x9d, 0x48, 0x8d, 0x64, 0x24, 0x08, 0xc3,
+  }};
+#else
+  // 9c               pushfd
+  // 50               push    eax
+  // 8b442408         mov     eax, dword ptr [esp+8]
+  // f0ff08           lock dec dword ptr [eax]
+  // 58               pop     eax
+  // 9d               popfd
+  // 8d642404         lea     esp, [esp+4]
+  // c3               ret
+  return {{
+      0x9c, 0x50, 0x8b, 0x44, 0x24, 0x08, 0xf0, 0xff,
+      0x08, 0x58, 0x9d, 0x8d, 0x64, 0x24, 0x04, 0xc3,
+  }};
+#endif
+}
+
+#endif  // DDIMON_SHADOW_HOOK_CORE_H_
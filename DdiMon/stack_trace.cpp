@@ -0,0 +1,310 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements stack trace functions.
+
+#include "stack_trace.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "unwind_cache.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of stack traces that can be stored
+static const ULONG kStpStackTableSize = 1024;
+
+// Number of entries of the stack table examined for a single stack trace
+static const ULONG kStpStackTableMaxProbes = 8;
+
+// A state of StpStack
+enum StpStackState : LONG {
+  kStpStackEmpty = 0,
+  kStpStackWriting = 1,
+  kStpStackReady = 2,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A stack trace stored once and referred to by its stack ID (index + 1)
+struct StpStack {
+  volatile LONG state;  // StpStackState
+  ULONG hash;
+  ULONG depth;
+  void* frames[kStMaxStackDepth];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+DECLSPEC_NOINLINE static ULONG StpWalkStack(
+    _In_ ULONG frames_to_skip, _Out_writes_to_(capacity, return) void** frames,
+    _In_ ULONG capacity);
+
+#if defined(_AMD64_)
+static void* StpLookupFunctionEntry(_In_ ULONG64 pc, _Out_ ULONG64* image_base,
+                                    _In_opt_ void* context);
+
+static LOAD_IMAGE_NOTIFY_ROUTINE StpLoadImageNotifyRoutine;
+#endif
+
+static ULONG StpInsertStack(_In_reads_(depth) void* const* frames,
+                            _In_ ULONG depth, _Out_ bool* is_new);
+
+static ULONG StpHashStack(_In_reads_(depth) void* const* frames,
+                          _In_ ULONG depth);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, StInitialization)
+#pragma alloc_text(PAGE, StTermination)
+#if defined(_AMD64_)
+#pragma alloc_text(PAGE, StpLoadImageNotifyRoutine)
+#endif
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+#if defined(_AMD64_)
+static UcCache* g_stp_unwind_cache;
+#endif
+
+static StpStack* g_stp_stacks;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates the stack table and the unwind cache
+_Use_decl_annotations_ NTSTATUS StInitialization() {
+  PAGED_CODE();
+
+  g_stp_stacks = reinterpret_cast<StpStack*>(
+      ExAllocatePoolWithTag(NonPagedPool, sizeof(StpStack) * kStpStackTableSize,
+                            kHyperPlatformCommonPoolTag));
+  if (!g_stp_stacks) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(g_stp_stacks, sizeof(StpStack) * kStpStackTableSize);
+
+#if defined(_AMD64_)
+  g_stp_unwind_cache = reinterpret_cast<UcCache*>(
+      ExAllocatePoolWithTag(NonPagedPoolCacheAligned, sizeof(UcCache),
+                            kHyperPlatformCommonPoolTag));
+  if (!g_stp_unwind_cache) {
+    ExFreePoolWithTag(g_stp_stacks, kHyperPlatformCommonPoolTag);
+    g_stp_stacks = nullptr;
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  UcInitialize(g_stp_unwind_cache);
+
+  const auto status = PsSetLoadImageNotifyRoutine(StpLoadImageNotifyRoutine);
+  if (!NT_SUCCESS(status)) {
+    ExFreePoolWithTag(g_stp_unwind_cache, kHyperPlatformCommonPoolTag);
+    g_stp_unwind_cache = nullptr;
+    ExFreePoolWithTag(g_stp_stacks, kHyperPlatformCommonPoolTag);
+    g_stp_stacks = nullptr;
+    return status;
+  }
+#endif
+  return STATUS_SUCCESS;
+}
+
+// Frees the stack table and the unwind cache. No one may capture a stack
+// trace anymore.
+_Use_decl_annotations_ void StTermination() {
+  PAGED_CODE();
+
+#if defined(_AMD64_)
+  if (g_stp_unwind_cache) {
+    PsRemoveLoadImageNotifyRoutine(StpLoadImageNotifyRoutine);
+    const auto hits = g_stp_unwind_cache->hit_count;
+    const auto lookups = hits + g_stp_unwind_cache->miss_count;
+    if (lookups) {
+      HYPERPLATFORM_LOG_INFO(
+          "Unwind cache hits %I64u of %I64u lookups (%I64u%%).", hits,
+          lookups, hits * 100 / lookups);
+    }
+    ExFreePoolWithTag(g_stp_unwind_cache, kHyperPlatformCommonPoolTag);
+    g_stp_unwind_cache = nullptr;
+  }
+#endif
+  if (g_stp_stacks) {
+    ExFreePoolWithTag(g_stp_stacks, kHyperPlatformCommonPoolTag);
+    g_stp_stacks = nullptr;
+  }
+}
+
+// Captures a stack trace of the caller, skipping frames_to_skip frames above
+// it, and returns its stack ID. is_new is set when the stack trace was stored
+// for the first time. Returns 0 when the stack table is full.
+_Use_decl_annotations_ ULONG StCaptureStack(ULONG frames_to_skip,
+                                            bool* is_new) {
+  *is_new = false;
+  if (!g_stp_stacks) {
+    return 0;
+  }
+
+  void* frames[kStMaxStackDepth] = {};
+  const auto depth =
+      StpWalkStack(frames_to_skip + 1, frames, RTL_NUMBER_OF(frames));
+  if (!depth) {
+    return 0;
+  }
+  return StpInsertStack(frames, depth, is_new);
+}
+
+// Copies frames of the stack trace and returns its depth, or 0 when stack_id
+// is not valid
+_Use_decl_annotations_ ULONG StGetStack(ULONG stack_id, void** frames,
+                                        ULONG capacity) {
+  if (!g_stp_stacks || !stack_id || stack_id > kStpStackTableSize) {
+    return 0;
+  }
+
+  const auto& stack = g_stp_stacks[stack_id - 1];
+  if (stack.state != kStpStackReady) {
+    return 0;
+  }
+  _ReadBarrier();
+  const auto depth = (stack.depth < capacity) ? stack.depth : capacity;
+  RtlCopyMemory(frames, stack.frames, sizeof(void*) * depth);
+  return depth;
+}
+
+// Walks the current stack and stores return addresses to frames, skipping
+// frames_to_skip frames above this function. On x64, unwinding stops at code
+// outside any image since it has no unwind information.
+_Use_decl_annotations_ DECLSPEC_NOINLINE static ULONG StpWalkStack(
+    ULONG frames_to_skip, void** frames, ULONG capacity) {
+#if defined(_AMD64_)
+  CONTEXT context = {};
+  RtlCaptureContext(&context);
+
+  ULONG_PTR stack_low = 0;
+  ULONG_PTR stack_high = 0;
+  IoGetStackLimits(&stack_low, &stack_high);
+  const auto system_range_start =
+      reinterpret_cast<ULONG64>(MmSystemRangeStart);
+
+  auto depth = 0ul;
+  for (auto i = 0ul; i <= frames_to_skip + capacity; ++i) {
+    if (context.Rip < system_range_start || context.Rsp < stack_low ||
+        context.Rsp >= stack_high) {
+      break;
+    }
+    if (i > frames_to_skip) {
+      frames[depth++] = reinterpret_cast<void*>(context.Rip);
+    }
+    if (depth == capacity) {
+      break;
+    }
+
+    ULONG64 image_base = 0;
+    const auto function_entry = reinterpret_cast<PRUNTIME_FUNCTION>(
+        UcLookup(g_stp_unwind_cache, context.Rip, &image_base,
+                 StpLookupFunctionEntry, nullptr));
+    if (!function_entry) {
+      break;
+    }
+    void* handler_data = nullptr;
+    ULONG64 establisher_frame = 0;
+    RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, context.Rip,
+                     function_entry, &context, &handler_data,
+                     &establisher_frame, nullptr);
+  }
+  return depth;
+#else
+  return RtlCaptureStackBackTrace(frames_to_skip + 1, capacity, frames,
+                                  nullptr);
+#endif
+}
+
+#if defined(_AMD64_)
+
+// Looks up pc in loaded images for the unwind cache. Return addresses repeat
+// across stack traces, so most lookups avoid searching loaded images and
+// their exception directories.
+_Use_decl_annotations_ static void* StpLookupFunctionEntry(ULONG64 pc,
+                                                           ULONG64* image_base,
+                                                           void* context) {
+  UNREFERENCED_PARAMETER(context);
+  return RtlLookupFunctionEntry(pc, image_base, nullptr);
+}
+
+// Invalidates the unwind cache when a kernel image is loaded
+_Use_decl_annotations_ static void StpLoadImageNotifyRoutine(
+    PUNICODE_STRING full_image_name, HANDLE process_id,
+    PIMAGE_INFO image_info) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(full_image_name);
+  UNREFERENCED_PARAMETER(process_id);
+
+  if (image_info->SystemModeImage) {
+    UcInvalidate(g_stp_unwind_cache);
+  }
+}
+
+#endif  // defined(_AMD64_)
+
+// Returns a stack ID of the stack trace, storing it when it is not stored
+// yet. A stack trace being stored by another processor at the same time may
+// be stored twice under different stack IDs.
+_Use_decl_annotations_ static ULONG StpInsertStack(void* const* frames,
+                                                   ULONG depth, bool* is_new) {
+  const auto hash = StpHashStack(frames, depth);
+  for (auto probe = 0ul; probe < kStpStackTableMaxProbes; ++probe) {
+    const auto index = (hash + probe) % kStpStackTableSize;
+    auto& stack = g_stp_stacks[index];
+    if (stack.state == kStpStackEmpty &&
+        InterlockedCompareExchange(&stack.state, kStpStackWriting,
+                                   kStpStackEmpty) == kStpStackEmpty) {
+      stack.hash = hash;
+      stack.depth = depth;
+      RtlCopyMemory(stack.frames, frames, sizeof(void*) * depth);
+      _WriteBarrier();
+      stack.state = kStpStackReady;
+      *is_new = true;
+      return index + 1;
+    }
+    if (stack.state != kStpStackReady) {
+      continue;
+    }
+    _ReadBarrier();
+    if (stack.hash == hash && stack.depth == depth &&
+        RtlCompareMemory(stack.frames, frames, sizeof(void*) * depth) ==
+            sizeof(void*) * depth) {
+      return index + 1;
+    }
+  }
+  return 0;
+}
+
+// Returns a FNV-1a hash of return addresses
+_Use_decl_annotations_ static ULONG StpHashStack(void* const* frames,
+                                                 ULONG depth) {
+  ULONG hash = 2166136261;
+  for (auto i = 0ul; i < depth; ++i) {
+    const auto frame = reinterpret_cast<ULONG64>(frames[i]);
+    hash ^= static_cast<ULONG>(frame ^ (frame >> 32));
+    hash *= 16777619;
+  }
+  return hash;
+}
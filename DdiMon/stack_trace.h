@@ -0,0 +1,63 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to stack trace functions.
+///
+/// Stack traces are captured with a bounded depth and stored once in a table,
+/// so that an event refers to its stack trace by a small stack ID. Capturing
+/// does not allocate memory or acquire locks and may be done at IRQL <=
+/// DISPATCH_LEVEL, for example, in hook handlers.
+
+#ifndef DDIMON_STACK_TRACE_H_
+#define DDIMON_STACK_TRACE_H_
+
+#include <fltKernel.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Maximum number of frames in a stack trace
+static const ULONG kStMaxStackDepth = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS StInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void StTermination();
+
+_IRQL_requires_max_(DISPATCH_LEVEL) ULONG
+    StCaptureStack(_In_ ULONG frames_to_skip, _Out_ bool* is_new);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) ULONG
+    StGetStack(_In_ ULONG stack_id,
+               _Out_writes_to_(capacity, return) void** frames,
+               _In_ ULONG capacity);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_STACK_TRACE_H_
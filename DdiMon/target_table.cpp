@@ -0,0 +1,207 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements target table functions.
+
+#include "target_table.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#undef _HAS_EXCEPTIONS
+#define _HAS_EXCEPTIONS 0
+#include <algorithm>
+#include "shadow_hook.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static_assert(kTtAccessRead == ACCESS_READ && kTtAccessWrite == ACCESS_WRITE,
+              "Value check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    TtpConvertError(_In_ TtcError error);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, TtParse)
+#pragma alloc_text(PAGE, TtLoadFromRegistry)
+#pragma alloc_text(PAGE, TtOpenParametersKey)
+#pragma alloc_text(PAGE, TtDiff)
+#pragma alloc_text(PAGE, TtIsEqualEntry)
+#pragma alloc_text(PAGE, TtpConvertError)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Parses and validates a whole target table. entries is left empty on failure.
+_Use_decl_annotations_ NTSTATUS TtParse(const void* table, ULONG size,
+                                        std::vector<TtEntry>* entries) {
+  PAGED_CODE();
+
+  entries->clear();
+  auto error = TtcValidateHeader(table, size);
+  if (error != kTtcSuccess) {
+    HYPERPLATFORM_LOG_ERROR("Target table is invalid: %s.",
+                            TtcGetErrorMessage(error));
+    return TtpConvertError(error);
+  }
+
+  const auto header = static_cast<const TtFileHeader*>(table);
+  const auto payload = reinterpret_cast<const UCHAR*>(header + 1);
+  const auto payload_size = size - static_cast<ULONG>(sizeof(TtFileHeader));
+  entries->reserve(header->record_count);
+  ULONG offset = 0;
+  for (auto i = 0ul; i < header->record_count; ++i) {
+    TtEntry entry = {};
+    error = TtcParseRecord(payload, payload_size, header->version, &offset,
+                           &entry);
+    if (error != kTtcSuccess) {
+      HYPERPLATFORM_LOG_ERROR("Target table record #%lu is invalid: %s.", i,
+                              TtcGetErrorMessage(error));
+      entries->clear();
+      return TtpConvertError(error);
+    }
+    entries->push_back(entry);
+  }
+
+  // Trailing bytes are not allowed so that the checksum covers exactly records
+  if (offset != payload_size) {
+    entries->clear();
+    return STATUS_INVALID_PARAMETER;
+  }
+  return STATUS_SUCCESS;
+}
+
+// Reads and parses the Targets value of the service. Returns
+// STATUS_OBJECT_NAME_NOT_FOUND when the value does not exist.
+_Use_decl_annotations_ NTSTATUS
+TtLoadFromRegistry(std::vector<TtEntry>* entries) {
+  PAGED_CODE();
+
+  entries->clear();
+
+  HANDLE key = nullptr;
+  auto status = TtOpenParametersKey(KEY_READ, &key);
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
+  const auto info_size =
+      FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + kTtMaxTableSize;
+  auto info = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(
+      ExAllocatePoolWithTag(PagedPool, info_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!info) {
+    ZwClose(key);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  UNICODE_STRING value_name = RTL_CONSTANT_STRING(L"Targets");
+  ULONG returned_size = 0;
+  status = ZwQueryValueKey(key, &value_name, KeyValuePartialInformation, info,
+                           info_size, &returned_size);
+  ZwClose(key);
+  if (NT_SUCCESS(status)) {
+    if (info->Type == REG_BINARY) {
+      status = TtParse(info->Data, info->DataLength, entries);
+    } else {
+      status = STATUS_INVALID_PARAMETER;
+    }
+  }
+  ExFreePoolWithTag(info, kHyperPlatformCommonPoolTag);
+  return status;
+}
+
+// Opens the Parameters key of the service where the target table is stored
+_Use_decl_annotations_ NTSTATUS TtOpenParametersKey(ACCESS_MASK desired_access,
+                                                    HANDLE* key) {
+  PAGED_CODE();
+
+  UNICODE_STRING key_name =
+      RTL_CONSTANT_STRING(L"\\Registry\\Machine\\System\\CurrentControlSet\\"
+                          L"Services\\DdiMon\\Parameters");
+  OBJECT_ATTRIBUTES oa = {};
+  InitializeObjectAttributes(&oa, &key_name,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  return ZwOpenKey(key, desired_access, &oa);
+}
+
+// Computes entries only in current (removed) and only in next (added).
+// Entries that are identical in both are left untouched by a reload.
+_Use_decl_annotations_ void TtDiff(const std::vector<TtEntry>& current,
+                                   const std::vector<TtEntry>& next,
+                                   std::vector<const TtEntry*>* removed,
+                                   std::vector<const TtEntry*>* added) {
+  PAGED_CODE();
+
+  removed->clear();
+  added->clear();
+  for (const auto& entry : current) {
+    const auto found = std::find_if(
+        next.cbegin(), next.cend(),
+        [&entry](const auto& other) { return TtIsEqualEntry(entry, other); });
+    if (found == next.cend()) {
+      removed->push_back(&entry);
+    }
+  }
+  for (const auto& entry : next) {
+    const auto found = std::find_if(
+        current.cbegin(), current.cend(),
+        [&entry](const auto& other) { return TtIsEqualEntry(entry, other); });
+    if (found == current.cend()) {
+      added->push_back(&entry);
+    }
+  }
+}
+
+// Checks if two entries describe exactly the same target
+_Use_decl_annotations_ bool TtIsEqualEntry(const TtEntry& lhs,
+                                           const TtEntry& rhs) {
+  PAGED_CODE();
+
+  return RtlEqualMemory(&lhs, &rhs, sizeof(TtEntry));
+}
+
+// Returns a status reported for an invalid table
+_Use_decl_annotations_ static NTSTATUS TtpConvertError(TtcError error) {
+  PAGED_CODE();
+
+  switch (error) {
+    case kTtcSuccess:
+      return STATUS_SUCCESS;
+    case kTtcErrorMagic:
+      return STATUS_INVALID_IMAGE_FORMAT;
+    case kTtcErrorVersion:
+      return STATUS_REVISION_MISMATCH;
+    case kTtcErrorChecksum:
+      return STATUS_DATA_ERROR;
+    default:
+      return STATUS_INVALID_PARAMETER;
+  }
+}
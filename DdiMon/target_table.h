@@ -0,0 +1,70 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to target table functions.
+///
+/// A target table is read from the Targets (REG_BINARY) value under the
+/// Parameters key of the service so that targets can be changed without
+/// rebuilding the driver. See target_table_core.h for the format.
+
+#ifndef DDIMON_TARGET_TABLE_H_
+#define DDIMON_TARGET_TABLE_H_
+
+#include <fltKernel.h>
+#undef _HAS_EXCEPTIONS
+#define _HAS_EXCEPTIONS 0
+#include <vector>
+#include "target_table_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    TtParse(_In_reads_bytes_(size) const void* table, _In_ ULONG size,
+            _Out_ std::vector<TtEntry>* entries);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    TtLoadFromRegistry(_Out_ std::vector<TtEntry>* entries);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    TtOpenParametersKey(_In_ ACCESS_MASK desired_access, _Out_ HANDLE* key);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void TtDiff(
+    _In_ const std::vector<TtEntry>& current,
+    _In_ const std::vector<TtEntry>& next,
+    _Out_ std::vector<const TtEntry*>* removed,
+    _Out_ std::vector<const TtEntry*>* added);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) bool TtIsEqualEntry(
+    _In_ const TtEntry& lhs, _In_ const TtEntry& rhs);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TARGET_TABLE_H_
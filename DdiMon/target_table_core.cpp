@@ -0,0 +1,346 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to validate the target table format.
+
+#include "target_table_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kTtcpFnvOffsetBasis = 0x811c9dc5;
+static const ULONG kTtcpFnvPrime = 0x01000193;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static TtcError TtcpValidateRecord(_In_ const TtRecordHeader& header,
+                                   _In_reads_bytes_(header.patch_length)
+                                       const UCHAR* patch);
+
+static bool TtcpIsValidName(_In_reads_bytes_(length) const UCHAR* name,
+                            _In_ ULONG length);
+
+static void TtcpCopyBytes(_Out_writes_bytes_(size) void* destination,
+                          _In_reads_bytes_(size) const UCHAR* source,
+                          _In_ ULONG size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Computes FNV-1a of data
+_Use_decl_annotations_ ULONG TtcComputeChecksum(const UCHAR* data,
+                                                ULONG size) {
+  auto hash = kTtcpFnvOffsetBasis;
+  for (auto i = 0ul; i < size; ++i) {
+    hash ^= data[i];
+    hash *= kTtcpFnvPrime;
+  }
+  return hash;
+}
+
+// Validates the file header of a whole table and the checksum of records
+_Use_decl_annotations_ TtcError TtcValidateHeader(const void* table,
+                                                  ULONG size) {
+  if (size < sizeof(TtFileHeader) || size > kTtMaxTableSize) {
+    return kTtcErrorTableSize;
+  }
+  const auto header = static_cast<const TtFileHeader*>(table);
+  if (header->magic != kTtMagic) {
+    return kTtcErrorMagic;
+  }
+  if (header->version < 1 || header->version > kTtVersion) {
+    return kTtcErrorVersion;
+  }
+  if (header->total_size != size) {
+    return kTtcErrorTableSize;
+  }
+  const auto payload = reinterpret_cast<const UCHAR*>(header + 1);
+  if (TtcComputeChecksum(payload, size - sizeof(TtFileHeader)) !=
+      header->checksum) {
+    return kTtcErrorChecksum;
+  }
+  return kTtcSuccess;
+}
+
+// Converts a record at offset in records following the file header into an
+// entry while validating each field, and advances offset past the record
+_Use_decl_annotations_ TtcError TtcParseRecord(const UCHAR* payload,
+                                               ULONG payload_size,
+                                               USHORT version, ULONG* offset,
+                                               TtEntry* entry) {
+  *entry = {};
+  if (*offset > payload_size ||
+      payload_size - *offset < sizeof(TtRecordHeader)) {
+    return kTtcErrorRecordSize;
+  }
+  const auto record = payload + *offset;
+  const auto header = reinterpret_cast<const TtRecordHeader*>(record);
+  if (header->size < sizeof(TtRecordHeader) ||
+      header->size > payload_size - *offset) {
+    return kTtcErrorRecordSize;
+  }
+
+  const auto module_length =
+      (version >= 2) ? header->module_length : static_cast<UCHAR>(0);
+  const auto variable_size = static_cast<ULONG>(header->name_length) +
+                             header->handler_length +
+                             header->signature_length + header->patch_length +
+                             module_length;
+  if (sizeof(TtRecordHeader) + variable_size != header->size) {
+    return kTtcErrorRecordSize;
+  }
+  const auto max_patch_length = (header->kind == kTtPatchBundle)
+                                    ? kTtMaxBundleLength
+                                    : kTtMaxPatchLength;
+  if (header->name_length > kTtMaxNameLength ||
+      header->handler_length > kTtMaxNameLength ||
+      header->signature_length > kTtMaxSignatureLength ||
+      header->patch_length > max_patch_length ||
+      module_length > kTtMaxNameLength) {
+    return kTtcErrorFieldLength;
+  }
+
+  const auto name = record + sizeof(TtRecordHeader);
+  const auto handler = name + header->name_length;
+  const auto signature = handler + header->handler_length;
+  const auto patch = signature + header->signature_length;
+  const auto module = patch + header->patch_length;
+  if (!TtcpIsValidName(name, header->name_length) ||
+      !TtcpIsValidName(handler, header->handler_length) ||
+      !TtcpIsValidName(module, module_length)) {
+    return kTtcErrorName;
+  }
+  if (module_length && (header->flags & kTtFlagAbsolute)) {
+    return kTtcErrorLocator;
+  }
+  const auto error = TtcpValidateRecord(*header, patch);
+  if (error != kTtcSuccess) {
+    return error;
+  }
+
+  // Only a recorded hook forwards arguments through a hook chain
+  const auto recorded = header->kind == kTtHook && !header->handler_length &&
+                        !(header->flags & kTtFlagCount);
+  auto argument_count =
+      (version >= 3) ? header->argument_count : static_cast<UCHAR>(0);
+  if (version < 3 && recorded) {
+    argument_count = static_cast<UCHAR>(kTtMaxArguments);
+  }
+  if (argument_count > kTtMaxArguments || (argument_count && !recorded)) {
+    return kTtcErrorArguments;
+  }
+
+  entry->kind = static_cast<TtRecordKind>(header->kind);
+  entry->flags = header->flags;
+  entry->access = header->access;
+  entry->length = header->length;
+  entry->location = header->location;
+  entry->signature_length = header->signature_length;
+  entry->argument_count = argument_count;
+  entry->patch_length = header->patch_length;
+  TtcpCopyBytes(entry->name, name, header->name_length);
+  TtcpCopyBytes(entry->handler, handler, header->handler_length);
+  TtcpCopyBytes(entry->signature, signature, header->signature_length);
+  TtcpCopyBytes(entry->patch, patch, header->patch_length);
+  TtcpCopyBytes(entry->module, module, module_length);
+  *offset += header->size;
+  return kTtcSuccess;
+}
+
+// Decodes a region of a kTtPatchBundle entry at offset and advances offset.
+// Returns false when the bytes are truncated or the region is empty.
+_Use_decl_annotations_ bool TtcReadBundleRegion(const UCHAR* bundle,
+                                                ULONG size, ULONG* offset,
+                                                TtBundleRegion* region) {
+  if (size - *offset < sizeof(TtBundleRegionHeader)) {
+    return false;
+  }
+  const auto header =
+      reinterpret_cast<const TtBundleRegionHeader*>(bundle + *offset);
+  const auto bytes = bundle + *offset + sizeof(TtBundleRegionHeader);
+  if (!header->length ||
+      size - *offset - sizeof(TtBundleRegionHeader) < header->length * 2ul) {
+    return false;
+  }
+
+  region->offset = header->offset;
+  region->length = header->length;
+  region->expected_code = bytes;
+  region->new_code = bytes + header->length;
+  *offset += sizeof(TtBundleRegionHeader) + header->length * 2ul;
+  return true;
+}
+
+// Returns a description of an error for logs and a compiler of tables
+_Use_decl_annotations_ const char* TtcGetErrorMessage(TtcError error) {
+  switch (error) {
+    case kTtcSuccess:
+      return "no error";
+    case kTtcErrorTableSize:
+      return "the table size is invalid";
+    case kTtcErrorMagic:
+      return "the table has a wrong magic";
+    case kTtcErrorVersion:
+      return "the table version is not supported";
+    case kTtcErrorChecksum:
+      return "the table is corrupted";
+    case kTtcErrorRecordSize:
+      return "the record size does not match its fields";
+    case kTtcErrorFieldLength:
+      return "a name, signature or patch is too long";
+    case kTtcErrorName:
+      return "a name has characters other than printable ASCII";
+    case kTtcErrorFlags:
+      return "flags are unknown, or count flags are used without count";
+    case kTtcErrorLocator:
+      return "the address is located in more than one way, or without what "
+             "the way needs";
+    case kTtcErrorKind:
+      return "the kind is unknown";
+    case kTtcErrorHook:
+      return "a hook has patch bytes, or both count and a handler";
+    case kTtcErrorPatch:
+      return "a patch has no bytes, has a handler or count, or crosses a page";
+    case kTtcErrorBundle:
+      return "a bundle has a handler or count, or its regions are invalid";
+    case kTtcErrorMemMonitor:
+      return "a memory monitor needs a handler, a length and access, and no "
+             "patch bytes or count";
+    case kTtcErrorArguments:
+      return "an argument count is given to other than a hook only recording "
+             "calls, or exceeds 8";
+  }
+  return "unknown error";
+}
+
+// Validates flags and fields required by a kind of the record
+_Use_decl_annotations_ static TtcError TtcpValidateRecord(
+    const TtRecordHeader& header, const UCHAR* patch) {
+  // Exactly one way to locate an address must be specified
+  const auto locators =
+      header.flags & (kTtFlagExport | kTtFlagAbsolute | kTtFlagScan);
+  if (header.flags & ~(kTtFlagExport | kTtFlagAbsolute | kTtFlagScan |
+                       kTtFlagCount | kTtFlagCallers | kTtFlagWildcard)) {
+    return kTtcErrorFlags;
+  }
+  if ((header.flags & kTtFlagCallers) && !(header.flags & kTtFlagCount)) {
+    return kTtcErrorFlags;
+  }
+  // A signature cannot be checked against exports not known in advance
+  if ((header.flags & kTtFlagWildcard) &&
+      (!(header.flags & kTtFlagExport) || !(header.flags & kTtFlagCount) ||
+       header.signature_length)) {
+    return kTtcErrorFlags;
+  }
+  if (locators & (locators - 1)) {
+    return kTtcErrorLocator;
+  }
+  if ((header.flags & kTtFlagExport) && !header.name_length) {
+    return kTtcErrorLocator;
+  }
+  if ((header.flags & kTtFlagScan) && !header.signature_length) {
+    return kTtcErrorLocator;
+  }
+
+  switch (header.kind) {
+    case kTtHook:
+      // A hook without a handler is recorded by the return recorder, or
+      // counted with kTtFlagCount
+      if (header.patch_length) {
+        return kTtcErrorHook;
+      }
+      if ((header.flags & kTtFlagCount) && header.handler_length) {
+        return kTtcErrorHook;
+      }
+      return kTtcSuccess;
+    case kTtPatch: {
+      if (!header.patch_length || header.handler_length ||
+          (header.flags & kTtFlagCount)) {
+        return kTtcErrorPatch;
+      }
+      // A patch must not cross a page boundary of the exec shadow page
+      const auto page_size = 1ull << PAGE_SHIFT;
+      if (!(header.flags & (kTtFlagExport | kTtFlagScan)) &&
+          (header.location & (page_size - 1)) + header.patch_length >
+              page_size) {
+        return kTtcErrorPatch;
+      }
+      return kTtcSuccess;
+    }
+    case kTtPatchBundle: {
+      if (!header.patch_length || header.handler_length ||
+          (header.flags & kTtFlagCount)) {
+        return kTtcErrorBundle;
+      }
+      // Regions must fill patch bytes exactly. Whether they cross pages or
+      // overlap is checked when the bundle is installed.
+      ULONG offset = 0;
+      auto region_count = 0ul;
+      TtBundleRegion region = {};
+      while (offset < header.patch_length) {
+        if (!TtcReadBundleRegion(patch, header.patch_length, &offset,
+                                 &region) ||
+            ++region_count > kTtMaxBundleRegions) {
+          return kTtcErrorBundle;
+        }
+      }
+      return kTtcSuccess;
+    }
+    case kTtMemMonitor:
+      if (!header.handler_length || header.patch_length || !header.length ||
+          (header.flags & kTtFlagCount)) {
+        return kTtcErrorMemMonitor;
+      }
+      if ((header.access & ~(kTtAccessRead | kTtAccessWrite)) ||
+          !header.access) {
+        return kTtcErrorMemMonitor;
+      }
+      return kTtcSuccess;
+  }
+  return kTtcErrorKind;
+}
+
+// Checks if a name consists of only printable ASCII characters
+_Use_decl_annotations_ static bool TtcpIsValidName(const UCHAR* name,
+                                                   ULONG length) {
+  for (auto i = 0ul; i < length; ++i) {
+    if (name[i] < 0x21 || name[i] > 0x7e) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copies bytes without depending on a runtime library
+_Use_decl_annotations_ static void TtcpCopyBytes(void* destination,
+                                                 const UCHAR* source,
+                                                 ULONG size) {
+  const auto bytes = static_cast<UCHAR*>(destination);
+  for (auto i = 0ul; i < size; ++i) {
+    bytes[i] = source[i];
+  }
+}
@@ -0,0 +1,212 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares the target table format and functions to validate it.
+///
+/// A target table is a compact, versioned binary description of hooks,
+/// patches and memory monitors. Functions here depend only on platform.h so
+/// that the driver and a compiler of tables on any host apply the same rules.
+/// Layout (all fields are little-endian and packed):
+///
+///   TtFileHeader
+///   TtRecordHeader, name, handler, signature, patch bytes, module
+///   TtRecordHeader, name, handler, signature, patch bytes, module
+///   ...
+///
+/// The checksum is FNV-1a (32bit) over all bytes following the file header.
+/// Version 1 tables have no module, and their module_length is always zero.
+/// Version 1 and 2 tables have no argument count, and their recorded hooks
+/// are taken to have kTtMaxArguments arguments.
+///
+/// A record with a module refers to an address in that kernel module (eg,
+/// ndis.sys) instead of ntoskrnl. When the module is not loaded yet, the
+/// record is installed when it is loaded.
+///
+/// A recorded hook is a kTtHook record with neither a handler nor
+/// kTtFlagCount. Its original function is called by a hook chain with only
+/// the first argument_count integer arguments of a call, so functions taking
+/// more than kTtMaxArguments arguments cannot be recorded.
+///
+/// Patch bytes of a kTtPatchBundle record are a list of regions, each of
+/// which is TtBundleRegionHeader followed by expected bytes and new bytes of
+/// the same length. Offsets are relative to the address of the record.
+
+#ifndef DDIMON_TARGET_TABLE_CORE_H_
+#define DDIMON_TARGET_TABLE_CORE_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kTtMagic = DdimonMakeTag('D', 'M', 'T', 'T');
+static_assert(kTtMagic == 0x54544d44, "Value check");
+static const USHORT kTtVersion = 3;
+
+static const ULONG kTtMaxTableSize = 0x10000;
+static const ULONG kTtMaxNameLength = 63;
+static const ULONG kTtMaxSignatureLength = 32;
+static const ULONG kTtMaxPatchLength = 0x100;
+static const ULONG kTtMaxBundleLength = 0x400;
+static const ULONG kTtMaxBundleRegions = 64;
+
+// Arguments a hook chain forwards at most, the same as kHcMaxArguments
+static const ULONG kTtMaxArguments = 8;
+
+// Bits of TtRecordHeader::access, the same values as ACCESS_TYPE
+static const UCHAR kTtAccessRead = 1;
+static const UCHAR kTtAccessWrite = 2;
+
+// A kind of a record
+enum TtRecordKind : UCHAR {
+  kTtHook = 1,        // A hook handled by a built-in handler named by
+                      // handler, or only recorded when handler is empty
+  kTtPatch = 2,       // Patch bytes applied to the exec shadow page
+  kTtMemMonitor = 3,  // A watched memory range handled by a built-in handler
+  kTtPatchBundle = 4,  // Regions of patch bytes applied all or none
+};
+
+// How to locate an address of a record, and how to handle a hook
+enum TtRecordFlags : UCHAR {
+  kTtFlagExport = 0x1,    // name is an export of the module
+  kTtFlagAbsolute = 0x2,  // location is an absolute virtual address
+  kTtFlagScan = 0x4,      // search signature in executable sections
+  kTtFlagCount = 0x8,     // count calls in VMX-root mode instead of entering
+                          // a handler. Only for kTtHook without a handler.
+  kTtFlagCallers = 0x10,  // with kTtFlagCount, count calls by return address
+  kTtFlagWildcard = 0x20, // with kTtFlagExport and kTtFlagCount, name is an
+                          // expression (eg, Ex*) and all matching exports are
+                          // hooked
+};
+
+// Why a table or a record is invalid. See TtcGetErrorMessage().
+enum TtcError {
+  kTtcSuccess = 0,
+  kTtcErrorTableSize,
+  kTtcErrorMagic,
+  kTtcErrorVersion,
+  kTtcErrorChecksum,
+  kTtcErrorRecordSize,
+  kTtcErrorFieldLength,
+  kTtcErrorName,
+  kTtcErrorFlags,
+  kTtcErrorLocator,
+  kTtcErrorKind,
+  kTtcErrorHook,
+  kTtcErrorPatch,
+  kTtcErrorBundle,
+  kTtcErrorMemMonitor,
+  kTtcErrorArguments,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#pragma pack(push, 1)
+struct TtFileHeader {
+  ULONG magic;            // kTtMagic
+  USHORT version;         // kTtVersion
+  USHORT record_count;    // Number of records following this header
+  ULONG total_size;       // Size of the table including this header
+  ULONG checksum;         // FNV-1a of the bytes following this header
+};
+static_assert(sizeof(TtFileHeader) == 16, "Size check");
+
+struct TtRecordHeader {
+  UCHAR kind;               // TtRecordKind
+  UCHAR flags;              // TtRecordFlags
+  USHORT size;              // Size of the record including this header
+  ULONG64 location;         // RVA from the module, or VA with kTtFlagAbsolute
+  ULONG length;             // Size of a range for kTtMemMonitor
+  UCHAR access;             // kTtAccessRead and kTtAccessWrite for
+                            // kTtMemMonitor
+  UCHAR name_length;        // Length of name in bytes (ASCII)
+  UCHAR handler_length;     // Length of handler in bytes (ASCII)
+  UCHAR signature_length;   // Bytes expected at (or searched for) the address
+  USHORT patch_length;      // Bytes written for kTtPatch, or regions of
+                            // kTtPatchBundle
+  UCHAR module_length;      // Length of module in bytes (ASCII), or 0 for
+                            // ntoskrnl. Not allowed with kTtFlagAbsolute.
+  UCHAR argument_count;     // Arguments of a recorded hook, or 0 for others
+};
+static_assert(sizeof(TtRecordHeader) == 24, "Size check");
+
+struct TtBundleRegionHeader {
+  ULONG offset;   // From the address of the record
+  UCHAR length;   // Length of both expected and new bytes
+};
+static_assert(sizeof(TtBundleRegionHeader) == 5, "Size check");
+#pragma pack(pop)
+
+// A region of a kTtPatchBundle entry pointing into TtEntry::patch
+struct TtBundleRegion {
+  ULONG offset;
+  ULONG length;
+  const UCHAR* expected_code;
+  const UCHAR* new_code;
+};
+
+// A parsed and validated record. Instances are compared as a whole to compute
+// differences between two tables, so unused bytes are always zero and the
+// structure has no implicit padding.
+struct TtEntry {
+  ULONG64 location;
+  ULONG length;
+  USHORT patch_length;
+  TtRecordKind kind;
+  UCHAR flags;
+  UCHAR access;
+  UCHAR signature_length;
+  UCHAR argument_count;
+  UCHAR reserved[5];
+  char name[kTtMaxNameLength + 1];
+  char handler[kTtMaxNameLength + 1];
+  UCHAR signature[kTtMaxSignatureLength];
+  UCHAR patch[kTtMaxBundleLength];
+  char module[kTtMaxNameLength + 1];  // A file name, or empty for ntoskrnl
+};
+static_assert(sizeof(TtEntry) == 1272, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+ULONG TtcComputeChecksum(_In_reads_bytes_(size) const UCHAR* data,
+                         _In_ ULONG size);
+
+TtcError TtcValidateHeader(_In_reads_bytes_(size) const void* table,
+                           _In_ ULONG size);
+
+TtcError TtcParseRecord(_In_reads_bytes_(payload_size) const UCHAR* payload,
+                        _In_ ULONG payload_size, _In_ USHORT version,
+                        _Inout_ ULONG* offset, _Out_ TtEntry* entry);
+
+bool TtcReadBundleRegion(_In_reads_bytes_(size) const UCHAR* bundle,
+                         _In_ ULONG size, _Inout_ ULONG* offset,
+                         _Out_ TtBundleRegion* region);
+
+const char* TtcGetErrorMessage(_In_ TtcError error);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TARGET_TABLE_CORE_H_
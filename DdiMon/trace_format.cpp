@@ -0,0 +1,237 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to encode and decode the trace file format.
+
+#include "trace_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Bytes available for encoded events in a block
+static const ULONG kTfpPayloadCapacity = kTfBlockSize - sizeof(TfBlockHeader);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG TfpEncodeVarint(_Out_writes_bytes_(10) UCHAR* buffer,
+                             _In_ ULONG64 value);
+
+static bool TfpDecodeVarint(_In_reads_bytes_(end) const UCHAR* payload,
+                            _Inout_ ULONG* offset, _In_ ULONG end,
+                            _Out_ ULONG64* value);
+
+static ULONG64 TfpZigZag(_In_ ULONG64 delta);
+
+static ULONG64 TfpUnZigZag(_In_ ULONG64 value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes an empty block whose deltas are computed from tsc and address
+_Use_decl_annotations_ void TfInitializeBlock(void* block, USHORT processor,
+                                              ULONG64 tsc, ULONG64 address) {
+  auto header = static_cast<TfBlockHeader*>(block);
+  *header = {};
+  header->magic = kTfBlockMagic;
+  header->processor = processor;
+  header->first_tsc = tsc;
+  header->last_tsc = tsc;
+  header->first_address = address;
+  header->last_address = address;
+  header->last_argument = address;
+}
+
+// Appends an event to the block. Returns false when the block is full or has
+// no room for a new tag, and the event should be appended to a new block.
+_Use_decl_annotations_ bool TfAppendEvent(void* block, const TfEvent& event) {
+  auto header = static_cast<TfBlockHeader*>(block);
+  const auto record_size =
+      (event.kind == kTfEventRecord) ? static_cast<ULONG>(event.size) : 0;
+  if (record_size > kTfMaxRecordSize ||
+      header->payload_size + kTfMaxEventSize - kTfMaxRecordSize +
+              record_size > kTfpPayloadCapacity) {
+    return false;
+  }
+
+  // Find the tag in the dictionary, or add it
+  auto tag_index = 0ul;
+  while (tag_index < header->tag_count &&
+         header->tags[tag_index] != event.tag) {
+    tag_index++;
+  }
+  if (tag_index == header->tag_count) {
+    if (header->tag_count == kTfMaxTagCount) {
+      return false;
+    }
+    header->tags[header->tag_count++] = event.tag;
+  }
+
+  auto buffer = static_cast<UCHAR*>(block) + sizeof(TfBlockHeader) +
+                header->payload_size;
+  auto size = 0ul;
+  buffer[size++] = event.kind;
+  size += TfpEncodeVarint(buffer + size,
+                          TfpZigZag(event.tsc - header->last_tsc));
+  size += TfpEncodeVarint(buffer + size,
+                          TfpZigZag(event.address - header->last_address));
+  // A schema ID is not related to arguments of other events
+  if (event.kind == kTfEventRecord) {
+    size += TfpEncodeVarint(buffer + size, event.argument);
+  } else {
+    size += TfpEncodeVarint(buffer + size,
+                            TfpZigZag(event.argument - header->last_argument));
+  }
+  size += TfpEncodeVarint(buffer + size, event.size);
+  buffer[size++] = static_cast<UCHAR>(tag_index);
+  for (auto i = 0ul; i < record_size; ++i) {
+    buffer[size++] = event.record[i];
+  }
+
+  header->payload_size += size;
+  header->event_count++;
+  header->last_tsc = event.tsc;
+  header->last_address = event.address;
+  if (event.kind != kTfEventRecord) {
+    header->last_argument = event.argument;
+  }
+  return true;
+}
+
+// Prepares to decode events in the block. Returns false when the block is
+// not a valid block.
+_Use_decl_annotations_ bool TfInitializeBlockReader(TfBlockReader* reader,
+                                                    const void* block) {
+  const auto header = static_cast<const TfBlockHeader*>(block);
+  if (header->magic != kTfBlockMagic ||
+      header->payload_size > kTfpPayloadCapacity ||
+      header->tag_count > kTfMaxTagCount) {
+    return false;
+  }
+
+  reader->block = static_cast<const UCHAR*>(block);
+  reader->offset = 0;
+  reader->tsc = header->first_tsc;
+  reader->address = header->first_address;
+  reader->argument = header->first_address;
+  return true;
+}
+
+// Decodes the next event. Returns false at the end of the block or when the
+// block is corrupted.
+_Use_decl_annotations_ bool TfReadEvent(TfBlockReader* reader,
+                                        TfEvent* event) {
+  const auto header = reinterpret_cast<const TfBlockHeader*>(reader->block);
+  const auto payload = reader->block + sizeof(TfBlockHeader);
+  const auto end = header->payload_size;
+  auto offset = reader->offset;
+  if (offset >= end) {
+    return false;
+  }
+
+  const auto kind = payload[offset++];
+  ULONG64 tsc_delta = 0;
+  ULONG64 address_delta = 0;
+  ULONG64 argument_delta = 0;
+  ULONG64 size = 0;
+  if (!TfpDecodeVarint(payload, &offset, end, &tsc_delta) ||
+      !TfpDecodeVarint(payload, &offset, end, &address_delta) ||
+      !TfpDecodeVarint(payload, &offset, end, &argument_delta) ||
+      !TfpDecodeVarint(payload, &offset, end, &size) || offset >= end) {
+    return false;
+  }
+  const auto tag_index = payload[offset++];
+  if (tag_index >= header->tag_count) {
+    return false;
+  }
+  const UCHAR* record = nullptr;
+  auto argument = reader->argument + TfpUnZigZag(argument_delta);
+  if (kind == kTfEventRecord) {
+    if (size > kTfMaxRecordSize || end - offset < size) {
+      return false;
+    }
+    record = payload + offset;
+    offset += static_cast<ULONG>(size);
+    argument = argument_delta;
+  } else {
+    reader->argument = argument;
+  }
+
+  reader->offset = offset;
+  reader->tsc += TfpUnZigZag(tsc_delta);
+  reader->address += TfpUnZigZag(address_delta);
+  event->tsc = reader->tsc;
+  event->address = reader->address;
+  event->argument = argument;
+  event->size = size;
+  event->tag = header->tags[tag_index];
+  event->kind = static_cast<TfEventKind>(kind);
+  event->record = record;
+  return true;
+}
+
+// Writes value 7 bits at a time from the least significant bits and returns
+// the number of bytes written
+_Use_decl_annotations_ static ULONG TfpEncodeVarint(UCHAR* buffer,
+                                                    ULONG64 value) {
+  auto size = 0ul;
+  while (value >= 0x80) {
+    buffer[size++] = static_cast<UCHAR>(value | 0x80);
+    value >>= 7;
+  }
+  buffer[size++] = static_cast<UCHAR>(value);
+  return size;
+}
+
+// Reads a value written by TfpEncodeVarint() without reading beyond end
+_Use_decl_annotations_ static bool TfpDecodeVarint(const UCHAR* payload,
+                                                   ULONG* offset, ULONG end,
+                                                   ULONG64* value) {
+  ULONG64 result = 0;
+  for (auto shift = 0ul; shift < 64; shift += 7) {
+    if (*offset >= end) {
+      return false;
+    }
+    const auto byte = payload[(*offset)++];
+    result |= static_cast<ULONG64>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Maps a signed delta to an unsigned value so that small negative deltas are
+// encoded in few bytes as well
+_Use_decl_annotations_ static ULONG64 TfpZigZag(ULONG64 delta) {
+  return (delta << 1) ^ (0ull - (delta >> 63));
+}
+
+// Reverses TfpZigZag()
+_Use_decl_annotations_ static ULONG64 TfpUnZigZag(ULONG64 value) {
+  return (value >> 1) ^ (0ull - (value & 1));
+}
@@ -0,0 +1,168 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares the trace file format and functions to encode and decode
+/// it.
+///
+/// A trace file persists events observed by hook handlers in a compact form.
+/// Functions here depend only on platform.h so that a reader can be built for
+/// any host. Layout (all fields are little-endian and packed):
+///
+///   TfFileHeader
+///   block (block_size bytes)
+///   block (block_size bytes)
+///   ...
+///   TfIndexEntry (one per block)
+///   TfFileFooter
+///
+/// A block holds events of a single processor in order of occurrence. It
+/// starts with TfBlockHeader, followed by encoded events. Timestamps and
+/// addresses are encoded as differences from the previous event in the block
+/// as variable length integers, and pool tags as indexes of the dictionary in
+/// the block header. Events other than frequent pool events are stored as
+/// records of typed schemas. The index lets a reader skip blocks out of a
+/// time range. When the file was not closed cleanly, the footer is missing,
+/// and blocks can still be read one by one.
+
+#ifndef DDIMON_TRACE_FORMAT_H_
+#define DDIMON_TRACE_FORMAT_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kTfFileMagic = DdimonMakeTag('D', 'M', 'T', 'F');
+static const ULONG kTfBlockMagic = DdimonMakeTag('D', 'M', 'T', 'B');
+static const ULONG kTfFooterMagic = DdimonMakeTag('D', 'M', 'T', 'I');
+static_assert(kTfFileMagic == 0x46544d44, "Value check");
+static const USHORT kTfVersion = 2;
+
+// Size of a block in a file, including its header
+static const ULONG kTfBlockSize = 0x4000;
+
+// Maximum number of distinct tags in a block
+static const ULONG kTfMaxTagCount = 64;
+
+// Maximum size of a record of kTfEventRecord
+static const ULONG kTfMaxRecordSize = 256;
+
+// Maximum size of an encoded event: a kind, four variable length integers,
+// a tag index and a record
+static const ULONG kTfMaxEventSize = 1 + 10 * 4 + 1 + kTfMaxRecordSize;
+
+// A kind of an event
+enum TfEventKind : UCHAR {
+  kTfEventAllocatePool = 1,  // argument is a result, and size is a size
+  kTfEventFreePool = 2,      // argument is a freed pointer
+  kTfEventRecord = 3,  // argument is a schema ID, and size bytes of a record
+                       // marshaled by EsEvent follow (see ddi_mon_schema.h)
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+#pragma pack(push, 1)
+struct TfFileHeader {
+  ULONG magic;       // kTfFileMagic
+  USHORT version;    // kTfVersion
+  USHORT reserved;
+  ULONG block_size;  // kTfBlockSize
+  ULONG reserved2;
+};
+static_assert(sizeof(TfFileHeader) == 16, "Size check");
+
+struct TfBlockHeader {
+  ULONG magic;  // kTfBlockMagic
+  USHORT processor;
+  UCHAR tag_count;
+  UCHAR reserved;
+  ULONG event_count;
+  ULONG payload_size;  // Bytes of encoded events following this header
+  ULONG64 first_tsc;   // A base of the time stamp of the first event
+  ULONG64 last_tsc;
+  ULONG64 first_address;  // A base of the address and argument of the first
+                          // event
+  ULONG64 last_address;   // Used by TfAppendEvent()
+  ULONG64 last_argument;  // Used by TfAppendEvent()
+  ULONG tags[kTfMaxTagCount];  // A dictionary of tags
+};
+static_assert(sizeof(TfBlockHeader) == 56 + 4 * kTfMaxTagCount, "Size check");
+
+struct TfIndexEntry {
+  ULONG64 offset;  // A file offset of the block
+  ULONG64 first_tsc;
+  ULONG64 last_tsc;
+  ULONG processor;
+  ULONG event_count;
+};
+static_assert(sizeof(TfIndexEntry) == 32, "Size check");
+
+struct TfFileFooter {
+  ULONG magic;  // kTfFooterMagic
+  ULONG index_count;
+  ULONG64 index_offset;   // A file offset of the first TfIndexEntry
+  ULONG64 dropped_count;  // Events not written due to lack of free blocks
+};
+static_assert(sizeof(TfFileFooter) == 24, "Size check");
+#pragma pack(pop)
+
+// A decoded event
+struct TfEvent {
+  ULONG64 tsc;
+  ULONG64 address;   // An address of a caller
+  ULONG64 argument;  // See TfEventKind
+  ULONG64 size;
+  ULONG tag;
+  TfEventKind kind;
+  const UCHAR* record;  // For kTfEventRecord. Points into a block when read.
+};
+
+// A position in a block being decoded by TfReadEvent()
+struct TfBlockReader {
+  const UCHAR* block;
+  ULONG offset;
+  ULONG64 tsc;
+  ULONG64 address;
+  ULONG64 argument;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void TfInitializeBlock(_Out_writes_bytes_(kTfBlockSize) void* block,
+                       _In_ USHORT processor, _In_ ULONG64 tsc,
+                       _In_ ULONG64 address);
+
+bool TfAppendEvent(_Inout_updates_bytes_(kTfBlockSize) void* block,
+                   _In_ const TfEvent& event);
+
+bool TfInitializeBlockReader(_Out_ TfBlockReader* reader,
+                             _In_reads_bytes_(kTfBlockSize) const void* block);
+
+bool TfReadEvent(_Inout_ TfBlockReader* reader, _Out_ TfEvent* event);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TRACE_FORMAT_H_
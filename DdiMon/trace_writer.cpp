@@ -0,0 +1,431 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements trace writer functions.
+
+#include "trace_writer.h"
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#undef _HAS_EXCEPTIONS
+#define _HAS_EXCEPTIONS 0
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of blocks preallocated for each processor
+static const ULONG kTwpBlocksPerProcessor = 8;
+
+// How long the writer thread waits for a full block before checking again, in
+// 100 nanoseconds (1 second)
+static const LONG64 kTwpWriterInterval = -10000000ll;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A block either free, owned by a processor, or full and waiting to be written
+struct TwpBlock {
+  SLIST_ENTRY entry;
+  UCHAR data[kTfBlockSize];
+};
+
+// A block being filled by a processor. It is accessed only by that processor
+// at DISPATCH_LEVEL.
+struct DECLSPEC_CACHEALIGN TwpProcessor {
+  TwpBlock* block;
+  ULONG64 dropped_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static KSTART_ROUTINE TwpWriterThreadRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void TwpWriteFullBlocks();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void TwpWriteIndex();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS TwpWriteFile(
+    _In_reads_bytes_(size) const void* buffer, _In_ ULONG size);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void TwpFreeResources();
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static void TwpRecordEvent(
+    _Inout_ TfEvent* event);
+
+static bool TwpAppendEvent(_Inout_ TwpProcessor* processor,
+                           _In_ ULONG processor_index,
+                           _In_ const TfEvent& event);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, TwInitialization)
+#pragma alloc_text(PAGE, TwTermination)
+#pragma alloc_text(PAGE, TwpWriterThreadRoutine)
+#pragma alloc_text(PAGE, TwpWriteFullBlocks)
+#pragma alloc_text(PAGE, TwpWriteIndex)
+#pragma alloc_text(PAGE, TwpWriteFile)
+#pragma alloc_text(PAGE, TwpFreeResources)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static SLIST_HEADER g_twp_free_blocks;
+static SLIST_HEADER g_twp_full_blocks;
+
+// All blocks, to free them regardless of where they are
+static TwpBlock** g_twp_blocks;
+static ULONG g_twp_block_count;
+
+static TwpProcessor* g_twp_processors;
+static ULONG g_twp_processor_count;
+
+static HANDLE g_twp_file;
+static ULONG64 g_twp_file_offset;
+static ULONG64 g_twp_lost_count;  // Events in blocks failed to be written
+
+// Owned by the writer thread while it runs
+static std::vector<TfIndexEntry>* g_twp_index;
+
+static PETHREAD g_twp_writer_thread;
+static KEVENT g_twp_wake_event;
+static volatile bool g_twp_stopping;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates the trace file, preallocates blocks and starts the writer thread
+_Use_decl_annotations_ NTSTATUS TwInitialization() {
+  PAGED_CODE();
+
+  InitializeSListHead(&g_twp_free_blocks);
+  InitializeSListHead(&g_twp_full_blocks);
+  KeInitializeEvent(&g_twp_wake_event, SynchronizationEvent, FALSE);
+  g_twp_stopping = false;
+
+  g_twp_processor_count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto processors_size = sizeof(TwpProcessor) * g_twp_processor_count;
+  g_twp_processors = reinterpret_cast<TwpProcessor*>(ExAllocatePoolWithTag(
+      NonPagedPoolCacheAligned, processors_size, kHyperPlatformCommonPoolTag));
+  if (!g_twp_processors) {
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(g_twp_processors, processors_size);
+
+  const auto block_count = g_twp_processor_count * kTwpBlocksPerProcessor;
+  g_twp_blocks = reinterpret_cast<TwpBlock**>(
+      ExAllocatePoolWithTag(PagedPool, sizeof(TwpBlock*) * block_count,
+                            kHyperPlatformCommonPoolTag));
+  if (!g_twp_blocks) {
+    TwpFreeResources();
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  for (; g_twp_block_count < block_count; ++g_twp_block_count) {
+    const auto block = reinterpret_cast<TwpBlock*>(ExAllocatePoolWithTag(
+        NonPagedPool, sizeof(TwpBlock), kHyperPlatformCommonPoolTag));
+    if (!block) {
+      TwpFreeResources();
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    g_twp_blocks[g_twp_block_count] = block;
+    InterlockedPushEntrySList(&g_twp_free_blocks, &block->entry);
+  }
+
+  g_twp_index = new std::vector<TfIndexEntry>();
+  if (!g_twp_index) {
+    TwpFreeResources();
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+
+  UNICODE_STRING path = RTL_CONSTANT_STRING(L"\\SystemRoot\\DdiMon.trace");
+  OBJECT_ATTRIBUTES object_attributes = {};
+  InitializeObjectAttributes(&object_attributes, &path,
+                             OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, nullptr,
+                             nullptr);
+  IO_STATUS_BLOCK io_status = {};
+  auto status = ZwCreateFile(
+      &g_twp_file, GENERIC_WRITE | SYNCHRONIZE, &object_attributes,
+      &io_status, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ,
+      FILE_OVERWRITE_IF,
+      FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, nullptr, 0);
+  if (!NT_SUCCESS(status)) {
+    g_twp_file = nullptr;
+    TwpFreeResources();
+    return status;
+  }
+
+  const TfFileHeader header = {kTfFileMagic, kTfVersion, 0, kTfBlockSize, 0};
+  status = TwpWriteFile(&header, sizeof(header));
+  if (!NT_SUCCESS(status)) {
+    TwpFreeResources();
+    return status;
+  }
+
+  HANDLE thread_handle = nullptr;
+  status = PsCreateSystemThread(&thread_handle, THREAD_ALL_ACCESS, nullptr,
+                                nullptr, nullptr, TwpWriterThreadRoutine,
+                                nullptr);
+  if (!NT_SUCCESS(status)) {
+    TwpFreeResources();
+    return status;
+  }
+  status = ObReferenceObjectByHandle(
+      thread_handle, SYNCHRONIZE, *PsThreadType, KernelMode,
+      reinterpret_cast<void**>(&g_twp_writer_thread), nullptr);
+  NT_VERIFY(NT_SUCCESS(status));
+  ZwClose(thread_handle);
+  return STATUS_SUCCESS;
+}
+
+// Stops the writer thread, writes remaining blocks and the index, and closes
+// the trace file. Hook handlers must have stopped recording events.
+_Use_decl_annotations_ void TwTermination() {
+  PAGED_CODE();
+
+  if (g_twp_writer_thread) {
+    g_twp_stopping = true;
+    KeSetEvent(&g_twp_wake_event, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(g_twp_writer_thread, Executive, KernelMode, FALSE,
+                          nullptr);
+    ObDereferenceObject(g_twp_writer_thread);
+    g_twp_writer_thread = nullptr;
+  }
+
+  if (!g_twp_file) {
+    TwpFreeResources();
+    return;
+  }
+
+  // Blocks being filled are written as they are, since no more events follow
+  ULONG64 dropped_count = 0;
+  for (auto i = 0ul; i < g_twp_processor_count; ++i) {
+    auto& processor = g_twp_processors[i];
+    if (processor.block) {
+      InterlockedPushEntrySList(&g_twp_full_blocks, &processor.block->entry);
+      processor.block = nullptr;
+    }
+    dropped_count += processor.dropped_count;
+  }
+  TwpWriteFullBlocks();
+  TwpWriteIndex();
+
+  HYPERPLATFORM_LOG_INFO("Trace: %Iu blocks, %I64u dropped, %I64u lost.",
+                         g_twp_index->size(), dropped_count, g_twp_lost_count);
+  TwpFreeResources();
+}
+
+// Records an event to a block of the current processor. The event is dropped
+// when no free block is available or IRQL is above DISPATCH_LEVEL.
+_Use_decl_annotations_ void TwRecordEvent(TfEventKind kind, void* address,
+                                          ULONG64 argument, ULONG64 size,
+                                          ULONG tag) {
+  TfEvent event = {
+      0, reinterpret_cast<ULONG_PTR>(address), argument, size, tag, kind,
+      nullptr,
+  };
+  TwpRecordEvent(&event);
+}
+
+// Records a record marshaled by EsEvent as kTfEventRecord. A record larger
+// than kTfMaxRecordSize is dropped.
+_Use_decl_annotations_ void TwRecordRecord(USHORT schema_id, void* address,
+                                           const void* record,
+                                           ULONG record_size) {
+  if (record_size > kTfMaxRecordSize) {
+    return;
+  }
+  TfEvent event = {
+      0, reinterpret_cast<ULONG_PTR>(address), schema_id, record_size, 0,
+      kTfEventRecord, static_cast<const UCHAR*>(record),
+  };
+  TwpRecordEvent(&event);
+}
+
+// Stamps the event with TSC and appends it to a block of the current
+// processor
+_Use_decl_annotations_ static void TwpRecordEvent(TfEvent* event) {
+  if (!g_twp_writer_thread || KeGetCurrentIrql() > DISPATCH_LEVEL) {
+    return;
+  }
+
+  // Stay on the processor while its block is used
+  KIRQL old_irql = 0;
+  KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+  const auto processor_index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor_index < g_twp_processor_count) {
+    auto& processor = g_twp_processors[processor_index];
+    event->tsc = __rdtsc();
+    if (!TwpAppendEvent(&processor, processor_index, *event)) {
+      processor.dropped_count++;
+    }
+  }
+  KeLowerIrql(old_irql);
+}
+
+// Appends the event to the block of the processor. When the block is full,
+// hands it to the writer thread and continues with a free block.
+_Use_decl_annotations_ static bool TwpAppendEvent(TwpProcessor* processor,
+                                                  ULONG processor_index,
+                                                  const TfEvent& event) {
+  if (processor->block) {
+    if (TfAppendEvent(processor->block->data, event)) {
+      return true;
+    }
+    InterlockedPushEntrySList(&g_twp_full_blocks, &processor->block->entry);
+    processor->block = nullptr;
+    KeSetEvent(&g_twp_wake_event, IO_NO_INCREMENT, FALSE);
+  }
+
+  const auto entry = InterlockedPopEntrySList(&g_twp_free_blocks);
+  if (!entry) {
+    return false;
+  }
+  processor->block = CONTAINING_RECORD(entry, TwpBlock, entry);
+  TfInitializeBlock(processor->block->data,
+                    static_cast<USHORT>(processor_index), event.tsc,
+                    event.address);
+  return TfAppendEvent(processor->block->data, event);
+}
+
+// Writes full blocks whenever a processor hands one over
+_Use_decl_annotations_ static void TwpWriterThreadRoutine(void* context) {
+  PAGED_CODE();
+  UNREFERENCED_PARAMETER(context);
+
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = kTwpWriterInterval;
+  while (!g_twp_stopping) {
+    KeWaitForSingleObject(&g_twp_wake_event, Executive, KernelMode, FALSE,
+                          &interval);
+    TwpWriteFullBlocks();
+  }
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Writes all full blocks in the order they were handed over, records them in
+// the index and returns them to the free list
+_Use_decl_annotations_ static void TwpWriteFullBlocks() {
+  PAGED_CODE();
+
+  // The list is LIFO. Reverse it so that blocks of each processor are written
+  // in order.
+  PSLIST_ENTRY blocks = nullptr;
+  for (auto entry = InterlockedFlushSList(&g_twp_full_blocks); entry;) {
+    const auto next = entry->Next;
+    entry->Next = blocks;
+    blocks = entry;
+    entry = next;
+  }
+
+  for (auto entry = blocks; entry;) {
+    const auto next = entry->Next;
+    const auto block = CONTAINING_RECORD(entry, TwpBlock, entry);
+    const auto header = reinterpret_cast<TfBlockHeader*>(block->data);
+
+    // Do not leak stale contents of the block to the file
+    const auto used_size = sizeof(TfBlockHeader) + header->payload_size;
+    RtlZeroMemory(block->data + used_size, kTfBlockSize - used_size);
+
+    const TfIndexEntry index_entry = {
+        g_twp_file_offset, header->first_tsc,   header->last_tsc,
+        header->processor, header->event_count,
+    };
+    if (NT_SUCCESS(TwpWriteFile(block->data, kTfBlockSize))) {
+      g_twp_index->push_back(index_entry);
+    } else {
+      g_twp_lost_count += header->event_count;
+    }
+    InterlockedPushEntrySList(&g_twp_free_blocks, entry);
+    entry = next;
+  }
+}
+
+// Writes the index and the footer after the last block
+_Use_decl_annotations_ static void TwpWriteIndex() {
+  PAGED_CODE();
+
+  const auto index_offset = g_twp_file_offset;
+  const auto index_size =
+      static_cast<ULONG>(sizeof(TfIndexEntry) * g_twp_index->size());
+  if (index_size &&
+      !NT_SUCCESS(TwpWriteFile(g_twp_index->data(), index_size))) {
+    return;
+  }
+
+  ULONG64 dropped_count = g_twp_lost_count;
+  for (auto i = 0ul; i < g_twp_processor_count; ++i) {
+    dropped_count += g_twp_processors[i].dropped_count;
+  }
+  const TfFileFooter footer = {
+      kTfFooterMagic,
+      static_cast<ULONG>(g_twp_index->size()),
+      index_offset,
+      dropped_count,
+  };
+  TwpWriteFile(&footer, sizeof(footer));
+}
+
+// Appends the buffer to the trace file
+_Use_decl_annotations_ static NTSTATUS TwpWriteFile(const void* buffer,
+                                                    ULONG size) {
+  PAGED_CODE();
+
+  IO_STATUS_BLOCK io_status = {};
+  LARGE_INTEGER offset = {};
+  offset.QuadPart = static_cast<LONG64>(g_twp_file_offset);
+  const auto status =
+      ZwWriteFile(g_twp_file, nullptr, nullptr, nullptr, &io_status,
+                  const_cast<void*>(buffer), size, &offset, nullptr);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_ERROR("Failed to write the trace file (%08x).", status);
+    return status;
+  }
+  g_twp_file_offset += size;
+  return status;
+}
+
+// Frees everything TwInitialization() allocated
+_Use_decl_annotations_ static void TwpFreeResources() {
+  PAGED_CODE();
+
+  if (g_twp_file) {
+    ZwClose(g_twp_file);
+    g_twp_file = nullptr;
+  }
+  if (g_twp_index) {
+    delete g_twp_index;
+    g_twp_index = nullptr;
+  }
+  if (g_twp_blocks) {
+    for (auto i = 0ul; i < g_twp_block_count; ++i) {
+      ExFreePoolWithTag(g_twp_blocks[i], kHyperPlatformCommonPoolTag);
+    }
+    ExFreePoolWithTag(g_twp_blocks, kHyperPlatformCommonPoolTag);
+    g_twp_blocks = nullptr;
+    g_twp_block_count = 0;
+  }
+  if (g_twp_processors) {
+    ExFreePoolWithTag(g_twp_processors, kHyperPlatformCommonPoolTag);
+    g_twp_processors = nullptr;
+    g_twp_processor_count = 0;
+  }
+  g_twp_file_offset = 0;
+  g_twp_lost_count = 0;
+}
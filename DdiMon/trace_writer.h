@@ -0,0 +1,64 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to trace writer functions.
+///
+/// A trace writer persists events to \SystemRoot\DdiMon.trace in the format
+/// declared in trace_format.h. Each processor appends events to its own block
+/// without locks, and a full block is handed to a system thread that writes it
+/// to the file. Blocks are preallocated; when none is free, an event is
+/// dropped and counted rather than blocking a hook handler.
+
+#ifndef DDIMON_TRACE_WRITER_H_
+#define DDIMON_TRACE_WRITER_H_
+
+#include <fltKernel.h>
+#include "trace_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS TwInitialization();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) void TwTermination();
+
+_IRQL_requires_max_(DISPATCH_LEVEL) void TwRecordEvent(_In_ TfEventKind kind,
+                                                       _In_ void* address,
+                                                       _In_ ULONG64 argument,
+                                                       _In_ ULONG64 size,
+                                                       _In_ ULONG tag);
+
+_IRQL_requires_max_(DISPATCH_LEVEL) void TwRecordRecord(
+    _In_ USHORT schema_id, _In_ void* address,
+    _In_reads_bytes_(record_size) const void* record, _In_ ULONG record_size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TRACE_WRITER_H_
@@ -0,0 +1,203 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to look up code addresses with an unwind cache.
+
+#include "unwind_cache.h"
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG UcpHashPc(_In_ ULONG64 pc);
+
+static LONG UcpLoadAcquire(_In_ const volatile LONG* value);
+
+static void UcpStoreRelease(_Inout_ volatile LONG* value, _In_ LONG new_value);
+
+static void UcpReadFence();
+
+static LONG UcpCompareExchange(_Inout_ volatile LONG* value,
+                               _In_ LONG new_value, _In_ LONG comparand);
+
+static LONG UcpIncrement(_Inout_ volatile LONG* value);
+
+static void UcpIncrement64(_Inout_ volatile ULONG64* value);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes an empty cache
+_Use_decl_annotations_ void UcInitialize(UcCache* cache) {
+  cache->generation = 1;
+  cache->hit_count = 0;
+  cache->miss_count = 0;
+  for (auto& entry : cache->entries) {
+    entry.sequence = 0;
+    entry.generation = 0;
+    entry.pc = 0;
+    entry.image_base = 0;
+    entry.function_entry = nullptr;
+  }
+}
+
+// Invalidates all entries, for example, when an image is loaded where another
+// image was unloaded
+_Use_decl_annotations_ void UcInvalidate(UcCache* cache) {
+  if (!UcpIncrement(&cache->generation)) {
+    UcpIncrement(&cache->generation);
+  }
+}
+
+// Returns a result of lookup for pc, from the cache when possible, and caches
+// a result of lookup otherwise. Gives up caching when another processor is
+// writing the entry to replace.
+_Use_decl_annotations_ void* UcLookup(UcCache* cache, ULONG64 pc,
+                                      ULONG64* image_base,
+                                      UcLookupRoutine lookup, void* context) {
+  const auto generation = static_cast<ULONG>(cache->generation);
+  const auto start = UcpHashPc(pc);
+  UcEntry* victim = nullptr;
+  for (auto way = 0ul; way < kUcCacheWays; ++way) {
+    auto& entry = cache->entries[(start + way) % kUcCacheSize];
+    const auto sequence = UcpLoadAcquire(&entry.sequence);
+    if (sequence & 1) {
+      continue;
+    }
+    const auto entry_pc = entry.pc;
+    const auto entry_generation = entry.generation;
+    const auto entry_image_base = entry.image_base;
+    const auto function_entry = entry.function_entry;
+    UcpReadFence();
+    if (entry.sequence != sequence) {
+      continue;
+    }
+    if (entry_pc == pc && entry_generation == generation) {
+      UcpIncrement64(&cache->hit_count);
+      *image_base = entry_image_base;
+      return function_entry;
+    }
+    if (!victim && entry_generation != generation) {
+      victim = &entry;
+    }
+  }
+  UcpIncrement64(&cache->miss_count);
+
+  const auto function_entry = lookup(pc, image_base, context);
+
+  // Replace an invalidated entry, or any entry when all are valid
+  if (!victim) {
+    victim =
+        &cache->entries[(start + (pc >> 4) % kUcCacheWays) % kUcCacheSize];
+  }
+  const auto sequence = UcpLoadAcquire(&victim->sequence);
+  if (!(sequence & 1) &&
+      UcpCompareExchange(&victim->sequence, sequence + 1, sequence) ==
+          sequence) {
+    victim->generation = generation;
+    victim->pc = pc;
+    victim->image_base = *image_base;
+    victim->function_entry = function_entry;
+    UcpStoreRelease(&victim->sequence, sequence + 2);
+  }
+  return function_entry;
+}
+
+// Returns a start index in the cache for pc
+_Use_decl_annotations_ static ULONG UcpHashPc(ULONG64 pc) {
+  return static_cast<ULONG>((pc * 0x9e3779b97f4a7c15ull) >>
+                            (64 - kUcCacheShift));
+}
+
+#if defined(_MSC_VER)
+
+// Volatile accesses have acquire and release semantics on x86 and x64 as
+// long as they are not reordered by the compiler
+
+_Use_decl_annotations_ static LONG UcpLoadAcquire(const volatile LONG* value) {
+  const auto result = *value;
+  _ReadWriteBarrier();
+  return result;
+}
+
+_Use_decl_annotations_ static void UcpStoreRelease(volatile LONG* value,
+                                                   LONG new_value) {
+  _ReadWriteBarrier();
+  *value = new_value;
+}
+
+static void UcpReadFence() { _ReadWriteBarrier(); }
+
+_Use_decl_annotations_ static LONG UcpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  return _InterlockedCompareExchange(reinterpret_cast<volatile long*>(value),
+                                     new_value, comparand);
+}
+
+_Use_decl_annotations_ static LONG UcpIncrement(volatile LONG* value) {
+  return _InterlockedIncrement(reinterpret_cast<volatile long*>(value));
+}
+
+_Use_decl_annotations_ static void UcpIncrement64(volatile ULONG64* value) {
+  _InterlockedIncrement64(reinterpret_cast<volatile __int64*>(value));
+}
+
+#else
+
+_Use_decl_annotations_ static LONG UcpLoadAcquire(const volatile LONG* value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+
+_Use_decl_annotations_ static void UcpStoreRelease(volatile LONG* value,
+                                                   LONG new_value) {
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
+static void UcpReadFence() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+
+_Use_decl_annotations_ static LONG UcpCompareExchange(volatile LONG* value,
+                                                      LONG new_value,
+                                                      LONG comparand) {
+  __atomic_compare_exchange_n(value, &comparand, new_value, false,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  return comparand;
+}
+
+_Use_decl_annotations_ static LONG UcpIncrement(volatile LONG* value) {
+  return __atomic_add_fetch(value, 1, __ATOMIC_RELAXED);
+}
+
+_Use_decl_annotations_ static void UcpIncrement64(volatile ULONG64* value) {
+  __atomic_add_fetch(value, 1, __ATOMIC_RELAXED);
+}
+
+#endif
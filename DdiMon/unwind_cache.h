@@ -0,0 +1,89 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares an unwind cache and functions to look up code addresses.
+///
+/// An unwind cache keeps results of RtlLookupFunctionEntry() per code address,
+/// so that walking stacks whose return addresses repeat seldom searches loaded
+/// images and their exception directories. An address is cached in one of
+/// kUcCacheWays entries following its hash. Entries are read and written
+/// without locks, and all of them are invalidated at once by bumping the
+/// generation of the cache when an image is loaded. Functions here depend
+/// only on platform.h.
+
+#ifndef DDIMON_UNWIND_CACHE_H_
+#define DDIMON_UNWIND_CACHE_H_
+
+#include "platform.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Number of entries of an unwind cache, as a power of 2
+static const ULONG kUcCacheShift = 12;
+static const ULONG kUcCacheSize = 1ul << kUcCacheShift;
+
+// Number of entries examined for a single address
+static const ULONG kUcCacheWays = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A result of a lookup for a code address. sequence is odd while the entry is
+// written, and a reader treats an entry whose sequence is odd or changed as a
+// miss.
+struct UcEntry {
+  volatile LONG sequence;
+  ULONG generation;  // UcCache::generation when the entry was written
+  ULONG64 pc;
+  ULONG64 image_base;
+  void* function_entry;  // nullptr for code outside any image
+};
+
+struct UcCache {
+  volatile LONG generation;  // Never 0, which zeroed entries have
+  volatile ULONG64 hit_count;
+  volatile ULONG64 miss_count;
+  UcEntry entries[kUcCacheSize];
+};
+
+// Looks up a function entry and an image base of pc as
+// RtlLookupFunctionEntry() does
+using UcLookupRoutine = void* (*)(_In_ ULONG64 pc, _Out_ ULONG64* image_base,
+                                  _In_opt_ void* context);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+void UcInitialize(_Out_ UcCache* cache);
+
+void UcInvalidate(_Inout_ UcCache* cache);
+
+void* UcLookup(_Inout_ UcCache* cache, _In_ ULONG64 pc,
+               _Out_ ULONG64* image_base, _In_ UcLookupRoutine lookup,
+               _In_opt_ void* context);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_UNWIND_CACHE_H_
@@ -0,0 +1,705 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Measures platform independent hot path logic of the shadow hook and event
+/// recording on a host, and prints results as JSON or CSV so that they can be
+/// compared across commits.
+///
+/// Usage: shadow_hook_benchmark [--iterations N] [--format json|csv]
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "command_ring.h"
+#include "hide_list_core.h"
+#include "hook_chain_core.h"
+#include "latency_histogram.h"
+#include "return_recorder_core.h"
+#include "seen_filter.h"
+#include "shadow_hook_core.h"
+#include "trace_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Realistic sizes: processes a hook is scoped to, distinct callers of a
+// counting hook, and processors and monitored pages in an exit trace
+static const ULONG kBmScopedProcessCount = 48;
+static const ULONG kBmCallerCount = 24;
+static const ULONG kBmProcessorCount = 64;
+static const ULONG kBmPageCount = 12;
+
+// Counting hooks installed at exports matched by a wildcard such as nt!Ke*,
+// and processors calling them
+static const ULONG kBmMassHookCount = 3000;
+static const ULONG kBmMassHookProcessorCount = 8;
+
+// Processes listed by NtQuerySystemInformation() on a busy server, and names
+// and process IDs in its hide list
+static const ULONG kBmListedProcessCount = 10000;
+static const ULONG kBmHiddenNameCount = 16;
+static const ULONG kBmHiddenProcessIdCount = 16;
+
+// Threads in recorded calls at once, and the depth of their calls
+static const ULONG kBmRecordingThreadCount = 64;
+static const ULONG kBmRecordedDepth = 3;
+
+// Processors updating their own counters at once, as VM-exit handlers do
+static const ULONG kBmThreadCount = 4;
+
+// A pool tag of allocation events, "Pool" in memory
+static const ULONG kBmPoolTag = 0x6c6f6f50;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Runs a benchmark for iterations operations and returns a value depending on
+// all of them, so that none is optimized away
+using BmFunction = ULONG64 (*)(ULONG64 iterations);
+
+struct BmBenchmark {
+  const char* name;
+  BmFunction function;
+  ULONG64 iterations_scale;  // Operations per --iterations
+};
+
+// A counting hook as ShHandleBreakpoint() finds it, with a histogram of
+// callers for each processor
+struct BmMassHook {
+  ULONG64 address;
+  ULONG64 counted_count;
+  ShcCallerHistogram histograms[kBmMassHookProcessorCount];
+};
+
+// A #BP VM-exit of a counting hook
+struct BmMassHookExit {
+  ULONG64 guest_ip;
+  ULONG processor;
+  ULONG64 return_address;
+};
+
+// A per-processor counter laid out as in_flight_counters were, next to
+// counters of other processors
+struct BmPackedCounter {
+  std::atomic<ULONG64> count;
+};
+
+// A per-processor counter on its own cache line, as in ShpProcessorData
+struct alignas(64) BmPaddedCounter {
+  std::atomic<ULONG64> count;
+};
+
+struct BmResult {
+  const char* name;
+  ULONG64 operations;
+  double nanoseconds;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ULONG64 BmScopeHit(ULONG64 iterations);
+static ULONG64 BmScopeMiss(ULONG64 iterations);
+static ULONG64 BmDispatchBreakpoint(ULONG64 iterations);
+static ULONG64 BmBuildTrampoline(ULONG64 iterations);
+static ULONG64 BmCountCaller(ULONG64 iterations);
+static ULONG64 BmCountMassHooks(ULONG64 iterations);
+static ULONG64 BmGovernExit(ULONG64 iterations);
+static ULONG64 BmReplayExitTrace(ULONG64 iterations);
+static ULONG64 BmReplayExitTraceDualViews(ULONG64 iterations);
+static ULONG64 BmEncodeEvents(ULONG64 iterations);
+static ULONG64 BmDecodeEvents(ULONG64 iterations);
+static ULONG64 BmRecordLatency(ULONG64 iterations);
+static ULONG64 BmSeenFilter(ULONG64 iterations);
+static ULONG64 BmCommandRing(ULONG64 iterations);
+static ULONG64 BmPackedCounters(ULONG64 iterations);
+static ULONG64 BmPaddedCounters(ULONG64 iterations);
+static ULONG64 BmFilterProcessList(ULONG64 iterations);
+static ULONG64 BmRecordReturns(ULONG64 iterations);
+static ULONG64 BmFindCollidingSlots(ULONG64 iterations);
+static ULONG64 BmPopAbandonedFrames(ULONG64 iterations);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const BmBenchmark kBmBenchmarks[] = {
+    {"scope_hit", BmScopeHit, 1000},
+    {"scope_miss", BmScopeMiss, 1000},
+    {"dispatch_breakpoint", BmDispatchBreakpoint, 1000},
+    {"build_trampoline", BmBuildTrampoline, 1000},
+    {"count_caller", BmCountCaller, 1000},
+    {"count_mass_hooks", BmCountMassHooks, 1000},
+    {"govern_exit", BmGovernExit, 1000},
+    {"replay_exit_trace", BmReplayExitTrace, 1000},
+    {"replay_exit_trace_dual_views", BmReplayExitTraceDualViews, 1000},
+    {"encode_event", BmEncodeEvents, 100},
+    {"decode_event", BmDecodeEvents, 100},
+    {"record_latency", BmRecordLatency, 1000},
+    {"seen_filter", BmSeenFilter, 100},
+    {"command_ring", BmCommandRing, 100},
+    {"per_cpu_counters_packed", BmPackedCounters, 1000},
+    {"per_cpu_counters_padded", BmPaddedCounters, 1000},
+    {"filter_process_list", BmFilterProcessList, 1000},
+    {"record_return", BmRecordReturns, 1000},
+    {"find_return_slot_colliding", BmFindCollidingSlots, 1000},
+    {"pop_return_frame_abandoned", BmPopAbandonedFrames, 100},
+};
+
+static volatile ULONG64 g_bm_sink;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+int main(int argc, char* argv[]) {
+  ULONG64 iterations = 10000;
+  const char* format = "json";
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--iterations") && i + 1 < argc) {
+      iterations = std::strtoull(argv[++i], nullptr, 0);
+    } else if (!std::strcmp(argv[i], "--format") && i + 1 < argc) {
+      format = argv[++i];
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--iterations N] [--format json|csv]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  const auto json = !std::strcmp(format, "json");
+  if (!iterations || (!json && std::strcmp(format, "csv"))) {
+    std::fprintf(stderr, "invalid arguments\n");
+    return 2;
+  }
+
+  std::vector<BmResult> results;
+  for (const auto& benchmark : kBmBenchmarks) {
+    const auto operations = iterations * benchmark.iterations_scale;
+    benchmark.function(operations / 10 + 1);  // Warms caches up
+    const auto start = std::chrono::steady_clock::now();
+    g_bm_sink = g_bm_sink + benchmark.function(operations);
+    const auto end = std::chrono::steady_clock::now();
+    results.push_back(
+        {benchmark.name, operations,
+         std::chrono::duration<double, std::nano>(end - start).count()});
+  }
+
+  if (json) {
+    std::printf("{\n  \"iterations\": %llu,\n  \"results\": [\n",
+                static_cast<unsigned long long>(iterations));
+    for (auto i = 0u; i < results.size(); ++i) {
+      const auto& result = results[i];
+      std::printf(
+          "    {\"name\": \"%s\", \"operations\": %llu, "
+          "\"ns_per_op\": %.3f, \"ops_per_sec\": %.0f}%s\n",
+          result.name, static_cast<unsigned long long>(result.operations),
+          result.nanoseconds / result.operations,
+          result.operations * 1e9 / result.nanoseconds,
+          (i + 1 == results.size()) ? "" : ",");
+    }
+    std::printf("  ]\n}\n");
+  } else {
+    std::printf("name,operations,ns_per_op,ops_per_sec\n");
+    for (const auto& result : results) {
+      std::printf("%s,%llu,%.3f,%.0f\n", result.name,
+                  static_cast<unsigned long long>(result.operations),
+                  result.nanoseconds / result.operations,
+                  result.operations * 1e9 / result.nanoseconds);
+    }
+  }
+  return 0;
+}
+
+// Returns CR3 values of processes with PCIDs
+static std::vector<ULONG64> BmMakeCr3s(ULONG count, ULONG64 seed) {
+  std::mt19937_64 random(seed);
+  std::vector<ULONG64> cr3s;
+  for (auto i = 0ul; i < count; ++i) {
+    cr3s.push_back(((random() & 0xfffffff) << PAGE_SHIFT) | (i & 0xfff));
+  }
+  return cr3s;
+}
+
+static ShcHookScope BmMakeScope(const std::vector<ULONG64>& cr3s) {
+  ShcHookScope scope = {};
+  for (const auto cr3 : cr3s) {
+    ShcAddToScope(&scope, cr3);
+  }
+  return scope;
+}
+
+// Looks up CR3 values in the scope of a hook
+static ULONG64 BmScopeHit(ULONG64 iterations) {
+  const auto cr3s = BmMakeCr3s(kBmScopedProcessCount, 1);
+  const auto scope = BmMakeScope(cr3s);
+  ULONG64 hits = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    hits += ShcIsInScope(scope, cr3s[i % cr3s.size()]);
+  }
+  return hits;
+}
+
+// Looks up CR3 values of processes out of the scope of a hook
+static ULONG64 BmScopeMiss(ULONG64 iterations) {
+  const auto scope = BmMakeScope(BmMakeCr3s(kBmScopedProcessCount, 1));
+  const auto others = BmMakeCr3s(kBmScopedProcessCount, 2);
+  ULONG64 hits = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    hits += ShcIsInScope(scope, others[i % others.size()]);
+  }
+  return hits;
+}
+
+// Decides #BP VM-exits of hooks with and without a scope, half in and half
+// out of the scope
+static ULONG64 BmDispatchBreakpoint(ULONG64 iterations) {
+  const auto cr3s = BmMakeCr3s(kBmScopedProcessCount * 2, 3);
+  const auto scope = BmMakeScope(
+      std::vector<ULONG64>(cr3s.begin(), cr3s.begin() + cr3s.size() / 2));
+  ULONG64 actions = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    actions += ShcDispatchBreakpoint((i & 1) ? &scope : nullptr,
+                                     cr3s[i % cr3s.size()], (i & 2) != 0);
+  }
+  return actions;
+}
+
+// Builds trampolines of 5 byte stolen instructions
+static ULONG64 BmBuildTrampoline(ULONG64 iterations) {
+  static const UCHAR kStolen[] = {0x48, 0x89, 0x5c, 0x24, 0x08};
+  auto exit_code = ShcMakeTrampolineExit();
+  ShcTrampoline trampoline = {};
+  ULONG64 sum = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    ShcBuildTrampoline(&trampoline, kStolen, sizeof(kStolen),
+                       reinterpret_cast<void*>(0x10000 + i * 16), &exit_code);
+    sum += trampoline.code[i % sizeof(trampoline.code)];
+  }
+  return sum;
+}
+
+// Counts calls of a counting hook from more callers than slots
+static ULONG64 BmCountCaller(ULONG64 iterations) {
+  ShcCallerHistogram histogram = {};
+  std::mt19937_64 random(4);
+  std::vector<ULONG64> callers;
+  for (auto i = 0ul; i < kBmCallerCount; ++i) {
+    callers.push_back(0xfffff80000000000ull + (random() & 0xffffff));
+  }
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    ShcCountCaller(&histogram, callers[(i * 7) % callers.size()]);
+  }
+  return histogram.other_count + histogram.counts[0];
+}
+
+// Handles #BP VM-exits of kBmMassHookCount counting hooks as
+// ShHandleBreakpoint() does: finds a hook by its address with a binary
+// search, decides to count the call, and counts its caller in the histogram
+// of the processor. Hooks are hit at random, so hooks and histograms are
+// mostly out of caches.
+static ULONG64 BmCountMassHooks(ULONG64 iterations) {
+  std::mt19937_64 random(44);
+  std::vector<BmMassHook> hooks(kBmMassHookCount);
+  auto address = 0xfffff80000401000ull;
+  for (auto& hook : hooks) {
+    hook.address = address;
+    address += 0x10 + (random() % 0x100) * 0x10;
+  }
+
+  // Exits to replay, each from one of a few callers of the hook
+  std::vector<BmMassHookExit> exits(4096);
+  for (auto& exit : exits) {
+    const auto& hook = hooks[random() % hooks.size()];
+    exit.guest_ip = hook.address;
+    exit.processor = random() % kBmMassHookProcessorCount;
+    exit.return_address = hook.address + 0x100000 + (random() % 4) * 0x40;
+  }
+
+  const auto cr3 = BmMakeCr3s(1, 7)[0];
+  ULONG64 counted_count = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    const auto& exit = exits[i % exits.size()];
+    const auto hook = std::lower_bound(
+        hooks.begin(), hooks.end(), exit.guest_ip,
+        [](const BmMassHook& hook, ULONG64 guest_ip) {
+          return hook.address < guest_ip;
+        });
+    if (ShcDispatchBreakpoint(nullptr, cr3, false) != kShcBreakpointCount) {
+      continue;
+    }
+    hook->counted_count++;
+    ShcCountCaller(&hook->histograms[exit.processor], exit.return_address);
+    counted_count++;
+  }
+  return counted_count + hooks[0].histograms[0].counts[0];
+}
+
+// Governs EPT violations of a page that exceeds the budget now and then
+static ULONG64 BmGovernExit(ULONG64 iterations) {
+  const DdimonExitBudget budget = {100000, 64, 1, 16, 0};
+  ShcGovernorState state = {};
+  ULONG64 demotions = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    const auto now = i * 997;
+    if (state.demoted_until) {
+      ShcGovernPromotion(&state, now);
+      continue;
+    }
+    demotions += ShcGovernExit(budget, &state, now) == kShcGovernorDemote;
+  }
+  return demotions;
+}
+
+// Returns an exit trace of processors reading and writing shadowed pages
+static std::vector<DdimonExitTraceRecord> BmMakeExitTrace(ULONG64 count) {
+  std::mt19937_64 random(5);
+  std::vector<DdimonExitTraceRecord> records;
+  records.reserve(count);
+  ULONG64 tsc = 0;
+  while (records.size() < count) {
+    DdimonExitTraceRecord record = {};
+    record.processor = random() % kBmProcessorCount;
+    record.page_number = 0xfffff8000ull + random() % kBmPageCount;
+    record.tsc = tsc += 1000;
+    if (random() % 4) {
+      record.kind = kDdimonExitTraceEptViolation;
+      records.push_back(record);
+      record.kind = kDdimonExitTraceMonitorTrapFlag;
+      record.tsc = tsc += 500;
+    } else {
+      record.kind = kDdimonExitTraceBreakpoint;
+    }
+    records.push_back(record);
+  }
+  records.resize(count);
+  return records;
+}
+
+// Replays a trace with the governor under a view policy, and returns view
+// switches and invalidations they cost
+static ULONG64 BmReplayExitTraceWithPolicy(ULONG64 iterations,
+                                           ShcViewPolicy policy) {
+  const auto records = BmMakeExitTrace(iterations);
+  std::vector<ULONG64> pending_pages(kBmProcessorCount);
+  std::unique_ptr<ShcReplayGovernor> governor(new ShcReplayGovernor());
+  governor->budget = {1000000, 256, 1, 16, 0};
+  ShcReplayResult result = {};
+  ShcReplayExitTrace(records.data(), static_cast<ULONG>(records.size()),
+                     policy, pending_pages.data(), kBmProcessorCount,
+                     governor.get(), &result);
+  return result.view_switch_count + result.invalidation_count +
+         result.race_count;
+}
+
+static ULONG64 BmReplayExitTrace(ULONG64 iterations) {
+  return BmReplayExitTraceWithPolicy(iterations, kShcViewPolicyEptEdit);
+}
+
+static ULONG64 BmReplayExitTraceDualViews(ULONG64 iterations) {
+  return BmReplayExitTraceWithPolicy(iterations, kShcViewPolicyDualEptViews);
+}
+
+// Returns an event of an allocation by one of a few callers
+static TfEvent BmMakeEvent(ULONG64 index) {
+  TfEvent event = {};
+  event.tsc = 1000000 + index * 1234;
+  event.address = 0xfffff80000001000ull + (index % 16) * 0x40;
+  event.argument = 0xffffa00000000000ull + index * 0x50;
+  event.size = 0x40 + (index % 8) * 0x10;
+  event.tag = kBmPoolTag + static_cast<ULONG>(index % 4);
+  event.kind = kTfEventAllocatePool;
+  return event;
+}
+
+// Encodes allocation events into blocks
+static ULONG64 BmEncodeEvents(ULONG64 iterations) {
+  std::vector<UCHAR> block(kTfBlockSize);
+  ULONG64 block_count = 0;
+  TfInitializeBlock(block.data(), 0, 0, 0);
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    const auto event = BmMakeEvent(i);
+    if (!TfAppendEvent(block.data(), event)) {
+      block_count++;
+      TfInitializeBlock(block.data(), 0, event.tsc, event.address);
+      TfAppendEvent(block.data(), event);
+    }
+  }
+  return block_count;
+}
+
+// Decodes allocation events from a full block over and over
+static ULONG64 BmDecodeEvents(ULONG64 iterations) {
+  std::vector<UCHAR> block(kTfBlockSize);
+  TfInitializeBlock(block.data(), 0, 0, 0);
+  for (ULONG64 i = 0; TfAppendEvent(block.data(), BmMakeEvent(i)); ++i) {
+  }
+
+  ULONG64 sum = 0;
+  for (ULONG64 decoded = 0; decoded < iterations;) {
+    TfBlockReader reader = {};
+    TfInitializeBlockReader(&reader, block.data());
+    TfEvent event = {};
+    while (decoded < iterations && TfReadEvent(&reader, &event)) {
+      sum += event.size;
+      decoded++;
+    }
+  }
+  return sum;
+}
+
+static ULONG64 BmRecordLatency(ULONG64 iterations) {
+  std::unique_ptr<LhHistogram> histogram(new LhHistogram());
+  std::mt19937_64 random(6);
+  std::lognormal_distribution<double> latencies(7, 1.5);
+  std::vector<ULONG64> values;
+  for (auto i = 0; i < 4096; ++i) {
+    values.push_back(static_cast<ULONG64>(latencies(random)));
+  }
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    LhRecord(histogram.get(), values[i % values.size()]);
+  }
+  return LhValueAtPermille(*histogram, 990);
+}
+
+// Tests addresses mostly reported already, as a handler filtering callers
+static ULONG64 BmSeenFilter(ULONG64 iterations) {
+  std::unique_ptr<SfFilter> filter(new SfFilter());
+  SfInitialize(filter.get(), 1ull << 40, 0);
+  ULONG64 reported = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    const auto key = 0xfffff80000000000ull + ((i * 0x9e3779b9) % 4096) * 16;
+    reported += SfTestAndSet(filter.get(), key, i);
+  }
+  return reported;
+}
+
+static LONG BmApplyOperation(void* context, const CrOperation& operation) {
+  *static_cast<ULONG64*>(context) += operation.arguments[0];
+  return 0;
+}
+
+// Posts and drains batches of two operations as a single processor does
+static ULONG64 BmCommandRing(ULONG64 iterations) {
+  std::unique_ptr<CrRing> ring(new CrRing());
+  CrInitializeRing(ring.get());
+  ULONG64 sum = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    CrBatch batch = {};
+    CrInitializeBatch(&batch, 1);
+    CrAddOperation(&batch, 1, i, 0);
+    CrAddOperation(&batch, 2, 1, 0);
+    CrPost(ring.get(), &batch);
+    CrDrain(ring.get(), BmApplyOperation, &sum);
+  }
+  return sum;
+}
+
+// Increments counters of kBmThreadCount threads, each its own counter, with
+// interlocked operations as ShHandleBreakpoint() and ShLeaveHookHandler() do,
+// and returns the sum of them
+template <typename Counter>
+static ULONG64 BmIncrementCounters(ULONG64 iterations) {
+  std::unique_ptr<Counter[]> counters(new Counter[kBmThreadCount]);
+  for (auto t = 0ul; t < kBmThreadCount; ++t) {
+    counters[t].count = 0;
+  }
+  std::vector<std::thread> threads;
+  for (auto t = 0ul; t < kBmThreadCount; ++t) {
+    threads.emplace_back([&counters, t, iterations] {
+      for (ULONG64 i = t; i < iterations; i += kBmThreadCount) {
+        counters[t].count.fetch_add(1);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ULONG64 sum = 0;
+  for (auto t = 0ul; t < kBmThreadCount; ++t) {
+    sum += counters[t].count;
+  }
+  return sum;
+}
+
+// Updates counters sharing cache lines, which bounce between processors
+static ULONG64 BmPackedCounters(ULONG64 iterations) {
+  return BmIncrementCounters<BmPackedCounter>(iterations);
+}
+
+// Updates counters on cache lines of their own
+static ULONG64 BmPaddedCounters(ULONG64 iterations) {
+  return BmIncrementCounters<BmPaddedCounter>(iterations);
+}
+
+// Returns an image name of a numbered program
+static std::u16string BmMakeImageName(ULONG number) {
+  const auto digits = std::to_string(number);
+  return u"program" + std::u16string(digits.begin(), digits.end()) + u".exe";
+}
+
+// Filters lists of kBmListedProcessCount processes, a few of which are
+// hidden, as the NtQuerySystemInformation() handler does. Each operation is
+// a process examined.
+static ULONG64 BmFilterProcessList(ULONG64 iterations) {
+  // A hide list of names of no listed process, and of some listed IDs
+  std::unique_ptr<HlcTable> table(new HlcTable());
+  std::vector<std::u16string> hidden_names;
+  for (auto i = 0ul; i < kBmHiddenNameCount; ++i) {
+    hidden_names.push_back(BmMakeImageName(i + 1000));
+  }
+  std::vector<HlcEntry> entries(kBmHiddenNameCount + kBmHiddenProcessIdCount);
+  for (auto i = 0ul; i < kBmHiddenNameCount; ++i) {
+    auto& entry = entries[i];
+    entry.name.length =
+        static_cast<USHORT>(hidden_names[i].size() * sizeof(USHORT));
+    entry.name.maximum_length = entry.name.length;
+    entry.name.buffer =
+        reinterpret_cast<const USHORT*>(hidden_names[i].data());
+    entry.hash = HlcHashName(entry.name);
+    HlcInsertEntry(table.get(), &entry);
+  }
+  for (auto i = 0ul; i < kBmHiddenProcessIdCount; ++i) {
+    auto& entry = entries[kBmHiddenNameCount + i];
+    entry.process_id =
+        i * (kBmListedProcessCount / kBmHiddenProcessIdCount) * 4;
+    entry.hash = HlcHashProcessId(entry.process_id);
+    HlcInsertEntry(table.get(), &entry);
+  }
+
+  // A list with an image name following each entry
+  const ULONG kEntrySize = sizeof(HlcProcessInformation) + 64;
+  std::vector<ULONG64> list(kBmListedProcessCount * kEntrySize / 8);
+  const auto base = reinterpret_cast<UCHAR*>(list.data());
+  for (auto i = 0ul; i < kBmListedProcessCount; ++i) {
+    const auto entry =
+        reinterpret_cast<HlcProcessInformation*>(base + i * kEntrySize);
+    const auto name = BmMakeImageName(i % 300);
+    const auto buffer = reinterpret_cast<USHORT*>(entry + 1);
+    std::copy(name.begin(), name.end(), buffer);
+    entry->image_name.length =
+        static_cast<USHORT>(name.size() * sizeof(USHORT));
+    entry->image_name.maximum_length = entry->image_name.length;
+    entry->image_name.buffer = buffer;
+    entry->unique_process_id = i * 4;
+  }
+
+  ULONG64 hidden_sum = 0;
+  const auto size = static_cast<ULONG>(list.size() * sizeof(ULONG64));
+  for (ULONG64 examined = 0; examined < iterations;
+       examined += kBmListedProcessCount) {
+    // Links all entries again
+    for (auto i = 0ul; i < kBmListedProcessCount; ++i) {
+      reinterpret_cast<HlcProcessInformation*>(base + i * kEntrySize)
+          ->next_entry_offset =
+          (i + 1 < kBmListedProcessCount) ? kEntrySize : 0;
+    }
+    ULONG hidden_count = 0;
+    HlcFilterProcessInformation(*table, list.data(), size, &hidden_count);
+    hidden_sum += hidden_count;
+  }
+  return hidden_sum;
+}
+
+// Returns ETHREAD-like owners of slots. With colliding, all of them are
+// probed from the same slot.
+static std::vector<void*> BmMakeOwners(ULONG count, bool colliding) {
+  std::mt19937_64 random(6);
+  std::vector<void*> owners;
+  for (auto i = 0ul; i < count; ++i) {
+    const auto address =
+        colliding ? 0xffffe00000001000ull + (i * kRrcSlotCount << 4)
+                  : 0xffffe00000000000ull + ((random() & 0xffffff) << 4);
+    owners.push_back(reinterpret_cast<void*>(address));
+  }
+  return owners;
+}
+
+// Records nested calls of kBmRecordingThreadCount threads as RrpPreCall()
+// and RrpPostCall() do, releasing a slot after the outermost call. Each
+// operation is a call pushed and popped.
+static ULONG64 BmRecordReturns(ULONG64 iterations) {
+  std::unique_ptr<RrcSlot[]> slots(new RrcSlot[kRrcSlotCount]());
+  const auto owners = BmMakeOwners(kBmRecordingThreadCount, false);
+  HcCallContext call_contexts[kBmRecordedDepth] = {};
+  ULONG64 cycles = 0;
+  for (ULONG64 i = 0; i < iterations; i += kBmRecordedDepth) {
+    const auto owner = owners[(i * 7) % owners.size()];
+    for (auto depth = 0ul; depth < kBmRecordedDepth; ++depth) {
+      const auto slot = RrcFindSlot(slots.get(), owner, true);
+      RrcPushFrame(slot, {&call_contexts[depth], nullptr, i + depth});
+    }
+    for (auto depth = kBmRecordedDepth; depth > 0; --depth) {
+      const auto slot = RrcFindSlot(slots.get(), owner, false);
+      RrcFrame frame = {};
+      ULONG abandoned_count = 0;
+      RrcPopFrame(slot, &call_contexts[depth - 1], &frame, &abandoned_count);
+      if (!slot->depth) {
+        RrcReleaseSlot(slot);
+      }
+      cycles += i + kBmRecordedDepth - frame.start_tsc;
+    }
+  }
+  return cycles;
+}
+
+// Finds slots of kRrcMaxProbes threads probed from the same slot, and of a
+// thread in no recorded call, which examines all of them
+static ULONG64 BmFindCollidingSlots(ULONG64 iterations) {
+  std::unique_ptr<RrcSlot[]> slots(new RrcSlot[kRrcSlotCount]());
+  const auto owners = BmMakeOwners(kRrcMaxProbes + 1, true);
+  for (auto i = 0ul; i < kRrcMaxProbes; ++i) {
+    RrcFindSlot(slots.get(), owners[i], true);
+  }
+  ULONG64 found_count = 0;
+  for (ULONG64 i = 0; i < iterations; ++i) {
+    found_count +=
+        RrcFindSlot(slots.get(), owners[i % owners.size()], false) != nullptr;
+  }
+  return found_count;
+}
+
+// Pushes kRrcMaxDepth calls, dropping the rest, and pops the outermost one,
+// abandoning the others as a thread unwound past them. Each operation is a
+// frame pushed or dropped.
+static ULONG64 BmPopAbandonedFrames(ULONG64 iterations) {
+  std::unique_ptr<RrcSlot[]> slots(new RrcSlot[kRrcSlotCount]());
+  const auto owner = BmMakeOwners(1, false)[0];
+  HcCallContext call_contexts[kRrcMaxDepth + 1] = {};
+  ULONG64 abandoned_total = 0;
+  for (ULONG64 i = 0; i < iterations; i += kRrcMaxDepth + 1) {
+    const auto slot = RrcFindSlot(slots.get(), owner, true);
+    for (const auto& call_context : call_contexts) {
+      abandoned_total += !RrcPushFrame(slot, {&call_context, nullptr, i});
+    }
+    RrcFrame frame = {};
+    ULONG abandoned_count = 0;
+    RrcPopFrame(slot, &call_contexts[0], &frame, &abandoned_count);
+    abandoned_total += abandoned_count;
+    RrcReleaseSlot(slot);
+  }
+  return abandoned_total;
+}
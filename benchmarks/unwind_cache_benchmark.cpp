@@ -0,0 +1,306 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Walks synthetic stacks through an unwind cache on a host, and prints hit
+/// rates and nanoseconds per lookup with and without the cache as JSON or CSV,
+/// so that the size and associativity of the cache in unwind_cache.h can be
+/// tuned without a kernel debugger.
+///
+/// Loaded images are modeled as sorted tables of function ranges searched as
+/// RtlLookupFunctionEntry() does: an image is found by its base, and then a
+/// function in its table by binary search. Stacks are made of call sites
+/// chosen with a skewed popularity, and walked with a skewed popularity too,
+/// as hooks see a few hot paths and a long tail of others.
+///
+/// Usage: unwind_cache_benchmark [--iterations N] [--format json|csv]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+#include "unwind_cache.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Kernel images loaded on a typical system, and functions of each
+static const ULONG kUbImageCount = 160;
+static const ULONG kUbMinFunctionCount = 50;
+static const ULONG kUbMaxFunctionCount = 4000;
+
+static const ULONG64 kUbImageRangeStart = 0xfffff80000000000ull;
+
+// Frames of a walked stack, as kStMaxStackDepth
+static const ULONG kUbMinDepth = 6;
+static const ULONG kUbMaxDepth = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// RUNTIME_FUNCTION with absolute addresses
+struct UbFunction {
+  ULONG64 begin;
+  ULONG64 end;
+};
+
+struct UbImage {
+  ULONG64 base;
+  ULONG64 size;
+  std::vector<UbFunction> functions;  // Sorted by address
+};
+
+// Loaded images sorted by their bases
+struct UbImages {
+  std::vector<UbImage> images;
+  ULONG64 lookup_count;
+};
+
+// A workload of stack walks
+struct UbScenario {
+  const char* name;
+  ULONG stack_count;      // Distinct stacks walked
+  ULONG call_site_count;  // Distinct return addresses in them
+  ULONG walks_per_load;   // Walks between image loads, or 0 for none
+};
+
+struct UbResult {
+  const char* name;
+  ULONG64 lookups;
+  double hit_rate;
+  double cached_nanoseconds;
+  double uncached_nanoseconds;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const UbScenario kUbScenarios[] = {
+    {"hot_paths", 512, 2000, 0},
+    {"wide_paths", 16384, 20000, 0},
+    {"image_loads", 512, 2000, 1000},
+};
+
+static volatile ULONG64 g_ub_sink;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Lays out images with functions of random sizes, leaving gaps between
+// images as the kernel address space has
+static UbImages UbMakeImages(std::mt19937_64* random) {
+  UbImages images = {};
+  auto base = kUbImageRangeStart;
+  for (auto i = 0ul; i < kUbImageCount; ++i) {
+    UbImage image = {base, 0, {}};
+    const auto function_count =
+        kUbMinFunctionCount +
+        (*random)() % (kUbMaxFunctionCount - kUbMinFunctionCount);
+    auto address = base + 0x1000;
+    for (auto j = 0ul; j < function_count; ++j) {
+      const auto size = 0x20 + (*random)() % 0x800;
+      image.functions.push_back({address, address + size});
+      address += (size + 0xf) & ~0xfull;
+    }
+    image.size = ((address - base) + 0xfff) & ~0xfffull;
+    base += image.size + 0x10000;
+    images.images.push_back(std::move(image));
+  }
+  return images;
+}
+
+// Finds a function of pc as RtlLookupFunctionEntry() does
+static void* UbLookup(ULONG64 pc, ULONG64* image_base, void* context) {
+  const auto images = static_cast<UbImages*>(context);
+  images->lookup_count++;
+  *image_base = 0;
+  const auto image = std::upper_bound(
+      images->images.begin(), images->images.end(), pc,
+      [](ULONG64 value, const UbImage& image) { return value < image.base; });
+  if (image == images->images.begin()) {
+    return nullptr;
+  }
+  auto& candidate = *(image - 1);
+  if (pc >= candidate.base + candidate.size) {
+    return nullptr;
+  }
+  const auto function = std::upper_bound(
+      candidate.functions.begin(), candidate.functions.end(), pc,
+      [](ULONG64 value, const UbFunction& function) {
+        return value < function.begin;
+      });
+  if (function == candidate.functions.begin() || pc >= (function - 1)->end) {
+    return nullptr;
+  }
+  *image_base = candidate.base;
+  return &*(function - 1);
+}
+
+// Returns an index in [0, count) chosen with popularity proportional to
+// 1 / (index + 1)
+static ULONG UbPickSkewed(std::mt19937_64* random, ULONG count) {
+  std::uniform_real_distribution<double> distribution(0.0, 1.0);
+  const auto index = static_cast<ULONG>(
+      std::exp(distribution(*random) * std::log(count + 1.0)) - 1.0);
+  return (index < count) ? index : count - 1;
+}
+
+// Returns return addresses of call sites, each inside a random function
+static std::vector<ULONG64> UbMakeCallSites(const UbImages& images,
+                                            ULONG count,
+                                            std::mt19937_64* random) {
+  std::vector<ULONG64> call_sites;
+  for (auto i = 0ul; i < count; ++i) {
+    const auto& image = images.images[(*random)() % images.images.size()];
+    const auto& function =
+        image.functions[(*random)() % image.functions.size()];
+    call_sites.push_back(function.begin +
+                         (*random)() % (function.end - function.begin));
+  }
+  return call_sites;
+}
+
+// Returns stacks made of call sites picked with a skewed popularity, so that
+// a few call sites are in most stacks
+static std::vector<std::vector<ULONG64>> UbMakeStacks(
+    const std::vector<ULONG64>& call_sites, ULONG count,
+    std::mt19937_64* random) {
+  std::vector<std::vector<ULONG64>> stacks(count);
+  for (auto& stack : stacks) {
+    const auto depth =
+        kUbMinDepth + (*random)() % (kUbMaxDepth - kUbMinDepth + 1);
+    for (auto i = 0ul; i < depth; ++i) {
+      stack.push_back(call_sites[UbPickSkewed(
+          random, static_cast<ULONG>(call_sites.size()))]);
+    }
+  }
+  return stacks;
+}
+
+// Walks stacks in the order given, looking up each frame with or without the
+// cache, and returns nanoseconds it took
+static double UbWalk(const UbScenario& scenario,
+                     const std::vector<std::vector<ULONG64>>& stacks,
+                     const std::vector<ULONG>& order, UbImages* images,
+                     UcCache* cache) {
+  ULONG64 sum = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (auto i = 0u; i < order.size(); ++i) {
+    if (cache && scenario.walks_per_load && i &&
+        !(i % scenario.walks_per_load)) {
+      UcInvalidate(cache);
+    }
+    for (const auto pc : stacks[order[i]]) {
+      ULONG64 image_base = 0;
+      const auto function_entry =
+          cache ? UcLookup(cache, pc, &image_base, UbLookup, images)
+                : UbLookup(pc, &image_base, images);
+      sum += reinterpret_cast<ULONG_PTR>(function_entry) + image_base;
+    }
+  }
+  const auto end = std::chrono::steady_clock::now();
+  g_ub_sink = g_ub_sink + sum;
+  return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+static UbResult UbRunScenario(const UbScenario& scenario, ULONG64 walks) {
+  std::mt19937_64 random(39);
+  auto images = UbMakeImages(&random);
+  const auto call_sites =
+      UbMakeCallSites(images, scenario.call_site_count, &random);
+  const auto stacks = UbMakeStacks(call_sites, scenario.stack_count, &random);
+  std::vector<ULONG> order;
+  ULONG64 lookups = 0;
+  for (ULONG64 i = 0; i < walks; ++i) {
+    order.push_back(UbPickSkewed(&random, scenario.stack_count));
+    lookups += stacks[order.back()].size();
+  }
+
+  std::unique_ptr<UcCache> cache(new UcCache());
+  UcInitialize(cache.get());
+  const auto cached_nanoseconds =
+      UbWalk(scenario, stacks, order, &images, cache.get());
+  const auto uncached_nanoseconds =
+      UbWalk(scenario, stacks, order, &images, nullptr);
+  return {scenario.name, lookups,
+          static_cast<double>(cache->hit_count) / lookups,
+          cached_nanoseconds / lookups, uncached_nanoseconds / lookups};
+}
+
+int main(int argc, char* argv[]) {
+  ULONG64 iterations = 10000;
+  const char* format = "json";
+  for (auto i = 1; i < argc; ++i) {
+    if (!std::strcmp(argv[i], "--iterations") && i + 1 < argc) {
+      iterations = std::strtoull(argv[++i], nullptr, 0);
+    } else if (!std::strcmp(argv[i], "--format") && i + 1 < argc) {
+      format = argv[++i];
+    } else {
+      std::fprintf(stderr,
+                   "usage: %s [--iterations N] [--format json|csv]\n",
+                   argv[0]);
+      return 2;
+    }
+  }
+  const auto json = !std::strcmp(format, "json");
+  if (!iterations || (!json && std::strcmp(format, "csv"))) {
+    std::fprintf(stderr, "invalid arguments\n");
+    return 2;
+  }
+
+  // Each iteration is a hundred stack walks
+  std::vector<UbResult> results;
+  for (const auto& scenario : kUbScenarios) {
+    results.push_back(UbRunScenario(scenario, iterations * 100));
+  }
+
+  if (json) {
+    std::printf("{\n  \"iterations\": %llu,\n  \"results\": [\n",
+                static_cast<unsigned long long>(iterations));
+    for (auto i = 0u; i < results.size(); ++i) {
+      const auto& result = results[i];
+      std::printf(
+          "    {\"name\": \"%s\", \"lookups\": %llu, \"hit_rate\": %.4f, "
+          "\"cached_ns_per_lookup\": %.3f, "
+          "\"uncached_ns_per_lookup\": %.3f}%s\n",
+          result.name, static_cast<unsigned long long>(result.lookups),
+          result.hit_rate, result.cached_nanoseconds,
+          result.uncached_nanoseconds, (i + 1 == results.size()) ? "" : ",");
+    }
+    std::printf("  ]\n}\n");
+  } else {
+    std::printf(
+        "name,lookups,hit_rate,cached_ns_per_lookup,uncached_ns_per_lookup\n");
+    for (const auto& result : results) {
+      std::printf("%s,%llu,%.4f,%.3f,%.3f\n", result.name,
+                  static_cast<unsigned long long>(result.lookups),
+                  result.hit_rate, result.cached_nanoseconds,
+                  result.uncached_nanoseconds);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,440 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Rebuilds pages of PE32+ and PE32 images generated in memory with
+/// CiBuildExpectedPage() and checks them against a reference loader for all
+/// kinds of base relocations, including ones crossing pages. Also checks that
+/// hooks written over a loaded page are located by CiComparePage(), that
+/// hashes are stable and sensitive to every byte and seed, and that
+/// malformed files and relocations are refused.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "code_integrity.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Layout of generated images
+static const ULONG kItNtOffset = 0x80;
+static const ULONG kItHeaderSize = 0x400;
+static const ULONG kItTextRva = 0x1000;
+static const ULONG kItTextSize = 0x2000;
+static const ULONG kItRelocationRva = 0x3000;
+static const ULONG kItRelocationRawSize = 0x200;
+static const ULONG kItDataRva = 0x4000;
+static const ULONG kItDataVirtualSize = 0x1800;
+static const ULONG kItDataRawSize = 0x200;
+static const ULONG kItImageSize = 0x6000;
+
+// Kinds of base relocations
+static const USHORT kItRelocationAbsolute = 0;
+static const USHORT kItRelocationHigh = 1;
+static const USHORT kItRelocationLow = 2;
+static const USHORT kItRelocationHighLow = 3;
+static const USHORT kItRelocationHighAdj = 4;
+static const USHORT kItRelocationDir64 = 10;
+
+// CiHashPage() of ItMakePage(7) with the seed 42, which both SSE2 and
+// portable code must give
+static const ULONG64 kItPageHash = 0x793a73f0779b8b6full;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct ItRelocation {
+  ULONG rva;
+  USHORT kind;
+  USHORT parameter;  // The low 16 bits of a value for kItRelocationHighAdj
+};
+
+// A generated image and its relocations
+struct ItImage {
+  std::vector<UCHAR> file;
+  ULONG64 image_base;
+  std::vector<ItRelocation> relocations;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static void ItStore(std::vector<UCHAR>* bytes, ULONG offset, ULONG size,
+                    ULONG64 value) {
+  for (auto i = 0ul; i < size; ++i) {
+    (*bytes)[offset + i] = static_cast<UCHAR>(value >> (i * 8));
+  }
+}
+
+static ULONG64 ItLoad(const std::vector<UCHAR>& bytes, ULONG offset,
+                      ULONG size) {
+  ULONG64 value = 0;
+  for (auto i = size; i > 0; --i) {
+    value = (value << 8) | bytes[offset + i - 1];
+  }
+  return value;
+}
+
+// Returns a page of pseudo-random bytes
+static std::vector<UCHAR> ItMakePage(ULONG seed) {
+  std::mt19937 random(seed);
+  std::vector<UCHAR> page(kCiPageSize);
+  for (auto& byte : page) {
+    byte = static_cast<UCHAR>(random());
+  }
+  return page;
+}
+
+// Encodes relocations into blocks of pages, each padded to 4 bytes with an
+// absolute entry
+static std::vector<UCHAR> ItEncodeRelocations(
+    const std::vector<ItRelocation>& relocations) {
+  std::vector<UCHAR> blocks;
+  for (size_t i = 0; i < relocations.size();) {
+    const auto page_rva = relocations[i].rva & ~(kCiPageSize - 1);
+    std::vector<USHORT> entries;
+    for (; i < relocations.size() &&
+           (relocations[i].rva & ~(kCiPageSize - 1)) == page_rva;
+         ++i) {
+      const auto& relocation = relocations[i];
+      entries.push_back(static_cast<USHORT>(
+          (relocation.kind << 12) | (relocation.rva & (kCiPageSize - 1))));
+      if (relocation.kind == kItRelocationHighAdj) {
+        entries.push_back(relocation.parameter);
+      }
+    }
+    if (entries.size() % 2) {
+      entries.push_back(kItRelocationAbsolute << 12);
+    }
+    const auto offset = static_cast<ULONG>(blocks.size());
+    blocks.resize(offset + 8 + entries.size() * 2);
+    ItStore(&blocks, offset, 4, page_rva);
+    ItStore(&blocks, offset + 4, 4, 8 + entries.size() * 2);
+    for (size_t j = 0; j < entries.size(); ++j) {
+      ItStore(&blocks, static_cast<ULONG>(offset + 8 + j * 2), 2, entries[j]);
+    }
+  }
+  return blocks;
+}
+
+// Generates a PE32+ or PE32 file with an executable section, a relocation
+// section whose raw data is larger than its virtual size, and a data section
+// whose virtual size is larger than its raw data. Relocations must be sorted
+// by RVA.
+static ItImage ItMakeImage(bool pe64,
+                           const std::vector<ItRelocation>& relocations) {
+  ItImage image = {};
+  image.image_base = (pe64) ? 0x140000000ull : 0x400000ull;
+  image.relocations = relocations;
+  const auto encoded = ItEncodeRelocations(relocations);
+
+  const ULONG text_offset = kItHeaderSize;
+  const auto relocation_offset = text_offset + kItTextSize;
+  const auto data_offset = relocation_offset + kItRelocationRawSize;
+  auto& file = image.file;
+  file.resize(data_offset + kItDataRawSize);
+
+  ItStore(&file, 0, 2, 0x5a4d);
+  ItStore(&file, 0x3c, 4, kItNtOffset);
+  ItStore(&file, kItNtOffset, 4, 0x00004550);
+  const auto file_header = kItNtOffset + 4;
+  const auto optional_size = (pe64) ? 240ul : 224ul;
+  ItStore(&file, file_header, 2, (pe64) ? 0x8664 : 0x14c);
+  ItStore(&file, file_header + 2, 2, 3);
+  ItStore(&file, file_header + 16, 2, optional_size);
+  const auto optional = file_header + 20;
+  ItStore(&file, optional, 2, (pe64) ? 0x20b : 0x10b);
+  if (pe64) {
+    ItStore(&file, optional + 24, 8, image.image_base);
+  } else {
+    ItStore(&file, optional + 28, 4, image.image_base);
+  }
+  ItStore(&file, optional + 56, 4, kItImageSize);
+  ItStore(&file, optional + 60, 4, kItHeaderSize);
+  const auto directories = optional + ((pe64) ? 112 : 96);
+  ItStore(&file, directories - 4, 4, 16);
+  ItStore(&file, directories + 5 * 8, 4, kItRelocationRva);
+  ItStore(&file, directories + 5 * 8 + 4, 4, encoded.size());
+
+  const struct {
+    ULONG rva;
+    ULONG virtual_size;
+    ULONG raw_offset;
+    ULONG raw_size;
+    ULONG characteristics;
+  } kSections[] = {
+      {kItTextRva, kItTextSize, text_offset, kItTextSize,
+       kCiSectionExecute | 0x60000020},
+      {kItRelocationRva, static_cast<ULONG>(encoded.size()),
+       relocation_offset, kItRelocationRawSize,
+       kCiSectionDiscardable | 0x42000040},
+      {kItDataRva, kItDataVirtualSize, data_offset, kItDataRawSize,
+       0xc0000040},
+  };
+  auto section_header = optional + optional_size;
+  for (const auto& section : kSections) {
+    ItStore(&file, section_header + 8, 4, section.virtual_size);
+    ItStore(&file, section_header + 12, 4, section.rva);
+    ItStore(&file, section_header + 16, 4, section.raw_size);
+    ItStore(&file, section_header + 20, 4, section.raw_offset);
+    ItStore(&file, section_header + 36, 4, section.characteristics);
+    section_header += 40;
+  }
+
+  for (auto page = 0ul; page < kItTextSize / kCiPageSize; ++page) {
+    const auto bytes = ItMakePage(page + 1);
+    std::copy(bytes.begin(), bytes.end(),
+              file.begin() + text_offset + page * kCiPageSize);
+  }
+  std::copy(encoded.begin(), encoded.end(), file.begin() + relocation_offset);
+  // Bytes past the virtual size of the section are never mapped
+  for (auto i = static_cast<ULONG>(encoded.size()); i < kItRelocationRawSize;
+       ++i) {
+    file[relocation_offset + i] = 0xee;
+  }
+  for (auto i = 0ul; i < kItDataRawSize; ++i) {
+    file[data_offset + i] = static_cast<UCHAR>(i | 1);
+  }
+  return image;
+}
+
+// Maps an image at load_base as the loader does, independently of
+// code_integrity.cpp
+static std::vector<UCHAR> ItMapImage(const ItImage& image, ULONG64 load_base) {
+  const auto& file = image.file;
+  std::vector<UCHAR> memory(kItImageSize);
+  std::copy(file.begin(), file.begin() + kItHeaderSize, memory.begin());
+  std::copy(file.begin() + kItHeaderSize,
+            file.begin() + kItHeaderSize + kItTextSize,
+            memory.begin() + kItTextRva);
+  const auto relocation_offset = kItHeaderSize + kItTextSize;
+  const auto encoded = ItEncodeRelocations(image.relocations);
+  std::copy(file.begin() + relocation_offset,
+            file.begin() + relocation_offset + encoded.size(),
+            memory.begin() + kItRelocationRva);
+  std::copy(file.begin() + relocation_offset + kItRelocationRawSize,
+            file.end(), memory.begin() + kItDataRva);
+
+  const auto delta = load_base - image.image_base;
+  for (const auto& relocation : image.relocations) {
+    const auto rva = relocation.rva;
+    switch (relocation.kind) {
+      case kItRelocationDir64:
+        ItStore(&memory, rva, 8, ItLoad(memory, rva, 8) + delta);
+        break;
+      case kItRelocationHighLow:
+        ItStore(&memory, rva, 4, ItLoad(memory, rva, 4) + delta);
+        break;
+      case kItRelocationLow:
+        ItStore(&memory, rva, 2, ItLoad(memory, rva, 2) + delta);
+        break;
+      case kItRelocationHigh:
+        ItStore(&memory, rva, 2, ItLoad(memory, rva, 2) + (delta >> 16));
+        break;
+      case kItRelocationHighAdj: {
+        auto value = static_cast<ULONG>(ItLoad(memory, rva, 2) << 16);
+        value += static_cast<ULONG>(static_cast<short>(relocation.parameter));
+        value += static_cast<ULONG>(delta) + 0x8000;
+        ItStore(&memory, rva, 2, value >> 16);
+        break;
+      }
+    }
+  }
+  return memory;
+}
+
+// Checks all pages rebuilt for load_base against the reference loader
+static void ItTestRebuild(const ItImage& image, ULONG64 load_base) {
+  CiImage parsed = {};
+  DDIMON_EXPECT(CiParseImage(&parsed, image.file.data(), image.file.size()));
+  DDIMON_EXPECT(parsed.image_base == image.image_base);
+  DDIMON_EXPECT(parsed.image_size == kItImageSize);
+  DDIMON_EXPECT(parsed.header_size == kItHeaderSize);
+  DDIMON_EXPECT(parsed.section_count == 3);
+  DDIMON_EXPECT(parsed.relocation_rva == kItRelocationRva);
+
+  CiSection section = {};
+  DDIMON_EXPECT(CiGetSection(parsed, 0, &section));
+  DDIMON_EXPECT(section.rva == kItTextRva);
+  DDIMON_EXPECT(section.characteristics & kCiSectionExecute);
+  DDIMON_EXPECT(!CiGetSection(parsed, 3, &section));
+
+  const auto memory = ItMapImage(image, load_base);
+  std::vector<UCHAR> window(kCiWindowSize);
+  for (auto rva = 0ul; rva < kItImageSize; rva += kCiPageSize) {
+    DDIMON_EXPECT(CiBuildExpectedPage(parsed, rva, load_base, window.data()));
+    CiDifference difference = {};
+    DDIMON_EXPECT(CiComparePage(memory.data() + rva,
+                                window.data() + kCiWindowMargin, kCiPageSize,
+                                &difference) == 0);
+  }
+}
+
+// Relocations of all kinds and at page boundaries. A DIR64 relocation at
+// 0x1ffc is split between the first and the second page of the section.
+static void ItTestRelocations() {
+  const std::vector<ItRelocation> relocations64 = {
+      {0x1000, kItRelocationDir64, 0},
+      {0x1100, kItRelocationDir64, 0},
+      {0x1ff0, kItRelocationDir64, 0},
+      {0x1ffc, kItRelocationDir64, 0},
+      {0x2004, kItRelocationHighLow, 0},
+      {0x2ff8, kItRelocationDir64, 0},
+  };
+  const auto image64 = ItMakeImage(true, relocations64);
+  ItTestRebuild(image64, image64.image_base);
+  ItTestRebuild(image64, image64.image_base + 0x7ff12340000ull);
+  ItTestRebuild(image64, image64.image_base - 0x10000);
+
+  const std::vector<ItRelocation> relocations32 = {
+      {0x1010, kItRelocationHighLow, 0},
+      {0x1020, kItRelocationHigh, 0},
+      {0x1030, kItRelocationLow, 0},
+      {0x1040, kItRelocationHighAdj, 0x8001},
+      {0x1050, kItRelocationHighAdj, 0x7fff},
+      {0x1ffe, kItRelocationHighLow, 0},
+  };
+  const auto image32 = ItMakeImage(false, relocations32);
+  ItTestRebuild(image32, image32.image_base);
+  ItTestRebuild(image32, 0x81238000);
+  ItTestRebuild(image32, 0x12345678 & ~(kCiPageSize - 1));
+}
+
+// Hooks written over a loaded page are located
+static void ItTestHookDetection() {
+  const auto image = ItMakeImage(true, {{0x1100, kItRelocationDir64, 0}});
+  const auto load_base = image.image_base + 0x100000;
+  auto memory = ItMapImage(image, load_base);
+  CiImage parsed = {};
+  DDIMON_EXPECT(CiParseImage(&parsed, image.file.data(), image.file.size()));
+  std::vector<UCHAR> window(kCiWindowSize);
+  DDIMON_EXPECT(
+      CiBuildExpectedPage(parsed, kItTextRva, load_base, window.data()));
+  const auto expected = window.data() + kCiWindowMargin;
+  const auto live = memory.data() + kItTextRva;
+
+  // A 5-byte jump at 0x123 and a flipped bit at 0xff0
+  live[0x123] = 0xe9;
+  for (auto i = 0x124ul; i < 0x128; ++i) {
+    live[i] = static_cast<UCHAR>(~live[i]);
+  }
+  live[0xff0] ^= 1;
+  const auto jump_changed = 4ul + (expected[0x123] != 0xe9);
+  CiDifference difference = {};
+  DDIMON_EXPECT(CiComparePage(live, expected, kCiPageSize, &difference) ==
+                jump_changed + 1);
+  DDIMON_EXPECT(difference.changed_count == jump_changed + 1);
+  DDIMON_EXPECT(difference.last_offset == 0xff0);
+  DDIMON_EXPECT(difference.first_offset == ((jump_changed == 5) ? 0x123
+                                                                 : 0x124));
+
+  // Sizes that are not a multiple of vectors compare the tail bytewise
+  DDIMON_EXPECT(CiComparePage(live, expected, 0x125, &difference) ==
+                jump_changed - 3);
+  DDIMON_EXPECT(difference.last_offset == 0x124);
+  DDIMON_EXPECT(CiComparePage(live, expected, 0x123, &difference) == 0);
+  DDIMON_EXPECT(!difference.changed_count);
+}
+
+static void ItTestHash() {
+  auto page = ItMakePage(7);
+  const auto hash = CiHashPage(page.data(), 42);
+  DDIMON_EXPECT(hash == kItPageHash);
+  DDIMON_EXPECT(CiHashPage(page.data(), 42) == hash);
+  DDIMON_EXPECT(CiHashPage(page.data(), 43) != hash);
+
+  // Contents at another address hash the same
+  std::vector<UCHAR> shifted(kCiPageSize + 1);
+  std::copy(page.begin(), page.end(), shifted.begin() + 1);
+  DDIMON_EXPECT(CiHashPage(shifted.data() + 1, 42) == hash);
+
+  // Every bit matters, and swapping words is not cancelled out
+  for (auto i = 0ul; i < kCiPageSize * 8; i += 61) {
+    page[i / 8] ^= static_cast<UCHAR>(1 << (i % 8));
+    DDIMON_EXPECT(CiHashPage(page.data(), 42) != hash);
+    page[i / 8] ^= static_cast<UCHAR>(1 << (i % 8));
+  }
+  std::swap_ranges(page.begin(), page.begin() + 8, page.begin() + 64);
+  DDIMON_EXPECT(CiHashPage(page.data(), 42) != hash);
+}
+
+// Malformed files and relocations are refused without reading beyond them
+static void ItTestMalformed() {
+  const auto image = ItMakeImage(true, {{0x1100, kItRelocationDir64, 0}});
+  CiImage parsed = {};
+  auto file = image.file;
+  DDIMON_EXPECT(!CiParseImage(&parsed, file.data(), 0x3f));
+  DDIMON_EXPECT(!CiParseImage(&parsed, file.data(), kItNtOffset + 20));
+  DDIMON_EXPECT(!CiParseImage(&parsed, file.data(), kItNtOffset + 100));
+
+  const auto corrupt = [&](ULONG offset, ULONG size, ULONG64 value) {
+    auto bytes = image.file;
+    ItStore(&bytes, offset, size, value);
+    return CiParseImage(&parsed, bytes.data(), bytes.size());
+  };
+  DDIMON_EXPECT(!corrupt(0, 2, 0x4d5a));
+  DDIMON_EXPECT(!corrupt(0x3c, 4, 0xfffffff0));
+  DDIMON_EXPECT(!corrupt(kItNtOffset, 4, 0x00004551));
+  DDIMON_EXPECT(!corrupt(kItNtOffset + 24, 2, 0x107));
+  DDIMON_EXPECT(!corrupt(kItNtOffset + 6, 2, 0xffff));  // Sections
+
+  // A block smaller than its header fails only when relocations are needed
+  file = image.file;
+  ItStore(&file, kItHeaderSize + kItTextSize + 4, 4, 4);
+  DDIMON_EXPECT(CiParseImage(&parsed, file.data(), file.size()));
+  std::vector<UCHAR> window(kCiWindowSize);
+  DDIMON_EXPECT(CiBuildExpectedPage(parsed, kItTextRva, image.image_base,
+                                    window.data()));
+  DDIMON_EXPECT(!CiBuildExpectedPage(parsed, kItTextRva,
+                                     image.image_base + 0x10000,
+                                     window.data()));
+
+  // So does a block larger than the directory
+  file = image.file;
+  ItStore(&file, kItHeaderSize + kItTextSize + 4, 4, 0x1000);
+  DDIMON_EXPECT(CiParseImage(&parsed, file.data(), file.size()));
+  DDIMON_EXPECT(!CiBuildExpectedPage(parsed, kItTextRva,
+                                     image.image_base + 0x10000,
+                                     window.data()));
+
+  // A file truncated in the middle of a section rebuilds the rest as zeros
+  file = image.file;
+  file.resize(kItHeaderSize + 0x800);
+  DDIMON_EXPECT(CiParseImage(&parsed, file.data(), file.size()));
+  DDIMON_EXPECT(CiBuildExpectedPage(parsed, kItTextRva, image.image_base,
+                                    window.data()));
+  DDIMON_EXPECT(window[kCiWindowMargin + 0x7ff] == file.back());
+  DDIMON_EXPECT(window[kCiWindowMargin + 0x800] == 0);
+}
+
+int main() {
+  ItTestRelocations();
+  ItTestHookDetection();
+  ItTestHash();
+  ItTestMalformed();
+  return DdimonTestResult();
+}
@@ -0,0 +1,246 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests command rings: batches posted by many producers to rings drained by
+/// one consumer each, full rings, failure statuses, and a batch left in a ring
+/// by a consumer that did not drain it, as ShpSubmitBatch() abandons one.
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "command_ring.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kCtConsumerCount = 4;
+static const ULONG kCtProducerCount = 8;
+static const ULONG kCtBatchesPerProducer = 20000;
+static const ULONG kCtOperationsPerBatch = 3;
+
+// Operations understood by CtHandle()
+enum CtOperationKind : ULONG {
+  kCtOperationAdd = 1,   // Adds arguments[0] to a sum of the consumer
+  kCtOperationFail = 2,  // Adds as well, and reports kCtFailure
+  kCtOperationRecord = 3,  // Appends *arguments[0] to values of the consumer
+};
+
+static const LONG kCtFailure = -5;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// What a consumer applied
+struct CtConsumer {
+  CrRing ring;
+  std::atomic<ULONG64> sum;
+  std::vector<ULONG> values;
+};
+
+// A batch owning a value an operation refers to, as ShpBatch owns its EPT
+// modifications
+struct CtOwningBatch {
+  CrBatch batch;
+  ULONG value;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static LONG CtHandle(void* context, const CrOperation& operation) {
+  const auto consumer = static_cast<CtConsumer*>(context);
+  switch (operation.kind) {
+    case kCtOperationAdd:
+      consumer->sum += operation.arguments[0];
+      return 0;
+    case kCtOperationFail:
+      consumer->sum += operation.arguments[0];
+      return kCtFailure;
+    case kCtOperationRecord:
+      consumer->values.push_back(
+          *reinterpret_cast<const ULONG*>(operation.arguments[0]));
+      return 0;
+  }
+  return -1;
+}
+
+// Posts batches from many producers to all rings while consumers drain them,
+// and checks that every operation is applied once by every consumer and its
+// failure is reported to the producer
+static void CtTestProducers() {
+  const auto consumers = std::make_unique<CtConsumer[]>(kCtConsumerCount);
+  for (auto i = 0ul; i < kCtConsumerCount; ++i) {
+    CrInitializeRing(&consumers[i].ring);
+    consumers[i].sum = 0;
+  }
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> consumer_threads;
+  for (auto i = 0ul; i < kCtConsumerCount; ++i) {
+    consumer_threads.emplace_back([&, i] {
+      while (!stop.load()) {
+        CrDrain(&consumers[i].ring, CtHandle, &consumers[i]);
+        std::this_thread::yield();
+      }
+      CrDrain(&consumers[i].ring, CtHandle, &consumers[i]);
+    });
+  }
+
+  std::atomic<ULONG> wrong_statuses(0);
+  std::vector<std::thread> producer_threads;
+  for (auto producer = 0ul; producer < kCtProducerCount; ++producer) {
+    producer_threads.emplace_back([&, producer] {
+      for (auto n = 0ul; n < kCtBatchesPerProducer; ++n) {
+        const auto fails = (n % 100) == 0;
+        CrBatch batch = {};
+        CrInitializeBatch(&batch, kCtConsumerCount);
+        for (auto k = 0ul; k < kCtOperationsPerBatch; ++k) {
+          CrAddOperation(&batch,
+                         (fails && k == 1) ? kCtOperationFail : kCtOperationAdd,
+                         producer * 1000 + k, 0);
+        }
+        for (auto i = 0ul; i < kCtConsumerCount; ++i) {
+          while (!CrPost(&consumers[i].ring, &batch)) {
+            std::this_thread::yield();
+          }
+        }
+        while (!CrIsBatchComplete(&batch)) {
+          std::this_thread::yield();
+        }
+        if (CrGetBatchStatus(&batch) != ((fails) ? kCtFailure : 0)) {
+          wrong_statuses++;
+        }
+      }
+    });
+  }
+  for (auto& thread : producer_threads) {
+    thread.join();
+  }
+  stop.store(true);
+  for (auto& thread : consumer_threads) {
+    thread.join();
+  }
+
+  ULONG64 expected_sum = 0;
+  for (auto producer = 0ull; producer < kCtProducerCount; ++producer) {
+    expected_sum += kCtBatchesPerProducer *
+                    (kCtOperationsPerBatch * producer * 1000 +
+                     kCtOperationsPerBatch * (kCtOperationsPerBatch - 1) / 2);
+  }
+  DDIMON_EXPECT(wrong_statuses.load() == 0);
+  for (auto i = 0ul; i < kCtConsumerCount; ++i) {
+    DDIMON_EXPECT(consumers[i].sum.load() == expected_sum);
+    DDIMON_EXPECT(CrIsRingEmpty(&consumers[i].ring));
+  }
+}
+
+// Fills a ring without draining it, and completes a batch that did not fit on
+// behalf of the consumer
+static void CtTestFullRing() {
+  const auto consumer = std::make_unique<CtConsumer>();
+  CrInitializeRing(&consumer->ring);
+  consumer->sum = 0;
+  DDIMON_EXPECT(CrIsRingEmpty(&consumer->ring));
+
+  const auto batches = std::make_unique<CrBatch[]>(kCrRingCapacity + 1);
+  for (auto i = 0ul; i < kCrRingCapacity; ++i) {
+    CrInitializeBatch(&batches[i], 1);
+    CrAddOperation(&batches[i], kCtOperationAdd, 1, 0);
+    DDIMON_EXPECT(CrPost(&consumer->ring, &batches[i]));
+  }
+  auto& rejected = batches[kCrRingCapacity];
+  CrInitializeBatch(&rejected, 1);
+  CrAddOperation(&rejected, kCtOperationAdd, 1, 0);
+  DDIMON_EXPECT(!CrPost(&consumer->ring, &rejected));
+  CrCompleteBatch(&rejected, kCtFailure);
+  DDIMON_EXPECT(CrIsBatchComplete(&rejected));
+  DDIMON_EXPECT(CrGetBatchStatus(&rejected) == kCtFailure);
+
+  DDIMON_EXPECT(CrDrain(&consumer->ring, CtHandle, consumer.get()) ==
+                kCrRingCapacity);
+  DDIMON_EXPECT(consumer->sum.load() == kCrRingCapacity);
+  for (auto i = 0ul; i < kCrRingCapacity; ++i) {
+    DDIMON_EXPECT(CrIsBatchComplete(&batches[i]));
+  }
+  DDIMON_EXPECT(CrIsRingEmpty(&consumer->ring));
+
+  // Slots are reused after draining
+  CrInitializeBatch(&rejected, 1);
+  DDIMON_EXPECT(CrPost(&consumer->ring, &rejected));
+  DDIMON_EXPECT(CrDrain(&consumer->ring, CtHandle, consumer.get()) == 1);
+}
+
+// Leaves a batch in a ring of a consumer that did not drain it, changes what
+// the producer stages, and posts the next batch. The abandoned batch completes
+// when the consumer drains the ring later, and applies what was staged when it
+// was posted since it owns a copy.
+static void CtTestAbandonedBatch() {
+  const auto consumers = std::make_unique<CtConsumer[]>(2);
+  for (auto i = 0ul; i < 2; ++i) {
+    CrInitializeRing(&consumers[i].ring);
+  }
+
+  ULONG staged_value = 1;
+  auto abandoned = std::make_unique<CtOwningBatch>();
+  CrInitializeBatch(&abandoned->batch, 2);
+  abandoned->value = staged_value;
+  CrAddOperation(&abandoned->batch, kCtOperationRecord,
+                 reinterpret_cast<ULONG_PTR>(&abandoned->value), 0);
+  for (auto i = 0ul; i < 2; ++i) {
+    DDIMON_EXPECT(CrPost(&consumers[i].ring, &abandoned->batch));
+  }
+  // The doorbell of the consumer 1 failed
+  CrDrain(&consumers[0].ring, CtHandle, &consumers[0]);
+  DDIMON_EXPECT(!CrIsBatchComplete(&abandoned->batch));
+
+  staged_value = 2;
+  auto next = std::make_unique<CtOwningBatch>();
+  CrInitializeBatch(&next->batch, 2);
+  next->value = staged_value;
+  CrAddOperation(&next->batch, kCtOperationRecord,
+                 reinterpret_cast<ULONG_PTR>(&next->value), 0);
+  for (auto i = 0ul; i < 2; ++i) {
+    DDIMON_EXPECT(CrPost(&consumers[i].ring, &next->batch));
+  }
+  for (auto i = 0ul; i < 2; ++i) {
+    CrDrain(&consumers[i].ring, CtHandle, &consumers[i]);
+  }
+
+  DDIMON_EXPECT(CrIsBatchComplete(&abandoned->batch));
+  DDIMON_EXPECT(CrIsBatchComplete(&next->batch));
+  const std::vector<ULONG> expected_values = {1, 2};
+  DDIMON_EXPECT(consumers[0].values == expected_values);
+  DDIMON_EXPECT(consumers[1].values == expected_values);
+}
+
+int main() {
+  CtTestProducers();
+  CtTestFullRing();
+  CtTestAbandonedBatch();
+  return DdimonTestResult();
+}
@@ -0,0 +1,226 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests event records as hook handlers write and trace readers decode them:
+/// each field type survives EsEvent::Marshal() and EsDecodeField(), strings
+/// and buffers are truncated to kEsMaxStringSize and kEsMaxBufferSize, a
+/// buffer too small for a record gives no record, and a record cut short or
+/// with a size beyond its end is not decoded past its end.
+
+#include <cstring>
+#include <vector>
+#include "event_schema.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// An event with each field type
+using EtAllEvent =
+    EsEvent<7, EsInteger, EsPointer, EsTag, EsString, EsBuffer>;
+
+using EtTagEvent = EsEvent<8, EsTag>;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const char* const kEtAllFieldNames[] = {
+    "integer", "pointer", "tag", "string", "buffer",
+};
+
+static const char* const kEtTagFieldNames[] = {"tag"};
+
+static const EsSchema kEtSchemas[] = {
+    EsMakeSchema<EtTagEvent>("Tag", kEtTagFieldNames),
+    EsMakeSchema<EtAllEvent>("All", kEtAllFieldNames),
+};
+
+static const ULONG kEtSchemaCount = sizeof(kEtSchemas) / sizeof(kEtSchemas[0]);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns bytes of a UTF-16LE string made of length / 2 characters
+static std::vector<UCHAR> EtMakeString(ULONG length) {
+  std::vector<UCHAR> string(length);
+  for (auto i = 0ul; i < length; ++i) {
+    string[i] = (i % 2) ? 0 : static_cast<UCHAR>('a' + (i / 2) % 26);
+  }
+  return string;
+}
+
+static std::vector<UCHAR> EtMakeBuffer(ULONG size) {
+  std::vector<UCHAR> buffer(size);
+  for (auto i = 0ul; i < size; ++i) {
+    buffer[i] = static_cast<UCHAR>(i * 7 + 1);
+  }
+  return buffer;
+}
+
+// Decodes a record of EtAllEvent, and checks each field against values
+static void EtCheckAllRecord(const UCHAR* record, ULONG record_size,
+                             ULONG64 integer, const void* pointer, ULONG tag,
+                             const std::vector<UCHAR>& string,
+                             const std::vector<UCHAR>& buffer) {
+  const auto schema = EsFindSchema(kEtSchemas, kEtSchemaCount,
+                                   EtAllEvent::kSchemaId);
+  DDIMON_EXPECT(schema == &kEtSchemas[1]);
+  DDIMON_EXPECT(schema->field_count == 5);
+
+  EsDecoder decoder = {};
+  EsInitializeDecoder(&decoder, schema, record, record_size);
+  EsValue value = {};
+  DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(value.type == kEsFieldInteger && value.integer == integer);
+  DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(value.type == kEsFieldPointer &&
+                value.integer == reinterpret_cast<ULONG_PTR>(pointer));
+  DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(value.type == kEsFieldTag && value.integer == tag);
+  DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(value.type == kEsFieldString);
+  DDIMON_EXPECT(value.size == string.size() &&
+                !std::memcmp(value.data, string.data(), string.size()));
+  DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(value.type == kEsFieldBuffer);
+  DDIMON_EXPECT(value.size == buffer.size() &&
+                !std::memcmp(value.data, buffer.data(), buffer.size()));
+
+  // Nothing follows the last field
+  DDIMON_EXPECT(!EsDecodeField(&decoder, &value));
+  DDIMON_EXPECT(decoder.offset == record_size);
+}
+
+// Each field type is decoded as marshaled, in little-endian without padding
+static void EtTestRoundTrip() {
+  const auto string = EtMakeString(22);
+  const auto buffer = EtMakeBuffer(9);
+  const auto pointer = reinterpret_cast<const void*>(0x12345678);
+  UCHAR record[512] = {};
+  const auto size = EtAllEvent::Marshal(
+      record, sizeof(record), 0x0123456789abcdefull, pointer, 0x6c6f6f50,
+      {string.data(), static_cast<USHORT>(string.size())},
+      {buffer.data(), static_cast<ULONG>(buffer.size())});
+  DDIMON_EXPECT(size == 8 + 8 + 4 + 2 + 22 + 2 + 9);
+  DDIMON_EXPECT(record[0] == 0xef && record[7] == 0x01);
+  DDIMON_EXPECT(!std::memcmp(&record[16], "Pool", 4));
+  DDIMON_EXPECT(record[20] == 22 && record[21] == 0);
+  EtCheckAllRecord(record, size, 0x0123456789abcdefull, pointer, 0x6c6f6f50,
+                   string, buffer);
+
+  // Empty and null strings and buffers have no bytes
+  const auto empty_size = EtAllEvent::Marshal(
+      record, sizeof(record), 0, nullptr, 0, {string.data(), 0},
+      {nullptr, 100});
+  DDIMON_EXPECT(empty_size == 8 + 8 + 4 + 2 + 2);
+  EtCheckAllRecord(record, empty_size, 0, nullptr, 0, {}, {});
+
+  // No schema has an unknown ID
+  DDIMON_EXPECT(!EsFindSchema(kEtSchemas, kEtSchemaCount, 9));
+}
+
+// Strings and buffers are truncated to their maximum sizes, and a string is
+// not truncated in the middle of a character
+static void EtTestTruncation() {
+  for (const auto length : {kEsMaxStringSize - 1, kEsMaxStringSize,
+                            kEsMaxStringSize + 1, kEsMaxStringSize * 3 + 1}) {
+    for (const auto size : {kEsMaxBufferSize - 1, kEsMaxBufferSize,
+                            kEsMaxBufferSize + 1, kEsMaxBufferSize * 5}) {
+      const auto string = EtMakeString(length);
+      const auto buffer = EtMakeBuffer(size);
+      UCHAR record[512] = {};
+      const auto record_size = EtAllEvent::Marshal(
+          record, sizeof(record), 1, nullptr, 2,
+          {string.data(), static_cast<USHORT>(string.size())},
+          {buffer.data(), static_cast<ULONG>(buffer.size())});
+
+      auto kept_length = (length < kEsMaxStringSize) ? length
+                                                     : kEsMaxStringSize;
+      kept_length &= ~1u;
+      const auto kept_size = (size < kEsMaxBufferSize) ? size
+                                                       : kEsMaxBufferSize;
+      DDIMON_EXPECT(record_size ==
+                    8 + 8 + 4 + 2 + kept_length + 2 + kept_size);
+      EtCheckAllRecord(
+          record, record_size, 1, nullptr, 2,
+          std::vector<UCHAR>(string.begin(), string.begin() + kept_length),
+          std::vector<UCHAR>(buffer.begin(), buffer.begin() + kept_size));
+    }
+  }
+}
+
+// A buffer too small for any field gives no record, and a record cut short
+// or with a size beyond its end is not decoded past its end
+static void EtTestUndersized() {
+  const auto string = EtMakeString(10);
+  const auto buffer = EtMakeBuffer(5);
+  const auto full_size = 8 + 8 + 4 + 2 + 10 + 2 + 5;
+  std::vector<UCHAR> record(full_size);
+  for (auto capacity = 0ul; capacity <= full_size; ++capacity) {
+    const auto size = EtAllEvent::Marshal(
+        record.data(), capacity, 1, nullptr, 2,
+        {string.data(), static_cast<USHORT>(string.size())},
+        {buffer.data(), static_cast<ULONG>(buffer.size())});
+    DDIMON_EXPECT(size == ((capacity == full_size) ? full_size : 0ul));
+  }
+  EtCheckAllRecord(record.data(), full_size, 1, nullptr, 2, string, buffer);
+
+  // Each field fails to decode when the record ends in it
+  const auto schema = &kEtSchemas[1];
+  const ULONG field_ends[] = {8, 16, 20, 32, full_size};
+  for (auto cut = 0ul; cut < full_size; ++cut) {
+    EsDecoder decoder = {};
+    EsInitializeDecoder(&decoder, schema, record.data(), cut);
+    EsValue value = {};
+    auto decoded_count = 0ul;
+    while (EsDecodeField(&decoder, &value)) {
+      decoded_count++;
+    }
+    auto expected_count = 0ul;
+    while (field_ends[expected_count] <= cut) {
+      expected_count++;
+    }
+    DDIMON_EXPECT(decoded_count == expected_count);
+    DDIMON_EXPECT(decoder.offset <= cut);
+  }
+
+  // A string size beyond the record is rejected
+  record[20] = 0xff;
+  EsDecoder decoder = {};
+  EsInitializeDecoder(&decoder, schema, record.data(), full_size);
+  EsValue value = {};
+  for (auto i = 0; i < 3; ++i) {
+    DDIMON_EXPECT(EsDecodeField(&decoder, &value));
+  }
+  DDIMON_EXPECT(!EsDecodeField(&decoder, &value));
+}
+
+int main() {
+  EtTestRoundTrip();
+  EtTestTruncation();
+  EtTestUndersized();
+  return DdimonTestResult();
+}
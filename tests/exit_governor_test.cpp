@@ -0,0 +1,196 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Drives the exit governor of a page with ShcGovernExit() and
+/// ShcGovernPromotion() as ShpGovernExit() and ShpPromotePages() do:
+/// demotions when a window exceeds the budget, demotions doubling while the
+/// page stays hot and clamped to the budget, halving for each quiet window,
+/// promotions exactly when demotions end, and disabled budgets.
+
+#include "shadow_hook_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG64 kEgWindowCycles = 1000;
+static const ULONG kEgMaxExits = 10;
+static const ULONG kEgMinDemotedWindows = 2;
+static const ULONG kEgMaxDemotedWindows = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static DdimonExitBudget EgMakeBudget() {
+  DdimonExitBudget budget = {};
+  budget.window_cycles = kEgWindowCycles;
+  budget.max_exits = kEgMaxExits;
+  budget.min_demoted_windows = kEgMinDemotedWindows;
+  budget.max_demoted_windows = kEgMaxDemotedWindows;
+  return budget;
+}
+
+// Counts exits at now until the page is demoted, and returns the number of
+// exits counted, or 0 when it was not demoted within limit exits
+static ULONG EgExitUntilDemoted(const DdimonExitBudget& budget,
+                                ShcGovernorState* state, ULONG64 now,
+                                ULONG limit) {
+  for (auto i = 1ul; i <= limit; ++i) {
+    if (ShcGovernExit(budget, state, now) == kShcGovernorDemote) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// Exits within the budget keep the page, and one more demotes it for the
+// minimum windows, until which it is not promoted
+static void EgTestDemotion() {
+  const auto budget = EgMakeBudget();
+  ShcGovernorState state = {};
+  for (auto i = 0ul; i < kEgMaxExits; ++i) {
+    DDIMON_EXPECT(ShcGovernExit(budget, &state, 100 + i) == kShcGovernorKeep);
+  }
+  DDIMON_EXPECT(ShcGovernPromotion(&state, 200) == kShcGovernorKeep);
+  DDIMON_EXPECT(ShcGovernExit(budget, &state, 200) == kShcGovernorDemote);
+  DDIMON_EXPECT(state.demoted_windows == kEgMinDemotedWindows);
+  DDIMON_EXPECT(state.demoted_until ==
+                200 + kEgWindowCycles * kEgMinDemotedWindows);
+
+  const auto until = state.demoted_until;
+  DDIMON_EXPECT(ShcGovernPromotion(&state, until - 1) == kShcGovernorKeep);
+  DDIMON_EXPECT(ShcGovernPromotion(&state, until) == kShcGovernorPromote);
+  DDIMON_EXPECT(!state.demoted_until);
+  DDIMON_EXPECT(state.window_start == until);
+  DDIMON_EXPECT(!state.exit_count);
+  // Promoted only once
+  DDIMON_EXPECT(ShcGovernPromotion(&state, until + 1) == kShcGovernorKeep);
+
+  // The window is counted from the promotion
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, until + 1, 100) ==
+                kEgMaxExits + 1);
+}
+
+// A page hot right after each promotion is demoted for twice as long each
+// time up to the maximum
+static void EgTestBackoff() {
+  const auto budget = EgMakeBudget();
+  ShcGovernorState state = {};
+  ULONG64 now = 0;
+  const ULONG kExpected[] = {2, 4, 8, 16, 16, 16};
+  for (const auto expected : kExpected) {
+    DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, now, 100) ==
+                  kEgMaxExits + 1);
+    DDIMON_EXPECT(state.demoted_windows == expected);
+    DDIMON_EXPECT(state.demoted_until == now + kEgWindowCycles * expected);
+    now = state.demoted_until;
+    DDIMON_EXPECT(ShcGovernPromotion(&state, now) == kShcGovernorPromote);
+  }
+}
+
+// Each window that ends within the budget halves the next demotion
+static void EgTestRecovery() {
+  const auto budget = EgMakeBudget();
+  ShcGovernorState state = {};
+  state.demoted_windows = kEgMaxDemotedWindows;
+
+  // One quiet window: 16 -> 8, then doubled to 16 on the next demotion
+  ULONG64 now = kEgWindowCycles;
+  DDIMON_EXPECT(ShcGovernExit(budget, &state, now) == kShcGovernorKeep);
+  DDIMON_EXPECT(state.demoted_windows == kEgMaxDemotedWindows / 2);
+  DDIMON_EXPECT(state.window_start == now);
+  DDIMON_EXPECT(state.exit_count == 1);
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, now, 100) == kEgMaxExits);
+  DDIMON_EXPECT(state.demoted_windows == kEgMaxDemotedWindows);
+  now = state.demoted_until;
+  DDIMON_EXPECT(ShcGovernPromotion(&state, now) == kShcGovernorPromote);
+
+  // Three quiet windows: 16 -> 2, then doubled to 4
+  now += kEgWindowCycles * 3;
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, now, 100) ==
+                kEgMaxExits + 1);
+  DDIMON_EXPECT(state.demoted_windows == 4);
+  now = state.demoted_until;
+  DDIMON_EXPECT(ShcGovernPromotion(&state, now) == kShcGovernorPromote);
+
+  // A long quiet period resets it to the minimum without overflowing a shift
+  now += kEgWindowCycles * 1000;
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, now, 100) ==
+                kEgMaxExits + 1);
+  DDIMON_EXPECT(state.demoted_windows == kEgMinDemotedWindows);
+}
+
+// Exits spread over windows within the budget are never demoted
+static void EgTestSteadyLoad() {
+  const auto budget = EgMakeBudget();
+  ShcGovernorState state = {};
+  const auto interval = kEgWindowCycles / kEgMaxExits + 1;
+  for (ULONG64 now = 0; now < kEgWindowCycles * 100; now += interval) {
+    DDIMON_EXPECT(ShcGovernExit(budget, &state, now) == kShcGovernorKeep);
+  }
+  DDIMON_EXPECT(!state.demoted_until);
+}
+
+// A budget without max_exits or window_cycles disables the governor, and
+// zero or inverted demotion lengths still demote for at least a window
+static void EgTestBudgetLimits() {
+  auto budget = EgMakeBudget();
+  budget.max_exits = 0;
+  ShcGovernorState state = {};
+  DDIMON_EXPECT(!EgExitUntilDemoted(budget, &state, 0, 1000));
+  budget = EgMakeBudget();
+  budget.window_cycles = 0;
+  DDIMON_EXPECT(!EgExitUntilDemoted(budget, &state, 0, 1000));
+
+  budget = EgMakeBudget();
+  budget.min_demoted_windows = 0;
+  budget.max_demoted_windows = 0;
+  state = {};
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, 0, 100) ==
+                kEgMaxExits + 1);
+  DDIMON_EXPECT(state.demoted_windows == 1);
+  DDIMON_EXPECT(state.demoted_until == kEgWindowCycles);
+
+  budget = EgMakeBudget();
+  budget.min_demoted_windows = 8;
+  budget.max_demoted_windows = 4;
+  state = {};
+  DDIMON_EXPECT(EgExitUntilDemoted(budget, &state, 0, 100) ==
+                kEgMaxExits + 1);
+  DDIMON_EXPECT(state.demoted_windows == 4);
+}
+
+int main() {
+  EgTestDemotion();
+  EgTestBackoff();
+  EgTestRecovery();
+  EgTestSteadyLoad();
+  EgTestBudgetLimits();
+  return DdimonTestResult();
+}
@@ -0,0 +1,298 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Replays exit traces with ShcReplayExitTrace(): view switches and
+/// invalidations under each view policy, traces of processors interleaved as
+/// IOCTL_DDIMON_READ_EXIT_TRACE returns them, records sharing a pending page
+/// as racing VM-exits do, traces read in chunks, and the exit governor. Both
+/// policies replay the same VM-exits and view switches, and differ only in
+/// invalidations, which are what dual EPT views save.
+
+#include <random>
+#include <vector>
+#include "shadow_hook_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kErProcessorCount = 4;
+static const ULONG kErAccessesPerProcessor = 1000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static DdimonExitTraceRecord ErMakeRecord(ULONG64 tsc, ULONG processor,
+                                          DdimonExitTraceKind kind,
+                                          ULONG64 page_number) {
+  DdimonExitTraceRecord record = {};
+  record.tsc = tsc;
+  record.processor = processor;
+  record.kind = kind;
+  record.page_number = page_number;
+  return record;
+}
+
+// Appends an access to a page: an EPT violation followed by MTF
+static void ErAddAccess(std::vector<DdimonExitTraceRecord>* records,
+                        ULONG64 tsc, ULONG processor, ULONG64 page_number) {
+  records->push_back(ErMakeRecord(tsc, processor,
+                                  kDdimonExitTraceEptViolation, page_number));
+  records->push_back(ErMakeRecord(tsc + 1, processor,
+                                  kDdimonExitTraceMonitorTrapFlag,
+                                  page_number));
+}
+
+static ShcReplayResult ErReplay(
+    const std::vector<DdimonExitTraceRecord>& records, ShcViewPolicy policy,
+    ShcReplayGovernor* governor) {
+  ULONG64 pending_pages[kErProcessorCount] = {};
+  ShcReplayResult result = {};
+  ShcReplayExitTrace(records.data(), static_cast<ULONG>(records.size()),
+                     policy, pending_pages, kErProcessorCount, governor,
+                     &result);
+  return result;
+}
+
+// Interleaves accesses of all processors at random while keeping the order
+// on each processor, as a merged trace of processors looks
+static std::vector<DdimonExitTraceRecord> ErMakeInterleavedTrace(
+    std::mt19937* random) {
+  std::vector<DdimonExitTraceRecord> records;
+  ULONG next_access[kErProcessorCount] = {};
+  auto remaining = kErProcessorCount * kErAccessesPerProcessor;
+  for (ULONG64 tsc = 0; remaining; tsc += 10) {
+    const auto processor = (*random)() % kErProcessorCount;
+    if (next_access[processor] == kErAccessesPerProcessor) {
+      continue;
+    }
+    next_access[processor]++;
+    remaining--;
+
+    // Every processor touches the same few pages, and calls hooks in between
+    ErAddAccess(&records, tsc, processor, 0x7ff00 + (*random)() % 3);
+    records.push_back(ErMakeRecord(tsc + 2, processor,
+                                   kDdimonExitTraceBreakpoint, 0x7ff10));
+  }
+  return records;
+}
+
+// Expects two results to have the same VM-exits, view switches and governor
+// decisions
+static void ErExpectSameExits(const ShcReplayResult& a,
+                              const ShcReplayResult& b) {
+  DDIMON_EXPECT(a.breakpoint_count == b.breakpoint_count);
+  DDIMON_EXPECT(a.out_of_scope_count == b.out_of_scope_count);
+  DDIMON_EXPECT(a.counted_count == b.counted_count);
+  DDIMON_EXPECT(a.ept_violation_count == b.ept_violation_count);
+  DDIMON_EXPECT(a.mtf_count == b.mtf_count);
+  DDIMON_EXPECT(a.view_switch_count == b.view_switch_count);
+  DDIMON_EXPECT(a.race_count == b.race_count);
+  DDIMON_EXPECT(a.invalid_count == b.invalid_count);
+  DDIMON_EXPECT(a.demotion_count == b.demotion_count);
+  DDIMON_EXPECT(a.promotion_count == b.promotion_count);
+  DDIMON_EXPECT(a.avoided_count == b.avoided_count);
+  DDIMON_EXPECT(a.ungoverned_count == b.ungoverned_count);
+}
+
+static void ErTestPolicies() {
+  std::vector<DdimonExitTraceRecord> records;
+  ErAddAccess(&records, 0, 0, 0x100);
+  records.push_back(ErMakeRecord(10, 0, kDdimonExitTraceBreakpoint, 0x200));
+  records.push_back(ErMakeRecord(11, 1, kDdimonExitTraceOutOfScope, 0x200));
+  records.push_back(ErMakeRecord(12, 2, kDdimonExitTraceCounted, 0x200));
+  ErAddAccess(&records, 20, 3, 0x100);
+
+  const auto edit = ErReplay(records, kShcViewPolicyEptEdit, nullptr);
+  DDIMON_EXPECT(edit.breakpoint_count == 1);
+  DDIMON_EXPECT(edit.out_of_scope_count == 1);
+  DDIMON_EXPECT(edit.counted_count == 1);
+  DDIMON_EXPECT(edit.ept_violation_count == 2);
+  DDIMON_EXPECT(edit.mtf_count == 2);
+  DDIMON_EXPECT(edit.view_switch_count == 4);
+  DDIMON_EXPECT(edit.invalidation_count == 4);
+  DDIMON_EXPECT(edit.race_count == 0);
+  DDIMON_EXPECT(edit.invalid_count == 0);
+
+  // Dual EPT views switch as often but never invalidate
+  const auto dual = ErReplay(records, kShcViewPolicyDualEptViews, nullptr);
+  DDIMON_EXPECT(dual.view_switch_count == edit.view_switch_count);
+  DDIMON_EXPECT(dual.invalidation_count == 0);
+  DDIMON_EXPECT(dual.race_count == 0);
+}
+
+static void ErTestProcessors() {
+  std::mt19937 random(38);
+  const auto records = ErMakeInterleavedTrace(&random);
+  const auto result = ErReplay(records, kShcViewPolicyEptEdit, nullptr);
+  const auto access_count = kErProcessorCount * kErAccessesPerProcessor;
+  DDIMON_EXPECT(result.ept_violation_count == access_count);
+  DDIMON_EXPECT(result.mtf_count == access_count);
+  DDIMON_EXPECT(result.breakpoint_count == access_count);
+  DDIMON_EXPECT(result.view_switch_count == access_count * 2);
+  DDIMON_EXPECT(result.race_count == 0);
+
+  // Replaying in chunks carries pending pages over, even when a chunk ends
+  // between an EPT violation and its MTF
+  ULONG64 pending_pages[kErProcessorCount] = {};
+  ShcReplayResult chunked = {};
+  for (size_t offset = 0; offset < records.size(); offset += 7) {
+    const auto count = (records.size() - offset < 7) ? records.size() - offset
+                                                     : 7;
+    ShcReplayExitTrace(&records[offset], static_cast<ULONG>(count),
+                       kShcViewPolicyEptEdit, pending_pages,
+                       kErProcessorCount, nullptr, &chunked);
+  }
+  DDIMON_EXPECT(chunked.view_switch_count == result.view_switch_count);
+  DDIMON_EXPECT(chunked.invalidation_count == result.invalidation_count);
+  DDIMON_EXPECT(chunked.race_count == 0);
+  for (const auto pending_page : pending_pages) {
+    DDIMON_EXPECT(pending_page == 0);
+  }
+}
+
+// Two VM-exits sharing last_page_hook_info of a processor leave records
+// inconsistent with its pending page
+static void ErTestRaces() {
+  std::vector<DdimonExitTraceRecord> records;
+
+  // An EPT violation while another page is pending on the processor
+  records.push_back(ErMakeRecord(0, 0, kDdimonExitTraceEptViolation, 0x100));
+  records.push_back(ErMakeRecord(1, 0, kDdimonExitTraceEptViolation, 0x101));
+  records.push_back(ErMakeRecord(2, 0, kDdimonExitTraceMonitorTrapFlag, 0x101));
+
+  // MTF hiding a page other than the pending one, and MTF with none pending
+  records.push_back(ErMakeRecord(3, 1, kDdimonExitTraceEptViolation, 0x100));
+  records.push_back(ErMakeRecord(4, 1, kDdimonExitTraceMonitorTrapFlag, 0x102));
+  records.push_back(ErMakeRecord(5, 2, kDdimonExitTraceMonitorTrapFlag, 0x100));
+
+  // The same page pending on two processors at once is not a race
+  records.push_back(ErMakeRecord(6, 3, kDdimonExitTraceEptViolation, 0x100));
+  records.push_back(ErMakeRecord(6, 2, kDdimonExitTraceEptViolation, 0x100));
+  records.push_back(ErMakeRecord(7, 3, kDdimonExitTraceMonitorTrapFlag, 0x100));
+  records.push_back(ErMakeRecord(7, 2, kDdimonExitTraceMonitorTrapFlag, 0x100));
+
+  // Records of unknown processors and kinds are only counted as invalid
+  records.push_back(ErMakeRecord(8, kErProcessorCount,
+                                 kDdimonExitTraceEptViolation, 0x100));
+  auto unknown = ErMakeRecord(9, 0, kDdimonExitTraceBreakpoint, 0x100);
+  unknown.kind = 0;
+  records.push_back(unknown);
+
+  const auto result = ErReplay(records, kShcViewPolicyDualEptViews, nullptr);
+  DDIMON_EXPECT(result.race_count == 3);
+  DDIMON_EXPECT(result.invalid_count == 2);
+  DDIMON_EXPECT(result.ept_violation_count == 5);
+  DDIMON_EXPECT(result.mtf_count == 5);
+}
+
+// Accesses of a page beyond the budget are avoided while it is demoted on
+// the processor, and counted again after it is promoted
+static void ErTestGovernor() {
+  ShcReplayGovernor governor = {};
+  governor.budget.window_cycles = 1000;
+  governor.budget.max_exits = 3;
+  governor.budget.min_demoted_windows = 2;
+  governor.budget.max_demoted_windows = 8;
+
+  std::vector<DdimonExitTraceRecord> records;
+  for (ULONG64 tsc = 0; tsc < 4000; tsc += 100) {
+    ErAddAccess(&records, tsc, 0, 0x100);
+  }
+  // The same page on another processor is governed separately
+  ErAddAccess(&records, 4000, 1, 0x100);
+
+  const auto result = ErReplay(records, kShcViewPolicyEptEdit, &governor);
+  // Exits at 0-300 demote the page until 2300 and ones at 2300-2600 until
+  // 6600 as the demotion doubles, leaving 8 accesses and one of CPU 1
+  DDIMON_EXPECT(result.demotion_count == 2);
+  DDIMON_EXPECT(result.promotion_count == 1);
+  DDIMON_EXPECT(result.ept_violation_count == 9);
+  DDIMON_EXPECT(result.mtf_count == 9);
+  DDIMON_EXPECT(result.avoided_count == (40 - 8) * 2);
+  DDIMON_EXPECT(result.view_switch_count == 18);
+  DDIMON_EXPECT(result.race_count == 0);
+  DDIMON_EXPECT(result.ungoverned_count == 0);
+
+  // A budget of 0 exits governs nothing
+  ShcReplayGovernor unlimited = {};
+  const auto ungoverned = ErReplay(records, kShcViewPolicyEptEdit, &unlimited);
+  DDIMON_EXPECT(ungoverned.ept_violation_count == 41);
+  DDIMON_EXPECT(ungoverned.avoided_count == 0);
+  DDIMON_EXPECT(ungoverned.demotion_count == 0);
+
+  // Pages that do not fit in the governor are counted as exits
+  std::vector<DdimonExitTraceRecord> many_pages;
+  for (ULONG64 page = 0; page < kShcReplayGovernorSize + 10; ++page) {
+    ErAddAccess(&many_pages, page * 10, 0, page);
+  }
+  ShcReplayGovernor full = {};
+  full.budget = governor.budget;
+  const auto overflowed = ErReplay(many_pages, kShcViewPolicyEptEdit, &full);
+  DDIMON_EXPECT(overflowed.ungoverned_count == 10);
+  DDIMON_EXPECT(overflowed.ept_violation_count == kShcReplayGovernorSize + 10);
+}
+
+// On traces of many processors, with and without the governor, the EPT edit
+// policy invalidates on every view switch and dual EPT views never do, while
+// VM-exits and switches are the same
+static void ErTestPolicyCosts() {
+  std::mt19937 random(52);
+  const auto records = ErMakeInterleavedTrace(&random);
+  for (const auto governed : {false, true}) {
+    ShcReplayGovernor edit_governor = {};
+    ShcReplayGovernor dual_governor = {};
+    if (governed) {
+      edit_governor.budget.window_cycles = 200;
+      edit_governor.budget.max_exits = 2;
+      edit_governor.budget.min_demoted_windows = 1;
+      edit_governor.budget.max_demoted_windows = 4;
+      dual_governor.budget = edit_governor.budget;
+    }
+    const auto edit =
+        ErReplay(records, kShcViewPolicyEptEdit, &edit_governor);
+    const auto dual =
+        ErReplay(records, kShcViewPolicyDualEptViews, &dual_governor);
+    ErExpectSameExits(edit, dual);
+    DDIMON_EXPECT(edit.view_switch_count ==
+                  (edit.ept_violation_count + edit.mtf_count));
+    DDIMON_EXPECT(edit.invalidation_count == edit.view_switch_count);
+    DDIMON_EXPECT(dual.invalidation_count == 0);
+    DDIMON_EXPECT(governed == (edit.demotion_count != 0));
+  }
+}
+
+int main() {
+  ErTestPolicies();
+  ErTestPolicyCosts();
+  ErTestProcessors();
+  ErTestRaces();
+  ErTestGovernor();
+  return DdimonTestResult();
+}
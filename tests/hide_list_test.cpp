@@ -0,0 +1,284 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests hide lists as HlFilterProcessInformation() uses them: processes are
+/// hidden by image names regardless of case and by process IDs, all others
+/// are kept in order, and lists with offsets or image names outside of the
+/// buffer are never read beyond it and keep no hidden process.
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "hide_list_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kHfProcessCount = 10000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+struct HfProcess {
+  std::u16string name;
+  ULONG_PTR process_id;
+};
+
+// A hide list table and entries linked into it
+struct HfHideList {
+  std::unique_ptr<HlcTable> table;
+  std::vector<std::unique_ptr<HlcEntry>> entries;
+  std::vector<std::u16string> names;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+static HlcName HfMakeName(const std::u16string& name) {
+  return {static_cast<USHORT>(name.size() * sizeof(USHORT)),
+          static_cast<USHORT>(name.size() * sizeof(USHORT)),
+          reinterpret_cast<const USHORT*>(name.data())};
+}
+
+// Builds a table as HlpInsertName() and HlpInsertProcessId() do
+static HfHideList HfMakeHideList(const std::vector<std::u16string>& names,
+                                 const std::vector<ULONG_PTR>& process_ids) {
+  HfHideList list = {std::make_unique<HlcTable>(), {}, names};
+  for (const auto& name : list.names) {
+    const auto hlc_name = HfMakeName(name);
+    const auto hash = HlcHashName(hlc_name);
+    if (HlcContainsName(*list.table, hlc_name, hash)) {
+      continue;
+    }
+    list.entries.push_back(std::make_unique<HlcEntry>());
+    list.entries.back()->hash = hash;
+    list.entries.back()->name = hlc_name;
+    HlcInsertEntry(list.table.get(), list.entries.back().get());
+  }
+  for (const auto process_id : process_ids) {
+    if (HlcContainsProcessId(*list.table, process_id)) {
+      continue;
+    }
+    list.entries.push_back(std::make_unique<HlcEntry>());
+    list.entries.back()->hash = HlcHashProcessId(process_id);
+    list.entries.back()->process_id = process_id;
+    HlcInsertEntry(list.table.get(), list.entries.back().get());
+  }
+  return list;
+}
+
+// Lays out processes as NtQuerySystemInformation() does, with an image name
+// following each entry
+static std::vector<ULONG64> HfMakeList(
+    const std::vector<HfProcess>& processes) {
+  std::vector<ULONG> offsets;
+  auto size = 0ul;
+  for (const auto& process : processes) {
+    offsets.push_back(size);
+    const auto name_size =
+        static_cast<ULONG>(process.name.size() * sizeof(USHORT));
+    size += sizeof(HlcProcessInformation) + (name_size + 7) / 8 * 8;
+  }
+  std::vector<ULONG64> list(size / sizeof(ULONG64));
+  const auto base = reinterpret_cast<UCHAR*>(list.data());
+  for (auto i = 0u; i < processes.size(); ++i) {
+    const auto entry =
+        reinterpret_cast<HlcProcessInformation*>(base + offsets[i]);
+    const auto name = reinterpret_cast<USHORT*>(entry + 1);
+    std::copy(processes[i].name.begin(), processes[i].name.end(), name);
+    entry->next_entry_offset =
+        (i + 1 < processes.size()) ? offsets[i + 1] - offsets[i] : 0;
+    entry->image_name.length =
+        static_cast<USHORT>(processes[i].name.size() * sizeof(USHORT));
+    entry->image_name.maximum_length = entry->image_name.length;
+    entry->image_name.buffer = processes[i].name.empty() ? nullptr : name;
+    entry->unique_process_id = processes[i].process_id;
+  }
+  return list;
+}
+
+// Returns process IDs in a list in order
+static std::vector<ULONG_PTR> HfReadList(const std::vector<ULONG64>& list) {
+  std::vector<ULONG_PTR> process_ids;
+  auto entry = reinterpret_cast<const HlcProcessInformation*>(list.data());
+  for (;;) {
+    process_ids.push_back(entry->unique_process_id);
+    if (!entry->next_entry_offset) {
+      break;
+    }
+    entry = reinterpret_cast<const HlcProcessInformation*>(
+        reinterpret_cast<const UCHAR*>(entry) + entry->next_entry_offset);
+  }
+  return process_ids;
+}
+
+static HlcProcessInformation* HfGetEntry(std::vector<ULONG64>* list,
+                                         ULONG index) {
+  auto entry = reinterpret_cast<HlcProcessInformation*>(list->data());
+  for (auto i = 0ul; i < index; ++i) {
+    entry = reinterpret_cast<HlcProcessInformation*>(
+        reinterpret_cast<UCHAR*>(entry) + entry->next_entry_offset);
+  }
+  return entry;
+}
+
+static ULONG HfSizeOf(const std::vector<ULONG64>& list) {
+  return static_cast<ULONG>(list.size() * sizeof(ULONG64));
+}
+
+// Names match regardless of case, and IDs and names never match each other
+static void HfTestMatch() {
+  const auto list = HfMakeHideList({u"cmd.exe", u"CMD.EXE", u"notepad.exe"},
+                                   {1234, 1234, 8});
+  DDIMON_EXPECT(list.table->entry_count == 4);
+
+  std::u16string name = u"Cmd.Exe";
+  HlcProcessInformation process = {};
+  process.image_name = HfMakeName(name);
+  process.unique_process_id = 4;
+  DDIMON_EXPECT(HlcIsHidden(*list.table, process));
+  name = u"cmd.ex";
+  process.image_name = HfMakeName(name);
+  DDIMON_EXPECT(!HlcIsHidden(*list.table, process));
+  process.unique_process_id = 1234;
+  DDIMON_EXPECT(HlcIsHidden(*list.table, process));
+
+  // An empty name does not match a process ID entry
+  process.image_name = {};
+  process.unique_process_id = 12;
+  DDIMON_EXPECT(!HlcIsHidden(*list.table, process));
+  process.unique_process_id = 8;
+  DDIMON_EXPECT(HlcIsHidden(*list.table, process));
+}
+
+// Hidden processes are unlinked and others are kept in order. The first
+// entry is kept even when it is hidden.
+static void HfTestFilter() {
+  std::mt19937_64 random(11);
+  std::vector<HfProcess> processes = {{u"", 0}};
+  std::vector<ULONG_PTR> hidden_ids;
+  for (auto i = 1ul; i < kHfProcessCount; ++i) {
+    const auto process_id = static_cast<ULONG_PTR>(i * 4);
+    const auto kind = random() % 16;
+    if (kind == 0) {
+      processes.push_back({u"cmd.exe", process_id});
+    } else if (kind == 1) {
+      processes.push_back({u"svchost.exe", process_id});
+      hidden_ids.push_back(process_id);
+    } else {
+      const auto letter = static_cast<char16_t>(u'a' + kind);
+      processes.push_back({u"app" + std::u16string(1, letter) + u".exe",
+                           process_id});
+    }
+  }
+  const auto hide_list = HfMakeHideList({u"CMD.exe"}, hidden_ids);
+
+  std::vector<ULONG_PTR> expected;
+  for (auto i = 0u; i < processes.size(); ++i) {
+    if (!i || (processes[i].name != u"cmd.exe" &&
+               std::find(hidden_ids.begin(), hidden_ids.end(),
+                         processes[i].process_id) == hidden_ids.end())) {
+      expected.push_back(processes[i].process_id);
+    }
+  }
+
+  auto list = HfMakeList(processes);
+  ULONG hidden_count = 0;
+  DDIMON_EXPECT(HlcFilterProcessInformation(*hide_list.table, list.data(),
+                                            HfSizeOf(list), &hidden_count));
+  DDIMON_EXPECT(HfReadList(list) == expected);
+  DDIMON_EXPECT(hidden_count == processes.size() - expected.size());
+
+  // Filtering again finds nothing more
+  DDIMON_EXPECT(HlcFilterProcessInformation(*hide_list.table, list.data(),
+                                            HfSizeOf(list), &hidden_count));
+  DDIMON_EXPECT(HfReadList(list) == expected);
+  DDIMON_EXPECT(!hidden_count);
+
+  // The first entry is kept
+  auto first = HfMakeList({{u"cmd.exe", 0}, {u"cmd.exe", 4}, {u"a.exe", 8}});
+  DDIMON_EXPECT(HlcFilterProcessInformation(*hide_list.table, first.data(),
+                                            HfSizeOf(first), &hidden_count));
+  DDIMON_EXPECT(HfReadList(first) == std::vector<ULONG_PTR>({0, 8}));
+}
+
+// Offsets leaving the buffer stop filtering, and the list ends at the last
+// entry kept
+static void HfTestMalformed() {
+  const auto hide_list = HfMakeHideList({u"cmd.exe"}, {});
+  const std::vector<HfProcess> processes = {
+      {u"", 0}, {u"a.exe", 4}, {u"cmd.exe", 8}, {u"b.exe", 12}, {u"c.exe", 16}};
+  ULONG hidden_count = 0;
+
+  // The list is larger than the buffer given
+  auto list = HfMakeList(processes);
+  const auto truncated_size = static_cast<ULONG>(
+      reinterpret_cast<UCHAR*>(HfGetEntry(&list, 3)) -
+      reinterpret_cast<UCHAR*>(list.data()) + sizeof(HlcProcessInformation) -
+      1);
+  DDIMON_EXPECT(!HlcFilterProcessInformation(*hide_list.table, list.data(),
+                                             truncated_size, &hidden_count));
+  DDIMON_EXPECT(HfReadList(list) == std::vector<ULONG_PTR>({0, 4}));
+  DDIMON_EXPECT(hidden_count == 1);
+
+  // An offset is out of range, misaligned or too small
+  for (const auto offset : {0x7fffffffu, 0xfffffff8u, 0x5cu, 0x10u}) {
+    list = HfMakeList(processes);
+    HfGetEntry(&list, 3)->next_entry_offset = offset;
+    DDIMON_EXPECT(!HlcFilterProcessInformation(*hide_list.table, list.data(),
+                                               HfSizeOf(list), &hidden_count));
+    DDIMON_EXPECT(HfReadList(list) == std::vector<ULONG_PTR>({0, 4, 12}));
+  }
+
+  // A buffer smaller than an entry is left as it is
+  list = HfMakeList(processes);
+  DDIMON_EXPECT(!HlcFilterProcessInformation(
+      *hide_list.table, list.data(), sizeof(HlcProcessInformation) - 1,
+      &hidden_count));
+  DDIMON_EXPECT(HfReadList(list).size() == processes.size());
+
+  // An image name outside of the buffer is not read, and its process is
+  // kept unless its ID is hidden
+  const auto id_list = HfMakeHideList({u"cmd.exe"}, {16});
+  list = HfMakeList(processes);
+  const std::u16string outside = u"cmd.exe";
+  HfGetEntry(&list, 2)->image_name = HfMakeName(outside);
+  HfGetEntry(&list, 4)->image_name.buffer =
+      reinterpret_cast<const USHORT*>(0x10);
+  DDIMON_EXPECT(HlcFilterProcessInformation(*id_list.table, list.data(),
+                                            HfSizeOf(list), &hidden_count));
+  DDIMON_EXPECT(HfReadList(list) == std::vector<ULONG_PTR>({0, 4, 8, 12}));
+}
+
+int main() {
+  HfTestMatch();
+  HfTestFilter();
+  HfTestMalformed();
+  return DdimonTestResult();
+}
@@ -0,0 +1,280 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Runs thunks built by HccBuildThunk() on an x64 host, calling them as the
+/// hooked function is called with the x64 calling convention of Windows, and
+/// checks that the arguments and the return address reach callbacks, that only
+/// argument_count arguments are passed to the original function, that
+/// callbacks run in priority order, and that the result returns to the caller
+/// through the leave function.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "hook_chain_core.h"
+#include "test_util.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define DDIMON_HOOK_CHAIN_TEST_SUPPORTED 1
+#endif
+
+#if defined(DDIMON_HOOK_CHAIN_TEST_SUPPORTED)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// The calling convention of thunks and functions they call
+#define DDIMON_MS_ABI __attribute__((ms_abi))
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Arguments each call passes, distinct from each other and from zero
+static const ULONG64 kHkArguments[kHcMaxArguments] = {
+    0x1111, 0x2222, 0x3333, 0x4444, 0x5555, 0x6666, 0x7777, 0x8888,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A hooked function as its callers see it, and as the chain calls it
+using HkFunction = ULONG64(DDIMON_MS_ABI*)(ULONG64, ULONG64, ULONG64,
+                                           ULONG64, ULONG64, ULONG64,
+                                           ULONG64, ULONG64);
+
+// Stands for HcChain
+struct HkChain {
+  HcCallback callbacks[kHcMaxCallbacks];
+  ULONG callback_count;
+  ULONG argument_count;
+  HkFunction original;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Arguments the original function received, and the number of calls to it
+static ULONG64 g_hk_original_arguments[kHcMaxArguments];
+static ULONG g_hk_original_calls;
+
+// Contexts of callbacks in the order they were called. Pre-call callbacks
+// add their contexts and post-call callbacks add negated ones.
+static std::vector<long> g_hk_events;
+
+// A context as the first pre-call callback and the last post-call callback
+// saw it
+static HcCallContext g_hk_pre_context;
+static HcCallContext g_hk_post_context;
+
+// A return address the leave function returns to
+static void* g_hk_leave_return_address;
+static ULONG g_hk_leave_count;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns executable and writable memory of a page
+static UCHAR* HkAllocatePage() {
+  const auto page = mmap(nullptr, getpagesize(),
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (page == MAP_FAILED) ? nullptr : static_cast<UCHAR*>(page);
+}
+
+static ULONG64 DDIMON_MS_ABI HkOriginal(ULONG64 a1, ULONG64 a2, ULONG64 a3,
+                                        ULONG64 a4, ULONG64 a5, ULONG64 a6,
+                                        ULONG64 a7, ULONG64 a8) {
+  const ULONG64 arguments[] = {a1, a2, a3, a4, a5, a6, a7, a8};
+  std::memcpy(g_hk_original_arguments, arguments, sizeof(arguments));
+  g_hk_original_calls++;
+  return a1 * 2 + a8;
+}
+
+// Does what HcpDispatch() does but measuring latencies
+static ULONG64 DDIMON_MS_ABI HkDispatch(const HkChain* chain,
+                                        HcCallContext* call_context) {
+  HccCallPreCallbacks(chain->callbacks, chain->callback_count,
+                      chain->argument_count, call_context);
+  if (!call_context->skip_original) {
+    const auto args = call_context->arguments;
+    call_context->return_value = chain->original(
+        args[0], args[1], args[2], args[3], args[4], args[5], args[6],
+        args[7]);
+  }
+  HccCallPostCallbacks(chain->callbacks, chain->callback_count,
+                       call_context);
+  return call_context->return_value;
+}
+
+// Does what HcpLeave() does. Not inlined so that it sees the return address
+// the thunk left on the stack.
+__attribute__((noinline)) static ULONG64 DDIMON_MS_ABI
+HkLeave(ULONG64 return_value) {
+  g_hk_leave_return_address = __builtin_return_address(0);
+  g_hk_leave_count++;
+  return return_value;
+}
+
+static void HkPreCall(HcCallContext* call_context, void* context) {
+  if (g_hk_events.empty()) {
+    g_hk_pre_context = *call_context;
+  }
+  g_hk_events.push_back(reinterpret_cast<long>(context));
+}
+
+static void HkPostCall(HcCallContext* call_context, void* context) {
+  g_hk_post_context = *call_context;
+  g_hk_events.push_back(-reinterpret_cast<long>(context));
+}
+
+// Makes the original function return a value of its own, without calling it
+static void HkSkipOriginal(HcCallContext* call_context, void* context) {
+  HkPreCall(call_context, context);
+  call_context->skip_original = true;
+  call_context->return_value = 0xdead;
+}
+
+// Builds a thunk of a chain into a page
+static HkFunction HkBuildThunk(UCHAR* page, const HkChain* chain) {
+  HccThunkCode code = {};
+  HccBuildThunk(&code, chain, reinterpret_cast<void*>(HkDispatch),
+                reinterpret_cast<void*>(HkLeave));
+  std::memcpy(page, &code, sizeof(code));
+  __builtin___clear_cache(reinterpret_cast<char*>(page),
+                          reinterpret_cast<char*>(page + sizeof(code)));
+  return reinterpret_cast<HkFunction>(page);
+}
+
+static HkChain HkMakeChain(const std::vector<HcCallback>& callbacks,
+                           ULONG argument_count) {
+  HkChain chain = {};
+  for (const auto& callback : callbacks) {
+    HccInsertCallback(chain.callbacks, &chain.callback_count, callback);
+  }
+  chain.argument_count = argument_count;
+  chain.original = HkOriginal;
+  return chain;
+}
+
+// Calls a thunk as a caller of the hooked function does
+static ULONG64 HkCall(HkFunction thunk) {
+  g_hk_events.clear();
+  g_hk_original_calls = 0;
+  g_hk_leave_count = 0;
+  std::memset(g_hk_original_arguments, 0xcc, sizeof(g_hk_original_arguments));
+  return thunk(kHkArguments[0], kHkArguments[1], kHkArguments[2],
+               kHkArguments[3], kHkArguments[4], kHkArguments[5],
+               kHkArguments[6], kHkArguments[7]);
+}
+
+// Register and stack arguments are saved, those beyond the argument count
+// are zero for callbacks and the original function, and the result and the
+// return address reach callbacks and the caller
+static void HkTestArguments(UCHAR* page) {
+  for (const ULONG argument_count : {0u, 4u, 6u, kHcMaxArguments}) {
+    const auto chain = HkMakeChain(
+        {{0, HkPreCall, HkPostCall, reinterpret_cast<void*>(1)}},
+        argument_count);
+    const auto thunk = HkBuildThunk(page, &chain);
+    const auto result = HkCall(thunk);
+
+    ULONG64 expected[kHcMaxArguments] = {};
+    std::memcpy(expected, kHkArguments, argument_count * sizeof(ULONG64));
+    DDIMON_EXPECT(!std::memcmp(g_hk_pre_context.arguments, expected,
+                               sizeof(expected)));
+    DDIMON_EXPECT(!std::memcmp(g_hk_original_arguments, expected,
+                               sizeof(expected)));
+    DDIMON_EXPECT(g_hk_original_calls == 1);
+    DDIMON_EXPECT(!g_hk_pre_context.return_value);
+    DDIMON_EXPECT(!g_hk_pre_context.skip_original);
+
+    const auto expected_result = expected[0] * 2 + expected[7];
+    DDIMON_EXPECT(result == expected_result);
+    DDIMON_EXPECT(g_hk_post_context.return_value == expected_result);
+
+    // The return address is where the thunk returns through the leave
+    // function, that is, right after the call in HkCall()
+    DDIMON_EXPECT(g_hk_leave_count == 1);
+    DDIMON_EXPECT(g_hk_pre_context.return_address);
+    DDIMON_EXPECT(g_hk_pre_context.return_address ==
+                  g_hk_leave_return_address);
+    DDIMON_EXPECT(g_hk_post_context.return_address ==
+                  g_hk_leave_return_address);
+  }
+}
+
+// Pre-call callbacks run in priority order, keeping given order for ties,
+// and post-call callbacks run in reverse order
+static void HkTestOrder(UCHAR* page) {
+  const auto chain = HkMakeChain(
+      {
+          {2, HkPreCall, HkPostCall, reinterpret_cast<void*>(1)},
+          {0, HkPreCall, HkPostCall, reinterpret_cast<void*>(2)},
+          {1, HkPreCall, nullptr, reinterpret_cast<void*>(3)},
+          {0, nullptr, HkPostCall, reinterpret_cast<void*>(4)},
+          {1, HkPreCall, HkPostCall, reinterpret_cast<void*>(5)},
+      },
+      kHcMaxArguments);
+  const auto thunk = HkBuildThunk(page, &chain);
+  HkCall(thunk);
+  DDIMON_EXPECT(g_hk_events == std::vector<long>({2, 3, 5, 1, -1, -5, -4, -2}));
+  DDIMON_EXPECT(g_hk_original_calls == 1);
+}
+
+// A pre-call callback can return a value without calling the original
+// function, and later callbacks still run
+static void HkTestSkip(UCHAR* page) {
+  const auto chain = HkMakeChain(
+      {
+          {0, HkSkipOriginal, HkPostCall, reinterpret_cast<void*>(1)},
+          {1, HkPreCall, HkPostCall, reinterpret_cast<void*>(2)},
+      },
+      2);
+  const auto thunk = HkBuildThunk(page, &chain);
+  DDIMON_EXPECT(HkCall(thunk) == 0xdead);
+  DDIMON_EXPECT(!g_hk_original_calls);
+  DDIMON_EXPECT(g_hk_events == std::vector<long>({1, 2, -2, -1}));
+  DDIMON_EXPECT(g_hk_post_context.return_value == 0xdead);
+  DDIMON_EXPECT(g_hk_leave_count == 1);
+}
+
+int main() {
+  const auto page = HkAllocatePage();
+  if (!page) {
+    std::fprintf(stderr, "Executable memory is not available.\n");
+    return kDdimonTestSkipped;
+  }
+  HkTestArguments(page);
+  HkTestOrder(page);
+  HkTestSkip(page);
+  munmap(page, getpagesize());
+  return DdimonTestResult();
+}
+
+#else
+
+int main() {
+  std::fprintf(stderr, "Thunks run only on x64 Linux hosts.\n");
+  return kDdimonTestSkipped;
+}
+
+#endif
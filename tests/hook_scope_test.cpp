@@ -0,0 +1,229 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests scopes of hooks: CR3 values added by ShcAddToScope() as
+/// ShSetHookScope() does, lookups by ShcIsInScope() against a reference set
+/// until the table refuses values, removals of exited processes by
+/// ShcRemoveFromScope(), what ShcDispatchBreakpoint() does with
+/// and without a scope, and how ShcCountCaller() counts callers of counting
+/// hooks.
+
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+#include "shadow_hook_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kScLookupCount = 100000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a CR3 value with random PCID bits
+static ULONG64 ScMakeCr3(std::mt19937_64* random) {
+  return (((*random)() & 0xffffffffull) << PAGE_SHIFT) | ((*random)() & 0xfff);
+}
+
+static void ScTestNormalize() {
+  DDIMON_EXPECT(ShcNormalizeCr3(0x1234567018ull) == 0x1234567000ull);
+  DDIMON_EXPECT(ShcNormalizeCr3(0x8000000001ab2fffull) == 0x1ab2000ull);
+  DDIMON_EXPECT(ShcNormalizeCr3(0xfff) == 0);
+
+  // Neither 0 nor PCID bits alone are an address space
+  ShcHookScope scope = {};
+  DDIMON_EXPECT(!ShcAddToScope(&scope, 0));
+  DDIMON_EXPECT(!ShcAddToScope(&scope, 0x5));
+  for (const auto slot : scope.cr3s) {
+    DDIMON_EXPECT(slot == 0);
+  }
+}
+
+// Adds random CR3 values until the table refuses one, checking lookups of
+// added and other values against a reference set on the way
+static void ScTestLookups() {
+  std::mt19937_64 random(7);
+  ShcHookScope scope = {};
+  std::set<ULONG64> added;
+  auto refused_count = 0ul;
+  while (refused_count < 16 && added.size() < kShcScopeSize) {
+    const auto cr3 = ScMakeCr3(&random);
+    if (!ShcAddToScope(&scope, cr3)) {
+      refused_count++;
+      DDIMON_EXPECT(!ShcIsInScope(scope, cr3));
+      continue;
+    }
+    added.insert(ShcNormalizeCr3(cr3));
+
+    // A value is found with any PCID bits, and adding it again takes no slot
+    DDIMON_EXPECT(ShcIsInScope(scope, cr3 ^ 0xfff));
+    DDIMON_EXPECT(ShcAddToScope(&scope, cr3 | 0x3));
+  }
+  DDIMON_EXPECT(refused_count == 16);
+
+  auto used_slots = 0ul;
+  for (const auto slot : scope.cr3s) {
+    used_slots += (slot != 0);
+  }
+  DDIMON_EXPECT(used_slots == added.size());
+  for (const auto cr3 : added) {
+    DDIMON_EXPECT(ShcIsInScope(scope, cr3));
+  }
+  for (auto i = 0ul; i < kScLookupCount; ++i) {
+    const auto cr3 = ScMakeCr3(&random);
+    DDIMON_EXPECT(ShcIsInScope(scope, cr3) ==
+                  (added.count(ShcNormalizeCr3(cr3)) != 0));
+  }
+}
+
+// Fills a scope, removes values in random order as their processes exit, and
+// checks lookups of the remaining and removed values after each removal
+static void ScTestRemove() {
+  std::mt19937_64 random(11);
+  ShcHookScope scope = {};
+  std::vector<ULONG64> added;
+  while (added.size() < kShcScopeSize * 3 / 4) {
+    const auto cr3 = ScMakeCr3(&random);
+    if (!ShcIsInScope(scope, cr3) && ShcAddToScope(&scope, cr3)) {
+      added.push_back(ShcNormalizeCr3(cr3));
+    }
+  }
+  std::shuffle(added.begin(), added.end(), random);
+
+  std::set<ULONG64> remaining(added.begin(), added.end());
+  for (const auto cr3 : added) {
+    DDIMON_EXPECT(ShcRemoveFromScope(&scope, cr3 | 0x7));
+    remaining.erase(cr3);
+    DDIMON_EXPECT(!ShcIsInScope(scope, cr3));
+    DDIMON_EXPECT(!ShcRemoveFromScope(&scope, cr3));
+    for (const auto other : remaining) {
+      DDIMON_EXPECT(ShcIsInScope(scope, other));
+    }
+  }
+  for (const auto slot : scope.cr3s) {
+    DDIMON_EXPECT(slot == 0);
+  }
+
+  // A scope emptied by exits keeps every process out of it
+  DDIMON_EXPECT(ShcDispatchBreakpoint(&scope, added.front(), true) ==
+                kShcBreakpointOutOfScope);
+  DDIMON_EXPECT(!ShcRemoveFromScope(&scope, 0));
+}
+
+static void ScTestDispatch() {
+  ShcHookScope scope = {};
+  DDIMON_EXPECT(ShcAddToScope(&scope, 0x1000));
+  DDIMON_EXPECT(ShcAddToScope(&scope, 0x7ffe5000));
+
+  // Without a scope, a hook applies to all address spaces
+  DDIMON_EXPECT(ShcDispatchBreakpoint(nullptr, 0x2000, true) ==
+                kShcBreakpointHandler);
+  DDIMON_EXPECT(ShcDispatchBreakpoint(nullptr, 0x2000, false) ==
+                kShcBreakpointCount);
+
+  DDIMON_EXPECT(ShcDispatchBreakpoint(&scope, 0x1001, true) ==
+                kShcBreakpointHandler);
+  DDIMON_EXPECT(ShcDispatchBreakpoint(&scope, 0x7ffe5000, false) ==
+                kShcBreakpointCount);
+  DDIMON_EXPECT(ShcDispatchBreakpoint(&scope, 0x2000, true) ==
+                kShcBreakpointOutOfScope);
+  DDIMON_EXPECT(ShcDispatchBreakpoint(&scope, 0x2000, false) ==
+                kShcBreakpointOutOfScope);
+}
+
+// Returns the slot where a return address is counted in an empty histogram,
+// which is where probing for it starts
+static ULONG ScFindCallerStart(ULONG64 return_address) {
+  ShcCallerHistogram histogram = {};
+  ShcCountCaller(&histogram, return_address);
+  for (auto i = 0ul; i < kShcCallerSlotCount; ++i) {
+    if (histogram.return_addresses[i] == return_address) {
+      return i;
+    }
+  }
+  return kShcCallerSlotCount;
+}
+
+static void ScTestCountCaller() {
+  // A return address claims a slot and is counted in it afterwards
+  ShcCallerHistogram histogram = {};
+  const auto return_address = 0xfffff80012345678ull;
+  const auto start = ScFindCallerStart(return_address);
+  DDIMON_EXPECT(start < kShcCallerSlotCount);
+  for (auto i = 0ul; i < 3; ++i) {
+    ShcCountCaller(&histogram, return_address);
+  }
+  DDIMON_EXPECT(histogram.return_addresses[start] == return_address);
+  DDIMON_EXPECT(histogram.counts[start] == 3);
+  DDIMON_EXPECT(!histogram.other_count);
+
+  // An unknown return address is counted in other_count and takes no slot
+  ShcCountCaller(&histogram, 0);
+  DDIMON_EXPECT(histogram.other_count == 1);
+  auto used_slots = 0ul;
+  for (const auto slot : histogram.return_addresses) {
+    used_slots += (slot != 0);
+  }
+  DDIMON_EXPECT(used_slots == 1);
+
+  // Return addresses starting at the same slot take the following ones, and
+  // the one beyond kShcCallerMaxProbes probes is counted in other_count
+  std::vector<ULONG64> colliding = {return_address};
+  for (auto candidate = return_address + 1;
+       colliding.size() <= kShcCallerMaxProbes; ++candidate) {
+    if (ScFindCallerStart(candidate) == start) {
+      colliding.push_back(candidate);
+    }
+  }
+  for (auto i = 1ul; i < colliding.size(); ++i) {
+    ShcCountCaller(&histogram, colliding[i]);
+  }
+  for (auto probe = 0ul; probe < kShcCallerMaxProbes; ++probe) {
+    const auto index = (start + probe) % kShcCallerSlotCount;
+    DDIMON_EXPECT(histogram.return_addresses[index] == colliding[probe]);
+  }
+  DDIMON_EXPECT(histogram.counts[start] == 3);
+  DDIMON_EXPECT(histogram.other_count == 2);
+
+  // The overflowing return address keeps going to other_count
+  ShcCountCaller(&histogram, colliding.back());
+  DDIMON_EXPECT(histogram.other_count == 3);
+}
+
+int main() {
+  ScTestNormalize();
+  ScTestLookups();
+  ScTestRemove();
+  ScTestDispatch();
+  ScTestCountCaller();
+  return DdimonTestResult();
+}
@@ -0,0 +1,353 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Simulates enabling and disabling hooks and pages one by one as
+/// ShSetHookStates() and ShSetPageState() do. EPT entries of simulated
+/// processors are updated only through batches posted to their command rings,
+/// and guest accesses to hooked code and pages are counted as VM-exits, so that
+/// the test can check which entries were touched and that disabled hooks cause
+/// no VM-exit.
+
+#include <memory>
+#include <vector>
+#include "command_ring.h"
+#include "shadow_hook_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kHsProcessorCount = 4;
+
+// Writes EPT entries. arguments[0] points to std::vector<HsEptEdit>.
+static const ULONG kHsCommandWriteEptEdits = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A function hook on a page
+struct HsHook {
+  ULONG page;
+  bool enabled;
+  bool breakpoint;  // 0xcc is written on the exec shadow page
+};
+
+// A page of function hooks or of a memory monitor
+struct HsPage {
+  bool func_page;
+  bool enabled;
+  bool monitor_read;
+  bool monitor_write;
+};
+
+struct HsEptEdit {
+  ULONG page;
+  ShcEptPermission permission;
+};
+
+// A batch owning its EPT modifications, as ShpBatch does
+struct HsBatch {
+  CrBatch batch;
+  std::vector<HsEptEdit> edits;
+};
+
+struct HsProcessor {
+  CrRing ring;
+  std::vector<ShcEptPermission> ept;  // Indexed by pages
+  ULONG64 exit_count;
+  ULONG64 written_edit_count;
+};
+
+struct HsSimulator {
+  bool hooks_active;
+  std::vector<HsHook> hooks;
+  std::vector<HsPage> pages;
+  std::unique_ptr<HsProcessor[]> processors;
+  ULONG64 batch_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Creates hooks 0 and 1 on the page 0, a hook 2 on the page 1, and a memory
+// monitor of writes on the page 2, none of them active yet
+static HsSimulator HsCreateSimulator() {
+  HsSimulator simulator = {};
+  simulator.hooks = {{0, true, true}, {0, true, true}, {1, true, true}};
+  simulator.pages = {{true, true, false, false},
+                     {true, true, false, false},
+                     {false, true, false, true}};
+  simulator.processors = std::make_unique<HsProcessor[]>(kHsProcessorCount);
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    auto& processor = simulator.processors[i];
+    CrInitializeRing(&processor.ring);
+    processor.ept.assign(simulator.pages.size(),
+                         ShcGetFuncPagePermission(false));
+  }
+  return simulator;
+}
+
+static bool HsIsPageActive(const HsSimulator& simulator, ULONG page) {
+  auto any_hook_enabled = false;
+  for (const auto& hook : simulator.hooks) {
+    any_hook_enabled |= (hook.page == page && hook.enabled);
+  }
+  const auto& info = simulator.pages[page];
+  return ShcIsPageActive(info.enabled, info.func_page, any_hook_enabled);
+}
+
+// Computes EPT entries of all pages, or of only the page when specified, as
+// ShpStageEptEdits() does
+static std::vector<HsEptEdit> HsStageEptEdits(const HsSimulator& simulator,
+                                              const ULONG* page) {
+  std::vector<HsEptEdit> edits;
+  for (ULONG i = 0; i < simulator.pages.size(); ++i) {
+    if (page && *page != i) {
+      continue;
+    }
+    const auto& info = simulator.pages[i];
+    const auto active = simulator.hooks_active && HsIsPageActive(simulator, i);
+    edits.push_back(
+        {i, (info.func_page) ? ShcGetFuncPagePermission(active)
+                             : ShcGetMemPagePermission(
+                                   active, info.monitor_read,
+                                   info.monitor_write)});
+  }
+  return edits;
+}
+
+static LONG HsHandleCommand(void* context, const CrOperation& operation) {
+  const auto processor = static_cast<HsProcessor*>(context);
+  if (operation.kind != kHsCommandWriteEptEdits) {
+    return -1;
+  }
+  const auto edits =
+      reinterpret_cast<const std::vector<HsEptEdit>*>(operation.arguments[0]);
+  for (const auto& edit : *edits) {
+    processor->ept[edit.page] = edit.permission;
+    processor->written_edit_count++;
+  }
+  return 0;
+}
+
+// Posts the edits to every processor and lets each drain its ring, as
+// ShpSubmitStagedEdits() does with a doorbell
+static void HsSubmitEptEdits(HsSimulator* simulator,
+                             std::vector<HsEptEdit> edits) {
+  if (edits.empty()) {
+    return;
+  }
+  HsBatch batch = {};
+  batch.edits = std::move(edits);
+  CrInitializeBatch(&batch.batch, kHsProcessorCount);
+  CrAddOperation(&batch.batch, kHsCommandWriteEptEdits,
+                 reinterpret_cast<ULONG_PTR>(&batch.edits), 0);
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    DDIMON_EXPECT(CrPost(&simulator->processors[i].ring, &batch.batch));
+  }
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    CrDrain(&simulator->processors[i].ring, HsHandleCommand,
+            &simulator->processors[i]);
+  }
+  DDIMON_EXPECT(CrIsBatchComplete(&batch.batch));
+  DDIMON_EXPECT(CrGetBatchStatus(&batch.batch) == 0);
+  simulator->batch_count++;
+}
+
+static void HsEnableHooks(HsSimulator* simulator) {
+  simulator->hooks_active = true;
+  HsSubmitEptEdits(simulator, HsStageEptEdits(*simulator, nullptr));
+}
+
+// Enables or disables the hooks as ShSetHookStates() does
+static void HsSetHookStates(HsSimulator* simulator,
+                            const std::vector<ULONG>& hooks, bool enable) {
+  ULONG changed_page = 0;
+  auto changed_page_count = 0ul;
+  for (const auto index : hooks) {
+    auto& hook = simulator->hooks[index];
+    if (hook.enabled == enable) {
+      continue;
+    }
+    const auto was_active = HsIsPageActive(*simulator, hook.page);
+    hook.enabled = enable;
+    hook.breakpoint = enable;
+    if (was_active != HsIsPageActive(*simulator, hook.page)) {
+      changed_page = hook.page;
+      changed_page_count++;
+    }
+  }
+  if (simulator->hooks_active && changed_page_count) {
+    HsSubmitEptEdits(simulator,
+                     HsStageEptEdits(*simulator, (changed_page_count == 1)
+                                                     ? &changed_page
+                                                     : nullptr));
+  }
+}
+
+// Enables or disables the page as ShSetPageState() does
+static void HsSetPageState(HsSimulator* simulator, ULONG page, bool enable) {
+  const auto was_active = HsIsPageActive(*simulator, page);
+  simulator->pages[page].enabled = enable;
+  if (simulator->hooks_active &&
+      was_active != HsIsPageActive(*simulator, page)) {
+    HsSubmitEptEdits(simulator, HsStageEptEdits(*simulator, &page));
+  }
+}
+
+// Runs guest code calling every hooked function and reading and writing every
+// page on every processor, and returns the number of VM-exits it caused. A
+// call causes #BP when the exec shadow page is mapped and has 0xcc, and an
+// access denied by EPT causes an EPT violation.
+static ULONG64 HsRunGuest(HsSimulator* simulator) {
+  ULONG64 exit_count = 0;
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    auto& processor = simulator->processors[i];
+    for (const auto& hook : simulator->hooks) {
+      if (processor.ept[hook.page].exec_view && hook.breakpoint) {
+        processor.exit_count++;
+        exit_count++;
+      }
+    }
+    for (const auto& permission : processor.ept) {
+      exit_count += !permission.read_access;
+      exit_count += !permission.write_access;
+    }
+  }
+  return exit_count;
+}
+
+// Returns EPT modifications written on each processor since the last call
+static ULONG64 HsTakeWrittenEdits(HsSimulator* simulator) {
+  const auto count = simulator->processors[0].written_edit_count;
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    DDIMON_EXPECT(simulator->processors[i].written_edit_count == count);
+    simulator->processors[i].written_edit_count = 0;
+  }
+  return count;
+}
+
+// Checks EPT entries of the page on every processor
+static bool HsIsShadowed(const HsSimulator& simulator, ULONG page) {
+  auto shadowed = 0ul;
+  for (auto i = 0ul; i < kHsProcessorCount; ++i) {
+    const auto& permission = simulator.processors[i].ept[page];
+    shadowed += (permission.exec_view || !permission.read_access ||
+                 !permission.write_access);
+  }
+  DDIMON_EXPECT(shadowed == 0 || shadowed == kHsProcessorCount);
+  return shadowed != 0;
+}
+
+static void HsTestPermissions() {
+  const auto active_func = ShcGetFuncPagePermission(true);
+  DDIMON_EXPECT(!active_func.read_access && !active_func.write_access &&
+                active_func.exec_view);
+  const auto inactive_func = ShcGetFuncPagePermission(false);
+  DDIMON_EXPECT(inactive_func.read_access && inactive_func.write_access &&
+                !inactive_func.exec_view);
+
+  const auto write_monitor = ShcGetMemPagePermission(true, false, true);
+  DDIMON_EXPECT(write_monitor.read_access && !write_monitor.write_access);
+  const auto read_monitor = ShcGetMemPagePermission(true, true, false);
+  DDIMON_EXPECT(!read_monitor.read_access && !read_monitor.write_access);
+  const auto inactive_mem = ShcGetMemPagePermission(false, true, true);
+  DDIMON_EXPECT(inactive_mem.read_access && inactive_mem.write_access);
+
+  DDIMON_EXPECT(ShcIsPageActive(true, true, true));
+  DDIMON_EXPECT(!ShcIsPageActive(true, true, false));
+  DDIMON_EXPECT(!ShcIsPageActive(false, true, true));
+  DDIMON_EXPECT(ShcIsPageActive(true, false, false));
+  DDIMON_EXPECT(!ShcIsPageActive(false, false, false));
+}
+
+static void HsTestStates() {
+  auto simulator = HsCreateSimulator();
+  DDIMON_EXPECT(HsRunGuest(&simulator) == 0);
+
+  // All hooks: 3 #BP and a write to the monitored page on each processor
+  HsEnableHooks(&simulator);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 3);
+  const auto all_exits = HsRunGuest(&simulator);
+  DDIMON_EXPECT(all_exits == kHsProcessorCount * (3 + 2 + 2 + 1));
+
+  // Disabling one of two hooks on a page keeps the page shadowed, so no EPT
+  // entry is touched and only #BP of the hook is gone
+  const auto batches = simulator.batch_count;
+  HsSetHookStates(&simulator, {0}, false);
+  DDIMON_EXPECT(simulator.batch_count == batches);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 0);
+  DDIMON_EXPECT(HsIsShadowed(simulator, 0));
+  DDIMON_EXPECT(HsRunGuest(&simulator) == all_exits - kHsProcessorCount);
+
+  // Disabling the other one unshadows only the page
+  HsSetHookStates(&simulator, {1}, false);
+  DDIMON_EXPECT(simulator.batch_count == batches + 1);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 1);
+  DDIMON_EXPECT(!HsIsShadowed(simulator, 0));
+  DDIMON_EXPECT(HsIsShadowed(simulator, 1));
+  DDIMON_EXPECT(HsRunGuest(&simulator) == kHsProcessorCount * (1 + 2 + 1));
+
+  // Disabling the page of the memory monitor leaves only the hook 2
+  HsSetPageState(&simulator, 2, false);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 1);
+  DDIMON_EXPECT(!HsIsShadowed(simulator, 2));
+  DDIMON_EXPECT(HsRunGuest(&simulator) == kHsProcessorCount * (1 + 2));
+
+  // Disabling a page already inactive changes nothing
+  HsSetPageState(&simulator, 0, false);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 0);
+
+  // Re-arming a hook on a disabled page writes 0xcc but costs no VM-exit
+  // until the page is enabled again
+  HsSetHookStates(&simulator, {0}, true);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 0);
+  DDIMON_EXPECT(HsRunGuest(&simulator) == kHsProcessorCount * (1 + 2));
+  HsSetPageState(&simulator, 0, true);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == 1);
+  DDIMON_EXPECT(HsRunGuest(&simulator) == kHsProcessorCount * (2 + 2 + 2));
+
+  // Disabling hooks of two pages at once stages all pages in a single batch
+  const auto batches_before_all = simulator.batch_count;
+  HsSetHookStates(&simulator, {0, 2}, false);
+  DDIMON_EXPECT(simulator.batch_count == batches_before_all + 1);
+  DDIMON_EXPECT(HsTakeWrittenEdits(&simulator) == simulator.pages.size());
+  DDIMON_EXPECT(HsRunGuest(&simulator) == 0);
+
+  // Changes while hooks are inactive only take effect when they are enabled
+  auto inactive = HsCreateSimulator();
+  HsSetHookStates(&inactive, {0, 1}, false);
+  DDIMON_EXPECT(inactive.batch_count == 0);
+  HsEnableHooks(&inactive);
+  DDIMON_EXPECT(!HsIsShadowed(inactive, 0));
+  DDIMON_EXPECT(HsRunGuest(&inactive) == kHsProcessorCount * (1 + 2 + 1));
+}
+
+int main() {
+  HsTestPermissions();
+  HsTestStates();
+  return DdimonTestResult();
+}
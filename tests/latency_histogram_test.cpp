@@ -0,0 +1,202 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests latency histograms against exact percentiles of the same values:
+/// values below kLhSubBucketCount are exact, larger ones are within
+/// 1 / (2 * kLhSubBucketCount) for uniform, long-tailed and bimodal
+/// distributions, values beyond the last bucket report the maximum, and
+/// histograms recorded on processors and merged with LhMerge() equal one
+/// histogram recording all values.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <vector>
+#include "latency_histogram.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kLtValueCount = 100000;
+static const ULONG kLtProcessorCount = 8;
+
+// Percentiles reported by IOCTL_DDIMON_QUERY_LATENCIES, and a few more
+static const ULONG kLtPermilles[] = {0, 1, 100, 500, 900, 990, 999, 1000};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a value that permille / 1000 of sorted values are at or below,
+// ranked as LhValueAtPermille() does
+static ULONG64 LtExactValueAtPermille(const std::vector<ULONG64>& sorted,
+                                      ULONG permille) {
+  auto rank = (sorted.size() * permille + 999) / 1000;
+  if (!rank) {
+    rank = 1;
+  }
+  return sorted[rank - 1];
+}
+
+// Records values and compares each percentile with the exact one
+static void LtCheckAccuracy(std::vector<ULONG64> values) {
+  const auto histogram = std::make_unique<LhHistogram>();
+  for (const auto value : values) {
+    LhRecord(histogram.get(), value);
+  }
+  std::sort(values.begin(), values.end());
+  DDIMON_EXPECT(histogram->count == values.size());
+  DDIMON_EXPECT(histogram->max_value == values.back());
+
+  const auto max_error = 1.0 / (2 * kLhSubBucketCount);
+  for (const auto permille : kLtPermilles) {
+    const auto exact = LtExactValueAtPermille(values, permille);
+    const auto reported = LhValueAtPermille(*histogram, permille);
+    if (exact < kLhSubBucketCount) {
+      DDIMON_EXPECT(reported == exact);
+      continue;
+    }
+    const auto error =
+        std::fabs(static_cast<double>(reported) - static_cast<double>(exact)) /
+        static_cast<double>(exact);
+    DDIMON_EXPECT(error <= max_error);
+  }
+  // No percentile exceeds the maximum
+  DDIMON_EXPECT(LhValueAtPermille(*histogram, 1000) <= values.back());
+}
+
+static void LtTestDistributions() {
+  std::mt19937_64 random(42);
+
+  // Small values have their own buckets
+  std::vector<ULONG64> values;
+  std::uniform_int_distribution<ULONG64> small(0, kLhSubBucketCount - 1);
+  for (auto i = 0ul; i < kLtValueCount; ++i) {
+    values.push_back(small(random));
+  }
+  LtCheckAccuracy(values);
+
+  // Cycles of a handler spread evenly
+  values.clear();
+  std::uniform_int_distribution<ULONG64> uniform(100, 50000);
+  for (auto i = 0ul; i < kLtValueCount; ++i) {
+    values.push_back(uniform(random));
+  }
+  LtCheckAccuracy(values);
+
+  // A long tail, as in calls that sometimes block
+  values.clear();
+  std::lognormal_distribution<double> long_tail(7.0, 2.0);
+  for (auto i = 0ul; i < kLtValueCount; ++i) {
+    const auto value = long_tail(random);
+    values.push_back(
+        static_cast<ULONG64>(std::min(value, static_cast<double>(1ull << 31))));
+  }
+  LtCheckAccuracy(values);
+
+  // Mostly fast calls with rare slow ones, which p99.9 must not hide
+  values.clear();
+  std::normal_distribution<double> fast(300.0, 20.0);
+  std::normal_distribution<double> slow(2000000.0, 100000.0);
+  for (auto i = 0ul; i < kLtValueCount; ++i) {
+    const auto value = (i % 500) ? fast(random) : slow(random);
+    values.push_back(static_cast<ULONG64>(std::max(value, 0.0)));
+  }
+  LtCheckAccuracy(values);
+}
+
+// Values at or above 2^kLhMaxValueBits share the last bucket, which reports
+// the maximum, and an empty histogram reports 0
+static void LtTestLimits() {
+  const auto histogram = std::make_unique<LhHistogram>();
+  DDIMON_EXPECT(!LhValueAtPermille(*histogram, 500));
+
+  const auto huge = (1ull << kLhMaxValueBits) * 5 + 3;
+  for (auto i = 0ul; i < 10; ++i) {
+    LhRecord(histogram.get(), 1000);
+  }
+  for (auto i = 0ul; i < 10; ++i) {
+    LhRecord(histogram.get(), huge + i);
+  }
+  DDIMON_EXPECT(histogram->buckets[kLhBucketCount - 1] == 10);
+  DDIMON_EXPECT(LhValueAtPermille(*histogram, 990) == huge + 9);
+  DDIMON_EXPECT(LhValueAtPermille(*histogram, 500) <= 1000 + 1000 / 32);
+
+  // A bucket middle above the maximum is clamped to the maximum
+  const auto single = std::make_unique<LhHistogram>();
+  LhRecord(single.get(), 1000);
+  DDIMON_EXPECT(LhValueAtPermille(*single, 500) == 1000);
+  LhRecord(single.get(), ~0ull);
+  DDIMON_EXPECT(LhValueAtPermille(*single, 1000) == ~0ull);
+}
+
+// Histograms of processors merged into one equal a histogram of all values
+static void LtTestMerge() {
+  std::mt19937_64 random(7);
+  std::lognormal_distribution<double> distribution(8.0, 1.5);
+  std::vector<std::unique_ptr<LhHistogram>> processors;
+  for (auto i = 0ul; i < kLtProcessorCount; ++i) {
+    processors.push_back(std::make_unique<LhHistogram>());
+  }
+  const auto all = std::make_unique<LhHistogram>();
+  for (auto i = 0ul; i < kLtValueCount; ++i) {
+    const auto value = static_cast<ULONG64>(distribution(random));
+    // Processors see different loads
+    const auto processor = (i * i) % kLtProcessorCount;
+    LhRecord(processors[processor].get(), value);
+    LhRecord(all.get(), value);
+  }
+
+  const auto merged = std::make_unique<LhHistogram>();
+  for (const auto& processor : processors) {
+    LhMerge(merged.get(), *processor);
+  }
+  DDIMON_EXPECT(merged->count == all->count);
+  DDIMON_EXPECT(merged->max_value == all->max_value);
+  DDIMON_EXPECT(std::equal(merged->buckets, merged->buckets + kLhBucketCount,
+                           all->buckets));
+  for (const auto permille : kLtPermilles) {
+    DDIMON_EXPECT(LhValueAtPermille(*merged, permille) ==
+                  LhValueAtPermille(*all, permille));
+  }
+
+  // Merging an empty histogram changes nothing
+  const auto empty = std::make_unique<LhHistogram>();
+  LhMerge(merged.get(), *empty);
+  DDIMON_EXPECT(merged->count == all->count);
+  DDIMON_EXPECT(merged->max_value == all->max_value);
+}
+
+int main() {
+  LtTestDistributions();
+  LtTestLimits();
+  LtTestMerge();
+  return DdimonTestResult();
+}
@@ -0,0 +1,228 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests shadow return stacks as RrpPreCall() and RrpPostCall() use them:
+/// returns pair with their calls by token, calls dropped for depth never pop
+/// an outer frame, frames of calls that never returned are popped together
+/// with an outer one, and slots of exited threads are freed for others.
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "return_recorder_core.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kRsThreadCount = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Stands for call contexts on the stack of a thread
+static ULONG64 g_rs_tokens[kRrcMaxDepth * 2];
+
+// Stands for statistics of two hooks
+static ULONG64 g_rs_contexts[2];
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a thread-like owner whose slots are probed from the same index for
+// any n
+static void* RsOwner(ULONG n) {
+  return reinterpret_cast<void*>(
+      0xffff800000001000ull + (static_cast<ULONG64>(n) * kRrcSlotCount << 4));
+}
+
+static RrcFrame RsFrame(ULONG n, ULONG context) {
+  return {&g_rs_tokens[n], &g_rs_contexts[context], n * 100ull};
+}
+
+// Nested calls of the same hook return in reverse order, and the slot is
+// released after the outermost one
+static void RsTestNesting(RrcSlot* slots) {
+  const auto slot = RrcFindSlot(slots, RsOwner(0), true);
+  DDIMON_EXPECT(slot);
+  DDIMON_EXPECT(RrcFindSlot(slots, RsOwner(0), true) == slot);
+  DDIMON_EXPECT(RrcPushFrame(slot, RsFrame(0, 0)));
+  DDIMON_EXPECT(RrcPushFrame(slot, RsFrame(1, 0)));
+  DDIMON_EXPECT(RrcPushFrame(slot, RsFrame(2, 1)));
+
+  for (auto n = 3ul; n > 0; --n) {
+    RrcFrame frame = {};
+    ULONG abandoned_count = ~0u;
+    DDIMON_EXPECT(RrcPopFrame(slot, &g_rs_tokens[n - 1], &frame,
+                              &abandoned_count));
+    DDIMON_EXPECT(frame.token == &g_rs_tokens[n - 1]);
+    DDIMON_EXPECT(frame.start_tsc == (n - 1) * 100ull);
+    DDIMON_EXPECT(!abandoned_count);
+    DDIMON_EXPECT(slot->depth == n - 1);
+  }
+  RrcReleaseSlot(slot);
+  DDIMON_EXPECT(!slot->owner);
+  DDIMON_EXPECT(!RrcFindSlot(slots, RsOwner(0), false));
+}
+
+// Recursive calls beyond the maximum depth are dropped, and their returns pop
+// nothing, so that each kept call is paired with its own return
+static void RsTestRecursion(RrcSlot* slots) {
+  const auto slot = RrcFindSlot(slots, RsOwner(0), true);
+  const auto call_count = kRrcMaxDepth * 2;
+  auto dropped_count = 0ul;
+  for (auto n = 0ul; n < call_count; ++n) {
+    dropped_count += !RrcPushFrame(slot, RsFrame(n, 0));
+  }
+  DDIMON_EXPECT(dropped_count == call_count - kRrcMaxDepth);
+  DDIMON_EXPECT(slot->depth == kRrcMaxDepth);
+
+  for (auto n = call_count; n > 0; --n) {
+    RrcFrame frame = {};
+    ULONG abandoned_count = 0;
+    const auto popped = RrcPopFrame(slot, &g_rs_tokens[n - 1], &frame,
+                                    &abandoned_count);
+    DDIMON_EXPECT(popped == (n <= kRrcMaxDepth));
+    DDIMON_EXPECT(!abandoned_count);
+    if (popped) {
+      DDIMON_EXPECT(frame.start_tsc == (n - 1) * 100ull);
+      DDIMON_EXPECT(slot->depth == n - 1);
+    } else {
+      DDIMON_EXPECT(slot->depth == kRrcMaxDepth);
+    }
+  }
+  RrcReleaseSlot(slot);
+}
+
+// Calls that left without returning through the hook are popped with the
+// first outer call that returns, and remain readable to be counted
+static void RsTestAbandoned(RrcSlot* slots) {
+  const auto slot = RrcFindSlot(slots, RsOwner(0), true);
+  for (auto n = 0ul; n < 4; ++n) {
+    RrcPushFrame(slot, RsFrame(n, n % 2));
+  }
+
+  RrcFrame frame = {};
+  ULONG abandoned_count = 0;
+  DDIMON_EXPECT(
+      RrcPopFrame(slot, &g_rs_tokens[1], &frame, &abandoned_count));
+  DDIMON_EXPECT(frame.token == &g_rs_tokens[1]);
+  DDIMON_EXPECT(abandoned_count == 2);
+  DDIMON_EXPECT(slot->depth == 1);
+  DDIMON_EXPECT(slot->frames[slot->depth + 1].token == &g_rs_tokens[2]);
+  DDIMON_EXPECT(slot->frames[slot->depth + 2].token == &g_rs_tokens[3]);
+
+  // A return never pushed pops nothing
+  DDIMON_EXPECT(
+      !RrcPopFrame(slot, &g_rs_tokens[3], &frame, &abandoned_count));
+  DDIMON_EXPECT(!abandoned_count);
+  DDIMON_EXPECT(slot->depth == 1);
+
+  DDIMON_EXPECT(
+      RrcPopFrame(slot, &g_rs_tokens[0], &frame, &abandoned_count));
+  DDIMON_EXPECT(!slot->depth);
+  RrcReleaseSlot(slot);
+}
+
+// Owners fill the probed slots, and a slot left by an exited owner with
+// frames in it is freed for another owner
+static void RsTestExitedOwner(RrcSlot* slots) {
+  std::vector<RrcSlot*> owned;
+  for (auto n = 0ul; n < kRrcMaxProbes; ++n) {
+    const auto slot = RrcFindSlot(slots, RsOwner(n), true);
+    DDIMON_EXPECT(slot);
+    owned.push_back(slot);
+    RrcPushFrame(slot, RsFrame(n, 0));
+  }
+  const auto late_owner = RsOwner(kRrcMaxProbes);
+  DDIMON_EXPECT(!RrcFindSlot(slots, late_owner, true));
+
+  // The owner 3 exits in a recorded call
+  const auto exited = RrcFindSlot(slots, RsOwner(3), false);
+  DDIMON_EXPECT(exited == owned[3]);
+  DDIMON_EXPECT(exited->depth == 1);
+  RrcReleaseSlot(exited);
+  DDIMON_EXPECT(!RrcFindSlot(slots, RsOwner(3), false));
+
+  const auto reused = RrcFindSlot(slots, late_owner, true);
+  DDIMON_EXPECT(reused == exited);
+  DDIMON_EXPECT(!reused->depth);
+  for (auto n = 0ul; n < kRrcMaxProbes; ++n) {
+    if (n != 3) {
+      DDIMON_EXPECT(RrcFindSlot(slots, RsOwner(n), false) == owned[n]);
+    }
+  }
+  for (const auto slot : owned) {
+    RrcReleaseSlot(slot);
+  }
+}
+
+// Threads claiming and releasing slots at once never share a slot
+static void RsTestConcurrency(RrcSlot* slots) {
+  const ULONG kRounds = 100000;
+  std::atomic<ULONG> shared_count(0);
+  std::vector<std::thread> threads;
+  for (auto t = 0ul; t < kRsThreadCount; ++t) {
+    threads.emplace_back([slots, t, &shared_count] {
+      const auto owner = RsOwner(t);
+      ULONG64 token = 0;
+      auto local_count = 0ul;
+      for (auto round = 0ul; round < kRounds; ++round) {
+        const auto slot = RrcFindSlot(slots, owner, true);
+        if (!slot) {
+          continue;
+        }
+        RrcPushFrame(slot, {&token, nullptr, round});
+        RrcFrame frame = {};
+        ULONG abandoned_count = 0;
+        if (!RrcPopFrame(slot, &token, &frame, &abandoned_count) ||
+            frame.start_tsc != round || slot->owner != owner) {
+          local_count++;
+        }
+        RrcReleaseSlot(slot);
+      }
+      shared_count += local_count;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  DDIMON_EXPECT(!shared_count);
+  for (auto i = 0ul; i < kRrcSlotCount; ++i) {
+    DDIMON_EXPECT(!slots[i].owner);
+  }
+}
+
+int main() {
+  const auto slots = std::make_unique<RrcSlot[]>(kRrcSlotCount);
+  RsTestNesting(slots.get());
+  RsTestRecursion(slots.get());
+  RsTestAbandoned(slots.get());
+  RsTestExitedOwner(slots.get());
+  RsTestConcurrency(slots.get());
+  return DdimonTestResult();
+}
@@ -0,0 +1,186 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests seen filters: keys are never forgotten before aging, unseen keys are
+/// reported seen at a bounded rate up to kSfGenerationCapacity keys, keys are
+/// forgotten after one to two periods or generations of capacity, both
+/// generations are cleared after idle periods, and keys tested by many
+/// threads at once are reported unseen at most once by each thread.
+
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+#include "seen_filter.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A period never reached by tests without aging by time
+static const ULONG64 kStNoAging = ~0ull;
+
+static const ULONG kStTrialCount = 200000;
+static const ULONG kStThreadCount = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a kernel-like address of the n-th key of a seed
+static ULONG64 StKey(ULONG seed, ULONG n) {
+  return 0xfffff80000000000ull + (static_cast<ULONG64>(seed) << 32) + n * 16;
+}
+
+// Returns a rate of random keys, other than any key inserted, that the
+// filter reports seen
+static double StFalsePositiveRate(const SfFilter* filter) {
+  std::mt19937_64 random(12345);
+  auto positive_count = 0ul;
+  for (auto i = 0ul; i < kStTrialCount; ++i) {
+    positive_count += SfContains(filter, random() & 0x7fffffffffffffffull);
+  }
+  return static_cast<double>(positive_count) / kStTrialCount;
+}
+
+// Inserted keys are always seen, and random keys rarely are
+static void StFalsePositives(SfFilter* filter) {
+  const struct {
+    ULONG key_count;
+    double max_rate;
+  } kLevels[] = {
+      {kSfGenerationCapacity / 4, 0.0001},
+      {kSfGenerationCapacity / 2, 0.001},
+      {kSfGenerationCapacity - 1, 0.005},
+  };
+  for (const auto& level : kLevels) {
+    SfInitialize(filter, kStNoAging, 0);
+    for (auto i = 0ul; i < level.key_count; ++i) {
+      SfTestAndSet(filter, StKey(1, i), 1);
+    }
+    for (auto i = 0ul; i < level.key_count; ++i) {
+      DDIMON_EXPECT(SfContains(filter, StKey(1, i)));
+      DDIMON_EXPECT(SfTestAndSet(filter, StKey(1, i), 1));
+    }
+    DDIMON_EXPECT(StFalsePositiveRate(filter) <= level.max_rate);
+  }
+}
+
+// A key is forgotten when it has not been tested for two agings, and a key
+// tested in every period is never forgotten
+static void StAgingByTime(SfFilter* filter) {
+  const ULONG64 kPeriod = 100;
+  const auto key = StKey(2, 0);
+  const auto other = StKey(2, 1);
+
+  SfInitialize(filter, kPeriod, 0);
+  DDIMON_EXPECT(!SfTestAndSet(filter, key, 10));
+  DDIMON_EXPECT(SfTestAndSet(filter, key, 50));
+  // The first aging keeps the key in the older generation
+  SfTestAndSet(filter, other, 150);
+  DDIMON_EXPECT(SfContains(filter, key));
+  // The second one clears it
+  SfTestAndSet(filter, other, 260);
+  DDIMON_EXPECT(!SfContains(filter, key));
+  DDIMON_EXPECT(!SfTestAndSet(filter, key, 270));
+
+  for (ULONG64 now = 300; now < 300 + kPeriod * 20; now += kPeriod / 2) {
+    DDIMON_EXPECT(SfTestAndSet(filter, key, now));
+  }
+
+  // Both generations are cleared after two idle periods
+  DDIMON_EXPECT(!SfTestAndSet(filter, other, 300 + kPeriod * 23));
+  DDIMON_EXPECT(!SfContains(filter, key));
+}
+
+// A generation holding kSfGenerationCapacity keys is aged as a period passed
+static void StAgingByCapacity(SfFilter* filter) {
+  SfInitialize(filter, kStNoAging, 0);
+  for (auto i = 0ul; i < kSfGenerationCapacity; ++i) {
+    SfTestAndSet(filter, StKey(3, i), 1);
+  }
+  // The first generation is now the older one
+  for (auto i = 0ul; i < kSfGenerationCapacity; ++i) {
+    DDIMON_EXPECT(SfContains(filter, StKey(3, i)));
+  }
+
+  // Keys reported seen are not counted, so the first generation may take a
+  // few more keys before it is aged. Another generation of keys clears it.
+  const auto key_count = kSfGenerationCapacity + kSfGenerationCapacity / 8;
+  for (auto i = 0ul; i < key_count; ++i) {
+    SfTestAndSet(filter, StKey(4, i), 1);
+  }
+  auto remembered_count = 0ul;
+  for (auto i = 0ul; i < kSfGenerationCapacity; ++i) {
+    remembered_count += SfContains(filter, StKey(3, i));
+  }
+  // Only false positives remain
+  DDIMON_EXPECT(remembered_count < kSfGenerationCapacity / 100);
+  for (auto i = kSfGenerationCapacity / 8; i < key_count; ++i) {
+    DDIMON_EXPECT(SfContains(filter, StKey(4, i)));
+  }
+}
+
+// Threads testing the same keys at once may all report a key unseen, but
+// never more than once each, and the key is remembered
+static void StConcurrency(SfFilter* filter) {
+  const ULONG kKeyCount = 4096;
+  const ULONG kRounds = 50;
+  SfInitialize(filter, kStNoAging, 0);
+  std::atomic<ULONG> unseen_count(0);
+  std::vector<std::thread> threads;
+  for (auto t = 0ul; t < kStThreadCount; ++t) {
+    threads.emplace_back([filter, &unseen_count] {
+      auto local_count = 0ul;
+      for (auto round = 0ul; round < kRounds; ++round) {
+        for (auto i = 0ul; i < kKeyCount; ++i) {
+          local_count += !SfTestAndSet(filter, StKey(5, i), 1);
+        }
+      }
+      unseen_count += local_count;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  DDIMON_EXPECT(unseen_count >= kKeyCount - kKeyCount / 100);
+  DDIMON_EXPECT(unseen_count <= kKeyCount * kStThreadCount);
+  for (auto i = 0ul; i < kKeyCount; ++i) {
+    DDIMON_EXPECT(SfContains(filter, StKey(5, i)));
+  }
+}
+
+int main() {
+  const auto filter = std::make_unique<SfFilter>();
+  StFalsePositives(filter.get());
+  StAgingByTime(filter.get());
+  StAgingByCapacity(filter.get());
+  StConcurrency(filter.get());
+  return DdimonTestResult();
+}
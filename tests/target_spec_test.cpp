@@ -0,0 +1,315 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Compiles specs into target tables and back: all kinds of records round
+/// trip to the same bytes, tables parse into the expected entries as the
+/// driver parses them, invalid lines are reported with their line numbers,
+/// corrupted or trailing bytes of tables are refused, and argument counts of
+/// recorded hooks are bounded and defaulted for older tables.
+
+#include <string>
+#include <vector>
+#include "target_spec.h"
+#include "test_util.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A spec with all kinds, flags and keys
+static const char kSpSpec[] =
+    "# Targets\n"
+    "hook ExQueueWorkItem export handler=EXQUEUEWORKITEM\n"
+    "\n"
+    "hook KeWaitForSingleObject export args=5   # Only recorded\n"
+    "hook Ndis* export count callers wildcard module=ndis.sys\n"
+    "hook NtQueryInformationThread rva=0x697050 "
+    "handler=NTQUERYINFORMATIONTHREAD signature=4883ec28\n"
+    "hook - scan signature=488bc4 rva=0x10 module=fltmgr.sys count\n"
+    "patch NtSetSystemTime rva=0x123456 bytes=B833020000C3\n"
+    "bundle KdTrap address=0xfffff80000001000 "
+    "region=4:833d1d0e310000:833dc1b7360000 region=0x20:90:cc\n"
+    "monitor KdDebuggerEnabled export handler=KDDEBUGGERENABLED length=1 "
+    "access=r\n"
+    "\tmonitor a#b rva=8 handler=X length=0x10 access=rw\n";
+
+static const ULONG kSpRecordCount = 9;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Parses a table as TtParse() does
+static std::vector<TtEntry> SpParse(const std::vector<UCHAR>& table) {
+  std::vector<TtEntry> entries;
+  const auto size = static_cast<ULONG>(table.size());
+  DDIMON_EXPECT(TtcValidateHeader(table.data(), size) == kTtcSuccess);
+  const auto header = reinterpret_cast<const TtFileHeader*>(table.data());
+  const auto payload = table.data() + sizeof(TtFileHeader);
+  ULONG offset = 0;
+  for (auto i = 0ul; i < header->record_count; ++i) {
+    TtEntry entry = {};
+    DDIMON_EXPECT(TtcParseRecord(payload, size - sizeof(TtFileHeader),
+                                 header->version, &offset,
+                                 &entry) == kTtcSuccess);
+    entries.push_back(entry);
+  }
+  DDIMON_EXPECT(offset == size - sizeof(TtFileHeader));
+  return entries;
+}
+
+// Compiles a spec expected to be invalid and returns the line reported
+static ULONG SpFailedLine(const std::string& spec) {
+  std::vector<UCHAR> table;
+  TsError error = {};
+  DDIMON_EXPECT(!TsCompile(spec, &table, &error));
+  DDIMON_EXPECT(table.empty());
+  DDIMON_EXPECT(!error.message.empty());
+  return error.line;
+}
+
+static void SpTestRoundTrip() {
+  std::vector<UCHAR> table;
+  TsError error = {};
+  DDIMON_EXPECT(TsCompile(kSpSpec, &table, &error));
+  const auto header = reinterpret_cast<const TtFileHeader*>(table.data());
+  DDIMON_EXPECT(header->magic == kTtMagic);
+  DDIMON_EXPECT(header->version == kTtVersion);
+  DDIMON_EXPECT(header->record_count == kSpRecordCount);
+  DDIMON_EXPECT(header->total_size == table.size());
+
+  const auto entries = SpParse(table);
+  DDIMON_EXPECT(entries.size() == kSpRecordCount);
+  DDIMON_EXPECT(entries[0].kind == kTtHook);
+  DDIMON_EXPECT(entries[0].flags == kTtFlagExport);
+  DDIMON_EXPECT(std::string(entries[0].name) == "ExQueueWorkItem");
+  DDIMON_EXPECT(std::string(entries[0].handler) == "EXQUEUEWORKITEM");
+  DDIMON_EXPECT(!entries[0].argument_count);
+  DDIMON_EXPECT(entries[1].argument_count == 5);
+  DDIMON_EXPECT(entries[2].flags == (kTtFlagExport | kTtFlagCount |
+                                     kTtFlagCallers | kTtFlagWildcard));
+  DDIMON_EXPECT(std::string(entries[2].module) == "ndis.sys");
+  DDIMON_EXPECT(entries[3].location == 0x697050);
+  DDIMON_EXPECT(entries[3].signature_length == 4);
+  DDIMON_EXPECT(entries[3].signature[0] == 0x48);
+  DDIMON_EXPECT(!entries[4].name[0]);
+  DDIMON_EXPECT(entries[4].flags == (kTtFlagScan | kTtFlagCount));
+  DDIMON_EXPECT(entries[5].kind == kTtPatch);
+  DDIMON_EXPECT(entries[5].patch_length == 6);
+  DDIMON_EXPECT(entries[5].patch[0] == 0xb8 && entries[5].patch[5] == 0xc3);
+  DDIMON_EXPECT(entries[6].kind == kTtPatchBundle);
+  DDIMON_EXPECT(entries[6].flags == kTtFlagAbsolute);
+  DDIMON_EXPECT(entries[6].location == 0xfffff80000001000ull);
+  ULONG offset = 0;
+  TtBundleRegion region = {};
+  DDIMON_EXPECT(TtcReadBundleRegion(entries[6].patch, entries[6].patch_length,
+                                    &offset, &region));
+  DDIMON_EXPECT(region.offset == 4 && region.length == 7);
+  DDIMON_EXPECT(region.new_code[2] == 0xc1);
+  DDIMON_EXPECT(TtcReadBundleRegion(entries[6].patch, entries[6].patch_length,
+                                    &offset, &region));
+  DDIMON_EXPECT(region.offset == 0x20 && region.expected_code[0] == 0x90);
+  DDIMON_EXPECT(offset == entries[6].patch_length);
+  DDIMON_EXPECT(entries[7].kind == kTtMemMonitor);
+  DDIMON_EXPECT(entries[7].length == 1 && entries[7].access == kTtAccessRead);
+  DDIMON_EXPECT(std::string(entries[8].name) == "a#b");
+  DDIMON_EXPECT(entries[8].access == (kTtAccessRead | kTtAccessWrite));
+
+  // Decompiling and compiling again gives the same bytes
+  std::string spec;
+  DDIMON_EXPECT(TsDecompile(table.data(), static_cast<ULONG>(table.size()),
+                            &spec, &error));
+  std::vector<UCHAR> recompiled;
+  DDIMON_EXPECT(TsCompile(spec, &recompiled, &error));
+  DDIMON_EXPECT(recompiled == table);
+
+  // An empty spec is a valid table without targets
+  DDIMON_EXPECT(TsCompile("# Nothing\n\n", &table, &error));
+  DDIMON_EXPECT(table.size() == sizeof(TtFileHeader));
+  DDIMON_EXPECT(SpParse(table).empty());
+}
+
+static void SpTestInvalidSpecs() {
+  // Syntax
+  DDIMON_EXPECT(SpFailedLine("hook A export args=1\nhook\n") == 2);
+  DDIMON_EXPECT(SpFailedLine("\n\nwatch A export\n") == 3);
+  DDIMON_EXPECT(SpFailedLine("hook A export fast\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export export\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 rva=2\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 address=2\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=0x\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=-1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 signature=123\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 signature=zz\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 handler=\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 bytes=90\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("patch A rva=1 region=0:90:90\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("bundle A rva=1 region=0:90:9090\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("bundle A rva=1 region=0::\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("bundle A rva=1 region=0x100000000:90:90\n") ==
+                1);
+  DDIMON_EXPECT(SpFailedLine("monitor A rva=1 handler=X length=1 "
+                             "access=x\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("monitor A rva=1 handler=X "
+                             "length=0x100000000 access=r\n") == 1);
+
+  // Lengths are checked before they are narrowed
+  DDIMON_EXPECT(SpFailedLine("hook " + std::string(64, 'A') +
+                             " export args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook " + std::string(256, 'A') +
+                             " export args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A rva=1 signature=" +
+                             std::string(33 * 2, '9') + "\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("patch A rva=1 bytes=" +
+                             std::string(0x101 * 2, '9') + "\n") == 1);
+
+  // Rules of target_table_core.cpp
+  DDIMON_EXPECT(SpFailedLine("hook A args=1\nhook A export scan args=1\n") ==
+                2);
+  DDIMON_EXPECT(SpFailedLine("hook - export args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A scan args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export callers args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A* export wildcard args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export count handler=X\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A address=1 module=ndis.sys args=1\n") ==
+                1);
+
+  // Arguments are forwarded only by a recorded hook, and only up to 8
+  DDIMON_EXPECT(SpFailedLine("hook A export args=0\nhook B export\n") == 2);
+  DDIMON_EXPECT(SpFailedLine("hook A export args=9\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export args=0x100\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export args=2 handler=X\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("hook A export args=2 count\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("patch A rva=1 bytes=90 args=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("patch A rva=1\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("patch A rva=0xffe bytes=909090\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("monitor A rva=1 length=1 access=r\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("monitor A rva=1 handler=X access=r\n") == 1);
+  DDIMON_EXPECT(SpFailedLine("monitor A rva=1 handler=X length=1\n") == 1);
+
+  // Records beyond kTtMaxTableSize
+  std::string spec;
+  for (auto i = 0; i < 2000; ++i) {
+    spec += "hook A export handler=" + std::string(40, 'H') + "\n";
+  }
+  DDIMON_EXPECT(SpFailedLine(spec) > 1);
+}
+
+static void SpTestInvalidTables() {
+  std::vector<UCHAR> table;
+  TsError error = {};
+  DDIMON_EXPECT(TsCompile(kSpSpec, &table, &error));
+  std::string spec;
+  const auto check = [&](const std::vector<UCHAR>& bytes) {
+    return TsDecompile(bytes.data(), static_cast<ULONG>(bytes.size()), &spec,
+                       &error);
+  };
+  DDIMON_EXPECT(check(table));
+
+  auto corrupted = table;
+  corrupted.back() ^= 1;
+  DDIMON_EXPECT(!check(corrupted));
+  DDIMON_EXPECT(error.message == TtcGetErrorMessage(kTtcErrorChecksum));
+
+  corrupted = table;
+  corrupted[0] ^= 1;
+  DDIMON_EXPECT(!check(corrupted));
+  DDIMON_EXPECT(error.message == TtcGetErrorMessage(kTtcErrorMagic));
+
+  corrupted = table;
+  corrupted.resize(corrupted.size() - 1);
+  DDIMON_EXPECT(!check(corrupted));
+
+  // A valid checksum does not save an invalid record, which is reported by
+  // its number
+  corrupted = table;
+  const auto record = reinterpret_cast<TtRecordHeader*>(
+      corrupted.data() + sizeof(TtFileHeader));
+  record->flags |= kTtFlagScan;
+  const auto header = reinterpret_cast<TtFileHeader*>(corrupted.data());
+  header->checksum =
+      TtcComputeChecksum(corrupted.data() + sizeof(TtFileHeader),
+                         header->total_size - sizeof(TtFileHeader));
+  DDIMON_EXPECT(!check(corrupted));
+  DDIMON_EXPECT(error.line == 1);
+  DDIMON_EXPECT(error.message == TtcGetErrorMessage(kTtcErrorLocator));
+
+  // Bytes following the last record are refused
+  corrupted = table;
+  const auto count_header = reinterpret_cast<TtFileHeader*>(corrupted.data());
+  count_header->record_count--;
+  count_header->checksum =
+      TtcComputeChecksum(corrupted.data() + sizeof(TtFileHeader),
+                         count_header->total_size - sizeof(TtFileHeader));
+  DDIMON_EXPECT(!check(corrupted));
+  DDIMON_EXPECT(!error.line);
+}
+
+// Recorded hooks of version 2 tables forward kTtMaxArguments arguments, and
+// an argument count in a table is validated as in a spec
+static void SpTestArgumentCount() {
+  std::vector<UCHAR> table;
+  TsError error = {};
+  DDIMON_EXPECT(TsCompile("hook A export args=3\nhook B export handler=X\n",
+                          &table, &error));
+  const auto header = reinterpret_cast<TtFileHeader*>(table.data());
+  const auto record = reinterpret_cast<TtRecordHeader*>(
+      table.data() + sizeof(TtFileHeader));
+  const auto update_checksum = [&] {
+    header->checksum =
+        TtcComputeChecksum(table.data() + sizeof(TtFileHeader),
+                           header->total_size - sizeof(TtFileHeader));
+  };
+
+  auto entries = SpParse(table);
+  DDIMON_EXPECT(entries[0].argument_count == 3);
+  DDIMON_EXPECT(!entries[1].argument_count);
+
+  header->version = 2;
+  record->argument_count = 0;
+  update_checksum();
+  entries = SpParse(table);
+  DDIMON_EXPECT(entries[0].argument_count == kTtMaxArguments);
+  DDIMON_EXPECT(!entries[1].argument_count);
+
+  header->version = kTtVersion;
+  record->argument_count = kTtMaxArguments + 1;
+  update_checksum();
+  std::string spec;
+  DDIMON_EXPECT(!TsDecompile(table.data(), static_cast<ULONG>(table.size()),
+                             &spec, &error));
+  DDIMON_EXPECT(error.line == 1);
+  DDIMON_EXPECT(error.message == TtcGetErrorMessage(kTtcErrorArguments));
+}
+
+int main() {
+  SpTestRoundTrip();
+  SpTestInvalidSpecs();
+  SpTestInvalidTables();
+  SpTestArgumentCount();
+  return DdimonTestResult();
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares checks shared by host tests.
+///
+/// A test counts failed checks with DDIMON_EXPECT() and returns
+/// DdimonTestResult() from main(), so that one run reports all failures.
+
+#ifndef DDIMON_TEST_UTIL_H_
+#define DDIMON_TEST_UTIL_H_
+
+#include <cstdio>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Reports and counts a failure when condition is false
+#define DDIMON_EXPECT(condition)                                       \
+  do {                                                                 \
+    if (!(condition)) {                                                \
+      std::fprintf(stderr, "%s(%d): %s\n", __FILE__, __LINE__,         \
+                   #condition);                                        \
+      ++g_ddimon_test_failures;                                        \
+    }                                                                  \
+  } while (false)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// An exit code ctest treats as a skipped test, set as SKIP_RETURN_CODE
+static const int kDdimonTestSkipped = 77;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static int g_ddimon_test_failures;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns an exit code of a test
+inline int DdimonTestResult() {
+  if (g_ddimon_test_failures) {
+    std::fprintf(stderr, "%d check(s) failed.\n", g_ddimon_test_failures);
+    return 1;
+  }
+  return 0;
+}
+
+#endif  // DDIMON_TEST_UTIL_H_
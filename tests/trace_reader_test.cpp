@@ -0,0 +1,270 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Writes trace files as trace_writer.cpp does and reads them with
+/// trace_reader.cpp: with the index, without the footer as after a crash, and
+/// with a corrupted block, narrowing events by processors, time, kinds, tags
+/// and callers, and aggregating them.
+
+#include <cstdlib>
+#include <vector>
+#include "test_util.h"
+#include "trace_reader.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#define DDIMON_TRACE_READER_TEST_SUPPORTED 1
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kRtProcessorCount = 2;
+static const ULONG kRtEventsPerProcessor = 5000;
+
+static const ULONG kRtTagA = DdimonMakeTag('A', 'a', 'a', 'a');
+static const ULONG kRtTagB = DdimonMakeTag('B', 'b', 'b', 'b');
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+#if defined(DDIMON_TRACE_READER_TEST_SUPPORTED)
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns the n-th event of a processor. Even events allocate 0x10 bytes
+// with kRtTagA from 0x1000, and odd ones free with kRtTagB from 0x2000.
+static TfEvent RtMakeEvent(ULONG processor, ULONG n) {
+  TfEvent event = {};
+  event.tsc = n * 10 + processor;
+  if (n % 2) {
+    event.kind = kTfEventFreePool;
+    event.address = 0x2000;
+    event.argument = 0xffff0000 + n;
+    event.tag = kRtTagB;
+  } else {
+    event.kind = kTfEventAllocatePool;
+    event.address = 0x1000;
+    event.argument = 0xffff0000 + n;
+    event.size = 0x10;
+    event.tag = kRtTagA;
+  }
+  return event;
+}
+
+// Returns a trace file of events of all processors, with the index and the
+// footer, as blocks are filled and written in turn
+static std::vector<UCHAR> RtMakeTrace() {
+  std::vector<UCHAR> data;
+  const TfFileHeader header = {kTfFileMagic, kTfVersion, 0, kTfBlockSize, 0};
+  data.insert(data.end(), reinterpret_cast<const UCHAR*>(&header),
+              reinterpret_cast<const UCHAR*>(&header + 1));
+
+  std::vector<TfIndexEntry> index;
+  const auto write_block = [&](const std::vector<UCHAR>& block) {
+    const auto block_header =
+        reinterpret_cast<const TfBlockHeader*>(block.data());
+    index.push_back({data.size(), block_header->first_tsc,
+                     block_header->last_tsc, block_header->processor,
+                     block_header->event_count});
+    data.insert(data.end(), block.begin(), block.end());
+  };
+
+  std::vector<std::vector<UCHAR>> blocks(kRtProcessorCount);
+  for (auto n = 0ul; n < kRtEventsPerProcessor; ++n) {
+    for (auto processor = 0ul; processor < kRtProcessorCount; ++processor) {
+      auto& block = blocks[processor];
+      const auto event = RtMakeEvent(processor, n);
+      if (!block.empty() && TfAppendEvent(block.data(), event)) {
+        continue;
+      }
+      if (!block.empty()) {
+        write_block(block);
+      }
+      block.assign(kTfBlockSize, 0);
+      TfInitializeBlock(block.data(), static_cast<USHORT>(processor),
+                        event.tsc, event.address);
+      DDIMON_EXPECT(TfAppendEvent(block.data(), event));
+    }
+  }
+  for (const auto& block : blocks) {
+    write_block(block);
+  }
+
+  const TfFileFooter footer = {kTfFooterMagic,
+                               static_cast<ULONG>(index.size()), data.size(),
+                               3};
+  data.insert(data.end(), reinterpret_cast<const UCHAR*>(index.data()),
+              reinterpret_cast<const UCHAR*>(index.data() + index.size()));
+  data.insert(data.end(), reinterpret_cast<const UCHAR*>(&footer),
+              reinterpret_cast<const UCHAR*>(&footer + 1));
+  return data;
+}
+
+// Writes data to a temporary file and opens it
+static bool RtOpen(const std::vector<UCHAR>& data, TrFile* file) {
+  char path[] = "/tmp/ddimon_trace_XXXXXX";
+  const auto fd = mkstemp(path);
+  if (fd == -1) {
+    return false;
+  }
+  const auto written = write(fd, data.data(), data.size());
+  close(fd);
+  const char* error = nullptr;
+  const auto opened = written == static_cast<ssize_t>(data.size()) &&
+                      TrOpenFile(path, file, &error);
+  unlink(path);
+  return opened;
+}
+
+static bool RtCount(void* context, USHORT, const TfEvent&) {
+  (*static_cast<ULONG64*>(context))++;
+  return true;
+}
+
+// Reads events with filters and checks that blocks out of them are skipped
+static void RtTestFilters(const TrFile& file) {
+  TrFilter filter = {};
+  TrInitializeFilter(&filter);
+  ULONG64 count = 0;
+  auto statistics = TrReadEvents(file, filter, RtCount, &count);
+  DDIMON_EXPECT(count == kRtProcessorCount * kRtEventsPerProcessor);
+  DDIMON_EXPECT(statistics.event_count == count);
+  DDIMON_EXPECT(statistics.read_block_count == file.block_count);
+  DDIMON_EXPECT(statistics.corrupted_block_count == 0);
+
+  filter.processor = 1;
+  statistics = TrReadEvents(file, filter, RtCount, &(count = 0));
+  DDIMON_EXPECT(count == kRtEventsPerProcessor);
+  DDIMON_EXPECT(statistics.skipped_block_count ==
+                file.block_count - statistics.read_block_count);
+  DDIMON_EXPECT(statistics.skipped_block_count);
+
+  // Events 100-199 of the processor 1 lie in one or two blocks
+  filter.min_tsc = 1001;
+  filter.max_tsc = 1991;
+  statistics = TrReadEvents(file, filter, RtCount, &(count = 0));
+  DDIMON_EXPECT(count == 100);
+  DDIMON_EXPECT(statistics.read_block_count <= 2);
+
+  TrInitializeFilter(&filter);
+  filter.kinds = 1ul << kTfEventFreePool;
+  DDIMON_EXPECT(TrReadEvents(file, filter, RtCount, &(count = 0))
+                    .event_count == kRtEventsPerProcessor);
+  filter.match_tag = true;
+  filter.tag = kRtTagA;
+  DDIMON_EXPECT(TrReadEvents(file, filter, RtCount, &(count = 0))
+                    .event_count == 0);
+
+  TrInitializeFilter(&filter);
+  filter.min_address = 0x1000;
+  filter.max_address = 0x1fff;
+  DDIMON_EXPECT(TrReadEvents(file, filter, RtCount, &(count = 0))
+                    .event_count == kRtEventsPerProcessor);
+
+  // A callback can stop reading
+  TrInitializeFilter(&filter);
+  const auto stop = [](void* context, USHORT, const TfEvent&) {
+    return ++(*static_cast<ULONG64*>(context)) < 10;
+  };
+  TrReadEvents(file, filter, stop, &(count = 0));
+  DDIMON_EXPECT(count == 10);
+}
+
+static void RtTestAggregate(const TrFile& file) {
+  TrFilter filter = {};
+  TrInitializeFilter(&filter);
+  TrAggregate aggregate;
+  TrAggregateEvents(file, filter, &aggregate);
+  const auto half = kRtProcessorCount * kRtEventsPerProcessor / 2;
+  DDIMON_EXPECT(aggregate.event_count == half * 2);
+  DDIMON_EXPECT(aggregate.first_tsc == 0);
+  DDIMON_EXPECT(aggregate.last_tsc ==
+                (kRtEventsPerProcessor - 1) * 10 + kRtProcessorCount - 1);
+  DDIMON_EXPECT(aggregate.kind_counts[kTfEventAllocatePool] == half);
+  DDIMON_EXPECT(aggregate.kind_counts[kTfEventFreePool] == half);
+  DDIMON_EXPECT(aggregate.processor_counts.size() == kRtProcessorCount);
+  DDIMON_EXPECT(aggregate.tags[kRtTagA].allocation_count == half);
+  DDIMON_EXPECT(aggregate.tags[kRtTagA].allocated_bytes == half * 0x10);
+  DDIMON_EXPECT(aggregate.tags[kRtTagB].free_count == half);
+  DDIMON_EXPECT(aggregate.callers[0x1000].allocated_bytes == half * 0x10);
+  DDIMON_EXPECT(aggregate.callers[0x2000].event_count == half);
+}
+
+int main() {
+  const auto data = RtMakeTrace();
+  TrFile file = {};
+  if (!RtOpen(data, &file)) {
+    std::fprintf(stderr, "A temporary file could not be written.\n");
+    return kDdimonTestSkipped;
+  }
+  DDIMON_EXPECT(file.index);
+  DDIMON_EXPECT(file.dropped_count == 3);
+  DDIMON_EXPECT(file.block_count > kRtProcessorCount * 2);
+  RtTestFilters(file);
+  RtTestAggregate(file);
+  const auto block_count = file.block_count;
+  TrCloseFile(&file);
+
+  // Without the index and the footer, blocks are found one by one
+  const auto index_offset = sizeof(TfFileHeader) + block_count * kTfBlockSize;
+  std::vector<UCHAR> crashed(data.begin(), data.begin() + index_offset);
+  DDIMON_EXPECT(RtOpen(crashed, &file));
+  DDIMON_EXPECT(!file.index);
+  DDIMON_EXPECT(file.block_count == block_count);
+  RtTestFilters(file);
+  RtTestAggregate(file);
+  TrCloseFile(&file);
+
+  // A corrupted block is counted and skipped
+  auto corrupted = data;
+  corrupted[sizeof(TfFileHeader)] ^= 0xff;
+  DDIMON_EXPECT(RtOpen(corrupted, &file));
+  TrFilter filter = {};
+  TrInitializeFilter(&filter);
+  ULONG64 count = 0;
+  const auto statistics = TrReadEvents(file, filter, RtCount, &count);
+  DDIMON_EXPECT(statistics.corrupted_block_count == 1);
+  DDIMON_EXPECT(statistics.read_block_count == block_count - 1);
+  DDIMON_EXPECT(count < kRtProcessorCount * kRtEventsPerProcessor);
+  TrCloseFile(&file);
+
+  // Other files are refused
+  auto other = data;
+  other[0] ^= 0xff;
+  DDIMON_EXPECT(!RtOpen(other, &file));
+  return DdimonTestResult();
+}
+
+#else
+
+int main() {
+  std::fprintf(stderr, "Trace files are read only on Linux hosts.\n");
+  return kDdimonTestSkipped;
+}
+
+#endif
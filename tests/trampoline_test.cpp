@@ -0,0 +1,243 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Runs trampolines built by ShcBuildTrampoline() on an x64 host, and frees
+/// them while threads keep entering them as hook handlers and as threads
+/// redirected by ShHandleBreakpoint() do. A freed trampoline is made
+/// inaccessible rather than unmapped, so that a thread still executing it
+/// crashes the test instead of running reused memory.
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "shadow_hook_core.h"
+#include "test_util.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define DDIMON_TRAMPOLINE_TEST_SUPPORTED 1
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const ULONG kTpThreadCount = 8;
+static const ULONG kTpRoundCount = 200;
+static const ULONG kTpStolenSize = 3;
+
+// A function returning -1 for 0 and x + 1 otherwise. Its first instruction
+// sets flags consumed after the trampoline returns to it.
+static const UCHAR kTpTarget[] = {
+    0x48, 0x85, 0xff,                          // test    rdi, rdi
+    0x74, 0x05,                                // je      minus_one
+    0x48, 0x8d, 0x47, 0x01,                    // lea     rax, [rdi+1]
+    0xc3,                                      // ret
+    0x48, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff,  // mov rax, -1 (minus_one)
+    0xc3,                                      // ret
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+using TpFunction = long (*)(long);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+#if defined(DDIMON_TRAMPOLINE_TEST_SUPPORTED)
+
+// The trampoline threads enter, or nullptr while it is being freed
+static std::atomic<ShcTrampoline*> g_tp_current;
+
+// Threads between looking up g_tp_current and leaving a handler, as
+// in_flight_counters, and threads in the emulated VM-exit handler
+static std::atomic<ULONG> g_tp_handlers;
+static std::atomic<ULONG> g_tp_vm_exits;
+static std::atomic<bool> g_tp_stop;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns executable and writable memory of a page
+static UCHAR* TpAllocatePage() {
+  const auto page = mmap(nullptr, getpagesize(),
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (page == MAP_FAILED) ? nullptr : static_cast<UCHAR*>(page);
+}
+
+// Enters trampolines as handlers calling original functions do, or as
+// threads redirected by ShHandleBreakpoint() do
+static void TpCall(ULONG thread_index) {
+  for (ULONG64 i = 0; !g_tp_stop.load(); ++i) {
+    const auto as_handler = (i + thread_index) & 1;
+    const auto argument = static_cast<long>(i & 3);
+    void* entry = nullptr;
+
+    // Stay away while no hook is installed, as hooks being disabled would
+    if (!g_tp_current.load()) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (as_handler) {
+      g_tp_handlers.fetch_add(1);
+      const auto trampoline = g_tp_current.load();
+      if (trampoline) {
+        entry = ShcGetTrampolineEntry(trampoline);
+        if ((i & 15) == 0) {
+          sched_yield();
+        }
+        const auto result = reinterpret_cast<TpFunction>(entry)(argument);
+        DDIMON_EXPECT(result == (argument ? argument + 1 : -1));
+      }
+      g_tp_handlers.fetch_sub(1);
+      continue;
+    }
+
+    // Count the thread in the trampoline while the trampoline cannot be
+    // freed, as in VMX-root mode, then run it after that is no longer true
+    g_tp_vm_exits.fetch_add(1);
+    const auto trampoline = g_tp_current.load();
+    if (trampoline) {
+      __atomic_add_fetch(&trampoline->in_flight, 1, __ATOMIC_SEQ_CST);
+      entry = ShcGetCountedTrampolineEntry(trampoline);
+    }
+    g_tp_vm_exits.fetch_sub(1);
+    if (entry) {
+      if ((i & 15) == 1) {
+        sched_yield();
+      }
+      const auto result = reinterpret_cast<TpFunction>(entry)(argument);
+      DDIMON_EXPECT(result == (argument ? argument + 1 : -1));
+    }
+  }
+}
+
+// Checks that both entries run the stolen instruction, preserve its flags and
+// leave the count as it was
+static void TpTestEntries(UCHAR* target, void* exit_code) {
+  const auto page = TpAllocatePage();
+  DDIMON_EXPECT(page);
+  if (!page) {
+    return;
+  }
+  const auto trampoline = reinterpret_cast<ShcTrampoline*>(page);
+  DDIMON_EXPECT(ShcBuildTrampoline(trampoline, target, kTpStolenSize,
+                                   target + kTpStolenSize, exit_code));
+  DDIMON_EXPECT(ShcGetTrampolineFromEntry(ShcGetTrampolineEntry(trampoline)) ==
+                trampoline);
+
+  const auto entry =
+      reinterpret_cast<TpFunction>(ShcGetTrampolineEntry(trampoline));
+  DDIMON_EXPECT(entry(0) == -1);
+  DDIMON_EXPECT(entry(41) == 42);
+  DDIMON_EXPECT(trampoline->in_flight == 0);
+
+  const auto counted_entry =
+      reinterpret_cast<TpFunction>(ShcGetCountedTrampolineEntry(trampoline));
+  trampoline->in_flight = 1;
+  DDIMON_EXPECT(counted_entry(0) == -1);
+  DDIMON_EXPECT(trampoline->in_flight == 0);
+
+  // Stolen instructions longer than any x64 instruction do not fit
+  UCHAR long_code[sizeof(trampoline->code)] = {};
+  DDIMON_EXPECT(!ShcBuildTrampoline(trampoline, long_code, sizeof(long_code),
+                                    target, exit_code));
+  munmap(page, getpagesize());
+}
+
+// Replaces trampolines while threads run them, freeing each one as
+// ShWaitForHookHandlers() and ShFreeTrampoline() do
+static void TpTestFreeWhileRunning(UCHAR* target, void* exit_code) {
+  std::vector<std::thread> threads;
+  for (auto i = 0ul; i < kTpThreadCount; ++i) {
+    threads.emplace_back(TpCall, i);
+  }
+
+  std::vector<UCHAR*> freed_pages;
+  for (auto round = 0ul; round < kTpRoundCount; ++round) {
+    const auto page = TpAllocatePage();
+    DDIMON_EXPECT(page);
+    if (!page) {
+      break;
+    }
+    const auto trampoline = reinterpret_cast<ShcTrampoline*>(page);
+    ShcBuildTrampoline(trampoline, target, kTpStolenSize,
+                       target + kTpStolenSize, exit_code);
+    g_tp_current.store(trampoline);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+
+    // Uninstall the hook and wait for handlers and VM-exit handlers
+    g_tp_current.store(nullptr);
+    while (g_tp_handlers.load() || g_tp_vm_exits.load()) {
+      std::this_thread::yield();
+    }
+
+    // Wait for threads in the trampoline, and free it
+    while (__atomic_load_n(&trampoline->in_flight, __ATOMIC_SEQ_CST)) {
+      std::this_thread::yield();
+    }
+    mprotect(page, getpagesize(), PROT_NONE);
+    freed_pages.push_back(page);
+  }
+
+  g_tp_stop.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto page : freed_pages) {
+    munmap(page, getpagesize());
+  }
+}
+
+int main() {
+  const auto exit_page = TpAllocatePage();
+  const auto target = TpAllocatePage();
+  if (!exit_page || !target) {
+    std::fprintf(stderr, "Executable memory is not available.\n");
+    return kDdimonTestSkipped;
+  }
+  const auto exit_code = ShcMakeTrampolineExit();
+  for (auto i = 0ul; i < sizeof(exit_code.code); ++i) {
+    exit_page[i] = exit_code.code[i];
+  }
+  for (auto i = 0ul; i < sizeof(kTpTarget); ++i) {
+    target[i] = kTpTarget[i];
+  }
+
+  TpTestEntries(target, exit_page);
+  TpTestFreeWhileRunning(target, exit_page);
+  return DdimonTestResult();
+}
+
+#else
+
+int main() {
+  std::fprintf(stderr, "Trampolines run only on x64 Linux hosts.\n");
+  return kDdimonTestSkipped;
+}
+
+#endif
@@ -0,0 +1,189 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Tests unwind caches as StpWalkStack() uses them: a cached address returns
+/// what the lookup routine returned without calling it again, including for
+/// code outside any image, invalidation makes every address looked up again,
+/// evicted addresses are looked up again correctly, and threads looking up
+/// addresses at once never see a torn entry.
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include "test_util.h"
+#include "unwind_cache.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// Code of a synthetic image, whose functions are 0x100 bytes each
+static const ULONG64 kUtImageBase = 0xfffff80000000000ull;
+static const ULONG64 kUtImageSize = 0x1000000;
+
+static const ULONG kUtThreadCount = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A lookup routine's view of loaded images
+struct UtImages {
+  ULONG64 image_base;
+  ULONG64 lookup_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Returns a function entry standing for the function of pc, or nullptr
+// outside the image
+static void* UtLookup(ULONG64 pc, ULONG64* image_base, void* context) {
+  const auto images = static_cast<UtImages*>(context);
+  images->lookup_count++;
+  if (pc < images->image_base || pc >= images->image_base + kUtImageSize) {
+    *image_base = 0;
+    return nullptr;
+  }
+  *image_base = images->image_base;
+  return reinterpret_cast<void*>(0x10000 + (pc - images->image_base) / 0x100);
+}
+
+// Does what UtLookup() does but without counting, so that threads may share
+// it
+static void* UtLookupShared(ULONG64 pc, ULONG64* image_base, void* context) {
+  UtImages images = *static_cast<const UtImages*>(context);
+  return UtLookup(pc, image_base, &images);
+}
+
+static std::unique_ptr<UcCache> UtMakeCache() {
+  std::unique_ptr<UcCache> cache(new UcCache());
+  UcInitialize(cache.get());
+  return cache;
+}
+
+// Expects a lookup of pc to give what UtLookup() gives
+static void UtExpectLookup(UcCache* cache, UtImages* images, ULONG64 pc) {
+  UtImages expected_images = *images;
+  ULONG64 expected_base = 0;
+  const auto expected = UtLookup(pc, &expected_base, &expected_images);
+  ULONG64 image_base = 1;
+  DDIMON_EXPECT(UcLookup(cache, pc, &image_base, UtLookup, images) ==
+                expected);
+  DDIMON_EXPECT(image_base == expected_base);
+}
+
+// A second lookup of an address is a hit, also outside any image
+static void UtTestHits() {
+  auto cache = UtMakeCache();
+  UtImages images = {kUtImageBase, 0};
+  const ULONG64 pcs[] = {kUtImageBase + 0x1234, kUtImageBase + 0x1235,
+                         kUtImageBase + 0x55000, 0x7ff612340000ull};
+  for (const auto pc : pcs) {
+    UtExpectLookup(cache.get(), &images, pc);
+  }
+  DDIMON_EXPECT(images.lookup_count == 4);
+  DDIMON_EXPECT(cache->miss_count == 4);
+  for (const auto pc : pcs) {
+    UtExpectLookup(cache.get(), &images, pc);
+  }
+  DDIMON_EXPECT(images.lookup_count == 4);
+  DDIMON_EXPECT(cache->hit_count == 4);
+}
+
+// Addresses are looked up again after invalidation, and give results of an
+// image loaded at another address
+static void UtTestInvalidate() {
+  auto cache = UtMakeCache();
+  UtImages images = {kUtImageBase, 0};
+  const auto pc = kUtImageBase + kUtImageSize - 1;
+  UtExpectLookup(cache.get(), &images, pc);
+  UtExpectLookup(cache.get(), &images, pc);
+  DDIMON_EXPECT(images.lookup_count == 1);
+
+  images.image_base = kUtImageBase + 0x100;
+  UcInvalidate(cache.get());
+  UtExpectLookup(cache.get(), &images, pc);
+  UtExpectLookup(cache.get(), &images, pc);
+  DDIMON_EXPECT(images.lookup_count == 2);
+
+  // The generation never becomes the one zeroed entries have
+  cache->generation = -1;
+  UcInvalidate(cache.get());
+  DDIMON_EXPECT(cache->generation == 1);
+}
+
+// More addresses than entries evict each other but are looked up correctly,
+// and each lookup is either a hit or a miss
+static void UtTestEviction() {
+  auto cache = UtMakeCache();
+  UtImages images = {kUtImageBase, 0};
+  for (auto pass = 0; pass < 2; ++pass) {
+    for (auto i = 0ul; i < kUcCacheSize * 4; ++i) {
+      UtExpectLookup(cache.get(), &images, kUtImageBase + i * 0x40);
+    }
+  }
+  DDIMON_EXPECT(cache->hit_count + cache->miss_count == kUcCacheSize * 8);
+  DDIMON_EXPECT(cache->miss_count == images.lookup_count);
+  DDIMON_EXPECT(cache->miss_count > kUcCacheSize * 4);
+}
+
+// Threads looking up and replacing the same entries at once get correct
+// results
+static void UtTestThreads() {
+  auto cache = UtMakeCache();
+  UtImages images = {kUtImageBase, 0};
+  std::vector<std::thread> threads;
+  ULONG wrong_counts[kUtThreadCount] = {};
+  for (auto t = 0ul; t < kUtThreadCount; ++t) {
+    threads.emplace_back([&, t] {
+      for (auto i = 0ul; i < 200000; ++i) {
+        const auto pc = kUtImageBase + ((i * 7 + t) % 20000) * 0x80;
+        ULONG64 image_base = 0;
+        const auto function_entry = UcLookup(cache.get(), pc, &image_base,
+                                             UtLookupShared, &images);
+        ULONG64 expected_base = 0;
+        const auto expected = UtLookupShared(pc, &expected_base, &images);
+        wrong_counts[t] +=
+            function_entry != expected || image_base != expected_base;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (const auto wrong_count : wrong_counts) {
+    DDIMON_EXPECT(wrong_count == 0);
+  }
+  DDIMON_EXPECT(cache->hit_count + cache->miss_count ==
+                kUtThreadCount * 200000ull);
+}
+
+int main() {
+  UtTestHits();
+  UtTestInvalidate();
+  UtTestEviction();
+  UtTestThreads();
+  return DdimonTestResult();
+}
@@ -0,0 +1,256 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Prints statistics of a running DdiMon as text by sending IOCTLs to its
+/// control device. Must be run by an administrator.
+///
+/// Usage: ddimon_stat [exits|callers|latencies]
+///        ddimon_stat enable|disable NAME
+///        ddimon_stat scope NAME [PID...]
+
+#include <windows.h>
+#include <winioctl.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "ddi_mon_ioctl.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// An initial size of an output buffer, doubled while it is too small
+static const DWORD kDsInitialBufferSize = 0x10000;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool DsQuery(HANDLE device, DWORD ioctl, std::vector<UCHAR>* output);
+
+static int DsPrintExits(HANDLE device);
+
+static int DsPrintCallers(HANDLE device);
+
+static int DsPrintLatencies(HANDLE device);
+
+static int DsSetTargetState(HANDLE device, const char* name, bool enable);
+
+static int DsSetTargetScope(HANDLE device, const char* name, int pid_count,
+                            char* pids[]);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+int main(int argc, char* argv[]) {
+  const char* command = (argc > 1) ? argv[1] : "exits";
+  const char* name = (argc > 2) ? argv[2] : nullptr;
+  int (*print)(HANDLE) = nullptr;
+  if (!std::strcmp(command, "exits")) {
+    print = DsPrintExits;
+  } else if (!std::strcmp(command, "callers")) {
+    print = DsPrintCallers;
+  } else if (!std::strcmp(command, "latencies")) {
+    print = DsPrintLatencies;
+  } else if ((std::strcmp(command, "enable") &&
+              std::strcmp(command, "disable") &&
+              std::strcmp(command, "scope")) ||
+             !name) {
+    std::fprintf(stderr,
+                 "usage: %s [exits|callers|latencies]\n"
+                 "       %s enable|disable NAME\n"
+                 "       %s scope NAME [PID...]\n",
+                 argv[0], argv[0], argv[0]);
+    return 2;
+  }
+
+  const auto device =
+      CreateFileW(DDIMON_CONTROL_DEVICE_PATH, GENERIC_READ | GENERIC_WRITE, 0,
+                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (device == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "%ls could not be opened (%lu).\n",
+                 DDIMON_CONTROL_DEVICE_PATH, GetLastError());
+    return 1;
+  }
+  auto result = 0;
+  if (print) {
+    result = print(device);
+  } else if (!std::strcmp(command, "scope")) {
+    result = DsSetTargetScope(device, name, argc - 3, argv + 3);
+  } else {
+    result = DsSetTargetState(device, name, !std::strcmp(command, "enable"));
+  }
+  CloseHandle(device);
+  return result;
+}
+
+// Sends an IOCTL returning a snapshot, growing output until all records fit
+static bool DsQuery(HANDLE device, DWORD ioctl, std::vector<UCHAR>* output) {
+  output->resize(kDsInitialBufferSize);
+  for (;;) {
+    DWORD returned = 0;
+    if (DeviceIoControl(device, ioctl, nullptr, 0, output->data(),
+                        static_cast<DWORD>(output->size()), &returned,
+                        nullptr)) {
+      return true;
+    }
+    if (GetLastError() != ERROR_MORE_DATA) {
+      std::fprintf(stderr, "IOCTL %08lx failed (%lu).\n", ioctl,
+                   GetLastError());
+      return false;
+    }
+    output->resize(output->size() * 2);
+  }
+}
+
+// Prints VM-exits of each hook and page with average cycles to handle them
+static int DsPrintExits(HANDLE device) {
+  std::vector<UCHAR> output;
+  if (!DsQuery(device, IOCTL_DDIMON_QUERY_EXIT_STATISTICS, &output)) {
+    return 1;
+  }
+
+  const auto snapshot = reinterpret_cast<const DdimonExitSnapshot*>(
+      output.data());
+  const auto average = [](ULONG64 cycles, ULONG64 count) {
+    return (count) ? cycles / count : 0;
+  };
+  std::printf("%-4s %-18s %12s %8s %12s %8s %12s %8s %8s %8s\n", "kind",
+              "address", "#BP", "cycles", "EPT", "cycles", "MTF", "cycles",
+              "demoted", "promoted");
+  for (auto i = 0ul; i < snapshot->record_count; ++i) {
+    const auto& record = snapshot->records[i];
+    std::printf(
+        "%-4s %018llx %12llu %8llu %12llu %8llu %12llu %8llu %8llu %8llu\n",
+        (record.kind == kDdimonExitStatisticsHook) ? "hook" : "page",
+        record.address, record.breakpoint_count,
+        average(record.breakpoint_cycles, record.breakpoint_count),
+        record.ept_violation_count,
+        average(record.ept_violation_cycles, record.ept_violation_count),
+        record.mtf_count, average(record.mtf_cycles, record.mtf_count),
+        record.demotion_count, record.promotion_count);
+  }
+  return 0;
+}
+
+// Prints calls counted by counting hooks for each caller
+static int DsPrintCallers(HANDLE device) {
+  std::vector<UCHAR> output;
+  if (!DsQuery(device, IOCTL_DDIMON_QUERY_CALLERS, &output)) {
+    return 1;
+  }
+
+  const auto snapshot = reinterpret_cast<const DdimonCallerSnapshot*>(
+      output.data());
+  std::printf("%-18s %-18s %12s\n", "hook", "caller", "calls");
+  for (auto i = 0ul; i < snapshot->record_count; ++i) {
+    const auto& record = snapshot->records[i];
+    std::printf("%018llx %018llx %12llu\n", record.hook_address,
+                record.return_address, record.call_count);
+  }
+  return 0;
+}
+
+// Prints latency percentiles of hook handlers and original functions
+static int DsPrintLatencies(HANDLE device) {
+  std::vector<UCHAR> output;
+  if (!DsQuery(device, IOCTL_DDIMON_QUERY_LATENCIES, &output)) {
+    return 1;
+  }
+
+  const auto snapshot = reinterpret_cast<const DdimonLatencySnapshot*>(
+      output.data());
+  std::printf("%-18s %-8s %12s %10s %10s %10s %10s\n", "hook", "kind",
+              "count", "p50", "p99", "p99.9", "max");
+  for (auto i = 0ul; i < snapshot->record_count; ++i) {
+    const auto& record = snapshot->records[i];
+    std::printf("%018llx %-8s %12llu %10llu %10llu %10llu %10llu\n",
+                record.hook_address,
+                (record.kind == kDdimonLatencyHandler) ? "handler"
+                                                       : "original",
+                record.count, record.p50, record.p99, record.p999,
+                record.max);
+  }
+  return 0;
+}
+
+// Enables or disables a target by its name
+static int DsSetTargetState(HANDLE device, const char* name, bool enable) {
+  DdimonTargetState state = {};
+  if (std::strlen(name) > DDIMON_MAX_TARGET_NAME_LENGTH) {
+    std::fprintf(stderr, "%s is longer than %d characters.\n", name,
+                 DDIMON_MAX_TARGET_NAME_LENGTH);
+    return 2;
+  }
+  std::strcpy(state.name, name);
+  state.enable = enable;
+  DWORD returned = 0;
+  if (!DeviceIoControl(device, IOCTL_DDIMON_SET_TARGET_STATE, &state,
+                       sizeof(state), nullptr, 0, &returned, nullptr)) {
+    std::fprintf(stderr, "%s could not be %s (%lu).\n", name,
+                 (enable) ? "enabled" : "disabled", GetLastError());
+    return 1;
+  }
+  return 0;
+}
+
+// Limits hooks of a target to processes, or to none of them when no process
+// ID is given
+static int DsSetTargetScope(HANDLE device, const char* name, int pid_count,
+                            char* pids[]) {
+  if (std::strlen(name) > DDIMON_MAX_TARGET_NAME_LENGTH) {
+    std::fprintf(stderr, "%s is longer than %d characters.\n", name,
+                 DDIMON_MAX_TARGET_NAME_LENGTH);
+    return 2;
+  }
+  if (pid_count > DDIMON_MAX_TARGET_SCOPE_PROCESSES) {
+    std::fprintf(stderr, "No more than %d processes can be given.\n",
+                 DDIMON_MAX_TARGET_SCOPE_PROCESSES);
+    return 2;
+  }
+
+  std::vector<UCHAR> input(FIELD_OFFSET(DdimonTargetScope, process_ids) +
+                           sizeof(ULONG64) * pid_count);
+  const auto scope = reinterpret_cast<DdimonTargetScope*>(input.data());
+  std::strcpy(scope->name, name);
+  scope->process_id_count = pid_count;
+  for (auto i = 0; i < pid_count; ++i) {
+    char* end = nullptr;
+    scope->process_ids[i] = std::strtoull(pids[i], &end, 0);
+    if (*end || end == pids[i]) {
+      std::fprintf(stderr, "%s is not a process ID.\n", pids[i]);
+      return 2;
+    }
+  }
+  DWORD returned = 0;
+  if (!DeviceIoControl(device, IOCTL_DDIMON_SET_TARGET_SCOPE, input.data(),
+                       static_cast<DWORD>(input.size()), nullptr, 0, &returned,
+                       nullptr)) {
+    std::fprintf(stderr, "A scope of %s could not be set (%lu).\n", name,
+                 GetLastError());
+    return 1;
+  }
+  return 0;
+}
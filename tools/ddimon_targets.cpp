@@ -0,0 +1,146 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Compiles a text spec into a target table, or validates a table and prints
+/// it as a spec. See target_spec.h for the spec format.
+///
+/// Usage: ddimon_targets compile SPEC TABLE
+///        ddimon_targets check TABLE
+///
+/// A compiled table is stored as the REG_BINARY value "Targets" of the
+/// service. See README.md.
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "target_spec.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static int DtgUsage(const char* program);
+
+static bool DtgReadFile(const char* path, std::string* contents);
+
+static int DtgCompile(const char* spec_path, const char* table_path);
+
+static int DtgCheck(const char* table_path);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+int main(int argc, char* argv[]) {
+  if (argc == 4 && !std::strcmp(argv[1], "compile")) {
+    return DtgCompile(argv[2], argv[3]);
+  }
+  if (argc == 3 && !std::strcmp(argv[1], "check")) {
+    return DtgCheck(argv[2]);
+  }
+  return DtgUsage(argv[0]);
+}
+
+static int DtgUsage(const char* program) {
+  std::fprintf(stderr,
+               "usage: %s compile SPEC TABLE\n"
+               "       %s check TABLE\n",
+               program, program);
+  return 2;
+}
+
+static bool DtgReadFile(const char* path, std::string* contents) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  contents->assign(std::istreambuf_iterator<char>(file),
+                   std::istreambuf_iterator<char>());
+  return !file.bad();
+}
+
+// Compiles a spec and writes a table only when all records are valid
+static int DtgCompile(const char* spec_path, const char* table_path) {
+  std::string spec;
+  if (!DtgReadFile(spec_path, &spec)) {
+    std::fprintf(stderr, "%s could not be read.\n", spec_path);
+    return 1;
+  }
+
+  std::vector<UCHAR> table;
+  TsError error = {};
+  if (!TsCompile(spec, &table, &error)) {
+    std::fprintf(stderr, "%s:%lu: %s.\n", spec_path,
+                 static_cast<unsigned long>(error.line),
+                 error.message.c_str());
+    return 1;
+  }
+
+  std::ofstream file(table_path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(table.data()), table.size());
+  if (!file.flush()) {
+    std::fprintf(stderr, "%s could not be written.\n", table_path);
+    return 1;
+  }
+  const auto header = reinterpret_cast<const TtFileHeader*>(table.data());
+  std::printf("%s: %u records, %lu bytes, checksum %08lx\n", table_path,
+              header->record_count,
+              static_cast<unsigned long>(header->total_size),
+              static_cast<unsigned long>(header->checksum));
+  return 0;
+}
+
+// Validates a table as the driver does and prints it as a spec
+static int DtgCheck(const char* table_path) {
+  std::string table;
+  if (!DtgReadFile(table_path, &table)) {
+    std::fprintf(stderr, "%s could not be read.\n", table_path);
+    return 1;
+  }
+  if (table.size() > kTtMaxTableSize) {
+    std::fprintf(stderr, "%s: %s.\n", table_path,
+                 TtcGetErrorMessage(kTtcErrorTableSize));
+    return 1;
+  }
+
+  std::string spec;
+  TsError error = {};
+  if (!TsDecompile(table.data(), static_cast<ULONG>(table.size()), &spec,
+                   &error)) {
+    if (error.line) {
+      std::fprintf(stderr, "%s: record #%lu: %s.\n", table_path,
+                   static_cast<unsigned long>(error.line),
+                   error.message.c_str());
+    } else {
+      std::fprintf(stderr, "%s: %s.\n", table_path, error.message.c_str());
+    }
+    return 1;
+  }
+  std::fputs(spec.c_str(), stdout);
+  return 0;
+}
@@ -0,0 +1,376 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Prints events in a trace file written by DdiMon, or aggregates of them, on
+/// a Linux host.
+///
+/// Usage: ddimon_trace [OPTION...] events|summary|tags|callers FILE
+///
+///   --processor N      Only events of the processor
+///   --from TSC         Only events at or after TSC
+///   --to TSC           Only events at or before TSC
+///   --kind KIND        Only events of allocate, free or record. Repeatable.
+///   --tag TAG          Only events of the pool tag, as it reads in memory
+///   --caller A[-B]     Only events from a caller address, or within A-B
+///   --limit N          Prints at most N events, tags or callers
+
+#include <getopt.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "ddi_mon_schema.h"
+#include "trace_reader.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+static const char* const kDtKindNames[] = {"?", "allocate", "free", "record"};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A state of the events command
+struct DtPrintContext {
+  ULONG64 limit;
+  ULONG64 printed_count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static int DtUsage(const char* program);
+
+static bool DtParseInteger(const char* text, ULONG64* value);
+
+static bool DtParseFilterOption(int option, const char* argument,
+                                TrFilter* filter);
+
+static void DtFormatTag(ULONG tag, char (&text)[5]);
+
+static bool DtPrintEvent(void* context, USHORT processor,
+                         const TfEvent& event);
+
+static void DtPrintRecord(const TfEvent& event);
+
+static void DtPrintSummary(const TrFile& file, const TrAggregate& aggregate,
+                           const TrReadStatistics& statistics);
+
+static void DtPrintTags(const TrAggregate& aggregate, ULONG64 limit);
+
+static void DtPrintCallers(const TrAggregate& aggregate, ULONG64 limit);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+int main(int argc, char* argv[]) {
+  static const option kOptions[] = {
+      {"processor", required_argument, nullptr, 'p'},
+      {"from", required_argument, nullptr, 'f'},
+      {"to", required_argument, nullptr, 't'},
+      {"kind", required_argument, nullptr, 'k'},
+      {"tag", required_argument, nullptr, 'g'},
+      {"caller", required_argument, nullptr, 'c'},
+      {"limit", required_argument, nullptr, 'l'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  TrFilter filter = {};
+  TrInitializeFilter(&filter);
+  ULONG64 limit = ~0ull;
+  auto kinds_given = false;
+  for (;;) {
+    const auto option = getopt_long(argc, argv, "", kOptions, nullptr);
+    if (option == -1) {
+      break;
+    }
+    if (option == 'l') {
+      if (!DtParseInteger(optarg, &limit)) {
+        return DtUsage(argv[0]);
+      }
+      continue;
+    }
+    if (option == 'k' && !kinds_given) {
+      filter.kinds = 0;
+      kinds_given = true;
+    }
+    if (!DtParseFilterOption(option, optarg, &filter)) {
+      return DtUsage(argv[0]);
+    }
+  }
+  if (argc - optind != 2) {
+    return DtUsage(argv[0]);
+  }
+  const auto command = argv[optind];
+  const auto path = argv[optind + 1];
+  if (std::strcmp(command, "events") && std::strcmp(command, "summary") &&
+      std::strcmp(command, "tags") && std::strcmp(command, "callers")) {
+    return DtUsage(argv[0]);
+  }
+
+  TrFile file = {};
+  const char* error = nullptr;
+  if (!TrOpenFile(path, &file, &error)) {
+    std::fprintf(stderr, "%s could not be read: %s.\n", path, error);
+    return 1;
+  }
+
+  if (!std::strcmp(command, "events")) {
+    DtPrintContext context = {limit, 0};
+    std::printf("%-20s %4s %-8s %-18s %-18s %10s %-4s\n", "tsc", "cpu",
+                "kind", "caller", "argument", "size", "tag");
+    TrReadEvents(file, filter, DtPrintEvent, &context);
+  } else {
+    TrAggregate aggregate;
+    const auto statistics = TrAggregateEvents(file, filter, &aggregate);
+    if (!std::strcmp(command, "summary")) {
+      DtPrintSummary(file, aggregate, statistics);
+    } else if (!std::strcmp(command, "tags")) {
+      DtPrintTags(aggregate, limit);
+    } else {
+      DtPrintCallers(aggregate, limit);
+    }
+  }
+  TrCloseFile(&file);
+  return 0;
+}
+
+static int DtUsage(const char* program) {
+  std::fprintf(stderr,
+               "usage: %s [--processor N] [--from TSC] [--to TSC] "
+               "[--kind allocate|free|record]...\n"
+               "       [--tag TAG] [--caller A[-B]] [--limit N] "
+               "events|summary|tags|callers FILE\n",
+               program);
+  return 2;
+}
+
+// Parses a decimal or 0x-prefixed hexadecimal integer
+static bool DtParseInteger(const char* text, ULONG64* value) {
+  char* end = nullptr;
+  *value = std::strtoull(text, &end, 0);
+  return end != text && !*end;
+}
+
+// Applies an option narrowing events to read
+static bool DtParseFilterOption(int option, const char* argument,
+                                TrFilter* filter) {
+  ULONG64 value = 0;
+  switch (option) {
+    case 'p':
+      if (!DtParseInteger(argument, &value) || value >= kTrAnyProcessor) {
+        return false;
+      }
+      filter->processor = static_cast<ULONG>(value);
+      return true;
+    case 'f':
+      return DtParseInteger(argument, &filter->min_tsc);
+    case 't':
+      return DtParseInteger(argument, &filter->max_tsc);
+    case 'k':
+      for (ULONG kind = kTfEventAllocatePool; kind <= kTfEventRecord; ++kind) {
+        if (!std::strcmp(argument, kDtKindNames[kind])) {
+          filter->kinds |= 1ul << kind;
+          return true;
+        }
+      }
+      return false;
+    case 'g':
+      if (std::strlen(argument) != 4) {
+        return false;
+      }
+      filter->match_tag = true;
+      filter->tag = DdimonMakeTag(argument[0], argument[1], argument[2],
+                                  argument[3]);
+      return true;
+    case 'c': {
+      char first[32] = {};
+      const auto separator = std::strchr(argument, '-');
+      const auto length =
+          (separator) ? static_cast<size_t>(separator - argument)
+                      : std::strlen(argument);
+      if (length >= sizeof(first)) {
+        return false;
+      }
+      std::memcpy(first, argument, length);
+      if (!DtParseInteger(first, &filter->min_address)) {
+        return false;
+      }
+      filter->max_address = filter->min_address;
+      return !separator || DtParseInteger(separator + 1, &filter->max_address);
+    }
+  }
+  return false;
+}
+
+// Formats a pool tag as its characters in memory
+static void DtFormatTag(ULONG tag, char (&text)[5]) {
+  for (auto i = 0; i < 4; ++i) {
+    const auto c = static_cast<char>(tag >> (i * 8));
+    text[i] = (c >= 0x20 && c < 0x7f) ? c : '.';
+  }
+  text[4] = '\0';
+}
+
+// Prints an event and fields of its record
+static bool DtPrintEvent(void* context, USHORT processor,
+                         const TfEvent& event) {
+  const auto print_context = static_cast<DtPrintContext*>(context);
+  if (print_context->printed_count++ == print_context->limit) {
+    return false;
+  }
+  char tag[5];
+  DtFormatTag(event.tag, tag);
+  std::printf("%-20llu %4u %-8s %018llx %018llx %10llu %-4s",
+              static_cast<unsigned long long>(event.tsc), processor,
+              kDtKindNames[(event.kind <= kTfEventRecord) ? event.kind : 0],
+              static_cast<unsigned long long>(event.address),
+              static_cast<unsigned long long>(event.argument),
+              static_cast<unsigned long long>(event.size), tag);
+  if (event.kind == kTfEventRecord) {
+    DtPrintRecord(event);
+  }
+  std::printf("\n");
+  return true;
+}
+
+// Prints fields of a record with its schema in kDdimonSchemas
+static void DtPrintRecord(const TfEvent& event) {
+  const auto schema = EsFindSchema(
+      kDdimonSchemas, sizeof(kDdimonSchemas) / sizeof(kDdimonSchemas[0]),
+      static_cast<USHORT>(event.argument));
+  if (!schema) {
+    std::printf(" (unknown schema)");
+    return;
+  }
+
+  std::printf(" %s", schema->name);
+  EsDecoder decoder = {};
+  EsInitializeDecoder(&decoder, schema, event.record,
+                      static_cast<ULONG>(event.size));
+  EsValue value = {};
+  for (auto i = 0; EsDecodeField(&decoder, &value); ++i) {
+    std::printf(" %s=", schema->field_names[i]);
+    switch (value.type) {
+      case kEsFieldInteger:
+      case kEsFieldPointer:
+        std::printf("%llx", static_cast<unsigned long long>(value.integer));
+        break;
+      case kEsFieldTag: {
+        char tag[5];
+        DtFormatTag(static_cast<ULONG>(value.integer), tag);
+        std::printf("%s", tag);
+        break;
+      }
+      case kEsFieldString:
+        for (auto k = 0ul; k + 1 < value.size; k += 2) {
+          const auto c = value.data[k];
+          std::printf("%c", (c >= 0x20 && c < 0x7f && !value.data[k + 1])
+                                ? c
+                                : '?');
+        }
+        break;
+      default:
+        for (auto k = 0ul; k < value.size; ++k) {
+          std::printf("%02x", value.data[k]);
+        }
+        break;
+    }
+  }
+}
+
+static void DtPrintSummary(const TrFile& file, const TrAggregate& aggregate,
+                           const TrReadStatistics& statistics) {
+  std::printf("index:     %s\n", (file.index) ? "present" : "missing");
+  std::printf("blocks:    %llu (%llu read, %llu skipped, %llu corrupted)\n",
+              static_cast<unsigned long long>(file.block_count),
+              static_cast<unsigned long long>(statistics.read_block_count),
+              static_cast<unsigned long long>(statistics.skipped_block_count),
+              static_cast<unsigned long long>(
+                  statistics.corrupted_block_count));
+  std::printf("dropped:   %llu\n",
+              static_cast<unsigned long long>(file.dropped_count));
+  std::printf("events:    %llu\n",
+              static_cast<unsigned long long>(aggregate.event_count));
+  if (!aggregate.event_count) {
+    return;
+  }
+  std::printf("tsc:       %llu - %llu\n",
+              static_cast<unsigned long long>(aggregate.first_tsc),
+              static_cast<unsigned long long>(aggregate.last_tsc));
+  for (ULONG kind = kTfEventAllocatePool; kind <= kTfEventRecord; ++kind) {
+    std::printf("%-10s %llu\n", kDtKindNames[kind],
+                static_cast<unsigned long long>(aggregate.kind_counts[kind]));
+  }
+  for (const auto& processor : aggregate.processor_counts) {
+    std::printf("cpu %-6u %llu\n", processor.first,
+                static_cast<unsigned long long>(processor.second));
+  }
+  for (const auto& schema : aggregate.schema_counts) {
+    const auto found = EsFindSchema(
+        kDdimonSchemas, sizeof(kDdimonSchemas) / sizeof(kDdimonSchemas[0]),
+        static_cast<USHORT>(schema.first));
+    std::printf("%-24s %llu\n", (found) ? found->name : "(unknown schema)",
+                static_cast<unsigned long long>(schema.second));
+  }
+}
+
+// Prints tags in descending order of allocated bytes
+static void DtPrintTags(const TrAggregate& aggregate, ULONG64 limit) {
+  std::vector<std::pair<ULONG, TrTagStatistics>> tags(aggregate.tags.begin(),
+                                                      aggregate.tags.end());
+  std::sort(tags.begin(), tags.end(), [](const auto& a, const auto& b) {
+    return a.second.allocated_bytes > b.second.allocated_bytes;
+  });
+  std::printf("%-4s %12s %16s %12s\n", "tag", "allocations", "bytes",
+              "frees");
+  for (ULONG64 i = 0; i < tags.size() && i < limit; ++i) {
+    char tag[5];
+    DtFormatTag(tags[i].first, tag);
+    std::printf("%-4s %12llu %16llu %12llu\n", tag,
+                static_cast<unsigned long long>(
+                    tags[i].second.allocation_count),
+                static_cast<unsigned long long>(
+                    tags[i].second.allocated_bytes),
+                static_cast<unsigned long long>(tags[i].second.free_count));
+  }
+}
+
+// Prints callers in descending order of events
+static void DtPrintCallers(const TrAggregate& aggregate, ULONG64 limit) {
+  std::vector<std::pair<ULONG64, TrCallerStatistics>> callers(
+      aggregate.callers.begin(), aggregate.callers.end());
+  std::sort(callers.begin(), callers.end(), [](const auto& a, const auto& b) {
+    return a.second.event_count > b.second.event_count;
+  });
+  std::printf("%-18s %12s %16s\n", "caller", "events", "allocated");
+  for (ULONG64 i = 0; i < callers.size() && i < limit; ++i) {
+    std::printf("%018llx %12llu %16llu\n",
+                static_cast<unsigned long long>(callers[i].first),
+                static_cast<unsigned long long>(callers[i].second.event_count),
+                static_cast<unsigned long long>(
+                    callers[i].second.allocated_bytes));
+  }
+}
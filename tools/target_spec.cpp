@@ -0,0 +1,549 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to compile a text spec into a target table and back.
+
+#include "target_spec.h"
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A name of a record kind or a flag in a spec
+struct TspKeyword {
+  const char* text;
+  UCHAR value;
+};
+
+// A record being compiled from a line
+struct TspRecord {
+  TtRecordHeader header;
+  std::string name;
+  std::string handler;
+  std::vector<UCHAR> signature;
+  std::vector<UCHAR> patch;
+  std::string module;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool TspCompileLine(_In_ const std::string& line,
+                           _Out_ std::vector<UCHAR>* record,
+                           _Out_ std::string* message);
+
+static bool TspApplyField(_In_ const std::string& key,
+                          _In_ const std::string& value,
+                          _Inout_ TspRecord* record,
+                          _Out_ std::string* message);
+
+static bool TspParseInteger(_In_ const std::string& text, _In_ ULONG64 max,
+                            _Out_ ULONG64* value);
+
+static bool TspParseHex(_In_ const std::string& text,
+                        _Out_ std::vector<UCHAR>* bytes);
+
+static void TspAppendBytes(_In_reads_bytes_(size) const void* data,
+                           _In_ size_t size,
+                           _Inout_ std::vector<UCHAR>* bytes);
+
+static bool TspDecompileEntry(_In_ const TtEntry& entry,
+                              _Out_ std::string* line,
+                              _Out_ std::string* message);
+
+static std::string TspFormatHex(_In_reads_bytes_(length) const UCHAR* bytes,
+                                _In_ ULONG length);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static const TspKeyword kTspKinds[] = {
+    {"hook", kTtHook},
+    {"patch", kTtPatch},
+    {"bundle", kTtPatchBundle},
+    {"monitor", kTtMemMonitor},
+};
+
+static const TspKeyword kTspFlags[] = {
+    {"export", kTtFlagExport}, {"scan", kTtFlagScan},
+    {"count", kTtFlagCount},   {"callers", kTtFlagCallers},
+    {"wildcard", kTtFlagWildcard},
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Compiles a spec into a table. Returns false with the line of the first
+// invalid record and why it is invalid.
+_Use_decl_annotations_ bool TsCompile(const std::string& spec,
+                                      std::vector<UCHAR>* table,
+                                      TsError* error) {
+  table->clear();
+  *error = {};
+
+  std::vector<UCHAR> records;
+  ULONG record_count = 0;
+  std::istringstream stream(spec);
+  std::string line;
+  for (ULONG line_number = 1; std::getline(stream, line); ++line_number) {
+    std::vector<UCHAR> record;
+    if (!TspCompileLine(line, &record, &error->message)) {
+      error->line = line_number;
+      return false;
+    }
+    if (record.empty()) {
+      continue;
+    }
+
+    // Apply the same rules as the driver
+    ULONG offset = 0;
+    TtEntry entry = {};
+    const auto result =
+        TtcParseRecord(record.data(), static_cast<ULONG>(record.size()),
+                       kTtVersion, &offset, &entry);
+    if (result != kTtcSuccess) {
+      *error = {line_number, TtcGetErrorMessage(result)};
+      return false;
+    }
+    if (sizeof(TtFileHeader) + records.size() + record.size() >
+        kTtMaxTableSize) {
+      *error = {line_number, TtcGetErrorMessage(kTtcErrorTableSize)};
+      return false;
+    }
+    records.insert(records.end(), record.begin(), record.end());
+    record_count++;
+  }
+
+  // The size limit bounds record_count well below USHORT
+  const TtFileHeader header = {
+      kTtMagic, kTtVersion, static_cast<USHORT>(record_count),
+      static_cast<ULONG>(sizeof(TtFileHeader) + records.size()),
+      TtcComputeChecksum(records.data(), static_cast<ULONG>(records.size()))};
+  TspAppendBytes(&header, sizeof(header), table);
+  table->insert(table->end(), records.begin(), records.end());
+
+  const auto result =
+      TtcValidateHeader(table->data(), static_cast<ULONG>(table->size()));
+  if (result != kTtcSuccess) {
+    table->clear();
+    *error = {0, TtcGetErrorMessage(result)};
+    return false;
+  }
+  return true;
+}
+
+// Validates a table as the driver does and converts it into a spec, one line
+// for each record. Compiling the spec gives the same table for kTtVersion.
+_Use_decl_annotations_ bool TsDecompile(const void* table, ULONG size,
+                                        std::string* spec, TsError* error) {
+  spec->clear();
+  *error = {};
+
+  auto result = TtcValidateHeader(table, size);
+  if (result != kTtcSuccess) {
+    *error = {0, TtcGetErrorMessage(result)};
+    return false;
+  }
+
+  const auto header = static_cast<const TtFileHeader*>(table);
+  const auto payload = reinterpret_cast<const UCHAR*>(header + 1);
+  const auto payload_size = size - static_cast<ULONG>(sizeof(TtFileHeader));
+  ULONG offset = 0;
+  for (ULONG i = 0; i < header->record_count; ++i) {
+    TtEntry entry = {};
+    result = TtcParseRecord(payload, payload_size, header->version, &offset,
+                            &entry);
+    if (result != kTtcSuccess) {
+      *error = {i + 1, TtcGetErrorMessage(result)};
+      return false;
+    }
+    std::string line;
+    if (!TspDecompileEntry(entry, &line, &error->message)) {
+      error->line = i + 1;
+      return false;
+    }
+    *spec += line;
+    *spec += '\n';
+  }
+  if (offset != payload_size) {
+    *error = {0, "the table has bytes following the last record"};
+    return false;
+  }
+  return true;
+}
+
+// Converts a line into a record, or into no bytes when the line has only
+// spaces and a comment
+_Use_decl_annotations_ static bool TspCompileLine(const std::string& line,
+                                                  std::vector<UCHAR>* record,
+                                                  std::string* message) {
+  record->clear();
+  message->clear();
+
+  // '#' starts a comment only at a start of a word so that names may have it
+  auto text = line;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == '#' && (i == 0 || text[i - 1] == ' ' ||
+                           text[i - 1] == '\t')) {
+      text.resize(i);
+      break;
+    }
+  }
+  std::istringstream stream(text);
+  std::vector<std::string> words;
+  for (std::string word; stream >> word;) {
+    words.push_back(word);
+  }
+  if (words.empty()) {
+    return true;
+  }
+  if (words.size() < 2) {
+    *message = "a record needs a kind and a name";
+    return false;
+  }
+
+  TspRecord compiled = {};
+  for (const auto& kind : kTspKinds) {
+    if (words[0] == kind.text) {
+      compiled.header.kind = kind.value;
+    }
+  }
+  if (!compiled.header.kind) {
+    *message = "unknown kind " + words[0];
+    return false;
+  }
+  compiled.name = (words[1] == "-") ? std::string() : words[1];
+
+  std::set<std::string> given;
+  for (size_t i = 2; i < words.size(); ++i) {
+    const auto& word = words[i];
+    const auto separator = word.find('=');
+    const auto key = word.substr(0, separator);
+    if (key != "region" && !given.insert(key).second) {
+      *message = key + " is given more than once";
+      return false;
+    }
+    if (separator != std::string::npos) {
+      if (!TspApplyField(key, word.substr(separator + 1), &compiled,
+                         message)) {
+        return false;
+      }
+      continue;
+    }
+    auto known = false;
+    for (const auto& flag : kTspFlags) {
+      if (word == flag.text) {
+        compiled.header.flags |= flag.value;
+        known = true;
+      }
+    }
+    if (!known) {
+      *message = "unknown flag " + word;
+      return false;
+    }
+  }
+  if (given.count("rva") && given.count("address")) {
+    *message = "rva and address are exclusive";
+    return false;
+  }
+  // The driver cannot tell how many arguments to forward otherwise
+  if (compiled.header.kind == kTtHook && compiled.handler.empty() &&
+      !(compiled.header.flags & kTtFlagCount) && !given.count("args")) {
+    *message = "a hook only recording calls needs args";
+    return false;
+  }
+
+  // Check lengths before they are narrowed into the header
+  if (compiled.name.size() > kTtMaxNameLength ||
+      compiled.handler.size() > kTtMaxNameLength ||
+      compiled.module.size() > kTtMaxNameLength ||
+      compiled.signature.size() > kTtMaxSignatureLength ||
+      compiled.patch.size() > kTtMaxBundleLength) {
+    *message = TtcGetErrorMessage(kTtcErrorFieldLength);
+    return false;
+  }
+  auto& header = compiled.header;
+  header.name_length = static_cast<UCHAR>(compiled.name.size());
+  header.handler_length = static_cast<UCHAR>(compiled.handler.size());
+  header.signature_length = static_cast<UCHAR>(compiled.signature.size());
+  header.patch_length = static_cast<USHORT>(compiled.patch.size());
+  header.module_length = static_cast<UCHAR>(compiled.module.size());
+  header.size = static_cast<USHORT>(
+      sizeof(TtRecordHeader) + header.name_length + header.handler_length +
+      header.signature_length + header.patch_length + header.module_length);
+
+  TspAppendBytes(&header, sizeof(header), record);
+  TspAppendBytes(compiled.name.data(), compiled.name.size(), record);
+  TspAppendBytes(compiled.handler.data(), compiled.handler.size(), record);
+  TspAppendBytes(compiled.signature.data(), compiled.signature.size(),
+                 record);
+  TspAppendBytes(compiled.patch.data(), compiled.patch.size(), record);
+  TspAppendBytes(compiled.module.data(), compiled.module.size(), record);
+  return true;
+}
+
+// Applies a KEY=VALUE field of a line to a record
+_Use_decl_annotations_ static bool TspApplyField(const std::string& key,
+                                                 const std::string& value,
+                                                 TspRecord* record,
+                                                 std::string* message) {
+  auto& header = record->header;
+  ULONG64 number = 0;
+  if (key == "rva" || key == "address") {
+    if (!TspParseInteger(value, ~0ull, &header.location)) {
+      *message = key + " is not a number";
+      return false;
+    }
+    if (key == "address") {
+      header.flags |= kTtFlagAbsolute;
+    }
+    return true;
+  }
+  if (key == "module" || key == "handler") {
+    if (value.empty()) {
+      *message = key + " is empty";
+      return false;
+    }
+    ((key == "module") ? record->module : record->handler) = value;
+    return true;
+  }
+  if (key == "args" && header.kind == kTtHook) {
+    if (!TspParseInteger(value, 0xff, &number)) {
+      *message = "args is not an 8bit number";
+      return false;
+    }
+    header.argument_count = static_cast<UCHAR>(number);
+    return true;
+  }
+  if (key == "signature") {
+    if (!TspParseHex(value, &record->signature)) {
+      *message = "signature is not hexadecimal bytes";
+      return false;
+    }
+    return true;
+  }
+  if (key == "bytes" && header.kind == kTtPatch) {
+    if (!TspParseHex(value, &record->patch)) {
+      *message = "bytes is not hexadecimal bytes";
+      return false;
+    }
+    return true;
+  }
+  if (key == "region" && header.kind == kTtPatchBundle) {
+    // OFFSET:EXPECTED:NEW
+    const auto first = value.find(':');
+    const auto second = (first == std::string::npos)
+                            ? std::string::npos
+                            : value.find(':', first + 1);
+    std::vector<UCHAR> expected_code;
+    std::vector<UCHAR> new_code;
+    if (second == std::string::npos ||
+        !TspParseInteger(value.substr(0, first), 0xffffffff, &number) ||
+        !TspParseHex(value.substr(first + 1, second - first - 1),
+                     &expected_code) ||
+        !TspParseHex(value.substr(second + 1), &new_code) ||
+        expected_code.empty() || expected_code.size() != new_code.size() ||
+        expected_code.size() > 0xff) {
+      *message = "region is not OFFSET:EXPECTED:NEW of the same length";
+      return false;
+    }
+    const TtBundleRegionHeader region = {
+        static_cast<ULONG>(number), static_cast<UCHAR>(expected_code.size())};
+    TspAppendBytes(&region, sizeof(region), &record->patch);
+    TspAppendBytes(expected_code.data(), expected_code.size(),
+                   &record->patch);
+    TspAppendBytes(new_code.data(), new_code.size(), &record->patch);
+    return true;
+  }
+  if (key == "length" && header.kind == kTtMemMonitor) {
+    if (!TspParseInteger(value, 0xffffffff, &number)) {
+      *message = "length is not a 32bit number";
+      return false;
+    }
+    header.length = static_cast<ULONG>(number);
+    return true;
+  }
+  if (key == "access" && header.kind == kTtMemMonitor) {
+    if (value == "r") {
+      header.access = kTtAccessRead;
+    } else if (value == "w") {
+      header.access = kTtAccessWrite;
+    } else if (value == "rw") {
+      header.access = kTtAccessRead | kTtAccessWrite;
+    } else {
+      *message = "access is not r, w or rw";
+      return false;
+    }
+    return true;
+  }
+  *message = "unknown key " + key + " for the kind";
+  return false;
+}
+
+// Parses a decimal or 0x-prefixed hexadecimal integer not greater than max
+_Use_decl_annotations_ static bool TspParseInteger(const std::string& text,
+                                                   ULONG64 max,
+                                                   ULONG64* value) {
+  if (text.empty() || text[0] == '-' || text[0] == '+') {
+    return false;
+  }
+  char* end = nullptr;
+  *value = std::strtoull(text.c_str(), &end, 0);
+  return !*end && *value <= max;
+}
+
+// Parses pairs of hexadecimal digits
+_Use_decl_annotations_ static bool TspParseHex(const std::string& text,
+                                               std::vector<UCHAR>* bytes) {
+  bytes->clear();
+  if (text.size() % 2) {
+    return false;
+  }
+  for (size_t i = 0; i < text.size(); i += 2) {
+    UCHAR byte = 0;
+    for (size_t j = i; j < i + 2; ++j) {
+      const auto c = text[j];
+      byte <<= 4;
+      if (c >= '0' && c <= '9') {
+        byte |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        byte |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        byte |= c - 'A' + 10;
+      } else {
+        return false;
+      }
+    }
+    bytes->push_back(byte);
+  }
+  return true;
+}
+
+_Use_decl_annotations_ static void TspAppendBytes(const void* data,
+                                                  size_t size,
+                                                  std::vector<UCHAR>* bytes) {
+  const auto begin = static_cast<const UCHAR*>(data);
+  bytes->insert(bytes->end(), begin, begin + size);
+}
+
+// Converts a validated entry into a line of a spec
+_Use_decl_annotations_ static bool TspDecompileEntry(const TtEntry& entry,
+                                                     std::string* line,
+                                                     std::string* message) {
+  line->clear();
+  message->clear();
+
+  // Such names would be read as no name or a comment
+  if (entry.name[0] == '#' ||
+      (entry.name[0] == '-' && !entry.name[1])) {
+    *message = std::string("the name ") + entry.name +
+               " cannot be written in a spec";
+    return false;
+  }
+
+  for (const auto& kind : kTspKinds) {
+    if (entry.kind == kind.value) {
+      *line = kind.text;
+    }
+  }
+  *line += ' ';
+  *line += (entry.name[0]) ? entry.name : "-";
+  for (const auto& flag : kTspFlags) {
+    if (entry.flags & flag.value) {
+      *line += ' ';
+      *line += flag.text;
+    }
+  }
+
+  char number[32] = {};
+  if (entry.flags & kTtFlagAbsolute) {
+    std::snprintf(number, sizeof(number), " address=0x%llx",
+                  static_cast<unsigned long long>(entry.location));
+    *line += number;
+  } else if (entry.location ||
+             !(entry.flags & (kTtFlagExport | kTtFlagScan))) {
+    std::snprintf(number, sizeof(number), " rva=0x%llx",
+                  static_cast<unsigned long long>(entry.location));
+    *line += number;
+  }
+  if (entry.module[0]) {
+    *line += std::string(" module=") + entry.module;
+  }
+  if (entry.handler[0]) {
+    *line += std::string(" handler=") + entry.handler;
+  }
+  if (entry.kind == kTtHook && !entry.handler[0] &&
+      !(entry.flags & kTtFlagCount)) {
+    std::snprintf(number, sizeof(number), " args=%u", entry.argument_count);
+    *line += number;
+  }
+  if (entry.signature_length) {
+    *line += " signature=" +
+             TspFormatHex(entry.signature, entry.signature_length);
+  }
+
+  switch (entry.kind) {
+    case kTtPatch:
+      *line += " bytes=" + TspFormatHex(entry.patch, entry.patch_length);
+      break;
+    case kTtPatchBundle: {
+      ULONG offset = 0;
+      TtBundleRegion region = {};
+      while (offset < entry.patch_length &&
+             TtcReadBundleRegion(entry.patch, entry.patch_length, &offset,
+                                 &region)) {
+        std::snprintf(number, sizeof(number), " region=0x%lx:",
+                      static_cast<unsigned long>(region.offset));
+        *line += number;
+        *line += TspFormatHex(region.expected_code, region.length) + ":" +
+                 TspFormatHex(region.new_code, region.length);
+      }
+      break;
+    }
+    case kTtMemMonitor: {
+      static const char* const kAccesses[] = {"", "r", "w", "rw"};
+      std::snprintf(number, sizeof(number), " length=0x%lx access=",
+                    static_cast<unsigned long>(entry.length));
+      *line += number;
+      *line += kAccesses[entry.access & (kTtAccessRead | kTtAccessWrite)];
+      break;
+    }
+    default:
+      break;
+  }
+  return true;
+}
+
+_Use_decl_annotations_ static std::string TspFormatHex(const UCHAR* bytes,
+                                                       ULONG length) {
+  static const char kDigits[] = "0123456789abcdef";
+  std::string text;
+  for (auto i = 0ul; i < length; ++i) {
+    text += kDigits[bytes[i] >> 4];
+    text += kDigits[bytes[i] & 0xf];
+  }
+  return text;
+}
@@ -0,0 +1,84 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares functions to compile a text spec into a target table and
+/// back.
+///
+/// A spec has a record in each line, and '#' starts a comment when it begins
+/// a line or follows a space:
+///
+///   KIND NAME [FLAG...] [KEY=VALUE...]
+///
+///   KIND      hook, patch, bundle or monitor
+///   NAME      An export, a symbol or an expression (eg, Ex*), or - for none
+///   FLAG      export, scan, count, callers or wildcard
+///   rva=N               An offset from the module (or from a signature found
+///                       with scan)
+///   address=N           An absolute virtual address
+///   module=FILE         A kernel module (eg, ndis.sys) instead of ntoskrnl
+///   handler=NAME        A handler built in the driver
+///   args=N              Integer arguments the function takes, up to 8.
+///                       Required by a hook without a handler or count.
+///   signature=HEX       Bytes expected at (or searched for) the address
+///   bytes=HEX           Patch bytes of a patch
+///   region=N:HEX:HEX    An offset, expected and new bytes of a bundle.
+///                       Repeatable.
+///   length=N            A length of a range of a monitor
+///   access=r|w|rw       Access to a range of a monitor
+///
+/// Numbers are decimal or 0x-prefixed hexadecimal. Each record is validated
+/// by target_table_core.cpp as the driver does.
+
+#ifndef DDIMON_TARGET_SPEC_H_
+#define DDIMON_TARGET_SPEC_H_
+
+#include <string>
+#include <vector>
+#include "target_table_core.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Why a spec or a table is invalid
+struct TsError {
+  ULONG line;  // A line of a spec from 1, or a record of a table from 1, or
+               // 0 when the error is not specific to either
+  std::string message;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+bool TsCompile(_In_ const std::string& spec, _Out_ std::vector<UCHAR>* table,
+               _Out_ TsError* error);
+
+bool TsDecompile(_In_reads_bytes_(size) const void* table, _In_ ULONG size,
+                 _Out_ std::string* spec, _Out_ TsError* error);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TARGET_SPEC_H_
@@ -0,0 +1,284 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements functions to read trace files on a Linux host.
+
+#include "trace_reader.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// A file offset of the first block
+static const ULONG64 kTrpFirstBlockOffset = sizeof(TfFileHeader);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static bool TrpReadFooter(_Inout_ TrFile* file);
+
+static bool TrpIsBlockInFilter(_In_ const TrFilter& filter,
+                               _In_ ULONG processor, _In_ ULONG64 first_tsc,
+                               _In_ ULONG64 last_tsc);
+
+static bool TrpReadBlock(_In_ const TrFile& file, _In_ ULONG64 offset,
+                         _In_ const TrFilter& filter,
+                         _In_ TrEventCallback callback, _In_opt_ void* context,
+                         _Inout_ TrReadStatistics* statistics);
+
+static bool TrpAggregateEvent(_In_ void* context, _In_ USHORT processor,
+                              _In_ const TfEvent& event);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Maps a trace file into memory. Returns false with a reason in error when
+// the file cannot be read or is not a trace file of this version.
+_Use_decl_annotations_ bool TrOpenFile(const char* path, TrFile* file,
+                                       const char** error) {
+  *file = {};
+  const auto fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    *error = "the file could not be opened";
+    return false;
+  }
+  struct stat status = {};
+  if (fstat(fd, &status) == -1 ||
+      static_cast<ULONG64>(status.st_size) < sizeof(TfFileHeader)) {
+    close(fd);
+    *error = "the file is too small";
+    return false;
+  }
+  const auto data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd,
+                         0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    *error = "the file could not be mapped";
+    return false;
+  }
+  madvise(data, status.st_size, MADV_SEQUENTIAL);
+  file->data = static_cast<const UCHAR*>(data);
+  file->size = status.st_size;
+
+  const auto header = reinterpret_cast<const TfFileHeader*>(file->data);
+  if (header->magic != kTfFileMagic || header->version != kTfVersion ||
+      header->block_size != kTfBlockSize) {
+    TrCloseFile(file);
+    *error = "the file is not a trace of this version";
+    return false;
+  }
+  if (!TrpReadFooter(file)) {
+    file->block_count = (file->size - kTrpFirstBlockOffset) / kTfBlockSize;
+  }
+  return true;
+}
+
+// Unmaps a file mapped by TrOpenFile()
+_Use_decl_annotations_ void TrCloseFile(TrFile* file) {
+  if (file->data) {
+    munmap(const_cast<UCHAR*>(file->data), file->size);
+  }
+  *file = {};
+}
+
+// Initializes a filter matching all events
+_Use_decl_annotations_ void TrInitializeFilter(TrFilter* filter) {
+  *filter = {};
+  filter->processor = kTrAnyProcessor;
+  filter->max_tsc = ~0ull;
+  filter->kinds = 0xffffffff;
+  filter->max_address = ~0ull;
+}
+
+// Checks if the event of the processor is to be read
+_Use_decl_annotations_ bool TrMatchesFilter(const TrFilter& filter,
+                                            USHORT processor,
+                                            const TfEvent& event) {
+  return (filter.processor == kTrAnyProcessor ||
+          filter.processor == processor) &&
+         event.tsc >= filter.min_tsc && event.tsc <= filter.max_tsc &&
+         event.kind < 32 && (filter.kinds & (1ul << event.kind)) &&
+         (!filter.match_tag || filter.tag == event.tag) &&
+         event.address >= filter.min_address &&
+         event.address <= filter.max_address;
+}
+
+// Calls callback for each event matching the filter, in order of blocks in
+// the file and of events in each block
+_Use_decl_annotations_ TrReadStatistics TrReadEvents(const TrFile& file,
+                                                     const TrFilter& filter,
+                                                     TrEventCallback callback,
+                                                     void* context) {
+  TrReadStatistics statistics = {};
+  if (file.index) {
+    for (auto i = 0ul; i < file.index_count; ++i) {
+      const auto& entry = file.index[i];
+      if (!TrpIsBlockInFilter(filter, entry.processor, entry.first_tsc,
+                              entry.last_tsc)) {
+        statistics.skipped_block_count++;
+        continue;
+      }
+      if (!TrpReadBlock(file, entry.offset, filter, callback, context,
+                        &statistics)) {
+        break;
+      }
+    }
+    return statistics;
+  }
+
+  for (ULONG64 i = 0; i < file.block_count; ++i) {
+    if (!TrpReadBlock(file, kTrpFirstBlockOffset + i * kTfBlockSize, filter,
+                      callback, context, &statistics)) {
+      break;
+    }
+  }
+  return statistics;
+}
+
+// Aggregates events matching the filter by kinds, processors, tags, callers
+// and schemas
+_Use_decl_annotations_ TrReadStatistics TrAggregateEvents(
+    const TrFile& file, const TrFilter& filter, TrAggregate* aggregate) {
+  *aggregate = {};
+  return TrReadEvents(file, filter, TrpAggregateEvent, aggregate);
+}
+
+// Finds the index through the footer. Returns false when the footer is
+// missing or inconsistent with the file.
+_Use_decl_annotations_ static bool TrpReadFooter(TrFile* file) {
+  if (file->size < kTrpFirstBlockOffset + sizeof(TfFileFooter)) {
+    return false;
+  }
+  const auto footer_offset = file->size - sizeof(TfFileFooter);
+  const auto footer =
+      reinterpret_cast<const TfFileFooter*>(file->data + footer_offset);
+  if (footer->magic != kTfFooterMagic ||
+      footer->index_offset < kTrpFirstBlockOffset ||
+      footer->index_offset > footer_offset ||
+      (footer->index_offset - kTrpFirstBlockOffset) % kTfBlockSize ||
+      footer_offset - footer->index_offset !=
+          sizeof(TfIndexEntry) * static_cast<ULONG64>(footer->index_count)) {
+    return false;
+  }
+
+  file->block_count =
+      (footer->index_offset - kTrpFirstBlockOffset) / kTfBlockSize;
+  file->index =
+      reinterpret_cast<const TfIndexEntry*>(file->data + footer->index_offset);
+  file->index_count = footer->index_count;
+  file->dropped_count = footer->dropped_count;
+  return true;
+}
+
+// Checks if a block may have events matching the filter
+_Use_decl_annotations_ static bool TrpIsBlockInFilter(const TrFilter& filter,
+                                                      ULONG processor,
+                                                      ULONG64 first_tsc,
+                                                      ULONG64 last_tsc) {
+  return (filter.processor == kTrAnyProcessor ||
+          filter.processor == processor) &&
+         last_tsc >= filter.min_tsc && first_tsc <= filter.max_tsc;
+}
+
+// Decodes a block at the offset and calls callback for events matching the
+// filter. Returns false when callback asked to stop.
+_Use_decl_annotations_ static bool TrpReadBlock(
+    const TrFile& file, ULONG64 offset, const TrFilter& filter,
+    TrEventCallback callback, void* context, TrReadStatistics* statistics) {
+  const auto block_end = kTrpFirstBlockOffset + file.block_count * kTfBlockSize;
+  TfBlockReader reader = {};
+  if (offset < kTrpFirstBlockOffset || offset + kTfBlockSize > block_end ||
+      (offset - kTrpFirstBlockOffset) % kTfBlockSize ||
+      !TfInitializeBlockReader(&reader, file.data + offset)) {
+    statistics->corrupted_block_count++;
+    return true;
+  }
+
+  // Blocks found without the index are skipped by their headers
+  const auto header =
+      reinterpret_cast<const TfBlockHeader*>(file.data + offset);
+  if (!TrpIsBlockInFilter(filter, header->processor, header->first_tsc,
+                          header->last_tsc)) {
+    statistics->skipped_block_count++;
+    return true;
+  }
+
+  statistics->read_block_count++;
+  TfEvent event = {};
+  while (TfReadEvent(&reader, &event)) {
+    if (!TrMatchesFilter(filter, header->processor, event)) {
+      continue;
+    }
+    statistics->event_count++;
+    if (!callback(context, header->processor, event)) {
+      return false;
+    }
+  }
+  if (reader.offset != header->payload_size) {
+    statistics->corrupted_block_count++;
+  }
+  return true;
+}
+
+// Adds an event to TrAggregate given as context
+_Use_decl_annotations_ static bool TrpAggregateEvent(void* context,
+                                                     USHORT processor,
+                                                     const TfEvent& event) {
+  const auto aggregate = static_cast<TrAggregate*>(context);
+  if (!aggregate->event_count || event.tsc < aggregate->first_tsc) {
+    aggregate->first_tsc = event.tsc;
+  }
+  if (event.tsc > aggregate->last_tsc) {
+    aggregate->last_tsc = event.tsc;
+  }
+  aggregate->event_count++;
+  aggregate->processor_counts[processor]++;
+  auto& caller = aggregate->callers[event.address];
+  caller.event_count++;
+
+  switch (event.kind) {
+    case kTfEventAllocatePool: {
+      auto& tag = aggregate->tags[event.tag];
+      tag.allocation_count++;
+      tag.allocated_bytes += event.size;
+      caller.allocated_bytes += event.size;
+      break;
+    }
+    case kTfEventFreePool:
+      aggregate->tags[event.tag].free_count++;
+      break;
+    case kTfEventRecord:
+      aggregate->schema_counts[event.argument]++;
+      break;
+    default:
+      return true;
+  }
+  aggregate->kind_counts[event.kind]++;
+  return true;
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2015-2018, Satoshi Tanda. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares functions to read trace files on a Linux host.
+///
+/// A trace file is mapped into memory and its blocks are decoded in place
+/// with trace_format.cpp. Blocks are found with the index when the footer is
+/// present, and one after another otherwise, so that a trace of a driver that
+/// was not unloaded cleanly can still be read. Blocks of other processors or
+/// out of a time range are skipped without decoding their events.
+
+#ifndef DDIMON_TRACE_READER_H_
+#define DDIMON_TRACE_READER_H_
+
+#include <map>
+#include "trace_format.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// TrFilter::processor matching events of all processors
+static const ULONG kTrAnyProcessor = 0xffffffff;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// A trace file mapped into memory by TrOpenFile()
+struct TrFile {
+  const UCHAR* data;
+  ULONG64 size;
+  ULONG64 block_count;       // Whole blocks in the file
+  const TfIndexEntry* index;  // nullptr when the footer is missing
+  ULONG index_count;
+  ULONG64 dropped_count;  // Events the driver could not write
+};
+
+// Events to read. Initialize it with TrInitializeFilter().
+struct TrFilter {
+  ULONG processor;  // kTrAnyProcessor for all processors
+  ULONG64 min_tsc;  // Inclusive
+  ULONG64 max_tsc;  // Inclusive
+  ULONG kinds;      // A bit of (1 << TfEventKind) for each kind to read
+  bool match_tag;
+  ULONG tag;
+  ULONG64 min_address;  // An inclusive range of caller addresses
+  ULONG64 max_address;
+};
+
+// Blocks visited by TrReadEvents()
+struct TrReadStatistics {
+  ULONG64 read_block_count;
+  ULONG64 skipped_block_count;    // Out of the filter
+  ULONG64 corrupted_block_count;  // Not valid, or with undecodable events
+  ULONG64 event_count;            // Events matched the filter
+};
+
+// Pool events of a tag
+struct TrTagStatistics {
+  ULONG64 allocation_count;
+  ULONG64 allocated_bytes;
+  ULONG64 free_count;
+};
+
+// Events from a caller address
+struct TrCallerStatistics {
+  ULONG64 event_count;
+  ULONG64 allocated_bytes;
+};
+
+// Events aggregated by TrAggregateEvents()
+struct TrAggregate {
+  ULONG64 event_count;
+  ULONG64 first_tsc;
+  ULONG64 last_tsc;
+  ULONG64 kind_counts[kTfEventRecord + 1];
+  std::map<ULONG, ULONG64> processor_counts;
+  std::map<ULONG, TrTagStatistics> tags;
+  std::map<ULONG64, TrCallerStatistics> callers;
+  std::map<ULONG64, ULONG64> schema_counts;  // Records keyed by schema IDs
+};
+
+// Called for each event matched by the filter. Returns false to stop reading.
+using TrEventCallback = bool (*)(void* context, USHORT processor,
+                                 const TfEvent& event);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+bool TrOpenFile(_In_ const char* path, _Out_ TrFile* file,
+                _Out_ const char** error);
+
+void TrCloseFile(_Inout_ TrFile* file);
+
+void TrInitializeFilter(_Out_ TrFilter* filter);
+
+bool TrMatchesFilter(_In_ const TrFilter& filter, _In_ USHORT processor,
+                     _In_ const TfEvent& event);
+
+TrReadStatistics TrReadEvents(_In_ const TrFile& file,
+                              _In_ const TrFilter& filter,
+                              _In_ TrEventCallback callback,
+                              _In_opt_ void* context);
+
+TrReadStatistics TrAggregateEvents(_In_ const TrFile& file,
+                                   _In_ const TrFilter& filter,
+                                   _Out_ TrAggregate* aggregate);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // DDIMON_TRACE_READER_H_